@@ -0,0 +1,91 @@
+// Throughput of the shm conversion kernels
+//
+// Converts frames in place at common output sizes with every kernel the cpu
+// supports and prints the frame bytes processed per second.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "convert.h"
+
+// each measurement runs for at least this long
+#define BENCH_MIN_NS 500000000LL
+
+struct bench_size {
+	const char *name;
+	uint32_t width, height;
+};
+
+struct bench_op {
+	const char *name;
+	bool flip_y;
+	bool swap_rb;
+};
+
+static int64_t bench_now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void bench_run(const struct xdpw_convert_kernel *kernel, const struct bench_op *op,
+		const struct bench_size *size, uint8_t *data) {
+	uint32_t stride = size->width * 4;
+	uint32_t swap_mask = op->swap_rb ? 0x000000ff : 0;
+	size_t frame_size = (size_t)stride * size->height;
+
+	// fault the pages in and warm the caches the same way for every kernel
+	kernel->convert(data, stride, size->height, op->flip_y, swap_mask);
+
+	uint64_t frames = 0;
+	int64_t start = bench_now_ns(), elapsed;
+	do {
+		kernel->convert(data, stride, size->height, op->flip_y, swap_mask);
+		frames++;
+		elapsed = bench_now_ns() - start;
+	} while (elapsed < BENCH_MIN_NS);
+
+	printf("%-8s %-12s %-5s %7.2f GB/s %8.3f ms per frame\n", kernel->name, op->name,
+		size->name, (double)frame_size * frames / elapsed,
+		elapsed / 1e6 / frames);
+}
+
+int main(void) {
+	static const struct bench_size sizes[] = {
+		{ "1080p", 1920, 1080 },
+		{ "4k", 3840, 2160 },
+		{ "8k", 7680, 4320 },
+	};
+	static const struct bench_op ops[] = {
+		{ "flip", true, false },
+		{ "swap_rb", false, true },
+		{ "flip+swap_rb", true, true },
+	};
+	const size_t size_count = sizeof(sizes) / sizeof(sizes[0]);
+	const size_t op_count = sizeof(ops) / sizeof(ops[0]);
+
+	const struct bench_size *largest = &sizes[size_count - 1];
+	size_t alloc_size = (size_t)largest->width * 4 * largest->height;
+	uint8_t *data = malloc(alloc_size);
+	if (!data) {
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < alloc_size; i++) {
+		data[i] = i * 7;
+	}
+
+	const struct xdpw_convert_kernel *kernels;
+	size_t kernel_count = xdpw_convert_get_kernels(&kernels);
+	for (size_t k = 0; k < kernel_count; k++) {
+		for (size_t o = 0; o < op_count; o++) {
+			for (size_t s = 0; s < size_count; s++) {
+				bench_run(&kernels[k], &ops[o], &sizes[s], data);
+			}
+		}
+	}
+
+	free(data);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,525 @@
+// Screencast benchmark consumer
+//
+// Starts a cast through the xdpw backend interface and records every frame
+// it receives on a PipeWire stream. run_screencast.sh sets up the headless
+// compositor, PipeWire and xdpw it talks to.
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pipewire/pipewire.h>
+#include <spa/param/video/format-utils.h>
+#include <spa/utils/result.h>
+
+#include <libdrm/drm_fourcc.h>
+
+#ifdef HAVE_LIBSYSTEMD
+#include <systemd/sd-bus.h>
+#elif HAVE_LIBELOGIND
+#include <elogind/sd-bus.h>
+#elif HAVE_BASU
+#include <basu/sd-bus.h>
+#endif
+
+#define BENCH_BUS_NAME "org.freedesktop.impl.portal.desktop.wlr"
+#define BENCH_OBJECT_PATH "/org/freedesktop/portal/desktop"
+#define BENCH_INTERFACE "org.freedesktop.impl.portal.ScreenCast"
+#define BENCH_REQUEST_PATH BENCH_OBJECT_PATH "/request/xdpw_bench/r%d"
+#define BENCH_SESSION_PATH BENCH_OBJECT_PATH "/session/xdpw_bench/s1"
+
+// frames that arrive later than this after the previous one end the run
+#define BENCH_FRAME_TIMEOUT_SEC 10
+
+struct bench_proc_sample {
+	uint64_t cpu_ns;
+	unsigned long rss_kib, hwm_kib;
+};
+
+struct bench {
+	struct pw_main_loop *loop;
+	struct pw_stream *stream;
+	struct spa_hook stream_listener;
+	struct spa_source *timeout;
+
+	bool dmabuf;
+	uint32_t warmup;
+	uint32_t frames;
+	pid_t pid;
+
+	struct spa_video_info_raw format;
+	uint32_t received;
+	uint32_t corrupted;
+	uint32_t wrong_type;
+	int64_t *latency_ns;
+	uint32_t latency_count;
+	struct timespec first, last;
+	struct bench_proc_sample start_sample;
+	int ret;
+};
+
+static uint64_t bench_now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return SPA_TIMESPEC_TO_NSEC(&now);
+}
+
+static double bench_diff_sec(struct timespec *a, struct timespec *b) {
+	return (SPA_TIMESPEC_TO_NSEC(a) - SPA_TIMESPEC_TO_NSEC(b)) / 1e9;
+}
+
+// cpu time and memory of the xdpw process from /proc
+static bool bench_sample_proc(pid_t pid, struct bench_proc_sample *sample) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return false;
+	}
+	// comm may contain spaces, the fields after it are well defined
+	char line[1024];
+	bool ok = fgets(line, sizeof(line), f) != NULL;
+	fclose(f);
+	char *p = ok ? strrchr(line, ')') : NULL;
+	unsigned long utime, stime;
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			&utime, &stime) != 2) {
+		return false;
+	}
+	long ticks = sysconf(_SC_CLK_TCK);
+	sample->cpu_ns = (utime + stime) * (SPA_NSEC_PER_SEC / ticks);
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if (!(f = fopen(path, "r"))) {
+		return false;
+	}
+	sample->rss_kib = sample->hwm_kib = 0;
+	while (fgets(line, sizeof(line), f)) {
+		sscanf(line, "VmRSS: %lu kB", &sample->rss_kib);
+		sscanf(line, "VmHWM: %lu kB", &sample->hwm_kib);
+	}
+	fclose(f);
+	return true;
+}
+
+static int bench_compare_ns(const void *a, const void *b) {
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double bench_percentile_ms(int64_t *sorted, uint32_t count, double p) {
+	uint32_t i = (uint32_t)(p * (count - 1) + 0.5);
+	return sorted[i] / 1e6;
+}
+
+static void bench_report(struct bench *bench) {
+	uint32_t measured = bench->received - bench->warmup;
+	double elapsed = bench_diff_sec(&bench->last, &bench->first);
+
+	printf("%s %ux%u: %u frames in %.2f s, %.2f fps, %u corrupted\n",
+		bench->dmabuf ? "dmabuf" : "shm",
+		bench->format.size.width, bench->format.size.height,
+		measured, elapsed, elapsed > 0 ? (measured - 1) / elapsed : 0.0,
+		bench->corrupted);
+
+	if (bench->latency_count > 0) {
+		int64_t *l = bench->latency_ns;
+		uint32_t n = bench->latency_count;
+		qsort(l, n, sizeof(*l), bench_compare_ns);
+		printf("latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+			bench_percentile_ms(l, n, 0.5), bench_percentile_ms(l, n, 0.9),
+			bench_percentile_ms(l, n, 0.99), l[n - 1] / 1e6);
+	}
+
+	struct bench_proc_sample end;
+	if (bench->pid > 0 && bench_sample_proc(bench->pid, &end)) {
+		double cpu = (end.cpu_ns - bench->start_sample.cpu_ns) / 1e9;
+		printf("xdpw: cpu %.3f s (%.1f%%), %.2f ms per frame, rss %lu KiB, peak %lu KiB\n",
+			cpu, elapsed > 0 ? cpu * 100 / elapsed : 0.0,
+			measured > 0 ? cpu * 1e3 / measured : 0.0,
+			end.rss_kib, end.hwm_kib);
+	}
+}
+
+static void bench_handle_process(void *data) {
+	struct bench *bench = data;
+	struct pw_buffer *buffer = pw_stream_dequeue_buffer(bench->stream);
+	if (!buffer) {
+		return;
+	}
+	uint64_t now_ns = bench_now_ns();
+	struct spa_buffer *spa_buf = buffer->buffer;
+	struct spa_meta_header *h = spa_buffer_find_meta_data(spa_buf, SPA_META_Header, sizeof(*h));
+
+	bool corrupted = (spa_buf->datas[0].chunk->flags & SPA_CHUNK_FLAG_CORRUPTED) ||
+		(h && (h->flags & SPA_META_HEADER_FLAG_CORRUPTED));
+	uint32_t expected_type = bench->dmabuf ? SPA_DATA_DmaBuf : SPA_DATA_MemFd;
+	if (spa_buf->datas[0].type != expected_type) {
+		bench->wrong_type++;
+	}
+
+	bench->received++;
+	if (bench->received > bench->warmup) {
+		if (corrupted) {
+			bench->corrupted++;
+		} else if (h && h->pts > 0 && (uint64_t)h->pts <= now_ns) {
+			bench->latency_ns[bench->latency_count++] = now_ns - h->pts;
+		}
+		if (bench->received == bench->warmup + 1) {
+			clock_gettime(CLOCK_MONOTONIC, &bench->first);
+			if (bench->pid > 0) {
+				bench_sample_proc(bench->pid, &bench->start_sample);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &bench->last);
+	}
+	pw_stream_queue_buffer(bench->stream, buffer);
+
+	struct timespec timeout = { BENCH_FRAME_TIMEOUT_SEC, 0 };
+	pw_loop_update_timer(pw_main_loop_get_loop(bench->loop), bench->timeout,
+		&timeout, NULL, false);
+
+	if (bench->wrong_type > 0) {
+		fprintf(stderr, "got %s buffers, expected %s\n",
+			bench->dmabuf ? "shm" : "dma-buf", bench->dmabuf ? "dma-buf" : "shm");
+		bench->ret = EXIT_FAILURE;
+		pw_main_loop_quit(bench->loop);
+	} else if (bench->received == bench->warmup + bench->frames) {
+		bench->ret = EXIT_SUCCESS;
+		pw_main_loop_quit(bench->loop);
+	}
+}
+
+static void bench_handle_param_changed(void *data, uint32_t id, const struct spa_pod *param) {
+	struct bench *bench = data;
+	if (!param || id != SPA_PARAM_Format) {
+		return;
+	}
+	spa_format_video_raw_parse(param, &bench->format);
+
+	uint8_t params_buffer[512];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
+	const struct spa_pod *params[2];
+	uint32_t data_type = bench->dmabuf ? 1 << SPA_DATA_DmaBuf : 1 << SPA_DATA_MemFd;
+	params[0] = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+		SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(data_type));
+	params[1] = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+		SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+	pw_stream_update_params(bench->stream, params, 2);
+}
+
+static void bench_handle_state_changed(void *data, enum pw_stream_state old,
+		enum pw_stream_state state, const char *error) {
+	struct bench *bench = data;
+	if (state == PW_STREAM_STATE_ERROR || state == PW_STREAM_STATE_UNCONNECTED) {
+		fprintf(stderr, "stream %s: %s\n", pw_stream_state_as_string(state),
+			error ? error : "disconnected");
+		bench->ret = EXIT_FAILURE;
+		pw_main_loop_quit(bench->loop);
+	}
+}
+
+static const struct pw_stream_events bench_stream_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.state_changed = bench_handle_state_changed,
+	.param_changed = bench_handle_param_changed,
+	.process = bench_handle_process,
+};
+
+static void bench_handle_timeout(void *data, uint64_t expirations) {
+	struct bench *bench = data;
+	fprintf(stderr, "no frame within %d s, got %u of %u\n", BENCH_FRAME_TIMEOUT_SEC,
+		bench->received, bench->warmup + bench->frames);
+	bench->ret = EXIT_FAILURE;
+	pw_main_loop_quit(bench->loop);
+}
+
+static const struct spa_pod *bench_build_format(struct spa_pod_builder *b, bool dmabuf) {
+	struct spa_pod_frame f[2];
+	spa_pod_builder_push_object(b, &f[0], SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+	spa_pod_builder_add(b,
+		SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+		SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+		SPA_FORMAT_VIDEO_format, SPA_POD_CHOICE_ENUM_Id(9,
+			SPA_VIDEO_FORMAT_BGRx,
+			SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_BGRA,
+			SPA_VIDEO_FORMAT_RGBx, SPA_VIDEO_FORMAT_RGBA,
+			SPA_VIDEO_FORMAT_xRGB, SPA_VIDEO_FORMAT_ARGB,
+			SPA_VIDEO_FORMAT_xBGR, SPA_VIDEO_FORMAT_ABGR),
+		SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(
+			&SPA_RECTANGLE(1920, 1080),
+			&SPA_RECTANGLE(1, 1),
+			&SPA_RECTANGLE(16384, 16384)),
+		SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(
+			&SPA_FRACTION(0, 1),
+			&SPA_FRACTION(0, 1),
+			&SPA_FRACTION(1000, 1)),
+		0);
+	// the buffers aren't imported, any layout the producer can allocate is fine
+	if (dmabuf) {
+		spa_pod_builder_prop(b, SPA_FORMAT_VIDEO_modifier,
+			SPA_POD_PROP_FLAG_MANDATORY | SPA_POD_PROP_FLAG_DONT_FIXATE);
+		spa_pod_builder_push_choice(b, &f[1], SPA_CHOICE_Enum, 0);
+		spa_pod_builder_long(b, DRM_FORMAT_MOD_LINEAR);
+		spa_pod_builder_long(b, DRM_FORMAT_MOD_LINEAR);
+		spa_pod_builder_long(b, DRM_FORMAT_MOD_INVALID);
+		spa_pod_builder_pop(b, &f[1]);
+	}
+	return spa_pod_builder_pop(b, &f[0]);
+}
+
+// calls a method of the backend's ScreenCast interface, which answer with
+// the response of the portal request right away
+static int bench_call(sd_bus *bus, const char *method, sd_bus_message **reply,
+		const char *types, ...) {
+	static int request_count = 0;
+	char request_path[128];
+	snprintf(request_path, sizeof(request_path), BENCH_REQUEST_PATH, ++request_count);
+
+	sd_bus_message *msg = NULL;
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	int ret = sd_bus_message_new_method_call(bus, &msg, BENCH_BUS_NAME,
+		BENCH_OBJECT_PATH, BENCH_INTERFACE, method);
+	if (ret < 0) {
+		return ret;
+	}
+	// never activate an installed xdpw instead of the one being measured
+	sd_bus_message_set_auto_start(msg, false);
+
+	va_list args;
+	va_start(args, types);
+	ret = sd_bus_message_append(msg, "oo", request_path, BENCH_SESSION_PATH);
+	if (ret >= 0) {
+		ret = sd_bus_message_appendv(msg, types, args);
+	}
+	va_end(args);
+	if (ret >= 0) {
+		ret = sd_bus_call(bus, msg, 0, &error, reply);
+	}
+	// the name not being owned yet is retried by the caller
+	if (ret < 0 && ret != -ENXIO && ret != -EHOSTUNREACH && sd_bus_error_is_set(&error)) {
+		fprintf(stderr, "%s failed: %s\n", method, error.message);
+	}
+	sd_bus_error_free(&error);
+	sd_bus_message_unref(msg);
+	if (ret < 0) {
+		return ret;
+	}
+
+	uint32_t response;
+	ret = sd_bus_message_read(*reply, "u", &response);
+	if (ret >= 0 && response != 0) {
+		fprintf(stderr, "%s was answered with response %u\n", method, response);
+		ret = -EIO;
+	}
+	if (ret < 0) {
+		*reply = sd_bus_message_unref(*reply);
+	}
+	return ret;
+}
+
+static int bench_read_node_id(sd_bus_message *reply, uint32_t *node_id) {
+	int ret = sd_bus_message_enter_container(reply, 'a', "{sv}");
+	while (ret > 0 && (ret = sd_bus_message_enter_container(reply, 'e', "sv")) > 0) {
+		const char *key;
+		if ((ret = sd_bus_message_read(reply, "s", &key)) < 0) {
+			return ret;
+		}
+		if (strcmp(key, "streams") == 0) {
+			// only the first stream is measured
+			if ((ret = sd_bus_message_enter_container(reply, 'v', "a(ua{sv})")) < 0 ||
+					(ret = sd_bus_message_enter_container(reply, 'a', "(ua{sv})")) < 0 ||
+					(ret = sd_bus_message_enter_container(reply, 'r', "ua{sv}")) <= 0) {
+				return ret < 0 ? ret : -ENOENT;
+			}
+			return sd_bus_message_read(reply, "u", node_id);
+		}
+		if ((ret = sd_bus_message_skip(reply, "v")) < 0 ||
+				(ret = sd_bus_message_exit_container(reply)) < 0) {
+			return ret;
+		}
+	}
+	return ret < 0 ? ret : -ENOENT;
+}
+
+static int bench_start_cast(sd_bus *bus, uint32_t *node_id) {
+	sd_bus_message *reply = NULL;
+	int ret = -1;
+
+	// xdpw is started right before, give it a moment to claim its name
+	for (int i = 0; i < 100; i++) {
+		ret = bench_call(bus, "CreateSession", &reply, "sa{sv}", "xdpw-bench", 0);
+		if (ret != -ENXIO && ret != -EHOSTUNREACH) {
+			break;
+		}
+		nanosleep(&(struct timespec){ .tv_nsec = 50 * 1000 * 1000 }, NULL);
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	sd_bus_message_unref(reply);
+
+	// a single monitor, the cursor is embedded like most consumers ask for
+	ret = bench_call(bus, "SelectSources", &reply, "sa{sv}", "xdpw-bench", 2,
+		"types", "u", 1, "cursor_mode", "u", 2);
+	if (ret < 0) {
+		return ret;
+	}
+	sd_bus_message_unref(reply);
+
+	ret = bench_call(bus, "Start", &reply, "ssa{sv}", "xdpw-bench", "", 0);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = bench_read_node_id(reply, node_id);
+	sd_bus_message_unref(reply);
+	return ret;
+}
+
+static int bench_usage(FILE *stream, int rc) {
+	static const char *usage =
+		"Usage: bench-screencast [options] shm|dmabuf\n"
+		"\n"
+		"    -f, --frames=<n>    Frames to measure (default 600)\n"
+		"    -w, --warmup=<n>    Frames to skip before measuring (default 60)\n"
+		"    -p, --pid=<pid>     Process whose cpu time and memory to report\n"
+		"    -h, --help          Get help (this text)\n"
+		"\n";
+
+	fprintf(stream, "%s", usage);
+	return rc;
+}
+
+int main(int argc, char *argv[]) {
+	struct bench bench = {
+		.frames = 600,
+		.warmup = 60,
+		.ret = EXIT_FAILURE,
+	};
+
+	static const char *shortopts = "f:w:p:h";
+	static const struct option longopts[] = {
+		{ "frames", required_argument, NULL, 'f' },
+		{ "warmup", required_argument, NULL, 'w' },
+		{ "pid", required_argument, NULL, 'p' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while (1) {
+		int c = getopt_long(argc, argv, shortopts, longopts, NULL);
+		if (c < 0) {
+			break;
+		}
+
+		switch (c) {
+		case 'f':
+			bench.frames = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			bench.warmup = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			bench.pid = atoi(optarg);
+			break;
+		case 'h':
+			return bench_usage(stdout, EXIT_SUCCESS);
+		default:
+			return bench_usage(stderr, EXIT_FAILURE);
+		}
+	}
+	if (optind + 1 != argc || bench.frames < 2) {
+		return bench_usage(stderr, EXIT_FAILURE);
+	}
+	if (strcmp(argv[optind], "dmabuf") == 0) {
+		bench.dmabuf = true;
+	} else if (strcmp(argv[optind], "shm") != 0) {
+		return bench_usage(stderr, EXIT_FAILURE);
+	}
+
+	bench.latency_ns = calloc(bench.frames, sizeof(*bench.latency_ns));
+	if (!bench.latency_ns) {
+		return EXIT_FAILURE;
+	}
+
+	sd_bus *bus = NULL;
+	int ret = sd_bus_open_user(&bus);
+	if (ret < 0) {
+		fprintf(stderr, "failed to connect to user bus: %s\n", strerror(-ret));
+		goto error_bus;
+	}
+
+	uint32_t node_id;
+	ret = bench_start_cast(bus, &node_id);
+	if (ret < 0) {
+		fprintf(stderr, "failed to start the cast: %s\n", strerror(-ret));
+		goto error_cast;
+	}
+
+	pw_init(NULL, NULL);
+	bench.loop = pw_main_loop_new(NULL);
+	struct pw_loop *loop = pw_main_loop_get_loop(bench.loop);
+	struct pw_context *context = pw_context_new(loop, NULL, 0);
+	struct pw_core *core = context ? pw_context_connect(context, NULL, 0) : NULL;
+	if (!core) {
+		fprintf(stderr, "failed to connect to pipewire\n");
+		goto error_pw;
+	}
+
+	bench.stream = pw_stream_new(core, "xdpw-bench",
+		pw_properties_new(
+			PW_KEY_MEDIA_TYPE, "Video",
+			PW_KEY_MEDIA_CATEGORY, "Capture",
+			PW_KEY_MEDIA_ROLE, "Screen",
+			NULL));
+	pw_stream_add_listener(bench.stream, &bench.stream_listener,
+		&bench_stream_events, &bench);
+
+	uint8_t params_buffer[1024];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
+	const struct spa_pod *params[] = { bench_build_format(&b, bench.dmabuf) };
+	ret = pw_stream_connect(bench.stream, PW_DIRECTION_INPUT, node_id,
+		PW_STREAM_FLAG_AUTOCONNECT, params, 1);
+	if (ret < 0) {
+		fprintf(stderr, "failed to connect to node %u: %s\n", node_id, spa_strerror(ret));
+		goto error_stream;
+	}
+
+	bench.timeout = pw_loop_add_timer(loop, bench_handle_timeout, &bench);
+	struct timespec timeout = { BENCH_FRAME_TIMEOUT_SEC, 0 };
+	pw_loop_update_timer(loop, bench.timeout, &timeout, NULL, false);
+
+	pw_main_loop_run(bench.loop);
+	if (bench.ret == EXIT_SUCCESS) {
+		bench_report(&bench);
+	}
+
+	pw_loop_destroy_source(loop, bench.timeout);
+error_stream:
+	spa_hook_remove(&bench.stream_listener);
+	pw_stream_destroy(bench.stream);
+	pw_core_disconnect(core);
+error_pw:
+	if (context) {
+		pw_context_destroy(context);
+	}
+	pw_main_loop_destroy(bench.loop);
+	pw_deinit();
+	sd_bus_call_method(bus, BENCH_BUS_NAME, BENCH_SESSION_PATH,
+		"org.freedesktop.impl.portal.Session", "Close", NULL, NULL, "");
+error_cast:
+	sd_bus_unref(bus);
+error_bus:
+	free(bench.latency_ns);
+	return bench.ret;
+}
@@ -0,0 +1,104 @@
+#!/bin/sh
+# Benchmarks a single screencast of a headless sway output.
+#
+# Usage: run_screencast.sh <xdg-desktop-portal-wlr> <bench-screencast> shm|dmabuf <width>x<height> [frames]
+#
+# Everything runs in a private runtime dir and D-Bus session: sway with the
+# headless backend, pipewire, wireplumber, an animated client providing
+# damage, and the xdpw binary being measured. Exits with 77 (skipped) if one
+# of them is missing. XDPW_BENCH_CLIENT overrides the client, which defaults
+# to weston-simple-shm.
+
+set -eu
+
+skip() {
+	echo "skipping: $*" >&2
+	exit 77
+}
+
+if [ $# -lt 4 ]; then
+	echo "usage: $0 <xdg-desktop-portal-wlr> <bench-screencast> shm|dmabuf <width>x<height> [frames]" >&2
+	exit 1
+fi
+
+xdpw=$1
+bench=$2
+type=$3
+mode=$4
+frames=${5:-600}
+client=${XDPW_BENCH_CLIENT:-weston-simple-shm}
+
+if [ -z "${XDPW_BENCH_SESSION:-}" ]; then
+	command -v dbus-run-session >/dev/null || skip "dbus-run-session not found"
+	XDPW_BENCH_SESSION=1 exec dbus-run-session -- "$0" "$@"
+fi
+
+for prog in sway pipewire wireplumber "${client%% *}"; do
+	command -v "$prog" >/dev/null || skip "$prog not found"
+done
+if [ "$type" = dmabuf ] && ! ls /dev/dri/renderD* >/dev/null 2>&1; then
+	skip "no render node for dma-buf"
+fi
+
+XDG_RUNTIME_DIR=$(mktemp -d)
+export XDG_RUNTIME_DIR
+pids=
+cleanup() {
+	for pid in $pids; do
+		kill "$pid" 2>/dev/null || true
+	done
+	wait 2>/dev/null || true
+	rm -rf "$XDG_RUNTIME_DIR"
+}
+trap cleanup EXIT INT TERM
+
+# waits up to 10 s for a file matching the glob in $1, prints its name
+wait_for() {
+	i=0
+	while [ $i -lt 100 ]; do
+		for f in $1; do
+			if [ -e "$f" ]; then
+				echo "$f"
+				return 0
+			fi
+		done
+		sleep 0.1
+		i=$((i + 1))
+	done
+	echo "timed out waiting for $1" >&2
+	return 1
+}
+
+cat > "$XDG_RUNTIME_DIR/sway.conf" <<EOF
+xwayland disable
+output HEADLESS-1 mode --custom $mode@60Hz
+EOF
+
+cat > "$XDG_RUNTIME_DIR/xdpw.conf" <<EOF
+[screencast]
+chooser_type=none
+output_name=HEADLESS-1
+EOF
+
+WLR_BACKENDS=headless WLR_LIBINPUT_NO_DEVICES=1 \
+	sway -c "$XDG_RUNTIME_DIR/sway.conf" >"$XDG_RUNTIME_DIR/sway.log" 2>&1 &
+pids="$pids $!"
+socket=$(wait_for "$XDG_RUNTIME_DIR/wayland-[0-9]")
+WAYLAND_DISPLAY=$(basename "$socket")
+export WAYLAND_DISPLAY
+
+pipewire >"$XDG_RUNTIME_DIR/pipewire.log" 2>&1 &
+pids="$pids $!"
+wait_for "$XDG_RUNTIME_DIR/pipewire-0" >/dev/null
+wireplumber >"$XDG_RUNTIME_DIR/wireplumber.log" 2>&1 &
+pids="$pids $!"
+
+# frames are only captured when the output is damaged
+$client >/dev/null 2>&1 &
+pids="$pids $!"
+
+"$xdpw" -r -l WARN -c "$XDG_RUNTIME_DIR/xdpw.conf" &
+xdpw_pid=$!
+pids="$pids $xdpw_pid"
+
+"$bench" --frames "$frames" --pid "$xdpw_pid" "$type"
@@ -0,0 +1,19 @@
+#ifndef CHILD_H
+#define CHILD_H
+
+#include <stdbool.h>
+
+// stdout beyond this is dropped
+#define XDPW_CHILD_OUTPUT_MAX 256
+
+struct xdpw_state;
+
+// status is as returned by waitpid, output is NUL terminated
+typedef void (*xdpw_child_done_func_t)(int status, const char *output, void *data);
+
+// runs cmd through /bin/sh without blocking the main loop, input is written
+// to its stdin if not NULL. func is not called if spawning fails.
+int xdpw_child_spawn(struct xdpw_state *state, const char *cmd, const char *input,
+	xdpw_child_done_func_t func, void *data);
+
+#endif
@@ -4,6 +4,27 @@
 #include "logger.h"
 #include "screencast_common.h"
 
+enum config_fps_rule_type {
+	XDPW_FPS_RULE_OUTPUT,
+	XDPW_FPS_RULE_APP,
+};
+
+// framerate keys of an [output:...] or [app:...] section
+struct config_fps_rule {
+	enum config_fps_rule_type type;
+	// output name, "make model" or app id
+	char *match;
+	double max_fps;
+	// -1 when not set
+	int idle_frames;
+	double idle_fps;
+};
+
+enum config_encoder {
+	XDPW_ENCODER_NONE,
+	XDPW_ENCODER_H264,
+};
+
 struct config_screencast {
 	char *output_name;
 	double max_fps;
@@ -12,10 +33,26 @@ struct config_screencast {
 	char *chooser_cmd;
 	enum xdpw_chooser_types chooser_type;
 	bool force_mod_linear;
+	int min_buffers;
+	int max_buffers;
+	bool pipewire_data_thread;
+	int idle_frames;
+	double idle_fps;
+	int idle_damage;
+	enum config_encoder encoder;
+	// kbit/s, 0 for constant quality
+	int encoder_bitrate;
+	struct config_fps_rule *fps_rules;
+	size_t fps_rules_len;
+};
+
+struct config_screenshot {
+	int png_compression;
 };
 
 struct xdpw_config {
 	struct config_screencast screencast_conf;
+	struct config_screenshot screenshot_conf;
 };
 
 void print_config(enum LOGLEVEL loglevel, struct xdpw_config *config);
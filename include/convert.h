@@ -0,0 +1,30 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "screencast_common.h"
+
+// a pass over a 32 bpp image in place, flipping it upside down and/or
+// swapping the two 8 bit channels selected by swap_mask, see
+// xdpw_convert_swap_rb_mask
+struct xdpw_convert_kernel {
+	const char *name;
+	void (*convert)(uint8_t *data, uint32_t stride, uint32_t height,
+		bool flip_y, uint32_t swap_mask);
+};
+
+// the kernels this cpu can run, fastest first. The first one is used for
+// buffers.
+size_t xdpw_convert_get_kernels(const struct xdpw_convert_kernel **kernels);
+
+// mask of the lower of the red and blue channels of a drm format, which are
+// 16 bits apart in all 8 bit rgb formats; 0 if the format has no such pair
+uint32_t xdpw_convert_swap_rb_mask(uint32_t format);
+
+int xdpw_convert_buffer(struct xdpw_buffer *buffer, bool flip_y, bool swap_rb);
+void xdpw_convert_flip_damage_y(struct xdpw_damage_list *damage, uint32_t height);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include "logger.h"
+#include "screencast_common.h"
+
+/*
+ * An H.264 stream of a screencast instance, encoded with VA-API. The encoder
+ * consumes a stream of the instance like any other consumer, so the frames
+ * are captured once into the shared dmabufs. The encoded node is shared by
+ * all sessions of the instance, the raw nodes of the sessions carry its id
+ * in the XDPW_ENCODER_NODE_KEY property.
+ */
+struct xdpw_encoder;
+
+#define XDPW_ENCODER_NODE_KEY "xdpw.h264.node"
+
+#ifdef HAVE_VAAPI
+
+struct xdpw_encoder *xdpw_encoder_create(struct xdpw_screencast_instance *cast);
+void xdpw_encoder_destroy(struct xdpw_encoder *encoder);
+// feeds the encoder or announces the encoded node on other streams
+void xdpw_encoder_stream_connected(struct xdpw_encoder *encoder,
+	struct xdpw_pwr_stream *pwr_stream);
+
+#else
+
+static inline struct xdpw_encoder *xdpw_encoder_create(struct xdpw_screencast_instance *cast) {
+	logprint(WARN, "encoder: built without VA-API, not offering an encoded stream");
+	return NULL;
+}
+
+static inline void xdpw_encoder_destroy(struct xdpw_encoder *encoder) {
+}
+
+static inline void xdpw_encoder_stream_connected(struct xdpw_encoder *encoder,
+		struct xdpw_pwr_stream *pwr_stream) {
+}
+
+#endif
+
+#endif
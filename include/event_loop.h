@@ -0,0 +1,55 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-util.h>
+
+// ready sources are dispatched in this order within one iteration
+enum xdpw_event_priority {
+	XDPW_EVENT_PRIORITY_FRAME, // wayland and frame timers
+	XDPW_EVENT_PRIORITY_STREAM, // pipewire
+	XDPW_EVENT_PRIORITY_CONTROL, // dbus
+};
+
+struct xdpw_event_loop;
+struct xdpw_event_source;
+
+// returns a negative errno on fatal errors
+typedef int (*xdpw_event_source_func_t)(struct xdpw_event_source *source,
+	uint32_t events);
+
+struct xdpw_event_source {
+	struct wl_list link; // xdpw_event_loop::sources, by priority
+	struct xdpw_event_loop *loop;
+	int fd;
+	// EPOLLET sources must drain their fd on every dispatch
+	uint32_t events;
+	enum xdpw_event_priority priority;
+	xdpw_event_source_func_t func;
+	void *data;
+
+	uint32_t ready_events;
+	// set by func when it stopped early, the source is dispatched again
+	// in the next iteration without waiting
+	bool again;
+};
+
+struct xdpw_event_loop {
+	int epoll_fd;
+	struct wl_list sources;
+	// the source dispatched after the current one, kept valid by remove
+	struct wl_list *dispatch_next;
+	bool quit;
+};
+
+int xdpw_event_loop_init(struct xdpw_event_loop *loop);
+void xdpw_event_loop_finish(struct xdpw_event_loop *loop);
+
+// func may remove and free any source, including its own
+int xdpw_event_loop_add(struct xdpw_event_loop *loop, struct xdpw_event_source *source);
+void xdpw_event_loop_remove(struct xdpw_event_source *source);
+
+int xdpw_event_loop_dispatch(struct xdpw_event_loop *loop, int timeout);
+
+#endif
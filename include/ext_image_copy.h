@@ -0,0 +1,11 @@
+#ifndef EXT_IMAGE_COPY_H
+#define EXT_IMAGE_COPY_H
+
+#include "screencast_common.h"
+
+extern const struct xdpw_capture_backend xdpw_ext_image_copy_backend;
+
+int xdpw_ext_cursor_session_init(struct xdpw_screencast_instance *cast);
+void xdpw_ext_cursor_session_finish(struct xdpw_screencast_instance *cast);
+
+#endif
@@ -1,11 +1,14 @@
 #ifndef FPS_LIMIT_H
 #define FPS_LIMIT_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 
 struct fps_limit_state {
 	struct timespec frame_last_time;
+	// compositor timestamp of the last captured frame, anchors the vblank grid
+	struct timespec frame_presented_time;
 	
 	struct timespec fps_last_time;
 	uint64_t fps_frame_count;
@@ -13,6 +16,12 @@ struct fps_limit_state {
 
 void fps_limit_measure_start(struct fps_limit_state *state, double max_fps);
 
-uint64_t fps_limit_measure_end(struct fps_limit_state *state, double max_fps);
+void fps_limit_frame_presented(struct fps_limit_state *state, uint64_t tv_sec, uint32_t tv_nsec);
+
+uint64_t fps_limit_measure_end(struct fps_limit_state *state, double max_fps, double refresh);
+
+// true once nothing changed since last_change for idle_frames frame intervals at max_fps
+bool fps_limit_is_idle(struct timespec *last_change, struct timespec *now,
+	uint32_t idle_frames, double max_fps);
 
 #endif
@@ -0,0 +1,17 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+// FNV-1a, used to bucket outputs and sessions by name
+static inline uint32_t xdpw_hash_str(const char *str) {
+	uint32_t hash = 2166136261u;
+	for (const char *c = str; *c; c++) {
+		hash = (hash ^ (uint8_t)*c) * 16777619u;
+	}
+	// the buckets take the low bits, which FNV only mixes with the low
+	// bits of each byte
+	return hash ^ (hash >> 16);
+}
+
+#endif
@@ -5,6 +5,11 @@
 
 #define DEFAULT_LOGLEVEL ERROR
 
+// messages above this level are compiled out, set by the max-loglevel option
+#ifndef XDPW_LOGLEVEL_MAX
+#define XDPW_LOGLEVEL_MAX TRACE
+#endif
+
 enum LOGLEVEL { QUIET, ERROR, WARN, INFO, DEBUG, TRACE };
 
 struct logger_properties {
@@ -12,8 +17,18 @@ struct logger_properties {
 	FILE *dst;
 };
 
+extern enum LOGLEVEL logger_level;
+
 void init_logger(FILE *dst, enum LOGLEVEL level);
+void finish_logger(void);
 enum LOGLEVEL get_loglevel(const char *level);
-void logprint(enum LOGLEVEL level, char *msg, ...);
+void xdpw_logprint(enum LOGLEVEL level, const char *msg, ...);
+
+// the arguments are only evaluated if the message is printed
+#define logprint(level, ...) do { \
+		if ((level) <= XDPW_LOGLEVEL_MAX && (level) <= logger_level) { \
+			xdpw_logprint((level), __VA_ARGS__); \
+		} \
+	} while (0)
 
 #endif
@@ -4,15 +4,22 @@
 #include "screencast_common.h"
 
 #define XDPW_PWR_BUFFERS 2
-#define XDPW_PWR_BUFFERS_MIN 2
 #define XDPW_PWR_ALIGN 16
+#define XDPW_PWR_PARAMS_BUFFER_SIZE 4096
 
 void xdpw_pwr_dequeue_buffer(struct xdpw_screencast_instance *cast);
 void xdpw_pwr_enqueue_buffer(struct xdpw_screencast_instance *cast);
 void xdpw_pwr_swap_buffer(struct xdpw_screencast_instance *cast);
+bool xdpw_pwr_is_streaming(struct xdpw_screencast_instance *cast);
+uint32_t xdpw_pwr_pool_count(struct xdpw_screencast_instance *cast);
+void xdpw_pwr_add_damage(struct xdpw_screencast_instance *cast, const struct xdpw_damage_list *damage);
+void xdpw_pwr_update_cursor(struct xdpw_screencast_instance *cast);
 void pwr_update_stream_param(struct xdpw_screencast_instance *cast);
-void xdpw_pwr_stream_create(struct xdpw_screencast_instance *cast);
-void xdpw_pwr_stream_destroy(struct xdpw_screencast_instance *cast);
+// offers the new max_framerate, keeping the buffer pools
+void pwr_update_stream_framerate(struct xdpw_screencast_instance *cast);
+struct xdpw_pwr_stream *xdpw_pwr_stream_create(struct xdpw_screencast_instance *cast,
+	const struct xdpw_stream_policy *policy);
+void xdpw_pwr_stream_destroy(struct xdpw_pwr_stream *pwr_stream);
 int xdpw_pwr_context_create(struct xdpw_state *state);
 void xdpw_pwr_context_destroy(struct xdpw_state *state);
 
@@ -0,0 +1,22 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#define XDPW_POOL_MAX 16
+
+// keeps up to XDPW_POOL_MAX freed objects of one type for reuse,
+// initialize with { .size = sizeof(struct ...) }
+struct xdpw_pool {
+	size_t size;
+	void *free[XDPW_POOL_MAX];
+	size_t free_len;
+};
+
+// zeroed like calloc
+void *xdpw_pool_alloc(struct xdpw_pool *pool);
+void xdpw_pool_free(struct xdpw_pool *pool, void *obj);
+// frees the kept objects, the pool stays usable
+void xdpw_pool_finish(struct xdpw_pool *pool);
+
+#endif
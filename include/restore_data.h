@@ -0,0 +1,31 @@
+#ifndef RESTORE_DATA_H
+#define RESTORE_DATA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "xdpw.h"
+
+// identifies our restore_data, bump the version when its contents change
+#define XDPW_RESTORE_VENDOR "wlr"
+#define XDPW_RESTORE_VERSION 1
+
+// the source of a persisted session, strings point into the message
+// they were read from
+struct xdpw_restore_data {
+	const char *output;
+	const char *make; // NULL if the output has none
+	const char *model;
+	// part of the output in output local logical coordinates
+	bool with_region;
+	int32_t x, y;
+	int32_t width, height;
+};
+
+// reads the (suv) variant of the restore_data option,
+// returns 1 if it is ours and 0 if it was written by someone else
+int xdpw_restore_data_read(sd_bus_message *msg, struct xdpw_restore_data *data);
+// appends the restore_data entry to an open a{sv}
+int xdpw_restore_data_append(sd_bus_message *reply, const struct xdpw_restore_data *data);
+
+#endif
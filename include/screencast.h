@@ -4,5 +4,12 @@
 #include "screencast_common.h"
 
 void xdpw_screencast_instance_destroy(struct xdpw_screencast_instance *cast);
+// releases pipewire and gbm after a while once the last session is gone
+void xdpw_screencast_schedule_release(struct xdpw_screencast_context *ctx);
+void xdpw_screencast_instance_update_framerate(struct xdpw_screencast_instance *cast);
+void xdpw_screencast_instance_ready(struct xdpw_screencast_instance *cast);
+void xdpw_screencast_stream_connected(struct xdpw_pwr_stream *pwr_stream);
+void xdpw_screencast_stream_policy(struct xdpw_state *state, const char *app_id,
+	struct xdpw_stream_policy *policy);
 
 #endif
@@ -4,13 +4,29 @@
 #include <gbm.h>
 #include <pipewire/pipewire.h>
 #include <spa/param/video/format-utils.h>
+#include <spa/utils/ringbuffer.h>
+#include <sys/types.h>
 #include <wayland-client-protocol.h>
 
+#include "event_loop.h"
 #include "fps_limit.h"
+#include "stats.h"
+#include "timer.h"
 
 // this seems to be right based on
 // https://github.com/flatpak/xdg-desktop-portal/blob/309a1fc0cf2fb32cceb91dbc666d20cf0a3202c2/src/screen-cast.c#L955
-#define XDP_CAST_PROTO_VER 2
+#define XDP_CAST_PROTO_VER 4
+
+#define XDPW_PWR_BUFFERS_MIN 2
+#define XDPW_PWR_BUFFERS_DEFAULT_MAX 8
+#define XDPW_PWR_BUFFERS_MAX 32
+#define XDPW_DAMAGE_REGIONS_MAX 16
+#define XDPW_CURSOR_BITMAP_MAX 256
+#define XDPW_OUTPUT_BUCKETS 16
+// pipewire and gbm are released after this long without sessions
+#define XDPW_IDLE_RELEASE_TIMEOUT_NS (30 * 1000000000ull)
+// damaged pixels per frame which don't end a static period, e.g. a blinking text cursor
+#define XDPW_IDLE_DAMAGE_DEFAULT 256
 
 enum cursor_modes {
   HIDDEN = 1,
@@ -23,6 +39,12 @@ enum source_types {
   WINDOW = 2,
 };
 
+enum persist_modes {
+  PERSIST_NONE = 0,
+  PERSIST_TRANSIENT = 1,
+  PERSIST_PERSISTENT = 2,
+};
+
 enum buffer_type {
   WL_SHM = 0,
   DMABUF = 1,
@@ -55,13 +77,19 @@ struct xdpw_frame_damage {
 	uint32_t height;
 };
 
+struct xdpw_damage_list {
+	struct xdpw_frame_damage regions[XDPW_DAMAGE_REGIONS_MAX];
+	uint32_t count;
+};
+
 struct xdpw_frame {
 	bool y_invert;
 	uint64_t tv_sec;
 	uint32_t tv_nsec;
-	struct xdpw_frame_damage damage;
+	struct xdpw_damage_list damage;
 	struct xdpw_buffer *xdpw_buffer;
-	struct pw_buffer *pw_buffer;
+	struct xdpw_buffer_pool *pool;
+	uint32_t buffer_index;
 };
 
 struct xdpw_screencopy_frame_info {
@@ -73,21 +101,152 @@ struct xdpw_screencopy_frame_info {
 };
 
 struct xdpw_buffer {
-	struct wl_list link;
+	struct wl_list link; // xdpw_shm_allocator::cache
+	struct xdpw_screencast_context *ctx;
 	enum buffer_type buffer_type;
 
 	uint32_t width;
 	uint32_t height;
 	uint32_t format;
+	int plane_count;
 
-	int fd;
-	uint32_t size;
-	uint32_t stride;
-	uint32_t offset;
+	int fd[GBM_MAX_PLANES];
+	uint32_t size[GBM_MAX_PLANES];
+	uint32_t stride[GBM_MAX_PLANES];
+	uint32_t offset[GBM_MAX_PLANES];
 
 	struct gbm_bo *bo;
 
 	struct wl_buffer *buffer;
+	// cpu mapping of shm buffers
+	void *data;
+	// size of the shm allocation, might be rounded up from size[0]
+	uint32_t alloc_size;
+	// pool whose consumers got the memfd, NULL if only xdpw and the
+	// compositor see the memory
+	struct xdpw_buffer_pool *pool;
+
+	// usage tracking
+	struct timespec dequeue_time;
+	struct timespec queue_time;
+};
+
+/*
+ * Buffers shared by all PipeWire streams of a screencast instance which
+ * negotiated the same buffer type and modifier. The compositor copies a frame
+ * once into one of the buffers, which is then queued on every stream.
+ * SHM streams which asked for red and blue swapped get a pool of their own.
+ */
+struct xdpw_buffer_pool {
+	struct wl_list link; // xdpw_screencast_instance::buffer_pools
+	struct xdpw_screencast_instance *cast;
+	enum buffer_type buffer_type;
+	uint64_t modifier;
+	// frames are converted from the compositor's channel order
+	bool swap_rb;
+
+	struct xdpw_buffer *buffers[XDPW_PWR_BUFFERS_MAX];
+	uint32_t bindings[XDPW_PWR_BUFFERS_MAX];
+
+	struct wl_list streams; // xdpw_pwr_stream::pool_link
+	// damage accumulated since the pool was last queued
+	struct xdpw_damage_list damage;
+
+	// adaptive sizing
+	uint32_t buffer_count;
+	uint32_t frames;
+	uint32_t misses;
+	uint64_t hold_ns_max;
+	uint64_t round_trip_ns_max;
+};
+
+// framerate settings of the client of a stream
+struct xdpw_stream_policy {
+	// 0 without a cap
+	double max_fps;
+	// frame intervals without significant damage before capturing at idle_fps,
+	// 0 disables throttling
+	uint32_t idle_frames;
+	double idle_fps;
+};
+
+struct xdpw_pwr_stream {
+	struct wl_list link; // xdpw_screencast_instance::stream_list
+	struct wl_list pool_link; // xdpw_buffer_pool::streams
+	struct xdpw_screencast_instance *cast;
+	struct xdpw_buffer_pool *pool;
+
+	struct pw_stream *stream;
+	struct spa_hook stream_listener;
+	struct spa_video_info_raw pwr_format;
+	enum buffer_type buffer_type;
+	uint32_t blocks;
+	bool avoid_dmabufs;
+	uint32_t seq;
+	uint32_t node_id;
+	bool pwr_stream_state;
+	// negotiated maximum
+	double framerate;
+	struct xdpw_stream_policy policy;
+	// serial of the cursor image the consumer has
+	uint32_t cursor_serial;
+
+	// pw_buffers indexed like the buffers of the pool
+	struct pw_buffer *buffers[XDPW_PWR_BUFFERS_MAX];
+	// bitmask of dequeued buffers ready to be filled
+	uint32_t free_buffers;
+
+	// data thread mode, the data thread passes returned buffers through
+	// the ring and wakes the main thread through the eventfd
+	int process_fd;
+	struct xdpw_event_source process_source;
+	struct spa_ringbuffer returned_ring;
+	struct pw_buffer *returned[XDPW_PWR_BUFFERS_MAX];
+};
+
+struct xdpw_format_modifier_pair {
+	uint32_t fourcc;
+	uint64_t modifier;
+};
+
+struct xdpw_dmabuf_feedback_data {
+	void *format_table_data;
+	uint32_t format_table_size;
+	bool device_used;
+	bool done;
+	// the device the compositor renders with, gbm is opened on it once needed
+	dev_t main_device;
+	bool has_main_device;
+};
+
+struct xdpw_screencast_instance;
+
+struct xdpw_capture_backend {
+	const char *name;
+	// create the per instance capture objects
+	int (*session_init)(struct xdpw_screencast_instance *cast);
+	// release the per instance capture objects
+	void (*session_finish)(struct xdpw_screencast_instance *cast);
+	// request the next frame
+	void (*frame_start)(struct xdpw_screencast_instance *cast);
+	// release the per frame capture objects
+	void (*frame_free)(struct xdpw_screencast_instance *cast);
+};
+
+/*
+ * Idle shm buffers are kept around, so renegotiations and new instances with
+ * the same frame geometry don't have to allocate and fault in new memory.
+ */
+struct xdpw_shm_allocator {
+	struct wl_list cache; // xdpw_buffer::link, most recently used first
+	size_t cached_size;
+	bool hugetlb_failed;
+};
+
+// a gbm device opened on the render node of a drm device
+struct xdpw_gbm_device {
+	struct wl_list link; // xdpw_screencast_context::gbm_devices
+	struct gbm_device *gbm;
 };
 
 struct xdpw_screencast_context {
@@ -101,19 +260,90 @@ struct xdpw_screencast_context {
 
 	// wlroots
 	struct wl_list output_list;
+	// committed outputs by global id and name
+	struct wl_list outputs_by_id[XDPW_OUTPUT_BUCKETS]; // xdpw_wlr_output::id_link
+	struct wl_list outputs_by_name[XDPW_OUTPUT_BUCKETS]; // xdpw_wlr_output::name_link
 	struct wl_registry *registry;
 	struct zwlr_screencopy_manager_v1 *screencopy_manager;
+	struct ext_image_copy_capture_manager_v1 *ext_image_copy_capture_manager;
+	struct ext_output_image_capture_source_manager_v1 *ext_output_image_capture_source_manager;
+	struct ext_foreign_toplevel_image_capture_source_manager_v1 *ext_toplevel_image_capture_source_manager;
+	struct ext_foreign_toplevel_list_v1 *foreign_toplevel_list;
+	struct wl_list toplevel_list; // xdpw_toplevel::link
+	const struct xdpw_capture_backend *capture_backend;
 	struct zxdg_output_manager_v1 *xdg_output_manager;
 	struct wl_shm *shm;
+	struct xdpw_shm_allocator shm_allocator;
+	struct wl_seat *seat;
+	struct wl_pointer *pointer;
 	struct zwp_linux_dmabuf_v1 *linux_dmabuf;
+	struct zwp_linux_dmabuf_feedback_v1 *linux_dmabuf_feedback;
+	struct xdpw_dmabuf_feedback_data feedback_data;
+	struct wl_array format_modifier_pairs;
+
+	// default choosers that aren't installed, by index
+	bool default_choosers_probed;
+	uint32_t default_choosers_missing;
+
+	// pipewire and gbm are acquired with the first session
+	bool acquired;
+	struct xdpw_timer idle_timer;
 
 	// gbm
+	struct wl_list gbm_devices; // xdpw_gbm_device::link
+	// the main device of the compositor
 	struct gbm_device *gbm;
 
 	// sessions
 	struct wl_list screencast_instances;
 };
 
+struct xdpw_toplevel {
+	struct wl_list link; // xdpw_screencast_context::toplevel_list
+	struct xdpw_screencast_context *ctx;
+	struct ext_foreign_toplevel_handle_v1 *handle;
+	char *title;
+	char *app_id;
+};
+
+// what a screencast instance captures
+struct xdpw_capture_target {
+	// monitor and region sources
+	struct xdpw_wlr_output *output;
+	// window sources, NULL once the window is closed
+	struct xdpw_toplevel *toplevel;
+	// part of the output in output local logical coordinates
+	bool with_region;
+	int32_t x, y;
+	int32_t width, height;
+};
+
+// the pointer cursor, exported as SPA_META_Cursor in cursor mode METADATA
+struct xdpw_cursor {
+	struct ext_image_capture_source_v1 *source;
+	struct ext_image_copy_capture_cursor_session_v1 *session;
+	struct ext_image_copy_capture_session_v1 *capture_session;
+	struct ext_image_copy_capture_frame_v1 *frame;
+	struct xdpw_screencopy_frame_info constraints;
+	struct xdpw_screencopy_frame_info frame_info;
+	struct xdpw_buffer *buffer;
+
+	// in buffer coordinates of the capture source
+	bool visible;
+	int32_t x, y;
+	int32_t hotspot_x, hotspot_y;
+
+	// last captured image, laid out as described by frame_info
+	uint8_t *bitmap;
+	struct xdpw_screencopy_frame_info bitmap_info;
+	// bumped whenever the image or its visibility changes
+	uint32_t serial;
+
+	// pointer updates are sent at most at the capture framerate
+	struct xdpw_timer timer;
+	struct timespec last_update;
+};
+
 struct xdpw_screencast_instance {
 	// list
 	struct wl_list link;
@@ -122,37 +352,69 @@ struct xdpw_screencast_instance {
 	uint32_t refcount;
 	struct xdpw_screencast_context *ctx;
 	bool initialized;
+	// the capture session was created and waits for its first constraints
+	bool session_started;
+	// device the dmabufs are allocated on
+	struct gbm_device *gbm;
 	struct xdpw_frame current_frame;
 	enum xdpw_frame_state frame_state;
-	struct wl_list buffer_list;
 
 	// pipewire
-	struct pw_stream *stream;
-	struct spa_hook stream_listener;
-	struct spa_video_info_raw pwr_format;
-	uint32_t seq;
-	uint32_t node_id;
-	bool pwr_stream_state;
-	uint32_t framerate;
+	struct wl_list stream_list;
+	struct wl_list buffer_pools;
+	uint32_t pool_cycle;
+	double framerate;
+	int64_t last_pts;
+	// H.264 stream shared by the sessions, NULL without encoder
+	struct xdpw_encoder *encoder;
 
 	// wlroots
+	const struct xdpw_capture_backend *capture_backend;
 	struct zwlr_screencopy_frame_v1 *frame_callback;
-	struct xdpw_wlr_output *target_output;
-	uint32_t max_framerate;
+	struct xdpw_capture_target target;
+	double max_framerate;
+	// max_framerate changed during a capture, the formats are updated once it is done
+	bool framerate_update_pending;
 	struct zwlr_screencopy_frame_v1 *wlr_frame;
+	// next frame, requested while wlr_frame is copied
+	struct zwlr_screencopy_frame_v1 *wlr_frame_pending;
+	bool wlr_frame_pending_done;
 	struct xdpw_screencopy_frame_info screencopy_frame_info[2];
+	enum cursor_modes cursor_mode;
+	// paint the cursor into the frames
 	bool with_cursor;
+	struct xdpw_cursor cursor;
 	int err;
 	bool quit;
 	bool need_buffer;
-	enum buffer_type buffer_type;
+
+	// ext-image-copy-capture
+	struct ext_image_capture_source_v1 *ext_source;
+	struct ext_image_copy_capture_session_v1 *ext_session;
+	struct ext_image_copy_capture_frame_v1 *ext_frame;
+	struct xdpw_screencopy_frame_info ext_constraints[2];
 
 	// fps limit
 	struct fps_limit_state fps_limit;
+	struct xdpw_timer frame_timer;
+	// idle throttling agreed on by all streams, idle_frames 0 disables it
+	uint32_t idle_frames;
+	double idle_fps;
+	// last frame with more than idle_damage pixels damaged
+	struct timespec last_change;
+	bool throttled;
+
+	struct xdpw_screencast_stats stats;
 };
 
 struct xdpw_wlr_output {
 	struct wl_list link;
+	struct wl_list id_link;
+	struct wl_list name_link;
+	struct xdpw_screencast_context *ctx;
+	// set once the first wl_output.done committed the output state
+	bool ready;
+	float pending_framerate;
 	uint32_t id;
 	struct wl_output *output;
 	struct zxdg_output_v1 *xdg_output;
@@ -162,17 +424,36 @@ struct xdpw_wlr_output {
 	int width;
 	int height;
 	float framerate;
+	int32_t transform; // enum wl_output_transform
+	// layout position and size in logical pixels, from the xdg_output
+	int32_t x, y;
+	int32_t logical_width, logical_height;
 };
 
 void randname(char *buf);
-struct gbm_device *xdpw_gbm_device_create(void);
-struct xdpw_buffer *xdpw_buffer_create(struct xdpw_screencast_instance *cast,
-	enum buffer_type buffer_type, struct xdpw_screencopy_frame_info *frame_info);
+struct gbm_device *xdpw_gbm_device_create(struct xdpw_screencast_context *ctx);
+struct gbm_device *xdpw_gbm_device_get(struct xdpw_screencast_context *ctx, dev_t device);
+void xdpw_gbm_devices_finish(struct xdpw_screencast_context *ctx);
+bool xdpw_gbm_device_matches(struct gbm_device *gbm, dev_t device);
+bool xdpw_drm_devices_match(dev_t a, dev_t b);
+struct xdpw_buffer *xdpw_buffer_create(struct xdpw_buffer_pool *pool,
+	struct xdpw_screencopy_frame_info *frame_info);
 void xdpw_buffer_destroy(struct xdpw_buffer *buffer);
+// bytes allocated for an instance and its buffers
+uint64_t xdpw_screencast_instance_memory(struct xdpw_screencast_instance *cast);
+bool xdpw_capture_target_equal(const struct xdpw_capture_target *a,
+	const struct xdpw_capture_target *b);
+
+void xdpw_damage_list_add(struct xdpw_damage_list *list, const struct xdpw_frame_damage *damage);
+void xdpw_damage_list_merge(struct xdpw_damage_list *dst, const struct xdpw_damage_list *src);
+void xdpw_damage_list_bounds(const struct xdpw_damage_list *list, struct xdpw_frame_damage *bounds);
+// sum of the region areas, overlaps are counted twice
+uint64_t xdpw_damage_list_area(const struct xdpw_damage_list *list);
 enum wl_shm_format xdpw_format_wl_shm_from_drm_fourcc(uint32_t format);
 uint32_t xdpw_format_drm_fourcc_from_wl_shm(enum wl_shm_format format);
 enum spa_video_format xdpw_format_pw_from_drm_fourcc(uint32_t format);
 enum spa_video_format xdpw_format_pw_strip_alpha(enum spa_video_format format);
+enum spa_video_format xdpw_format_pw_swap_rb(enum spa_video_format format);
 
 enum xdpw_chooser_types get_chooser_type(const char *chooser_type);
 const char *chooser_type_str(enum xdpw_chooser_types chooser_type);
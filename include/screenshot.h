@@ -1,10 +1,33 @@
 #ifndef SCREENSHOT_H
 #define SCREENSHOT_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct xdpw_screencast_context;
 
 struct xdpw_ppm_pixel {
 	int max_color_value;
 	unsigned char red, green, blue;
 };
 
-#endif
\ No newline at end of file
+typedef void (*xdpw_screenshot_done_func_t)(bool success, void *data);
+
+// captures all outputs into a png at path, func runs on the main loop once
+// the file is written. Returns -1 if the compositor can't be captured in-process.
+int xdpw_screenshot_capture(struct xdpw_screencast_context *ctx, const char *path,
+	int png_compression, xdpw_screenshot_done_func_t func, void *data);
+
+typedef void (*xdpw_pick_color_done_func_t)(bool success, double red, double green,
+	double blue, void *data);
+
+// reads the pixel at x, y in layout coordinates, func runs on the main loop
+int xdpw_screenshot_pick_color(struct xdpw_screencast_context *ctx, int32_t x, int32_t y,
+	xdpw_pick_color_done_func_t func, void *data);
+
+// rgb holds height rows of 3 * width bytes
+int xdpw_png_write(FILE *f, const uint8_t *rgb, uint32_t width, uint32_t height,
+	int level);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef SHM_ALLOCATOR_H
+#define SHM_ALLOCATOR_H
+
+#include "screencast_common.h"
+
+// upper bound for the memory held by idle shm buffers
+#define XDPW_SHM_CACHE_MAX_SIZE (256 << 20)
+// hugetlb memfds are sized in multiples of the default hugepage size
+#define XDPW_SHM_HUGEPAGE_SIZE (2 << 20)
+
+void xdpw_shm_allocator_init(struct xdpw_shm_allocator *alloc);
+void xdpw_shm_allocator_finish(struct xdpw_shm_allocator *alloc);
+// destroys the idle buffers consumers of the pool have seen
+void xdpw_shm_allocator_drop(struct xdpw_shm_allocator *alloc,
+	struct xdpw_buffer_pool *pool);
+
+// idle buffers are only handed out again to the pool they were created for,
+// so no consumer gets to see the frames of another one
+struct xdpw_buffer *xdpw_shm_buffer_acquire(struct xdpw_screencast_context *ctx,
+	struct xdpw_screencopy_frame_info *frame_info, struct xdpw_buffer_pool *pool);
+void xdpw_shm_buffer_release(struct xdpw_buffer *buffer);
+
+#endif
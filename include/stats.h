@@ -0,0 +1,50 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// log-linear buckets, 8 per power of two, up to 2^32 us
+#define XDPW_HISTOGRAM_SUB_BITS 3
+#define XDPW_HISTOGRAM_BUCKETS 240
+
+struct xdpw_histogram {
+	uint64_t buckets[XDPW_HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t max;
+};
+
+struct xdpw_screencast_stats {
+	uint64_t frames;
+	uint64_t dropped_frames;
+	uint64_t failed_frames;
+	uint64_t renegotiations;
+	uint64_t out_of_buffers;
+	uint64_t idle_frames; // captured at the idle rate
+
+	// latencies in us
+	struct xdpw_histogram capture_latency; // capture request to ready
+	struct xdpw_histogram queue_latency; // compositor timestamp to queue
+	struct xdpw_histogram timer_wait; // time spent waiting for the fps limit
+	struct xdpw_histogram frame_interval; // between two captured frames
+
+	struct timespec request_time;
+	struct timespec timer_armed_time;
+	struct timespec first_frame_time;
+	struct timespec last_frame_time;
+
+	// process cpu time in us when the instance was created
+	uint64_t start_cpu_time;
+};
+
+void xdpw_histogram_record(struct xdpw_histogram *histogram, uint64_t value);
+uint64_t xdpw_histogram_percentile(const struct xdpw_histogram *histogram, double percentile);
+uint64_t xdpw_histogram_bucket_max(size_t index);
+
+void xdpw_stats_record_since(struct xdpw_histogram *histogram, struct timespec *since);
+void xdpw_stats_start(struct xdpw_screencast_stats *stats);
+void xdpw_stats_frame(struct xdpw_screencast_stats *stats);
+void xdpw_stats_print(struct xdpw_screencast_stats *stats);
+
+#endif
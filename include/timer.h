@@ -0,0 +1,31 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct xdpw_state;
+
+typedef void (*xdpw_event_loop_timer_func_t)(void *data);
+
+// timers are embedded in their owner and kept in a min-heap by deadline
+struct xdpw_timer {
+	struct xdpw_state *state;
+	xdpw_event_loop_timer_func_t func;
+	void *user_data;
+	struct timespec at;
+	bool armed;
+	size_t heap_index; // xdpw_state::timers
+};
+
+void xdpw_timer_arm(struct xdpw_state *state, struct xdpw_timer *timer,
+	uint64_t delay_ns, xdpw_event_loop_timer_func_t func, void *data);
+void xdpw_timer_disarm(struct xdpw_timer *timer);
+
+// runs all expired timers
+void xdpw_timers_dispatch(struct xdpw_state *state);
+void xdpw_timers_finish(struct xdpw_state *state);
+
+#endif
@@ -1,33 +1,76 @@
 #ifndef WLR_SCREENCAST_H
 #define WLR_SCREENCAST_H
 
+#include "child.h"
 #include "screencast_common.h"
 
-#define WL_OUTPUT_VERSION 1
+#define WL_OUTPUT_VERSION 2
 
 #define SC_MANAGER_VERSION 3
 #define SC_MANAGER_VERSION_MIN 2
 
 #define WL_SHM_VERSION 1
 
+#define WL_SEAT_VERSION 1
+
 #define XDG_OUTPUT_MANAGER_VERSION 3
 
-#define LINUX_DMABUF_VERSION 3
+#define EXT_IMAGE_COPY_CAPTURE_MANAGER_VERSION 1
+#define EXT_OUTPUT_IMAGE_CAPTURE_SOURCE_MANAGER_VERSION 1
+#define EXT_TOPLEVEL_IMAGE_CAPTURE_SOURCE_MANAGER_VERSION 1
+#define EXT_FOREIGN_TOPLEVEL_LIST_VERSION 1
+
+#define LINUX_DMABUF_VERSION 4
+#define LINUX_DMABUF_VERSION_MIN 3
 
 struct xdpw_state;
 
 int xdpw_wlr_screencopy_init(struct xdpw_state *state);
 void xdpw_wlr_screencopy_finish(struct xdpw_screencast_context *ctx);
+// opens the gbm device used for dmabufs, the first time or after an idle release
+void xdpw_wlr_gbm_acquire(struct xdpw_screencast_context *ctx);
 
-struct xdpw_wlr_output *xdpw_wlr_output_find_by_name(struct wl_list *output_list,
+// only outputs with committed state are returned
+struct xdpw_wlr_output *xdpw_wlr_output_find_by_name(struct xdpw_screencast_context *ctx,
 	const char *name);
-struct xdpw_wlr_output *xdpw_wlr_output_first(struct wl_list *output_list);
+struct xdpw_wlr_output *xdpw_wlr_output_first(struct xdpw_screencast_context *ctx);
+// the output of a restored session, also found by make and model after a rename
+struct xdpw_wlr_output *xdpw_wlr_output_find_restore(struct xdpw_screencast_context *ctx,
+	const char *name, const char *make, const char *model);
 struct xdpw_wlr_output *xdpw_wlr_output_find(struct xdpw_screencast_context *ctx,
 	struct wl_output *out, uint32_t id);
-struct xdpw_wlr_output *xdpw_wlr_output_chooser(struct xdpw_screencast_context *ctx);
+
+// called with NULL if the selection failed or was canceled
+typedef void (*xdpw_wlr_output_chooser_func_t)(const struct xdpw_capture_target *target,
+	void *data);
+// func runs once the chooser process exits, or right away when no chooser is spawned,
+// types is a bitmask of the enum source_types that may be chosen
+void xdpw_wlr_output_chooser(struct xdpw_screencast_context *ctx, uint32_t types,
+	xdpw_wlr_output_chooser_func_t func, void *data);
+
+// a line printed by an output chooser, "NAME" or "NAME X,Y WxH"
+struct xdpw_chooser_selection {
+	char name[XDPW_CHILD_OUTPUT_MAX];
+	bool with_region;
+	// layout coordinates
+	int32_t x, y;
+	int32_t width, height;
+};
+
+bool xdpw_wlr_parse_selection(const char *line, struct xdpw_chooser_selection *sel);
+// clips a region in layout coordinates to target->output and makes it output local,
+// false if nothing is left of it
+bool xdpw_wlr_target_clip_region(struct xdpw_capture_target *target,
+	int32_t x, int32_t y, int32_t width, int32_t height);
+
+// modifiers of drm_format announced by the compositor and usable on gbm
+uint32_t xdpw_wlr_query_dmabuf_modifiers(struct xdpw_screencast_context *ctx,
+	struct gbm_device *gbm, uint32_t drm_format, uint64_t **modifiers);
 
 void xdpw_wlr_frame_finish(struct xdpw_screencast_instance *cast);
 void xdpw_wlr_frame_start(struct xdpw_screencast_instance *cast);
-void xdpw_wlr_register_cb(struct xdpw_screencast_instance *cast);
+bool xdpw_wlr_frame_prepare_buffer(struct xdpw_screencast_instance *cast);
+
+extern const struct xdpw_capture_backend xdpw_wlr_screencopy_backend;
 
 #endif
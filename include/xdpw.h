@@ -12,9 +12,15 @@
 
 #include "screencast_common.h"
 #include "config.h"
+#include "event_loop.h"
+#include "timer.h"
+
+#define XDPW_SESSION_BUCKETS 64
 
 struct xdpw_state {
 	struct wl_list xdpw_sessions;
+	// sessions by handle, see xdpw_session_find
+	struct wl_list session_buckets[XDPW_SESSION_BUCKETS]; // xdpw_session::handle_link
 	sd_bus *bus;
 	struct wl_display *wl_display;
 	struct pw_loop *pw_loop;
@@ -23,9 +29,12 @@ struct xdpw_state {
 	uint32_t screencast_cursor_modes; // bitfield of enum cursor_modes
 	uint32_t screencast_version;
 	struct xdpw_config *config;
+	// other subsystems can hook their fds in here
+	struct xdpw_event_loop event_loop;
 	int timer_poll_fd;
-	struct wl_list timers;
-	struct xdpw_timer *next_timer;
+	struct xdpw_timer **timers;
+	size_t timers_len;
+	size_t timers_cap;
 };
 
 struct xdpw_request {
@@ -34,19 +43,17 @@ struct xdpw_request {
 
 struct xdpw_session {
 	struct wl_list link;
+	struct wl_list handle_link;
+	struct xdpw_state *state;
 	sd_bus_slot *slot;
+	sd_bus_slot *stats_slot;
 	char *session_handle;
 	struct xdpw_screencast_instance *screencast_instance;
-};
-
-typedef void (*xdpw_event_loop_timer_func_t)(void *data);
-
-struct xdpw_timer {
-	struct xdpw_state *state;
-	xdpw_event_loop_timer_func_t func;
-	void *user_data;
-	struct timespec at;
-	struct wl_list link; // xdpw_state::timers
+	struct xdpw_pwr_stream *pwr_stream;
+	enum persist_modes persist_mode;
+	// pending Start call, answered once the stream has a node id
+	sd_bus_message *start_msg;
+	struct xdpw_stream_policy stream_policy;
 };
 
 enum {
@@ -57,16 +64,17 @@ enum {
 
 int xdpw_screenshot_init(struct xdpw_state *state);
 int xdpw_screencast_init(struct xdpw_state *state);
+void xdpw_screencast_finish(struct xdpw_state *state);
 
 struct xdpw_request *xdpw_request_create(sd_bus *bus, const char *object_path);
 void xdpw_request_destroy(struct xdpw_request *req);
+void xdpw_requests_finish(void);
 
 struct xdpw_session *xdpw_session_create(struct xdpw_state *state, sd_bus *bus, char *object_path);
 void xdpw_session_destroy(struct xdpw_session *req);
-
-struct xdpw_timer *xdpw_add_timer(struct xdpw_state *state,
-	uint64_t delay_ns, xdpw_event_loop_timer_func_t func, void *data);
-
-void xdpw_destroy_timer(struct xdpw_timer *timer);
+struct xdpw_session *xdpw_session_find(struct xdpw_state *state, const char *session_handle);
+struct wl_list *xdpw_session_bucket(struct xdpw_state *state, const char *session_handle);
+// destroys the remaining sessions at exit
+void xdpw_sessions_finish(struct xdpw_state *state);
 
 #endif
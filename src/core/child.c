@@ -0,0 +1,217 @@
+#define _GNU_SOURCE 1
+#include "child.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "xdpw.h"
+#include "logger.h"
+
+struct xdpw_child {
+	pid_t pid;
+	int pid_fd;
+	struct xdpw_event_source out_source;
+	struct xdpw_event_source pid_source;
+	bool out_done, exited;
+	int status;
+	char output[XDPW_CHILD_OUTPUT_MAX];
+	size_t output_len;
+
+	xdpw_child_done_func_t func;
+	void *data;
+};
+
+static pid_t spawn_child(const char *cmd, int child_in[2], int child_out[2]) {
+	logprint(TRACE,
+			"exec child called: cmd %s, pipe child_in (%d,%d), pipe child_out (%d,%d)",
+			cmd, child_in[0], child_in[1], child_out[0], child_out[1]);
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		perror("fork");
+		return pid;
+	} else if (pid == 0) {
+		close(child_in[1]);
+		close(child_out[0]);
+
+		dup2(child_in[0], STDIN_FILENO);
+		dup2(child_out[1], STDOUT_FILENO);
+		close(child_in[0]);
+		close(child_out[1]);
+
+		execl("/bin/sh", "/bin/sh", "-c", cmd, NULL);
+
+		perror("execl");
+		_exit(127);
+	}
+
+	close(child_in[0]);
+	close(child_out[1]);
+
+	return pid;
+}
+
+static int pidfd_open_compat(pid_t pid) {
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	return -1;
+#endif
+}
+
+static void child_check(struct xdpw_child *child) {
+	if (!child->out_done) {
+		return;
+	}
+	if (!child->exited) {
+		if (child->pid_fd >= 0) {
+			// the pidfd reports the exit
+			return;
+		}
+		// the child closed its stdout, so it is about to exit anyway
+		if (waitpid(child->pid, &child->status, 0) < 0) {
+			child->status = 127 << 8;
+		}
+		child->exited = true;
+	}
+
+	child->output[child->output_len] = '\0';
+	child->func(child->status, child->output, child->data);
+	free(child);
+}
+
+static int child_handle_out(struct xdpw_event_source *source, uint32_t events) {
+	struct xdpw_child *child = source->data;
+
+	while (true) {
+		char buf[256];
+		ssize_t n = read(source->fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && errno == EAGAIN) {
+			return 0;
+		}
+		if (n <= 0) {
+			break;
+		}
+		size_t len = MIN((size_t)n, sizeof(child->output) - 1 - child->output_len);
+		memcpy(child->output + child->output_len, buf, len);
+		child->output_len += len;
+	}
+
+	xdpw_event_loop_remove(source);
+	close(source->fd);
+	child->out_done = true;
+	child_check(child);
+	return 0;
+}
+
+static int child_handle_pid(struct xdpw_event_source *source, uint32_t events) {
+	struct xdpw_child *child = source->data;
+
+	pid_t ret = waitpid(child->pid, &child->status, WNOHANG);
+	if (ret == 0) {
+		return 0;
+	}
+	if (ret < 0) {
+		child->status = 127 << 8;
+	}
+
+	xdpw_event_loop_remove(source);
+	close(source->fd);
+	child->pid_fd = -1;
+	child->exited = true;
+	child_check(child);
+	return 0;
+}
+
+int xdpw_child_spawn(struct xdpw_state *state, const char *cmd, const char *input,
+		xdpw_child_done_func_t func, void *data) {
+	struct xdpw_child *child = calloc(1, sizeof(*child));
+	if (child == NULL) {
+		return -1;
+	}
+	child->func = func;
+	child->data = data;
+
+	int child_in[2]; //p -> c
+	int child_out[2]; //c -> p
+
+	if (pipe(child_in) == -1) {
+		perror("pipe child_in");
+		logprint(ERROR, "Failed to open pipe child_in");
+		goto error_child_in;
+	}
+	if (pipe(child_out) == -1) {
+		perror("pipe child_out");
+		logprint(ERROR, "Failed to open pipe child_out");
+		goto error_child_out;
+	}
+
+	child->pid = spawn_child(cmd, child_in, child_out);
+	if (child->pid < 0) {
+		logprint(ERROR, "Failed to fork child");
+		goto error_fork;
+	}
+
+	// input is expected to be far below the pipe capacity, so this doesn't block
+	if (input && write(child_in[1], input, strlen(input)) < 0) {
+		logprint(WARN, "Failed to write to pipe child_in: %s", strerror(errno));
+	}
+	close(child_in[1]);
+
+	fcntl(child_out[0], F_SETFL, fcntl(child_out[0], F_GETFL) | O_NONBLOCK);
+	fcntl(child_out[0], F_SETFD, FD_CLOEXEC);
+
+	child->out_source = (struct xdpw_event_source){
+		.fd = child_out[0],
+		.events = EPOLLIN,
+		.priority = XDPW_EVENT_PRIORITY_CONTROL,
+		.func = child_handle_out,
+		.data = child,
+	};
+	if (xdpw_event_loop_add(&state->event_loop, &child->out_source) < 0) {
+		close(child_out[0]);
+		kill(child->pid, SIGTERM);
+		waitpid(child->pid, NULL, 0);
+		free(child);
+		return -1;
+	}
+
+	// without pidfds the exit is picked up once the child closes its stdout
+	child->pid_fd = pidfd_open_compat(child->pid);
+	if (child->pid_fd >= 0) {
+		child->pid_source = (struct xdpw_event_source){
+			.fd = child->pid_fd,
+			.events = EPOLLIN,
+			.priority = XDPW_EVENT_PRIORITY_CONTROL,
+			.func = child_handle_pid,
+			.data = child,
+		};
+		if (xdpw_event_loop_add(&state->event_loop, &child->pid_source) < 0) {
+			close(child->pid_fd);
+			child->pid_fd = -1;
+		}
+	}
+	return 0;
+
+error_fork:
+	close(child_out[0]);
+	close(child_out[1]);
+error_child_out:
+	close(child_in[0]);
+	close(child_in[1]);
+error_child_in:
+	free(child);
+	return -1;
+}
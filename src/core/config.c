@@ -17,6 +17,22 @@ void print_config(enum LOGLEVEL loglevel, struct xdpw_config *config) {
 	logprint(loglevel, "config: chooser_cmd: %s", config->screencast_conf.chooser_cmd);
 	logprint(loglevel, "config: chooser_type: %s", chooser_type_str(config->screencast_conf.chooser_type));
 	logprint(loglevel, "config: force_mod_linear: %d", config->screencast_conf.force_mod_linear);
+	logprint(loglevel, "config: min_buffers: %d", config->screencast_conf.min_buffers);
+	logprint(loglevel, "config: max_buffers: %d", config->screencast_conf.max_buffers);
+	logprint(loglevel, "config: pipewire_data_thread: %d", config->screencast_conf.pipewire_data_thread);
+	logprint(loglevel, "config: idle_frames: %d", config->screencast_conf.idle_frames);
+	logprint(loglevel, "config: idle_fps: %f", config->screencast_conf.idle_fps);
+	logprint(loglevel, "config: idle_damage: %d", config->screencast_conf.idle_damage);
+	logprint(loglevel, "config: encoder: %s",
+		config->screencast_conf.encoder == XDPW_ENCODER_H264 ? "h264" : "none");
+	logprint(loglevel, "config: encoder_bitrate: %d", config->screencast_conf.encoder_bitrate);
+	for (size_t i = 0; i < config->screencast_conf.fps_rules_len; i++) {
+		struct config_fps_rule *rule = &config->screencast_conf.fps_rules[i];
+		logprint(loglevel, "config: %s %s: max_fps: %f, idle_frames: %d, idle_fps: %f",
+			rule->type == XDPW_FPS_RULE_OUTPUT ? "output" : "app", rule->match,
+			rule->max_fps, rule->idle_frames, rule->idle_fps);
+	}
+	logprint(loglevel, "config: png_compression: %d", config->screenshot_conf.png_compression);
 }
 
 // NOTE: calling finish_config won't prepare the config to be read again from config file
@@ -29,6 +45,10 @@ void finish_config(struct xdpw_config *config) {
 	free(config->screencast_conf.exec_before);
 	free(config->screencast_conf.exec_after);
 	free(config->screencast_conf.chooser_cmd);
+	for (size_t i = 0; i < config->screencast_conf.fps_rules_len; i++) {
+		free(config->screencast_conf.fps_rules[i].match);
+	}
+	free(config->screencast_conf.fps_rules);
 }
 
 static void parse_string(char **dest, const char* value) {
@@ -48,6 +68,14 @@ static void parse_double(double *dest, const char* value) {
 	*dest = strtod(value, (char**)NULL);
 }
 
+static void parse_int(int *dest, const char* value) {
+	if (value == NULL || *value == '\0') {
+		logprint(TRACE, "config: skipping empty value in config file");
+		return;
+	}
+	*dest = strtol(value, (char**)NULL, 10);
+}
+
 static void parse_bool(bool *dest, const char* value) {
 	if (value == NULL || *value == '\0') {
 		logprint(TRACE, "config: skipping empty value in config file");
@@ -60,6 +88,21 @@ static void parse_bool(bool *dest, const char* value) {
 	}
 }
 
+static void parse_encoder(enum config_encoder *dest, const char *value) {
+	if (value == NULL || *value == '\0') {
+		logprint(TRACE, "config: skipping empty value in config file");
+		return;
+	}
+	if (strcmp(value, "h264") == 0) {
+		*dest = XDPW_ENCODER_H264;
+	} else {
+		if (strcmp(value, "none") != 0) {
+			logprint(WARN, "config: unknown encoder %s", value);
+		}
+		*dest = XDPW_ENCODER_NONE;
+	}
+}
+
 static int handle_ini_screencast(struct config_screencast *screencast_conf, const char *key, const char *value) {
 	if (strcmp(key, "output_name") == 0) {
 		parse_string(&screencast_conf->output_name, value);
@@ -78,6 +121,81 @@ static int handle_ini_screencast(struct config_screencast *screencast_conf, cons
 		free(chooser_type);
 	} else if (strcmp(key, "force_mod_linear") == 0) {
 		parse_bool(&screencast_conf->force_mod_linear, value);
+	} else if (strcmp(key, "min_buffers") == 0) {
+		parse_int(&screencast_conf->min_buffers, value);
+	} else if (strcmp(key, "max_buffers") == 0) {
+		parse_int(&screencast_conf->max_buffers, value);
+	} else if (strcmp(key, "pipewire_data_thread") == 0) {
+		parse_bool(&screencast_conf->pipewire_data_thread, value);
+	} else if (strcmp(key, "idle_frames") == 0) {
+		parse_int(&screencast_conf->idle_frames, value);
+	} else if (strcmp(key, "idle_fps") == 0) {
+		parse_double(&screencast_conf->idle_fps, value);
+	} else if (strcmp(key, "idle_damage") == 0) {
+		parse_int(&screencast_conf->idle_damage, value);
+	} else if (strcmp(key, "encoder") == 0) {
+		parse_encoder(&screencast_conf->encoder, value);
+	} else if (strcmp(key, "encoder_bitrate") == 0) {
+		parse_int(&screencast_conf->encoder_bitrate, value);
+	} else {
+		logprint(TRACE, "config: skipping invalid key in config file");
+		return 0;
+	}
+	return 1;
+}
+
+static int handle_ini_screenshot(struct config_screenshot *screenshot_conf, const char *key, const char *value) {
+	if (strcmp(key, "png_compression") == 0) {
+		parse_int(&screenshot_conf->png_compression, value);
+	} else {
+		logprint(TRACE, "config: skipping invalid key in config file");
+		return 0;
+	}
+	return 1;
+}
+
+static struct config_fps_rule *fps_rule_get(struct config_screencast *screencast_conf,
+		enum config_fps_rule_type type, const char *match) {
+	for (size_t i = 0; i < screencast_conf->fps_rules_len; i++) {
+		struct config_fps_rule *rule = &screencast_conf->fps_rules[i];
+		if (rule->type == type && strcmp(rule->match, match) == 0) {
+			return rule;
+		}
+	}
+
+	struct config_fps_rule *rules = realloc(screencast_conf->fps_rules,
+		(screencast_conf->fps_rules_len + 1) * sizeof(*rules));
+	if (rules == NULL) {
+		logprint(ERROR, "config: failed to allocate max_fps rule");
+		return NULL;
+	}
+	screencast_conf->fps_rules = rules;
+	struct config_fps_rule *rule = &rules[screencast_conf->fps_rules_len++];
+	*rule = (struct config_fps_rule){
+		.type = type,
+		.match = strdup(match),
+		.idle_frames = -1,
+		.idle_fps = -1,
+	};
+	return rule;
+}
+
+static int handle_ini_fps_rule(struct config_screencast *screencast_conf,
+		enum config_fps_rule_type type, const char *match, const char *key, const char *value) {
+	if (*match == '\0') {
+		logprint(TRACE, "config: skipping invalid section in config file");
+		return 0;
+	}
+	struct config_fps_rule *rule = fps_rule_get(screencast_conf, type, match);
+	if (rule == NULL) {
+		return 0;
+	}
+	if (strcmp(key, "max_fps") == 0) {
+		parse_double(&rule->max_fps, value);
+	} else if (type == XDPW_FPS_RULE_APP && strcmp(key, "idle_frames") == 0) {
+		parse_int(&rule->idle_frames, value);
+	} else if (type == XDPW_FPS_RULE_APP && strcmp(key, "idle_fps") == 0) {
+		parse_double(&rule->idle_fps, value);
 	} else {
 		logprint(TRACE, "config: skipping invalid key in config file");
 		return 0;
@@ -92,6 +210,17 @@ static int handle_ini_config(void *data, const char* section, const char *key, c
 	if (strcmp(section, "screencast") == 0) {
 		return handle_ini_screencast(&config->screencast_conf, key, value);
 	}
+	if (strcmp(section, "screenshot") == 0) {
+		return handle_ini_screenshot(&config->screenshot_conf, key, value);
+	}
+	if (strncmp(section, "output:", strlen("output:")) == 0) {
+		return handle_ini_fps_rule(&config->screencast_conf, XDPW_FPS_RULE_OUTPUT,
+			section + strlen("output:"), key, value);
+	}
+	if (strncmp(section, "app:", strlen("app:")) == 0) {
+		return handle_ini_fps_rule(&config->screencast_conf, XDPW_FPS_RULE_APP,
+			section + strlen("app:"), key, value);
+	}
 
 	logprint(TRACE, "config: skipping invalid key in config file");
 	return 0;
@@ -100,6 +229,50 @@ static int handle_ini_config(void *data, const char* section, const char *key, c
 static void default_config(struct xdpw_config *config) {
 	config->screencast_conf.max_fps = 0;
 	config->screencast_conf.chooser_type = XDPW_CHOOSER_DEFAULT;
+	config->screencast_conf.min_buffers = XDPW_PWR_BUFFERS_MIN;
+	config->screencast_conf.max_buffers = XDPW_PWR_BUFFERS_DEFAULT_MAX;
+	config->screencast_conf.idle_frames = 0;
+	config->screencast_conf.idle_fps = 1;
+	config->screencast_conf.idle_damage = XDPW_IDLE_DAMAGE_DEFAULT;
+	config->screenshot_conf.png_compression = 6;
+}
+
+static void check_config(struct xdpw_config *config) {
+	struct config_screencast *screencast_conf = &config->screencast_conf;
+	if (screencast_conf->min_buffers < XDPW_PWR_BUFFERS_MIN) {
+		logprint(WARN, "config: min_buffers must be at least %d", XDPW_PWR_BUFFERS_MIN);
+		screencast_conf->min_buffers = XDPW_PWR_BUFFERS_MIN;
+	}
+	if (screencast_conf->max_buffers > XDPW_PWR_BUFFERS_MAX) {
+		logprint(WARN, "config: max_buffers must be at most %d", XDPW_PWR_BUFFERS_MAX);
+		screencast_conf->max_buffers = XDPW_PWR_BUFFERS_MAX;
+	}
+	if (screencast_conf->max_buffers < screencast_conf->min_buffers) {
+		logprint(WARN, "config: max_buffers is smaller than min_buffers");
+		screencast_conf->max_buffers = screencast_conf->min_buffers;
+	}
+	if (screencast_conf->idle_frames < 0) {
+		logprint(WARN, "config: idle_frames must not be negative");
+		screencast_conf->idle_frames = 0;
+	}
+	if (screencast_conf->idle_fps <= 0) {
+		logprint(WARN, "config: idle_fps must be positive");
+		screencast_conf->idle_fps = 1;
+	}
+	if (screencast_conf->idle_damage < 0) {
+		logprint(WARN, "config: idle_damage must not be negative");
+		screencast_conf->idle_damage = XDPW_IDLE_DAMAGE_DEFAULT;
+	}
+	if (screencast_conf->encoder_bitrate < 0) {
+		logprint(WARN, "config: encoder_bitrate must not be negative");
+		screencast_conf->encoder_bitrate = 0;
+	}
+
+	struct config_screenshot *screenshot_conf = &config->screenshot_conf;
+	if (screenshot_conf->png_compression < 0 || screenshot_conf->png_compression > 9) {
+		logprint(WARN, "config: png_compression must be between 0 and 9");
+		screenshot_conf->png_compression = 6;
+	}
 }
 
 static bool file_exists(const char *path) {
@@ -191,4 +364,5 @@ void init_config(char ** const configfile, struct xdpw_config *config) {
 	if (ini_parse(*configfile, handle_ini_config, config) < 0) {
 		logprint(ERROR, "config: unable to load config file %s", *configfile);
 	}
+	check_config(config);
 }
@@ -0,0 +1,117 @@
+#include "event_loop.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define EVENT_LOOP_MAX_EVENTS 16
+
+int xdpw_event_loop_init(struct xdpw_event_loop *loop) {
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		logprint(ERROR, "event-loop: failed to create epoll fd: %s", strerror(errno));
+		return -errno;
+	}
+	wl_list_init(&loop->sources);
+	loop->dispatch_next = NULL;
+	loop->quit = false;
+	return 0;
+}
+
+void xdpw_event_loop_finish(struct xdpw_event_loop *loop) {
+	struct xdpw_event_source *source, *tmp;
+	wl_list_for_each_safe(source, tmp, &loop->sources, link) {
+		xdpw_event_loop_remove(source);
+	}
+	close(loop->epoll_fd);
+	loop->epoll_fd = -1;
+}
+
+int xdpw_event_loop_add(struct xdpw_event_loop *loop, struct xdpw_event_source *source) {
+	struct epoll_event event = {
+		.events = source->events,
+		.data.ptr = source,
+	};
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &event) < 0) {
+		logprint(ERROR, "event-loop: failed to add fd %d: %s", source->fd, strerror(errno));
+		return -errno;
+	}
+
+	source->loop = loop;
+	source->ready_events = 0;
+	source->again = false;
+
+	// keep the list sorted, sources of equal priority run in insertion order
+	struct xdpw_event_source *pos;
+	wl_list_for_each(pos, &loop->sources, link) {
+		if (pos->priority > source->priority) {
+			break;
+		}
+	}
+	wl_list_insert(pos->link.prev, &source->link);
+	return 0;
+}
+
+void xdpw_event_loop_remove(struct xdpw_event_source *source) {
+	struct xdpw_event_loop *loop = source->loop;
+	if (!loop) {
+		return;
+	}
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+	if (loop->dispatch_next == &source->link) {
+		loop->dispatch_next = source->link.next;
+	}
+	wl_list_remove(&source->link);
+	source->loop = NULL;
+}
+
+int xdpw_event_loop_dispatch(struct xdpw_event_loop *loop, int timeout) {
+	struct xdpw_event_source *source;
+	wl_list_for_each(source, &loop->sources, link) {
+		if (source->again) {
+			timeout = 0;
+			break;
+		}
+	}
+
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+	int n = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+	if (n < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		logprint(ERROR, "event-loop: epoll_wait failed: %s", strerror(errno));
+		return -errno;
+	}
+
+	for (int i = 0; i < n; i++) {
+		source = events[i].data.ptr;
+		source->ready_events |= events[i].events;
+	}
+
+	// epoll reports ready fds in no particular order, run them by priority.
+	// func may remove the next source, so walk the list through
+	// dispatch_next which xdpw_event_loop_remove moves past it
+	int ret = 0;
+	struct wl_list *link = loop->sources.next;
+	while (link != &loop->sources) {
+		source = wl_container_of(link, source, link);
+		loop->dispatch_next = link->next;
+		if (source->ready_events || source->again) {
+			uint32_t ready_events = source->ready_events;
+			source->ready_events = 0;
+			source->again = false;
+
+			ret = source->func(source, ready_events);
+			if (ret < 0 || loop->quit) {
+				break;
+			}
+		}
+		link = loop->dispatch_next;
+	}
+	loop->dispatch_next = NULL;
+	return ret < 0 ? ret : 0;
+}
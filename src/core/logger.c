@@ -1,15 +1,138 @@
 #include "logger.h"
 
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "timespec_util.h"
+
+#define LOG_RING_SIZE 1024
+#define LOG_MESSAGE_MAX 512
+
+struct log_record {
+	enum LOGLEVEL level;
+	struct timespec time;
+	char msg[LOG_MESSAGE_MAX];
+};
+
+/*
+ * Messages are formatted into a ring by the calling thread and written by
+ * the logger thread, so tracing doesn't block the frame path on stderr.
+ * Warnings and errors wait until they are written.
+ */
+struct log_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t written;
+	pthread_t thread;
+	bool running;
+	bool quit;
+
+	struct log_record records[LOG_RING_SIZE];
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+
+	// difference between the wall clock and the monotonic clock
+	int64_t realtime_offset_ns;
+};
+
+enum LOGLEVEL logger_level = TRACE;
 static struct logger_properties logprops;
+static struct log_ring ring = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.written = PTHREAD_COND_INITIALIZER,
+};
+
+static const char *print_loglevel(enum LOGLEVEL loglevel);
+
+static void log_record_write(const struct log_record *record) {
+	struct timespec realtime = record->time;
+	timespec_add(&realtime, ring.realtime_offset_ns);
+
+	char timestr[200];
+	time_t t = realtime.tv_sec;
+	struct tm tm;
+	if (strftime(timestr, sizeof(timestr), "%Y/%m/%d %H:%M:%S", localtime_r(&t, &tm)) == 0) {
+		fprintf(stderr, "strftime returned 0");
+		abort();
+	}
+
+	fprintf(logprops.dst, "%s.%03ld [%s] - %s\n", timestr, realtime.tv_nsec / 1000000,
+		print_loglevel(record->level), record->msg);
+}
+
+static void *log_thread(void *data) {
+	pthread_mutex_lock(&ring.lock);
+	while (true) {
+		while (ring.head == ring.tail && !ring.quit) {
+			pthread_cond_wait(&ring.queued, &ring.lock);
+		}
+		if (ring.head == ring.tail) {
+			break;
+		}
+		uint64_t head = ring.head;
+		uint64_t dropped = ring.dropped;
+		ring.dropped = 0;
+		pthread_mutex_unlock(&ring.lock);
+
+		// producers don't touch records between tail and head
+		if (dropped > 0) {
+			fprintf(logprops.dst, "[logger] - %lu messages dropped\n", (unsigned long)dropped);
+		}
+		for (uint64_t i = ring.tail; i < head; i++) {
+			log_record_write(&ring.records[i % LOG_RING_SIZE]);
+		}
+		fflush(logprops.dst);
+
+		pthread_mutex_lock(&ring.lock);
+		ring.tail = head;
+		pthread_cond_broadcast(&ring.written);
+	}
+	pthread_mutex_unlock(&ring.lock);
+	return NULL;
+}
 
 void init_logger(FILE *dst, enum LOGLEVEL level) {
 	logprops.dst = dst;
 	logprops.level = level;
+	logger_level = level;
+
+	struct timespec realtime, now;
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ring.realtime_offset_ns = timespec_diff_ns(&realtime, &now);
+
+	if (level == QUIET || ring.running) {
+		return;
+	}
+	if (pthread_create(&ring.thread, NULL, log_thread, NULL) != 0) {
+		fprintf(stderr, "Failed to start the logger thread, logging synchronously\n");
+		return;
+	}
+	ring.running = true;
+	atexit(finish_logger);
+}
+
+void finish_logger(void) {
+	pthread_mutex_lock(&ring.lock);
+	if (!ring.running) {
+		pthread_mutex_unlock(&ring.lock);
+		return;
+	}
+	ring.quit = true;
+	pthread_cond_signal(&ring.queued);
+	pthread_mutex_unlock(&ring.lock);
+
+	pthread_join(ring.thread, NULL);
+	pthread_mutex_lock(&ring.lock);
+	ring.running = false;
+	pthread_mutex_unlock(&ring.lock);
 }
 
 enum LOGLEVEL get_loglevel(const char *level) {
@@ -50,7 +173,7 @@ static const char *print_loglevel(enum LOGLEVEL loglevel) {
 	abort();
 }
 
-void logprint(enum LOGLEVEL level, char *msg, ...) {
+void xdpw_logprint(enum LOGLEVEL level, const char *msg, ...) {
 	if (!logprops.dst) {
 		fprintf(stderr, "Logger has been called, but was not initialized\n");
 		abort();
@@ -59,27 +182,48 @@ void logprint(enum LOGLEVEL level, char *msg, ...) {
 	if (level > logprops.level || level == QUIET) {
 		return;
 	}
-	va_list args;
 
-	char timestr[200];
-	time_t t = time(NULL);
-	struct tm *tmp = localtime(&t);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	if (strftime(timestr, sizeof(timestr), "%Y/%m/%d %H:%M:%S", tmp) == 0) {
-		fprintf(stderr, "strftime returned 0");
-		abort();
+	va_list args;
+	pthread_mutex_lock(&ring.lock);
+	if (!ring.running) {
+		// the logger thread is gone, write right away
+		struct log_record record = { .level = level, .time = now };
+		va_start(args, msg);
+		vsnprintf(record.msg, sizeof(record.msg), msg, args);
+		va_end(args);
+		log_record_write(&record);
+		fflush(logprops.dst);
+		pthread_mutex_unlock(&ring.lock);
+		return;
 	}
 
-	fprintf(logprops.dst, "%s", timestr);
-	fprintf(logprops.dst, " ");
-	fprintf(logprops.dst, "[%s]", print_loglevel(level));
-	fprintf(logprops.dst, " - ");
+	// warnings and errors are never dropped
+	while (level <= WARN && ring.head - ring.tail == LOG_RING_SIZE) {
+		pthread_cond_wait(&ring.written, &ring.lock);
+	}
+	if (ring.head - ring.tail == LOG_RING_SIZE) {
+		ring.dropped++;
+		pthread_mutex_unlock(&ring.lock);
+		return;
+	}
 
+	struct log_record *record = &ring.records[ring.head % LOG_RING_SIZE];
+	record->level = level;
+	record->time = now;
 	va_start(args, msg);
-	vfprintf(logprops.dst, msg, args);
+	vsnprintf(record->msg, sizeof(record->msg), msg, args);
 	va_end(args);
+	uint64_t seq = ++ring.head;
+	pthread_cond_signal(&ring.queued);
 
-
-	fprintf(logprops.dst, "\n");
-	fflush(logprops.dst);
+	// keep warnings and errors in front of a possible crash
+	if (level <= WARN) {
+		while (ring.tail < seq && ring.running) {
+			pthread_cond_wait(&ring.written, &ring.lock);
+		}
+	}
+	pthread_mutex_unlock(&ring.lock);
 }
@@ -3,7 +3,7 @@
 #include <stdio.h>
 #include <sys/timerfd.h>
 #include <getopt.h>
-#include <poll.h>
+#include <sys/epoll.h>
 #include <pipewire/pipewire.h>
 #include <spa/utils/result.h>
 #include <unistd.h>
@@ -11,12 +11,8 @@
 #include "xdpw.h"
 #include "logger.h"
 
-enum event_loop_fd {
-	EVENT_LOOP_DBUS,
-	EVENT_LOOP_WAYLAND,
-	EVENT_LOOP_PIPEWIRE,
-	EVENT_LOOP_TIMER,
-};
+// bound the dbus work per iteration so frame events don't wait behind a burst
+#define DBUS_DISPATCH_BATCH 32
 
 static const char service_name[] = "org.freedesktop.impl.portal.desktop.wlr";
 
@@ -36,6 +32,83 @@ static int xdpw_usage(FILE *stream, int rc) {
 	return rc;
 }
 
+static int handle_wayland_event(struct xdpw_event_source *source, uint32_t events) {
+	struct xdpw_state *state = source->data;
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		logprint(INFO, "event-loop: disconnected from wayland");
+		source->loop->quit = true;
+		return 0;
+	}
+
+	logprint(TRACE, "event-loop: got wayland event");
+	if (wl_display_dispatch(state->wl_display) < 0) {
+		logprint(ERROR, "wl_display_dispatch failed: %s", strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+static int handle_timer_event(struct xdpw_event_source *source, uint32_t events) {
+	struct xdpw_state *state = source->data;
+	logprint(TRACE, "event-loop: got a timer event");
+
+	uint64_t expirations;
+	ssize_t n = read(source->fd, &expirations, sizeof(expirations));
+	if (n < 0 && errno != EAGAIN) {
+		logprint(ERROR, "failed to read from timer FD\n");
+		return -errno;
+	}
+
+	xdpw_timers_dispatch(state);
+	return 0;
+}
+
+static int handle_pipewire_event(struct xdpw_event_source *source, uint32_t events) {
+	struct xdpw_state *state = source->data;
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		logprint(INFO, "event-loop: disconnected from pipewire");
+		source->loop->quit = true;
+		return 0;
+	}
+
+	logprint(TRACE, "event-loop: got pipewire event");
+	// the source is edge triggered, drain everything pending
+	int ret;
+	do {
+		ret = pw_loop_iterate(state->pw_loop, 0);
+	} while (ret > 0);
+	if (ret < 0 && ret != -EINTR) {
+		logprint(ERROR, "pw_loop_iterate failed: %s", spa_strerror(ret));
+		return ret;
+	}
+	return 0;
+}
+
+static int handle_dbus_event(struct xdpw_event_source *source, uint32_t events) {
+	struct xdpw_state *state = source->data;
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		logprint(INFO, "event-loop: disconnected from dbus");
+		source->loop->quit = true;
+		return 0;
+	}
+
+	logprint(TRACE, "event-loop: got dbus event");
+	int ret = 0;
+	for (int i = 0; i < DBUS_DISPATCH_BATCH; i++) {
+		ret = sd_bus_process(state->bus, NULL);
+		if (ret <= 0) {
+			break;
+		}
+	}
+	if (ret < 0) {
+		logprint(ERROR, "sd_bus_process failed: %s", strerror(-ret));
+		return ret;
+	}
+	// more messages might be queued in sd-bus without the fd being readable
+	source->again = ret > 0;
+	return 0;
+}
+
 static int handle_name_lost(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
 	logprint(INFO, "dbus: lost name, closing connection");
 	sd_bus_close(sd_bus_message_get_bus(m));
@@ -123,14 +196,19 @@ int main(int argc, char *argv[]) {
 	};
 
 	wl_list_init(&state.xdpw_sessions);
+	for (size_t i = 0; i < XDPW_SESSION_BUCKETS; i++) {
+		wl_list_init(&state.session_buckets[i]);
+	}
 
-	xdpw_screenshot_init(&state);
-	ret = xdpw_screencast_init(&state);
-	if (ret < 0) {
-		logprint(ERROR, "xdpw: failed to initialize screencast");
-		goto error;
+	if (xdpw_event_loop_init(&state.event_loop) < 0) {
+		pw_loop_destroy(pw_loop);
+		wl_display_disconnect(wl_display);
+		sd_bus_unref(bus);
+		return EXIT_FAILURE;
 	}
+	state.timer_poll_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
 
+	// own the name before anything slow, messages queue up until the loop runs
 	uint64_t flags = SD_BUS_NAME_ALLOW_REPLACEMENT;
 	if (replace) {
 		flags |= SD_BUS_NAME_REPLACE_EXISTING;
@@ -166,97 +244,55 @@ int main(int argc, char *argv[]) {
 		goto error;
 	}
 
-	wl_list_init(&state.timers);
+	// pipewire and gbm are set up lazily with the first session
+	xdpw_screenshot_init(&state);
+	ret = xdpw_screencast_init(&state);
+	if (ret < 0) {
+		logprint(ERROR, "xdpw: failed to initialize screencast");
+		goto error;
+	}
 
-	struct pollfd pollfds[] = {
-		[EVENT_LOOP_DBUS] = {
-			.fd = sd_bus_get_fd(state.bus),
-			.events = POLLIN,
-		},
-		[EVENT_LOOP_WAYLAND] = {
+	struct xdpw_event_source sources[] = {
+		{
 			.fd = wl_display_get_fd(state.wl_display),
-			.events = POLLIN,
+			.events = EPOLLIN,
+			.priority = XDPW_EVENT_PRIORITY_FRAME,
+			.func = handle_wayland_event,
+			.data = &state,
+		},
+		{
+			.fd = state.timer_poll_fd,
+			.events = EPOLLIN,
+			.priority = XDPW_EVENT_PRIORITY_FRAME,
+			.func = handle_timer_event,
+			.data = &state,
 		},
-		[EVENT_LOOP_PIPEWIRE] = {
+		{
 			.fd = pw_loop_get_fd(state.pw_loop),
-			.events = POLLIN,
+			.events = EPOLLIN | EPOLLET,
+			.priority = XDPW_EVENT_PRIORITY_STREAM,
+			.func = handle_pipewire_event,
+			.data = &state,
+		},
+		{
+			.fd = sd_bus_get_fd(state.bus),
+			.events = EPOLLIN,
+			.priority = XDPW_EVENT_PRIORITY_CONTROL,
+			.func = handle_dbus_event,
+			.data = &state,
 		},
-		[EVENT_LOOP_TIMER] = {
-			.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC),
-			.events = POLLIN,
-		}
 	};
-
-	state.timer_poll_fd = pollfds[EVENT_LOOP_TIMER].fd;
-
-	while (1) {
-		ret = poll(pollfds, sizeof(pollfds) / sizeof(pollfds[0]), -1);
+	for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+		ret = xdpw_event_loop_add(&state.event_loop, &sources[i]);
 		if (ret < 0) {
-			logprint(ERROR, "poll failed: %s", strerror(errno));
 			goto error;
 		}
+	}
 
-		if (pollfds[EVENT_LOOP_DBUS].revents & POLLHUP) {
-			logprint(INFO, "event-loop: disconnected from dbus");
-			break;
-		}
-		if (pollfds[EVENT_LOOP_WAYLAND].revents & POLLHUP) {
-			logprint(INFO, "event-loop: disconnected from wayland");
-			break;
-		}
-		if (pollfds[EVENT_LOOP_PIPEWIRE].revents & POLLHUP) {
-			logprint(INFO, "event-loop: disconnected from pipewire");
-			break;
-		}
-
-		if (pollfds[EVENT_LOOP_DBUS].revents & POLLIN) {
-			logprint(TRACE, "event-loop: got dbus event");
-			do {
-				ret = sd_bus_process(state.bus, NULL);
-			} while (ret > 0);
-			if (ret < 0) {
-				logprint(ERROR, "sd_bus_process failed: %s", strerror(-ret));
-				goto error;
-			}
-		}
-
-		if (pollfds[EVENT_LOOP_WAYLAND].revents & POLLIN) {
-			logprint(TRACE, "event-loop: got wayland event");
-			ret = wl_display_dispatch(state.wl_display);
-			if (ret < 0) {
-				logprint(ERROR, "wl_display_dispatch failed: %s", strerror(errno));
-				goto error;
-			}
-		}
-
-		if (pollfds[EVENT_LOOP_PIPEWIRE].revents & POLLIN) {
-			logprint(TRACE, "event-loop: got pipewire event");
-			ret = pw_loop_iterate(state.pw_loop, 0);
-			if (ret < 0) {
-				logprint(ERROR, "pw_loop_iterate failed: %s", spa_strerror(ret));
-				goto error;
-			}
-		}
-
-		if (pollfds[EVENT_LOOP_TIMER].revents & POLLIN) {
-			logprint(TRACE, "event-loop: got a timer event");
-
-			int timer_fd = pollfds[EVENT_LOOP_TIMER].fd;
-			uint64_t expirations;
-			ssize_t n = read(timer_fd, &expirations, sizeof(expirations));
-			if (n < 0) {
-				logprint(ERROR, "failed to read from timer FD\n");
-				goto error;
-			}
-
-			struct xdpw_timer *timer = state.next_timer;
-			if (timer != NULL) {
-				xdpw_event_loop_timer_func_t func = timer->func;
-				void *user_data = timer->user_data;
-				xdpw_destroy_timer(timer);
-
-				func(user_data);
-			}
+	while (!state.event_loop.quit) {
+		ret = xdpw_event_loop_dispatch(&state.event_loop, -1);
+		if (ret < 0) {
+			goto error;
 		}
 
 		do {
@@ -268,6 +304,11 @@ int main(int argc, char *argv[]) {
 	}
 
 	// TODO: cleanup
+	xdpw_sessions_finish(&state);
+	xdpw_screencast_finish(&state);
+	xdpw_requests_finish();
+	xdpw_event_loop_finish(&state.event_loop);
+	xdpw_timers_finish(&state);
 	finish_config(&config);
 	free(configfile);
 
@@ -0,0 +1,30 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void *xdpw_pool_alloc(struct xdpw_pool *pool) {
+	if (pool->free_len == 0) {
+		return calloc(1, pool->size);
+	}
+	void *obj = pool->free[--pool->free_len];
+	memset(obj, 0, pool->size);
+	return obj;
+}
+
+void xdpw_pool_free(struct xdpw_pool *pool, void *obj) {
+	if (obj == NULL) {
+		return;
+	}
+	if (pool->free_len == XDPW_POOL_MAX) {
+		free(obj);
+		return;
+	}
+	pool->free[pool->free_len++] = obj;
+}
+
+void xdpw_pool_finish(struct xdpw_pool *pool) {
+	while (pool->free_len > 0) {
+		free(pool->free[--pool->free_len]);
+	}
+}
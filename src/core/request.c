@@ -4,9 +4,12 @@
 #include <string.h>
 #include "xdpw.h"
 #include "logger.h"
+#include "pool.h"
 
 static const char interface_name[] = "org.freedesktop.impl.portal.Request";
 
+static struct xdpw_pool request_pool = { .size = sizeof(struct xdpw_request) };
+
 static int method_close(sd_bus_message *msg, void *data,
 		sd_bus_error *ret_error) {
 	struct xdpw_request *req = data;
@@ -38,11 +41,14 @@ static const sd_bus_vtable request_vtable[] = {
 };
 
 struct xdpw_request *xdpw_request_create(sd_bus *bus, const char *object_path) {
-	struct xdpw_request *req = calloc(1, sizeof(struct xdpw_request));
+	struct xdpw_request *req = xdpw_pool_alloc(&request_pool);
+	if (req == NULL) {
+		return NULL;
+	}
 
 	if (sd_bus_add_object_vtable(bus, &req->slot, object_path, interface_name,
-			request_vtable, NULL) < 0) {
-		free(req);
+			request_vtable, req) < 0) {
+		xdpw_pool_free(&request_pool, req);
 		logprint(ERROR, "dbus: sd_bus_add_object_vtable failed: %s",
 			strerror(-errno));
 		return NULL;
@@ -56,5 +62,9 @@ void xdpw_request_destroy(struct xdpw_request *req) {
 		return;
 	}
 	sd_bus_slot_unref(req->slot);
-	free(req);
+	xdpw_pool_free(&request_pool, req);
+}
+
+void xdpw_requests_finish(void) {
+	xdpw_pool_finish(&request_pool);
 }
@@ -1,13 +1,24 @@
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include "xdpw.h"
 #include "screencast.h"
+#include "pipewire_screencast.h"
+#include "hash.h"
 #include "logger.h"
+#include "pool.h"
 
 static const char interface_name[] = "org.freedesktop.impl.portal.Session";
+static const char stats_interface_name[] = "org.freedesktop.impl.portal.desktop.wlr.Stats";
+
+static struct xdpw_pool session_pool = { .size = sizeof(struct xdpw_session) };
+
+struct wl_list *xdpw_session_bucket(struct xdpw_state *state, const char *session_handle) {
+	return &state->session_buckets[xdpw_hash_str(session_handle) % XDPW_SESSION_BUCKETS];
+}
 
 static int method_close(sd_bus_message *msg, void *data,
 		sd_bus_error *ret_error) {
@@ -39,28 +50,154 @@ static const sd_bus_vtable session_vtable[] = {
 	SD_BUS_VTABLE_END
 };
 
+static const struct {
+	const char *name;
+	size_t offset;
+} stats_counters[] = {
+	{ "Frames", offsetof(struct xdpw_screencast_stats, frames) },
+	{ "DroppedFrames", offsetof(struct xdpw_screencast_stats, dropped_frames) },
+	{ "FailedFrames", offsetof(struct xdpw_screencast_stats, failed_frames) },
+	{ "Renegotiations", offsetof(struct xdpw_screencast_stats, renegotiations) },
+	{ "OutOfBuffers", offsetof(struct xdpw_screencast_stats, out_of_buffers) },
+}, stats_histograms[] = {
+	{ "CaptureLatency", offsetof(struct xdpw_screencast_stats, capture_latency) },
+	{ "QueueLatency", offsetof(struct xdpw_screencast_stats, queue_latency) },
+	{ "TimerWait", offsetof(struct xdpw_screencast_stats, timer_wait) },
+};
+
+static const char *session_stats(struct xdpw_session *sess) {
+	if (!sess->screencast_instance) {
+		return NULL;
+	}
+	return (const char *)&sess->screencast_instance->stats;
+}
+
+static int get_stats_counter(sd_bus *bus, const char *path, const char *interface,
+		const char *property, sd_bus_message *reply, void *data,
+		sd_bus_error *ret_error) {
+	const char *stats = session_stats(data);
+	uint64_t value = 0;
+	for (size_t i = 0; stats && i < sizeof(stats_counters) / sizeof(stats_counters[0]); i++) {
+		if (strcmp(property, stats_counters[i].name) == 0) {
+			value = *(const uint64_t *)(stats + stats_counters[i].offset);
+			break;
+		}
+	}
+	return sd_bus_message_append(reply, "t", value);
+}
+
+// non-empty histogram buckets as (largest value in us, count) pairs
+static int get_stats_histogram(sd_bus *bus, const char *path, const char *interface,
+		const char *property, sd_bus_message *reply, void *data,
+		sd_bus_error *ret_error) {
+	const char *stats = session_stats(data);
+	const struct xdpw_histogram *histogram = NULL;
+	for (size_t i = 0; stats && i < sizeof(stats_histograms) / sizeof(stats_histograms[0]); i++) {
+		if (strcmp(property, stats_histograms[i].name) == 0) {
+			histogram = (const struct xdpw_histogram *)(stats + stats_histograms[i].offset);
+			break;
+		}
+	}
+
+	int ret = sd_bus_message_open_container(reply, 'a', "(tt)");
+	if (ret < 0) {
+		return ret;
+	}
+	for (size_t i = 0; histogram && i < XDPW_HISTOGRAM_BUCKETS; i++) {
+		if (histogram->buckets[i] == 0) {
+			continue;
+		}
+		ret = sd_bus_message_append(reply, "(tt)",
+			xdpw_histogram_bucket_max(i), histogram->buckets[i]);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	return sd_bus_message_close_container(reply);
+}
+
+// captures shared with other sessions are split between them
+static int get_stats_memory(sd_bus *bus, const char *path, const char *interface,
+		const char *property, sd_bus_message *reply, void *data,
+		sd_bus_error *ret_error) {
+	struct xdpw_session *sess = data;
+	uint64_t size = sizeof(*sess) + strlen(sess->session_handle) + 1;
+	if (sess->pwr_stream) {
+		size += sizeof(*sess->pwr_stream);
+	}
+	struct xdpw_screencast_instance *cast = sess->screencast_instance;
+	if (cast && cast->refcount > 0) {
+		size += xdpw_screencast_instance_memory(cast) / cast->refcount;
+	}
+	return sd_bus_message_append(reply, "t", size);
+}
+
+static const sd_bus_vtable stats_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("Frames", "t", get_stats_counter, 0, 0),
+	SD_BUS_PROPERTY("DroppedFrames", "t", get_stats_counter, 0, 0),
+	SD_BUS_PROPERTY("FailedFrames", "t", get_stats_counter, 0, 0),
+	SD_BUS_PROPERTY("Renegotiations", "t", get_stats_counter, 0, 0),
+	SD_BUS_PROPERTY("OutOfBuffers", "t", get_stats_counter, 0, 0),
+	SD_BUS_PROPERTY("CaptureLatency", "a(tt)", get_stats_histogram, 0, 0),
+	SD_BUS_PROPERTY("QueueLatency", "a(tt)", get_stats_histogram, 0, 0),
+	SD_BUS_PROPERTY("TimerWait", "a(tt)", get_stats_histogram, 0, 0),
+	SD_BUS_PROPERTY("MemoryBytes", "t", get_stats_memory, 0, 0),
+	SD_BUS_VTABLE_END
+};
+
 struct xdpw_session *xdpw_session_create(struct xdpw_state *state, sd_bus *bus, char *object_path) {
-	struct xdpw_session *sess = calloc(1, sizeof(struct xdpw_session));
+	struct xdpw_session *sess = xdpw_pool_alloc(&session_pool);
+	if (sess == NULL) {
+		free(object_path);
+		return NULL;
+	}
 
+	sess->state = state;
 	sess->session_handle = object_path;
 
 	if (sd_bus_add_object_vtable(bus, &sess->slot, object_path, interface_name,
 			session_vtable, sess) < 0) {
-		free(sess);
+		free(object_path);
+		xdpw_pool_free(&session_pool, sess);
 		logprint(ERROR, "dbus: sd_bus_add_object_vtable failed: %s",
 			strerror(-errno));
 		return NULL;
 	}
 
+	if (sd_bus_add_object_vtable(bus, &sess->stats_slot, object_path, stats_interface_name,
+			stats_vtable, sess) < 0) {
+		logprint(WARN, "dbus: unable to export session stats: %s", strerror(-errno));
+	}
+
 	wl_list_insert(&state->xdpw_sessions, &sess->link);
+	wl_list_insert(xdpw_session_bucket(state, object_path), &sess->handle_link);
 	return sess;
 }
 
+struct xdpw_session *xdpw_session_find(struct xdpw_state *state, const char *session_handle) {
+	struct xdpw_session *sess;
+	wl_list_for_each(sess, xdpw_session_bucket(state, session_handle), handle_link) {
+		if (strcmp(sess->session_handle, session_handle) == 0) {
+			return sess;
+		}
+	}
+	return NULL;
+}
+
 void xdpw_session_destroy(struct xdpw_session *sess) {
 	logprint(DEBUG, "dbus: destroying session %p", sess);
 	if (!sess) {
 		return;
 	}
+	if (sess->start_msg) {
+		sd_bus_reply_method_errno(sess->start_msg, ECANCELED, NULL);
+		sd_bus_message_unref(sess->start_msg);
+		sess->start_msg = NULL;
+	}
+	xdpw_pwr_stream_destroy(sess->pwr_stream);
+	sess->pwr_stream = NULL;
+
 	struct xdpw_screencast_instance *cast = sess->screencast_instance;
 	if (cast) {
 		assert(cast->refcount > 0);
@@ -78,8 +215,21 @@ void xdpw_session_destroy(struct xdpw_session *sess) {
 		}
 	}
 
+	struct xdpw_state *state = sess->state;
+	sd_bus_slot_unref(sess->stats_slot);
 	sd_bus_slot_unref(sess->slot);
 	wl_list_remove(&sess->link);
+	wl_list_remove(&sess->handle_link);
 	free(sess->session_handle);
-	free(sess);
+	xdpw_pool_free(&session_pool, sess);
+
+	xdpw_screencast_schedule_release(&state->screencast);
+}
+
+void xdpw_sessions_finish(struct xdpw_state *state) {
+	struct xdpw_session *sess, *tmp;
+	wl_list_for_each_safe(sess, tmp, &state->xdpw_sessions, link) {
+		xdpw_session_destroy(sess);
+	}
+	xdpw_pool_finish(&session_pool);
 }
@@ -1,5 +1,7 @@
-#include <poll.h>
-#include <wayland-util.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/timerfd.h>
 
 #include "xdpw.h"
@@ -12,58 +14,140 @@ static void update_timer(struct xdpw_state *state) {
 		return;
 	}
 
-	bool updated = false;
-	struct xdpw_timer *timer;
-	wl_list_for_each(timer, &state->timers, link) {
-		if (state->next_timer == NULL ||
-				timespec_less(&timer->at, &state->next_timer->at)) {
-			state->next_timer = timer;
-			updated = true;
+	// a zero it_value disarms the timerfd
+	struct itimerspec delay = { 0 };
+	if (state->timers_len > 0) {
+		delay.it_value = state->timers[0]->at;
+	}
+	errno = 0;
+	int ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &delay, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "failed to timerfd_settime(): %s\n",
+			strerror(errno));
+	}
+}
+
+static void heap_set(struct xdpw_state *state, size_t index, struct xdpw_timer *timer) {
+	state->timers[index] = timer;
+	timer->heap_index = index;
+}
+
+static void heap_sift_up(struct xdpw_state *state, size_t index) {
+	struct xdpw_timer *timer = state->timers[index];
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (!timespec_less(&timer->at, &state->timers[parent]->at)) {
+			break;
 		}
+		heap_set(state, index, state->timers[parent]);
+		index = parent;
 	}
+	heap_set(state, index, timer);
+}
 
-	if (updated) {
-		struct itimerspec delay = { .it_value = state->next_timer->at };
-		errno = 0;
-		int ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &delay, NULL);
-		if (ret < 0) {
-			fprintf(stderr, "failed to timerfd_settime(): %s\n",
-				strerror(errno));
+static void heap_sift_down(struct xdpw_state *state, size_t index) {
+	struct xdpw_timer *timer = state->timers[index];
+	while (true) {
+		size_t child = 2 * index + 1;
+		if (child >= state->timers_len) {
+			break;
+		}
+		if (child + 1 < state->timers_len &&
+				timespec_less(&state->timers[child + 1]->at, &state->timers[child]->at)) {
+			child++;
 		}
+		if (!timespec_less(&state->timers[child]->at, &timer->at)) {
+			break;
+		}
+		heap_set(state, index, state->timers[child]);
+		index = child;
 	}
+	heap_set(state, index, timer);
 }
 
-struct xdpw_timer *xdpw_add_timer(struct xdpw_state *state,
+static void heap_remove(struct xdpw_state *state, size_t index) {
+	struct xdpw_timer *last = state->timers[--state->timers_len];
+	if (index == state->timers_len) {
+		return;
+	}
+	heap_set(state, index, last);
+	heap_sift_down(state, index);
+	heap_sift_up(state, last->heap_index);
+}
+
+void xdpw_timer_arm(struct xdpw_state *state, struct xdpw_timer *timer,
 		uint64_t delay_ns, xdpw_event_loop_timer_func_t func, void *data) {
-	struct xdpw_timer *timer = calloc(1, sizeof(struct xdpw_timer));
-	if (timer == NULL) {
-		logprint(ERROR, "Timer allocation failed");
-		return NULL;
+	struct xdpw_timer *first = state->timers_len > 0 ? state->timers[0] : NULL;
+
+	if (timer->armed) {
+		heap_remove(state, timer->heap_index);
+		timer->armed = false;
+	}
+
+	if (state->timers_len == state->timers_cap) {
+		size_t cap = state->timers_cap > 0 ? 2 * state->timers_cap : 8;
+		struct xdpw_timer **timers = realloc(state->timers, cap * sizeof(*timers));
+		if (timers == NULL) {
+			logprint(ERROR, "Timer allocation failed");
+			return;
+		}
+		state->timers = timers;
+		state->timers_cap = cap;
 	}
+
 	timer->state = state;
 	timer->func = func;
 	timer->user_data = data;
-	wl_list_insert(&state->timers, &timer->link);
-
 	clock_gettime(CLOCK_MONOTONIC, &timer->at);
 	timespec_add(&timer->at, delay_ns);
 
-	update_timer(state);
-	return timer;
+	timer->armed = true;
+	heap_set(state, state->timers_len++, timer);
+	heap_sift_up(state, timer->heap_index);
+
+	// the timerfd only needs to move when the earliest deadline did
+	if (state->timers[0] != first || first == timer) {
+		update_timer(state);
+	}
 }
 
-void xdpw_destroy_timer(struct xdpw_timer *timer) {
-	if (timer == NULL) {
+void xdpw_timer_disarm(struct xdpw_timer *timer) {
+	if (!timer->armed) {
 		return;
 	}
 	struct xdpw_state *state = timer->state;
 
-	if (state->next_timer == timer) {
-		state->next_timer = NULL;
+	bool first = timer->heap_index == 0;
+	heap_remove(state, timer->heap_index);
+	timer->armed = false;
+
+	if (first) {
+		update_timer(state);
 	}
+}
+
+void xdpw_timers_dispatch(struct xdpw_state *state) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	wl_list_remove(&timer->link);
-	free(timer);
+	// callbacks may arm and disarm timers, so always look at the current root
+	while (state->timers_len > 0 && !timespec_less(&now, &state->timers[0]->at)) {
+		struct xdpw_timer *timer = state->timers[0];
+		heap_remove(state, 0);
+		timer->armed = false;
+
+		timer->func(timer->user_data);
+	}
 
 	update_timer(state);
 }
+
+void xdpw_timers_finish(struct xdpw_state *state) {
+	for (size_t i = 0; i < state->timers_len; i++) {
+		state->timers[i]->armed = false;
+	}
+	free(state->timers);
+	state->timers = NULL;
+	state->timers_len = 0;
+	state->timers_cap = 0;
+}
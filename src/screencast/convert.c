@@ -0,0 +1,216 @@
+#include "convert.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <libdrm/drm_fourcc.h>
+
+#include "logger.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CONVERT_HAVE_AVX2 1
+#endif
+
+#define CONVERT_INLINE static inline __attribute__((always_inline))
+
+static void *convert_map_buffer(struct xdpw_buffer *buffer) {
+	if (buffer->data) {
+		return buffer->data;
+	}
+	void *data = mmap(NULL, buffer->alloc_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		buffer->fd[0], buffer->offset[0]);
+	if (data == MAP_FAILED) {
+		logprint(ERROR, "convert: unable to map buffer");
+		return NULL;
+	}
+	buffer->data = data;
+	return data;
+}
+
+// 8 pixels at a time. This is a single register with AVX2, the compiler
+// splits it into two halves for SSE2 and NEON. The kernels below are written
+// once against it and instantiated per instruction set.
+typedef uint32_t convert_vec __attribute__((vector_size(32), aligned(1), may_alias));
+
+// vectors go by pointer, 32 byte arguments have no stable ABI without AVX
+CONVERT_INLINE void convert_vec_swap(convert_vec *dst, const convert_vec *src,
+		uint32_t swap_mask) {
+	uint32_t keep = ~(swap_mask | swap_mask << 16);
+	convert_vec p = *src;
+	*dst = (p & keep) | ((p >> 16) & swap_mask) | ((p & swap_mask) << 16);
+}
+
+CONVERT_INLINE uint32_t convert_pixel_swap(uint32_t p, uint32_t swap_mask) {
+	uint32_t keep = ~(swap_mask | swap_mask << 16);
+	return (p & keep) | ((p >> 16) & swap_mask) | ((p & swap_mask) << 16);
+}
+
+CONVERT_INLINE void convert_swap_row(uint8_t *row, size_t len, uint32_t swap_mask) {
+	size_t i = 0;
+	for (; i + sizeof(convert_vec) <= len; i += sizeof(convert_vec)) {
+		convert_vec *v = (convert_vec *)(row + i);
+		convert_vec_swap(v, v, swap_mask);
+	}
+	for (; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)) {
+		uint32_t p;
+		memcpy(&p, row + i, sizeof(p));
+		p = convert_pixel_swap(p, swap_mask);
+		memcpy(row + i, &p, sizeof(p));
+	}
+}
+
+// exchanges two rows in one pass instead of bouncing through a temporary
+// row, swapping channels on the way
+CONVERT_INLINE void convert_swap_rows(uint8_t *a, uint8_t *b, size_t len, uint32_t swap_mask) {
+	size_t i = 0;
+	for (; i + 2 * sizeof(convert_vec) <= len; i += 2 * sizeof(convert_vec)) {
+		convert_vec *va = (convert_vec *)(a + i);
+		convert_vec *vb = (convert_vec *)(b + i);
+		convert_vec a0 = va[0], a1 = va[1];
+		convert_vec b0 = vb[0], b1 = vb[1];
+		convert_vec_swap(&va[0], &b0, swap_mask);
+		convert_vec_swap(&va[1], &b1, swap_mask);
+		convert_vec_swap(&vb[0], &a0, swap_mask);
+		convert_vec_swap(&vb[1], &a1, swap_mask);
+	}
+	for (; i + sizeof(convert_vec) <= len; i += sizeof(convert_vec)) {
+		convert_vec *va = (convert_vec *)(a + i);
+		convert_vec *vb = (convert_vec *)(b + i);
+		convert_vec tmp = *va;
+		convert_vec_swap(va, vb, swap_mask);
+		convert_vec_swap(vb, &tmp, swap_mask);
+	}
+	for (; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)) {
+		uint32_t pa, pb;
+		memcpy(&pa, a + i, sizeof(pa));
+		memcpy(&pb, b + i, sizeof(pb));
+		pa = convert_pixel_swap(pa, swap_mask);
+		pb = convert_pixel_swap(pb, swap_mask);
+		memcpy(a + i, &pb, sizeof(pb));
+		memcpy(b + i, &pa, sizeof(pa));
+	}
+	// only reached by flips of strides which aren't a multiple of a pixel
+	for (; i < len; i++) {
+		uint8_t tmp = a[i];
+		a[i] = b[i];
+		b[i] = tmp;
+	}
+}
+
+CONVERT_INLINE void convert_image(uint8_t *data, uint32_t stride, uint32_t height,
+		bool flip_y, uint32_t swap_mask) {
+	if (!flip_y) {
+		for (uint32_t y = 0; y < height; y++) {
+			convert_swap_row(data + (size_t)y * stride, stride, swap_mask);
+		}
+		return;
+	}
+
+	uint8_t *top = data;
+	uint8_t *bottom = data + (size_t)(height - 1) * stride;
+	// a constant mask lets plain flips skip the swizzle arithmetic
+	if (swap_mask == 0) {
+		for (; top < bottom; top += stride, bottom -= stride) {
+			convert_swap_rows(top, bottom, stride, 0);
+		}
+		return;
+	}
+	for (; top < bottom; top += stride, bottom -= stride) {
+		convert_swap_rows(top, bottom, stride, swap_mask);
+	}
+	// the middle row of an odd height stays in place
+	if (top == bottom) {
+		convert_swap_row(top, stride, swap_mask);
+	}
+}
+
+static void convert_baseline(uint8_t *data, uint32_t stride, uint32_t height,
+		bool flip_y, uint32_t swap_mask) {
+	convert_image(data, stride, height, flip_y, swap_mask);
+}
+
+#ifdef CONVERT_HAVE_AVX2
+__attribute__((target("avx2")))
+static void convert_avx2(uint8_t *data, uint32_t stride, uint32_t height,
+		bool flip_y, uint32_t swap_mask) {
+	convert_image(data, stride, height, flip_y, swap_mask);
+}
+#endif
+
+static const struct xdpw_convert_kernel convert_kernels[] = {
+#ifdef CONVERT_HAVE_AVX2
+	{ "avx2", convert_avx2 },
+#endif
+	{ "baseline", convert_baseline },
+};
+
+size_t xdpw_convert_get_kernels(const struct xdpw_convert_kernel **kernels) {
+	size_t first = 0;
+#ifdef CONVERT_HAVE_AVX2
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("avx2")) {
+		first++;
+	}
+#endif
+	*kernels = &convert_kernels[first];
+	return sizeof(convert_kernels) / sizeof(convert_kernels[0]) - first;
+}
+
+uint32_t xdpw_convert_swap_rb_mask(uint32_t format) {
+	switch (format) {
+	// B, G, R and A in memory
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ABGR8888:
+	case DRM_FORMAT_XBGR8888:
+		return 0x000000ff;
+	// A, B, G and R in memory
+	case DRM_FORMAT_RGBA8888:
+	case DRM_FORMAT_RGBX8888:
+	case DRM_FORMAT_BGRA8888:
+	case DRM_FORMAT_BGRX8888:
+		return 0x0000ff00;
+	default:
+		return 0;
+	}
+}
+
+int xdpw_convert_buffer(struct xdpw_buffer *buffer, bool flip_y, bool swap_rb) {
+	static const struct xdpw_convert_kernel *kernel = NULL;
+	if (!kernel) {
+		xdpw_convert_get_kernels(&kernel);
+		logprint(DEBUG, "convert: using %s kernel", kernel->name);
+	}
+
+	if (buffer->buffer_type != WL_SHM) {
+		logprint(ERROR, "convert: only shm buffers can be converted");
+		return -1;
+	}
+
+	uint32_t swap_mask = 0;
+	if (swap_rb) {
+		swap_mask = xdpw_convert_swap_rb_mask(buffer->format);
+		if (swap_mask == 0) {
+			logprint(ERROR, "convert: can't swap channels of format 0x%08x", buffer->format);
+			return -1;
+		}
+	}
+
+	uint8_t *data = convert_map_buffer(buffer);
+	if (!data) {
+		return -1;
+	}
+
+	// Both capture protocols rewrite the whole buffer for every frame, not
+	// just the damaged part, so every row needs converting.
+	kernel->convert(data, buffer->stride[0], buffer->height, flip_y, swap_mask);
+	return 0;
+}
+
+void xdpw_convert_flip_damage_y(struct xdpw_damage_list *damage, uint32_t height) {
+	for (uint32_t i = 0; i < damage->count; i++) {
+		struct xdpw_frame_damage *region = &damage->regions[i];
+		region->y = height - region->y - region->height;
+	}
+}
@@ -0,0 +1,790 @@
+#include "encoder.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_drm.h>
+#include <libdrm/drm_fourcc.h>
+#include <pipewire/pipewire.h>
+#include <spa/param/video/encoded.h>
+#include <spa/param/video/format-utils.h>
+#include <xf86drm.h>
+
+#include "pipewire_screencast.h"
+#include "screencast.h"
+#include "wlr_screencast.h"
+#include "xdpw.h"
+#include "logger.h"
+
+// frames between keyframes, consumers joining a running stream wait at most this long
+#define ENCODER_GOP_SIZE 120
+#define ENCODER_BUFFERS 4
+
+/*
+ * The encoder is a consumer of a raw stream of its instance, so capture,
+ * buffer pools and renegotiation work like for any other consumer:
+ *
+ *   xdpw raw stream -> input -> libav (hwmap, scale_vaapi, h264_vaapi) -> output
+ *
+ * The input only takes dmabufs. libav maps them into VA surfaces, the frames
+ * never reach the cpu. The input is inactive while no consumer is connected
+ * to the output, which lets the capture stop.
+ */
+struct xdpw_encoder {
+	struct xdpw_screencast_instance *cast;
+
+	struct xdpw_pwr_stream *raw;
+	struct pw_stream *input;
+	struct spa_hook input_listener;
+	bool input_connected;
+	struct spa_video_info_raw input_format;
+	uint32_t drm_format;
+
+	struct pw_stream *output;
+	struct spa_hook output_listener;
+	uint32_t node_id;
+	uint32_t width, height;
+	uint32_t seq;
+	bool streaming;
+	bool failed;
+
+	AVBufferRef *drm_device;
+	// built with the first frame of a format
+	AVBufferRef *drm_frames;
+	AVFilterGraph *graph;
+	AVFilterContext *source;
+	AVFilterContext *sink;
+	AVCodecContext *codec;
+	AVPacket *packet;
+	bool force_keyframe;
+	int64_t last_pts;
+};
+
+// an input buffer lent to libav, queued back once libav releases the frame
+struct encoder_frame {
+	AVDRMFrameDescriptor desc;
+	struct xdpw_encoder *encoder;
+	// NULL once the buffer was removed from the stream
+	struct pw_buffer *buffer;
+};
+
+static enum AVPixelFormat encoder_sw_format(uint32_t format) {
+	switch (format) {
+	case DRM_FORMAT_XRGB8888:
+		return AV_PIX_FMT_BGR0;
+	case DRM_FORMAT_ARGB8888:
+		return AV_PIX_FMT_BGRA;
+	case DRM_FORMAT_XBGR8888:
+		return AV_PIX_FMT_RGB0;
+	case DRM_FORMAT_ABGR8888:
+		return AV_PIX_FMT_RGBA;
+	default:
+		return AV_PIX_FMT_NONE;
+	}
+}
+
+// an encoded frame never gets bigger than the raw nv12 frame
+static uint32_t encoder_buffer_size(uint32_t width, uint32_t height) {
+	return width * height * 3 / 2;
+}
+
+static const struct spa_pod *encoder_build_output_format(struct spa_pod_builder *b,
+		uint32_t width, uint32_t height) {
+	return spa_pod_builder_add_object(b,
+		SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+		SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+		SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_h264),
+		SPA_FORMAT_VIDEO_size, SPA_POD_Rectangle(&SPA_RECTANGLE(width, height)),
+		SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&SPA_FRACTION(0, 1)),
+		SPA_FORMAT_VIDEO_H264_streamFormat, SPA_POD_Id(SPA_H264_STREAM_FORMAT_BYTESTREAM),
+		SPA_FORMAT_VIDEO_H264_alignment, SPA_POD_Id(SPA_H264_ALIGNMENT_AU));
+}
+
+// tells the consumers of a raw stream where to find the encoded one
+static void encoder_announce(struct xdpw_encoder *encoder, struct xdpw_pwr_stream *pwr_stream) {
+	char node_id[16];
+	const char *value = NULL;
+	if (!encoder->failed && encoder->node_id != SPA_ID_INVALID) {
+		snprintf(node_id, sizeof(node_id), "%u", encoder->node_id);
+		value = node_id;
+	}
+	// a NULL value removes the key
+	const struct spa_dict_item items[] = {
+		SPA_DICT_ITEM_INIT(XDPW_ENCODER_NODE_KEY, value),
+	};
+	const struct spa_dict dict = SPA_DICT_INIT_ARRAY(items);
+	pw_stream_update_properties(pwr_stream->stream, &dict);
+}
+
+static void encoder_announce_all(struct xdpw_encoder *encoder) {
+	struct xdpw_pwr_stream *pwr_stream;
+	wl_list_for_each(pwr_stream, &encoder->cast->stream_list, link) {
+		if (pwr_stream != encoder->raw && pwr_stream->node_id != SPA_ID_INVALID) {
+			encoder_announce(encoder, pwr_stream);
+		}
+	}
+}
+
+static void encoder_fail(struct xdpw_encoder *encoder, const char *error) {
+	if (encoder->failed) {
+		return;
+	}
+	logprint(ERROR, "encoder: %s", error);
+	encoder->failed = true;
+	if (encoder->input_connected) {
+		pw_stream_set_active(encoder->input, false);
+	}
+	// consumers don't look for the node anymore
+	if (encoder->node_id != SPA_ID_INVALID) {
+		encoder_announce_all(encoder);
+	}
+}
+
+static void encoder_pipeline_destroy(struct xdpw_encoder *encoder) {
+	// releases the lent input buffers
+	avcodec_free_context(&encoder->codec);
+	avfilter_graph_free(&encoder->graph);
+	encoder->source = NULL;
+	encoder->sink = NULL;
+	av_buffer_unref(&encoder->drm_frames);
+}
+
+static int encoder_graph_create(struct xdpw_encoder *encoder) {
+	encoder->graph = avfilter_graph_alloc();
+	if (!encoder->graph) {
+		return AVERROR(ENOMEM);
+	}
+
+	encoder->source = avfilter_graph_alloc_filter(encoder->graph,
+		avfilter_get_by_name("buffer"), "source");
+	encoder->sink = avfilter_graph_alloc_filter(encoder->graph,
+		avfilter_get_by_name("buffersink"), "sink");
+	AVBufferSrcParameters *params = av_buffersrc_parameters_alloc();
+	if (!encoder->source || !encoder->sink || !params) {
+		av_free(params);
+		return AVERROR(ENOMEM);
+	}
+	params->format = AV_PIX_FMT_DRM_PRIME;
+	params->width = encoder->input_format.size.width;
+	params->height = encoder->input_format.size.height;
+	params->time_base = (AVRational){ 1, 1000000 };
+	params->hw_frames_ctx = encoder->drm_frames;
+	int ret = av_buffersrc_parameters_set(encoder->source, params);
+	av_free(params);
+	if (ret < 0) {
+		return ret;
+	}
+	if ((ret = avfilter_init_str(encoder->source, NULL)) < 0 ||
+			(ret = avfilter_init_str(encoder->sink, NULL)) < 0) {
+		return ret;
+	}
+
+	AVFilterInOut *outputs = avfilter_inout_alloc();
+	AVFilterInOut *inputs = avfilter_inout_alloc();
+	if (!outputs || !inputs) {
+		avfilter_inout_free(&outputs);
+		avfilter_inout_free(&inputs);
+		return AVERROR(ENOMEM);
+	}
+	outputs->name = av_strdup("in");
+	outputs->filter_ctx = encoder->source;
+	inputs->name = av_strdup("out");
+	inputs->filter_ctx = encoder->sink;
+	// the gpu converts to the encoder's format straight from the dmabufs
+	ret = avfilter_graph_parse_ptr(encoder->graph,
+		"hwmap=derive_device=vaapi,scale_vaapi=format=nv12", &inputs, &outputs, NULL);
+	avfilter_inout_free(&outputs);
+	avfilter_inout_free(&inputs);
+	if (ret < 0) {
+		return ret;
+	}
+	return avfilter_graph_config(encoder->graph, NULL);
+}
+
+static int encoder_codec_create(struct xdpw_encoder *encoder) {
+	struct xdpw_screencast_instance *cast = encoder->cast;
+	struct config_screencast *conf = &cast->ctx->state->config->screencast_conf;
+
+	const AVCodec *codec = avcodec_find_encoder_by_name("h264_vaapi");
+	encoder->codec = avcodec_alloc_context3(codec);
+	if (!encoder->codec) {
+		return AVERROR(ENOMEM);
+	}
+	AVCodecContext *c = encoder->codec;
+	c->width = encoder->input_format.size.width;
+	c->height = encoder->input_format.size.height;
+	c->pix_fmt = AV_PIX_FMT_VAAPI;
+	c->hw_frames_ctx = av_buffer_ref(av_buffersink_get_hw_frames_ctx(encoder->sink));
+	if (!c->hw_frames_ctx) {
+		return AVERROR(ENOMEM);
+	}
+	c->time_base = (AVRational){ 1, 1000000 };
+	c->framerate = av_d2q(cast->max_framerate > 0 ? cast->max_framerate : 60, 1000000);
+	// frames go out in capture order, without waiting for later ones
+	c->max_b_frames = 0;
+	c->gop_size = ENCODER_GOP_SIZE;
+	if (conf->encoder_bitrate > 0) {
+		c->bit_rate = conf->encoder_bitrate * 1000LL;
+	}
+	return avcodec_open2(c, codec, NULL);
+}
+
+static int encoder_pipeline_create(struct xdpw_encoder *encoder) {
+	encoder->drm_frames = av_hwframe_ctx_alloc(encoder->drm_device);
+	if (!encoder->drm_frames) {
+		return AVERROR(ENOMEM);
+	}
+	AVHWFramesContext *frames = (AVHWFramesContext *)encoder->drm_frames->data;
+	frames->format = AV_PIX_FMT_DRM_PRIME;
+	frames->sw_format = encoder_sw_format(encoder->drm_format);
+	frames->width = encoder->input_format.size.width;
+	frames->height = encoder->input_format.size.height;
+	int ret = av_hwframe_ctx_init(encoder->drm_frames);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if ((ret = encoder_graph_create(encoder)) < 0 ||
+			(ret = encoder_codec_create(encoder)) < 0) {
+		return ret;
+	}
+
+	logprint(DEBUG, "encoder: encoding %ux%u, modifier %lu",
+		encoder->input_format.size.width, encoder->input_format.size.height,
+		encoder->input_format.modifier);
+	encoder->force_keyframe = true;
+	return 0;
+}
+
+static void encoder_frame_free(void *opaque, uint8_t *data) {
+	struct encoder_frame *frame = opaque;
+	if (frame->buffer) {
+		frame->buffer->user_data = NULL;
+		pw_stream_queue_buffer(frame->encoder->input, frame->buffer);
+	}
+	free(frame);
+}
+
+static int64_t encoder_frame_pts(struct xdpw_encoder *encoder, struct spa_buffer *buffer) {
+	struct spa_meta_header *header =
+		spa_buffer_find_meta_data(buffer, SPA_META_Header, sizeof(*header));
+	int64_t pts;
+	if (header && header->pts > 0) {
+		pts = header->pts / 1000;
+	} else {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		pts = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+	}
+	// the encoder rejects repeated timestamps
+	if (pts <= encoder->last_pts) {
+		pts = encoder->last_pts + 1;
+	}
+	encoder->last_pts = pts;
+	return pts;
+}
+
+// wraps the dmabufs of an input buffer, which is lent to the frame
+static AVFrame *encoder_frame_create(struct xdpw_encoder *encoder, struct pw_buffer *buffer) {
+	struct spa_buffer *spa_buffer = buffer->buffer;
+	if (spa_buffer->n_datas > AV_DRM_MAX_PLANES) {
+		return NULL;
+	}
+
+	struct encoder_frame *frame_data = calloc(1, sizeof(*frame_data));
+	if (!frame_data) {
+		return NULL;
+	}
+	frame_data->encoder = encoder;
+	frame_data->buffer = buffer;
+
+	AVDRMFrameDescriptor *desc = &frame_data->desc;
+	desc->nb_layers = 1;
+	desc->layers[0].format = encoder->drm_format;
+	desc->layers[0].nb_planes = spa_buffer->n_datas;
+	for (uint32_t i = 0; i < spa_buffer->n_datas; i++) {
+		struct spa_data *d = &spa_buffer->datas[i];
+		// planes can share an object
+		int object = 0;
+		while (object < desc->nb_objects && desc->objects[object].fd != d->fd) {
+			object++;
+		}
+		if (object == desc->nb_objects) {
+			off_t size = lseek(d->fd, 0, SEEK_END);
+			desc->objects[object].fd = d->fd;
+			desc->objects[object].size = size > 0 ? (size_t)size : d->maxsize;
+			desc->objects[object].format_modifier = encoder->input_format.modifier;
+			desc->nb_objects++;
+		}
+		desc->layers[0].planes[i].object_index = object;
+		desc->layers[0].planes[i].offset = d->chunk->offset;
+		desc->layers[0].planes[i].pitch = d->chunk->stride;
+	}
+
+	AVFrame *frame = av_frame_alloc();
+	if (frame) {
+		frame->hw_frames_ctx = av_buffer_ref(encoder->drm_frames);
+	}
+	if (frame && frame->hw_frames_ctx) {
+		frame->buf[0] = av_buffer_create((uint8_t *)desc, sizeof(*desc),
+			encoder_frame_free, frame_data, 0);
+	}
+	if (!frame || !frame->buf[0]) {
+		av_frame_free(&frame);
+		free(frame_data);
+		return NULL;
+	}
+	frame->format = AV_PIX_FMT_DRM_PRIME;
+	frame->width = encoder->input_format.size.width;
+	frame->height = encoder->input_format.size.height;
+	frame->data[0] = (uint8_t *)desc;
+	frame->pts = encoder_frame_pts(encoder, spa_buffer);
+	buffer->user_data = frame_data;
+	return frame;
+}
+
+static void encoder_send_packet(struct xdpw_encoder *encoder, AVPacket *packet) {
+	struct pw_buffer *buffer = pw_stream_dequeue_buffer(encoder->output);
+	if (!buffer) {
+		// the consumer is behind, later frames need a keyframe to decode
+		logprint(TRACE, "encoder: no free buffer, dropping packet");
+		encoder->force_keyframe = true;
+		return;
+	}
+
+	struct spa_buffer *spa_buffer = buffer->buffer;
+	struct spa_data *d = &spa_buffer->datas[0];
+	d->chunk->offset = 0;
+	d->chunk->stride = 0;
+	if (!d->data || d->maxsize < (uint32_t)packet->size) {
+		logprint(WARN, "encoder: packet of %d bytes doesn't fit the buffer", packet->size);
+		d->chunk->size = 0;
+		d->chunk->flags = SPA_CHUNK_FLAG_CORRUPTED;
+		encoder->force_keyframe = true;
+	} else {
+		memcpy(d->data, packet->data, packet->size);
+		d->chunk->size = packet->size;
+		d->chunk->flags = SPA_CHUNK_FLAG_NONE;
+	}
+
+	struct spa_meta_header *header =
+		spa_buffer_find_meta_data(spa_buffer, SPA_META_Header, sizeof(*header));
+	if (header) {
+		header->pts = av_rescale_q(packet->pts, encoder->codec->time_base,
+			(AVRational){ 1, 1000000000 });
+		header->flags = (packet->flags & AV_PKT_FLAG_KEY) ? 0 : SPA_META_HEADER_FLAG_DELTA_UNIT;
+		header->seq = encoder->seq++;
+		header->dts_offset = 0;
+	}
+	pw_stream_queue_buffer(encoder->output, buffer);
+}
+
+static int encoder_encode(struct xdpw_encoder *encoder, AVFrame *frame) {
+	int ret = av_buffersrc_add_frame(encoder->source, frame);
+	if (ret < 0) {
+		return ret;
+	}
+
+	AVFrame *filtered = av_frame_alloc();
+	if (!filtered) {
+		return AVERROR(ENOMEM);
+	}
+	while ((ret = av_buffersink_get_frame(encoder->sink, filtered)) >= 0) {
+		if (encoder->force_keyframe) {
+			filtered->pict_type = AV_PICTURE_TYPE_I;
+			encoder->force_keyframe = false;
+		}
+		ret = avcodec_send_frame(encoder->codec, filtered);
+		av_frame_unref(filtered);
+		if (ret < 0) {
+			break;
+		}
+		while ((ret = avcodec_receive_packet(encoder->codec, encoder->packet)) >= 0) {
+			encoder_send_packet(encoder, encoder->packet);
+			av_packet_unref(encoder->packet);
+		}
+		if (ret != AVERROR(EAGAIN)) {
+			break;
+		}
+	}
+	av_frame_free(&filtered);
+	return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static void encoder_handle_input_process(void *data) {
+	struct xdpw_encoder *encoder = data;
+
+	// only the newest frame is encoded
+	struct pw_buffer *buffer = NULL, *next;
+	while ((next = pw_stream_dequeue_buffer(encoder->input))) {
+		if (buffer) {
+			pw_stream_queue_buffer(encoder->input, buffer);
+		}
+		buffer = next;
+	}
+	if (!buffer) {
+		return;
+	}
+
+	struct spa_buffer *spa_buffer = buffer->buffer;
+	struct spa_meta_header *header =
+		spa_buffer_find_meta_data(spa_buffer, SPA_META_Header, sizeof(*header));
+	if (!encoder->streaming || encoder->failed ||
+			spa_buffer->datas[0].type != SPA_DATA_DmaBuf ||
+			spa_buffer->datas[0].chunk->size == 0 ||
+			(header && (header->flags & SPA_META_HEADER_FLAG_CORRUPTED))) {
+		pw_stream_queue_buffer(encoder->input, buffer);
+		return;
+	}
+
+	int ret;
+	if (!encoder->graph && (ret = encoder_pipeline_create(encoder)) < 0) {
+		logprint(ERROR, "encoder: unable to set up encoding: %s", av_err2str(ret));
+		encoder_pipeline_destroy(encoder);
+		pw_stream_queue_buffer(encoder->input, buffer);
+		encoder_fail(encoder, "unable to set up VA-API encoding");
+		pw_stream_set_error(encoder->output, -EIO, "unable to set up VA-API encoding");
+		return;
+	}
+
+	AVFrame *frame = encoder_frame_create(encoder, buffer);
+	if (!frame) {
+		logprint(ERROR, "encoder: unable to wrap the frame");
+		pw_stream_queue_buffer(encoder->input, buffer);
+		return;
+	}
+	// This runs on the main loop, h264_vaapi may wait for the gpu here.
+	ret = encoder_encode(encoder, frame);
+	av_frame_free(&frame);
+	if (ret < 0) {
+		// dropping the pipeline resyncs with a keyframe
+		logprint(ERROR, "encoder: unable to encode frame: %s", av_err2str(ret));
+		encoder_pipeline_destroy(encoder);
+	}
+}
+
+static void encoder_handle_input_param_changed(void *data, uint32_t id,
+		const struct spa_pod *param) {
+	struct xdpw_encoder *encoder = data;
+	if (!param || id != SPA_PARAM_Format) {
+		return;
+	}
+
+	const struct spa_pod_prop *prop_modifier =
+		spa_pod_find_prop(param, NULL, SPA_FORMAT_VIDEO_modifier);
+	if (!prop_modifier) {
+		logprint(ERROR, "encoder: negotiated a format without modifier");
+		return;
+	}
+	// xdpw picks the modifier and sends the format again
+	if (prop_modifier->flags & SPA_POD_PROP_FLAG_DONT_FIXATE) {
+		return;
+	}
+
+	// the frames of the pipeline have the old format
+	encoder_pipeline_destroy(encoder);
+	spa_format_video_raw_parse(param, &encoder->input_format);
+	encoder->drm_format = encoder->cast->screencopy_frame_info[DMABUF].format;
+	logprint(DEBUG, "encoder: input format %u, size (%u, %u), modifier %lu",
+		encoder->input_format.format, encoder->input_format.size.width,
+		encoder->input_format.size.height, encoder->input_format.modifier);
+
+	uint8_t params_buffer[1024];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
+	const struct spa_pod *params[2];
+	params[0] = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+		SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(1 << SPA_DATA_DmaBuf));
+	params[1] = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+		SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+	pw_stream_update_params(encoder->input, params, 2);
+
+	// the capture size changed, e.g. with the output's mode
+	if (encoder->input_format.size.width != encoder->width ||
+			encoder->input_format.size.height != encoder->height) {
+		encoder->width = encoder->input_format.size.width;
+		encoder->height = encoder->input_format.size.height;
+		params[0] = encoder_build_output_format(&b, encoder->width, encoder->height);
+		pw_stream_update_params(encoder->output, params, 1);
+	}
+}
+
+static void encoder_handle_input_remove_buffer(void *data, struct pw_buffer *buffer) {
+	// still referenced by libav, the frame must not queue it anymore
+	struct encoder_frame *frame = buffer->user_data;
+	if (frame) {
+		frame->buffer = NULL;
+		buffer->user_data = NULL;
+	}
+}
+
+static const struct pw_stream_events encoder_input_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.param_changed = encoder_handle_input_param_changed,
+	.remove_buffer = encoder_handle_input_remove_buffer,
+	.process = encoder_handle_input_process,
+};
+
+static void encoder_handle_output_state_changed(void *data,
+		enum pw_stream_state old, enum pw_stream_state state, const char *error) {
+	struct xdpw_encoder *encoder = data;
+	logprint(INFO, "encoder: stream state changed to \"%s\"", pw_stream_state_as_string(state));
+
+	if (state == PW_STREAM_STATE_ERROR) {
+		encoder_fail(encoder, error ? error : "stream failed");
+	}
+	if (encoder->node_id == SPA_ID_INVALID && !encoder->failed) {
+		encoder->node_id = pw_stream_get_node_id(encoder->output);
+		if (encoder->node_id != SPA_ID_INVALID) {
+			logprint(INFO, "encoder: node id is %u", encoder->node_id);
+			encoder_announce_all(encoder);
+		}
+	}
+
+	bool streaming = state == PW_STREAM_STATE_STREAMING && !encoder->failed;
+	if (streaming == encoder->streaming) {
+		return;
+	}
+	encoder->streaming = streaming;
+	encoder->force_keyframe = true;
+	// frames are only captured for the encoder while someone takes them
+	if (encoder->input_connected) {
+		pw_stream_set_active(encoder->input, streaming);
+	}
+}
+
+static void encoder_handle_output_param_changed(void *data, uint32_t id,
+		const struct spa_pod *param) {
+	struct xdpw_encoder *encoder = data;
+	if (!param || id != SPA_PARAM_Format) {
+		return;
+	}
+
+	uint8_t params_buffer[1024];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
+	const struct spa_pod *params[2];
+	params[0] = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+		SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(ENCODER_BUFFERS,
+			XDPW_PWR_BUFFERS_MIN, XDPW_PWR_BUFFERS_DEFAULT_MAX),
+		SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(1),
+		SPA_PARAM_BUFFERS_size, SPA_POD_Int(encoder_buffer_size(encoder->width, encoder->height)),
+		SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(
+			(1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr)));
+	params[1] = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+		SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+	pw_stream_update_params(encoder->output, params, 2);
+}
+
+static const struct pw_stream_events encoder_output_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.state_changed = encoder_handle_output_state_changed,
+	.param_changed = encoder_handle_output_param_changed,
+};
+
+void xdpw_encoder_stream_connected(struct xdpw_encoder *encoder,
+		struct xdpw_pwr_stream *pwr_stream) {
+	if (pwr_stream != encoder->raw) {
+		encoder_announce(encoder, pwr_stream);
+		return;
+	}
+	if (encoder->input_connected) {
+		return;
+	}
+	struct xdpw_screencast_instance *cast = encoder->cast;
+
+	// VA-API needs to know the layout, implicit modifiers are left out
+	uint64_t *modifiers = NULL;
+	uint32_t format = cast->screencopy_frame_info[DMABUF].format;
+	uint32_t modifier_count = xdpw_wlr_query_dmabuf_modifiers(cast->ctx, cast->gbm,
+		format, &modifiers);
+	uint64_t linear = DRM_FORMAT_MOD_LINEAR;
+	uint32_t explicit_count = 0;
+	for (uint32_t i = 0; i < modifier_count; i++) {
+		if (modifiers[i] != DRM_FORMAT_MOD_INVALID) {
+			modifiers[explicit_count++] = modifiers[i];
+		}
+	}
+
+	uint8_t params_buffer[XDPW_PWR_PARAMS_BUFFER_SIZE];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
+	struct spa_pod_frame f[2];
+	spa_pod_builder_push_object(&b, &f[0], SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+	spa_pod_builder_add(&b, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video), 0);
+	spa_pod_builder_add(&b, SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw), 0);
+	spa_pod_builder_add(&b, SPA_FORMAT_VIDEO_format,
+		SPA_POD_Id(xdpw_format_pw_from_drm_fourcc(format)), 0);
+	// xdpw picks one of them for the pool
+	spa_pod_builder_prop(&b, SPA_FORMAT_VIDEO_modifier,
+		SPA_POD_PROP_FLAG_MANDATORY | SPA_POD_PROP_FLAG_DONT_FIXATE);
+	spa_pod_builder_push_choice(&b, &f[1], SPA_CHOICE_Enum, 0);
+	const uint64_t *offered = explicit_count > 0 ? modifiers : &linear;
+	uint32_t offered_count = explicit_count > 0 ? explicit_count : 1;
+	spa_pod_builder_long(&b, offered[0]);
+	for (uint32_t i = 0; i < offered_count; i++) {
+		spa_pod_builder_long(&b, offered[i]);
+	}
+	spa_pod_builder_pop(&b, &f[1]);
+	const struct spa_pod *params[1] = { spa_pod_builder_pop(&b, &f[0]) };
+	free(modifiers);
+
+	enum pw_stream_flags flags = PW_STREAM_FLAG_AUTOCONNECT;
+	if (!encoder->streaming) {
+		flags |= PW_STREAM_FLAG_INACTIVE;
+	}
+	if (pw_stream_connect(encoder->input, PW_DIRECTION_INPUT, PW_ID_ANY, flags,
+			params, 1) < 0) {
+		logprint(ERROR, "encoder: unable to connect to node %u", pwr_stream->node_id);
+		encoder_fail(encoder, "unable to connect to the raw stream");
+		pw_stream_set_error(encoder->output, -EIO, "unable to connect to the raw stream");
+		return;
+	}
+	encoder->input_connected = true;
+}
+
+void xdpw_encoder_destroy(struct xdpw_encoder *encoder) {
+	if (!encoder) {
+		return;
+	}
+
+	logprint(DEBUG, "encoder: destroying encoder");
+	encoder_pipeline_destroy(encoder);
+	if (encoder->input) {
+		spa_hook_remove(&encoder->input_listener);
+		pw_stream_destroy(encoder->input);
+	}
+	if (encoder->output) {
+		spa_hook_remove(&encoder->output_listener);
+		pw_stream_destroy(encoder->output);
+	}
+	xdpw_pwr_stream_destroy(encoder->raw);
+	av_packet_free(&encoder->packet);
+	av_buffer_unref(&encoder->drm_device);
+	free(encoder);
+}
+
+static int encoder_open_device(struct xdpw_encoder *encoder) {
+	char *render_node = drmGetRenderDeviceNameFromFd(gbm_device_get_fd(encoder->cast->gbm));
+	if (!render_node) {
+		logprint(ERROR, "encoder: the dma-buf device has no render node");
+		return -1;
+	}
+
+	int ret = av_hwdevice_ctx_create(&encoder->drm_device, AV_HWDEVICE_TYPE_DRM,
+		render_node, NULL, 0);
+	if (ret < 0) {
+		logprint(ERROR, "encoder: unable to open %s: %s", render_node, av_err2str(ret));
+		free(render_node);
+		return -1;
+	}
+
+	// the graph derives its own, this only fails early without VA-API
+	AVBufferRef *vaapi_device = NULL;
+	ret = av_hwdevice_ctx_create_derived(&vaapi_device, AV_HWDEVICE_TYPE_VAAPI,
+		encoder->drm_device, 0);
+	av_buffer_unref(&vaapi_device);
+	if (ret < 0) {
+		logprint(ERROR, "encoder: no VA-API on %s: %s", render_node, av_err2str(ret));
+		free(render_node);
+		return -1;
+	}
+
+	logprint(DEBUG, "encoder: encoding on %s", render_node);
+	free(render_node);
+	return 0;
+}
+
+struct xdpw_encoder *xdpw_encoder_create(struct xdpw_screencast_instance *cast) {
+	struct xdpw_screencast_context *ctx = cast->ctx;
+	struct xdpw_screencopy_frame_info *frame_info = &cast->screencopy_frame_info[DMABUF];
+
+	if (encoder_sw_format(frame_info->format) == AV_PIX_FMT_NONE) {
+		logprint(WARN, "encoder: can't encode frames of format 0x%08x", frame_info->format);
+		return NULL;
+	}
+	if (!avcodec_find_encoder_by_name("h264_vaapi")) {
+		logprint(ERROR, "encoder: libavcodec has no h264_vaapi encoder");
+		return NULL;
+	}
+
+	struct xdpw_encoder *encoder = calloc(1, sizeof(*encoder));
+	if (!encoder) {
+		logprint(ERROR, "encoder: failed to allocate encoder");
+		return NULL;
+	}
+	encoder->cast = cast;
+	encoder->node_id = SPA_ID_INVALID;
+	encoder->width = frame_info->width;
+	encoder->height = frame_info->height;
+	encoder->packet = av_packet_alloc();
+	if (!encoder->packet || encoder_open_device(encoder) < 0) {
+		goto error;
+	}
+
+	char name[] = "xdpw-h264-XXXXXX";
+	randname(name + strlen(name) - 6);
+	encoder->output = pw_stream_new(ctx->core, name,
+		pw_properties_new(
+			PW_KEY_MEDIA_CLASS, "Video/Source",
+			NULL));
+	if (!encoder->output) {
+		logprint(ERROR, "encoder: failed to create stream");
+		goto error;
+	}
+	pw_stream_add_listener(encoder->output, &encoder->output_listener,
+		&encoder_output_events, encoder);
+
+	// the raw frames come from a stream of our own, configured like the
+	// streams of sessions without framerate rules
+	struct xdpw_stream_policy policy;
+	xdpw_screencast_stream_policy(ctx->state, NULL, &policy);
+	encoder->raw = xdpw_pwr_stream_create(cast, &policy);
+	if (!encoder->raw) {
+		goto error;
+	}
+	// connected by xdpw_encoder_stream_connected once the raw node exists,
+	// so the session manager doesn't link anything else meanwhile
+	encoder->input = pw_stream_new(ctx->core, "xdpw-h264-input",
+		pw_properties_new(
+			PW_KEY_MEDIA_TYPE, "Video",
+			PW_KEY_MEDIA_CATEGORY, "Capture",
+			PW_KEY_TARGET_OBJECT, pw_stream_get_name(encoder->raw->stream),
+			PW_KEY_NODE_DONT_RECONNECT, "true",
+			"node.dont-fallback", "true",
+			NULL));
+	if (!encoder->input) {
+		logprint(ERROR, "encoder: failed to create input stream");
+		goto error;
+	}
+	pw_stream_add_listener(encoder->input, &encoder->input_listener,
+		&encoder_input_events, encoder);
+
+	uint8_t params_buffer[1024];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
+	const struct spa_pod *params[1];
+	params[0] = encoder_build_output_format(&b, encoder->width, encoder->height);
+	if (pw_stream_connect(encoder->output, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+			PW_STREAM_FLAG_DRIVER | PW_STREAM_FLAG_MAP_BUFFERS, params, 1) < 0) {
+		logprint(ERROR, "encoder: failed to connect stream");
+		goto error;
+	}
+
+	logprint(INFO, "encoder: screencast instance %p has an h264 stream", cast);
+	return encoder;
+
+error:
+	xdpw_encoder_destroy(encoder);
+	return NULL;
+}
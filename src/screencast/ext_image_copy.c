@@ -0,0 +1,601 @@
+#include "ext_image_copy.h"
+
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libdrm/drm_fourcc.h>
+#include <wayland-client-protocol.h>
+
+#include "screencast.h"
+#include "wlr_screencast.h"
+#include "pipewire_screencast.h"
+#include "shm_allocator.h"
+#include "xdpw.h"
+#include "logger.h"
+
+static bool ext_format_supported(uint32_t format) {
+	switch (format) {
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_RGBA8888:
+	case DRM_FORMAT_RGBX8888:
+	case DRM_FORMAT_ABGR8888:
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_BGRA8888:
+	case DRM_FORMAT_BGRX8888:
+	case DRM_FORMAT_XRGB2101010:
+	case DRM_FORMAT_XBGR2101010:
+	case DRM_FORMAT_RGBX1010102:
+	case DRM_FORMAT_BGRX1010102:
+	case DRM_FORMAT_ARGB2101010:
+	case DRM_FORMAT_ABGR2101010:
+	case DRM_FORMAT_RGBA1010102:
+	case DRM_FORMAT_BGRA1010102:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void ext_frame_free(struct xdpw_screencast_instance *cast) {
+	if (!cast->ext_frame) {
+		return;
+	}
+	ext_image_copy_capture_frame_v1_destroy(cast->ext_frame);
+	cast->ext_frame = NULL;
+	logprint(TRACE, "ext: frame destroyed");
+}
+
+static void ext_frame_handle_transform(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame, uint32_t transform) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(TRACE, "ext: transform event handler");
+	cast->current_frame.y_invert = transform == WL_OUTPUT_TRANSFORM_FLIPPED_180;
+}
+
+static void ext_frame_handle_damage(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(TRACE, "ext: damage event handler");
+
+	if (x < 0 || y < 0 || width <= 0 || height <= 0) {
+		return;
+	}
+	struct xdpw_frame_damage damage = {
+		.x = x,
+		.y = y,
+		.width = width,
+		.height = height,
+	};
+	xdpw_damage_list_add(&cast->current_frame.damage, &damage);
+}
+
+static void ext_frame_handle_presentation_time(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame,
+		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(TRACE, "ext: presentation_time event handler");
+
+	cast->current_frame.tv_sec = ((((uint64_t)tv_sec_hi) << 32) | tv_sec_lo);
+	cast->current_frame.tv_nsec = tv_nsec;
+}
+
+static void ext_frame_handle_ready(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(TRACE, "ext: ready event handler");
+	logprint(TRACE, "ext: frame has %u damage regions", cast->current_frame.damage.count);
+
+	xdpw_pwr_add_damage(cast, &cast->current_frame.damage);
+
+	cast->frame_state = XDPW_FRAME_STATE_SUCCESS;
+
+	xdpw_wlr_frame_finish(cast);
+}
+
+static void ext_frame_handle_failed(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame, uint32_t reason) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(TRACE, "ext: failed event handler (reason %u)", reason);
+
+	switch (reason) {
+	case EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS:
+		cast->frame_state = XDPW_FRAME_STATE_RENEG;
+		break;
+	case EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED:
+		logprint(ERROR, "ext: capture session stopped");
+		cast->err = 1;
+		// fall through
+	default:
+		cast->frame_state = XDPW_FRAME_STATE_FAILED;
+	}
+
+	xdpw_wlr_frame_finish(cast);
+}
+
+static const struct ext_image_copy_capture_frame_v1_listener ext_frame_listener = {
+	.transform = ext_frame_handle_transform,
+	.damage = ext_frame_handle_damage,
+	.presentation_time = ext_frame_handle_presentation_time,
+	.ready = ext_frame_handle_ready,
+	.failed = ext_frame_handle_failed,
+};
+
+static void ext_frame_finish_deferred(void *data) {
+	xdpw_wlr_frame_finish(data);
+}
+
+static void ext_frame_start(struct xdpw_screencast_instance *cast) {
+	logprint(TRACE, "ext: start capture");
+
+	if (!xdpw_wlr_frame_prepare_buffer(cast)) {
+		// the session keeps the constraints, so retrying right away
+		// would spin. Wait one frame interval instead.
+		uint32_t framerate = cast->framerate >= 1 ? cast->framerate : 1;
+		xdpw_timer_arm(cast->ctx->state, &cast->frame_timer, 1000000000 / framerate,
+			ext_frame_finish_deferred, cast);
+		return;
+	}
+
+	cast->ext_frame = ext_image_copy_capture_session_v1_create_frame(cast->ext_session);
+	ext_image_copy_capture_frame_v1_add_listener(cast->ext_frame,
+		&ext_frame_listener, cast);
+
+	ext_image_copy_capture_frame_v1_attach_buffer(cast->ext_frame,
+		cast->current_frame.xdpw_buffer->buffer);
+	// buffers are reused out of order, their content is always stale
+	ext_image_copy_capture_frame_v1_damage_buffer(cast->ext_frame,
+		0, 0, INT32_MAX, INT32_MAX);
+	ext_image_copy_capture_frame_v1_capture(cast->ext_frame);
+	logprint(TRACE, "ext: frame copied");
+}
+
+static void ext_session_handle_buffer_size(void *data,
+		struct ext_image_copy_capture_session_v1 *session,
+		uint32_t width, uint32_t height) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(TRACE, "ext: buffer_size event handler");
+
+	for (int i = 0; i < 2; i++) {
+		cast->ext_constraints[i].width = width;
+		cast->ext_constraints[i].height = height;
+	}
+}
+
+static void ext_session_handle_shm_format(void *data,
+		struct ext_image_copy_capture_session_v1 *session, uint32_t format) {
+	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_screencopy_frame_info *info = &cast->ext_constraints[WL_SHM];
+
+	logprint(TRACE, "ext: shm_format event handler (0x%08x)", format);
+
+	// only the two mandatory wl_shm formats differ from their drm fourcc
+	uint32_t drm_format = format;
+	if (format == WL_SHM_FORMAT_ARGB8888) {
+		drm_format = DRM_FORMAT_ARGB8888;
+	} else if (format == WL_SHM_FORMAT_XRGB8888) {
+		drm_format = DRM_FORMAT_XRGB8888;
+	}
+	if (info->format == DRM_FORMAT_INVALID && ext_format_supported(drm_format)) {
+		info->format = drm_format;
+	}
+}
+
+static void ext_session_handle_dmabuf_device(void *data,
+		struct ext_image_copy_capture_session_v1 *session, struct wl_array *device_arr) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(TRACE, "ext: dmabuf_device event handler");
+
+	dev_t device;
+	assert(device_arr->size == sizeof(device));
+	memcpy(&device, device_arr->data, sizeof(device));
+
+	// the source may be rendered on another gpu than the main device,
+	// only switch before any buffers were allocated
+	if (!wl_list_empty(&cast->buffer_pools)) {
+		return;
+	}
+	struct gbm_device *gbm = xdpw_gbm_device_get(cast->ctx, device);
+	if (gbm && gbm != cast->gbm) {
+		logprint(DEBUG, "ext: allocating dmabufs on the device of the capture source");
+		cast->gbm = gbm;
+	}
+}
+
+static void ext_session_handle_dmabuf_format(void *data,
+		struct ext_image_copy_capture_session_v1 *session,
+		uint32_t format, struct wl_array *modifiers) {
+	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_screencopy_frame_info *info = &cast->ext_constraints[DMABUF];
+
+	logprint(TRACE, "ext: dmabuf_format event handler (0x%08x)", format);
+
+	if (info->format == DRM_FORMAT_INVALID && ext_format_supported(format)) {
+		info->format = format;
+	}
+}
+
+static void ext_session_handle_done(void *data,
+		struct ext_image_copy_capture_session_v1 *session) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(TRACE, "ext: done event handler");
+
+	struct xdpw_screencopy_frame_info *shm_info = &cast->ext_constraints[WL_SHM];
+	if (shm_info->format == DRM_FORMAT_INVALID) {
+		// wl_shm mandates support for these
+		shm_info->format = DRM_FORMAT_XRGB8888;
+	}
+	// all supported shm formats have 32 bits per pixel
+	shm_info->stride = shm_info->width * 4;
+	shm_info->size = shm_info->stride * shm_info->height;
+
+	memcpy(cast->screencopy_frame_info, cast->ext_constraints,
+		sizeof(cast->screencopy_frame_info));
+	// start over with the next batch of constraints
+	memset(cast->ext_constraints, 0, sizeof(cast->ext_constraints));
+
+	logprint(DEBUG, "ext: buffer constraints %ux%u, shm 0x%08x, dmabuf 0x%08x",
+		cast->screencopy_frame_info[WL_SHM].width, cast->screencopy_frame_info[WL_SHM].height,
+		cast->screencopy_frame_info[WL_SHM].format,
+		cast->screencopy_frame_info[DMABUF].format);
+
+	if (!cast->initialized) {
+		xdpw_screencast_instance_ready(cast);
+	}
+}
+
+static void ext_session_handle_stopped(void *data,
+		struct ext_image_copy_capture_session_v1 *session) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(ERROR, "ext: capture session stopped");
+	cast->err = 1;
+}
+
+static const struct ext_image_copy_capture_session_v1_listener ext_session_listener = {
+	.buffer_size = ext_session_handle_buffer_size,
+	.shm_format = ext_session_handle_shm_format,
+	.dmabuf_device = ext_session_handle_dmabuf_device,
+	.dmabuf_format = ext_session_handle_dmabuf_format,
+	.done = ext_session_handle_done,
+	.stopped = ext_session_handle_stopped,
+};
+
+static struct ext_image_capture_source_v1 *ext_source_create(
+		struct xdpw_screencast_context *ctx, const struct xdpw_capture_target *target) {
+	if (target->toplevel) {
+		return ext_foreign_toplevel_image_capture_source_manager_v1_create_source(
+			ctx->ext_toplevel_image_capture_source_manager, target->toplevel->handle);
+	} else if (target->output && ctx->ext_output_image_capture_source_manager) {
+		return ext_output_image_capture_source_manager_v1_create_source(
+			ctx->ext_output_image_capture_source_manager, target->output->output);
+	}
+	return NULL;
+}
+
+static int ext_session_init(struct xdpw_screencast_instance *cast) {
+	struct xdpw_screencast_context *ctx = cast->ctx;
+
+	cast->ext_source = ext_source_create(ctx, &cast->target);
+	if (!cast->ext_source) {
+		logprint(ERROR, "ext: capture source is gone");
+		return -1;
+	}
+
+	uint32_t options = 0;
+	if (cast->with_cursor) {
+		options |= EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_OPTIONS_PAINT_CURSORS;
+	}
+	memset(cast->ext_constraints, 0, sizeof(cast->ext_constraints));
+	cast->ext_session = ext_image_copy_capture_manager_v1_create_session(
+		ctx->ext_image_copy_capture_manager, cast->ext_source, options);
+	ext_image_copy_capture_session_v1_add_listener(cast->ext_session,
+		&ext_session_listener, cast);
+
+	logprint(TRACE, "ext: capture session created");
+	return 0;
+}
+
+static void ext_session_finish(struct xdpw_screencast_instance *cast) {
+	ext_frame_free(cast);
+	if (cast->ext_session) {
+		ext_image_copy_capture_session_v1_destroy(cast->ext_session);
+		cast->ext_session = NULL;
+	}
+	if (cast->ext_source) {
+		ext_image_capture_source_v1_destroy(cast->ext_source);
+		cast->ext_source = NULL;
+	}
+	logprint(TRACE, "ext: capture session destroyed");
+}
+
+const struct xdpw_capture_backend xdpw_ext_image_copy_backend = {
+	.name = "ext-image-copy-capture",
+	.session_init = ext_session_init,
+	.session_finish = ext_session_finish,
+	.frame_start = ext_frame_start,
+	.frame_free = ext_frame_free,
+};
+
+static void ext_cursor_frame_free(struct xdpw_cursor *cursor) {
+	if (!cursor->frame) {
+		return;
+	}
+	ext_image_copy_capture_frame_v1_destroy(cursor->frame);
+	cursor->frame = NULL;
+}
+
+static void ext_cursor_frame_start(struct xdpw_screencast_instance *cast);
+
+static void ext_cursor_frame_handle_transform(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame, uint32_t transform) {
+	/* Nothing to do */
+}
+
+static void ext_cursor_frame_handle_damage(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	/* Nothing to do */
+}
+
+static void ext_cursor_frame_handle_presentation_time(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame,
+		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+	/* Nothing to do */
+}
+
+static void ext_cursor_frame_handle_ready(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame) {
+	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_cursor *cursor = &cast->cursor;
+	struct xdpw_screencopy_frame_info *info = &cursor->frame_info;
+
+	logprint(TRACE, "ext: cursor ready event handler");
+	ext_cursor_frame_free(cursor);
+
+	// consumers cache the image, only send it again when it changed
+	bool changed = !cursor->bitmap || memcmp(&cursor->bitmap_info, info, sizeof(*info)) != 0 ||
+		memcmp(cursor->bitmap, cursor->buffer->data, info->size) != 0;
+	if (changed) {
+		uint8_t *bitmap = realloc(cursor->bitmap, info->size);
+		if (!bitmap) {
+			logprint(ERROR, "ext: failed to allocate cursor image");
+			return;
+		}
+		memcpy(bitmap, cursor->buffer->data, info->size);
+		cursor->bitmap = bitmap;
+		cursor->bitmap_info = *info;
+		cursor->serial++;
+		logprint(TRACE, "ext: cursor image %ux%u", info->width, info->height);
+		xdpw_pwr_update_cursor(cast);
+	}
+
+	// the next frame is ready once the image changes
+	ext_cursor_frame_start(cast);
+}
+
+static void ext_cursor_frame_handle_failed(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame, uint32_t reason) {
+	struct xdpw_screencast_instance *cast = data;
+
+	// new constraints are followed by a done event, which starts the next frame
+	logprint(DEBUG, "ext: cursor capture failed (reason %u)", reason);
+	ext_cursor_frame_free(&cast->cursor);
+}
+
+static const struct ext_image_copy_capture_frame_v1_listener ext_cursor_frame_listener = {
+	.transform = ext_cursor_frame_handle_transform,
+	.damage = ext_cursor_frame_handle_damage,
+	.presentation_time = ext_cursor_frame_handle_presentation_time,
+	.ready = ext_cursor_frame_handle_ready,
+	.failed = ext_cursor_frame_handle_failed,
+};
+
+static void ext_cursor_frame_start(struct xdpw_screencast_instance *cast) {
+	struct xdpw_cursor *cursor = &cast->cursor;
+	struct xdpw_screencopy_frame_info *info = &cursor->frame_info;
+	if (cursor->frame || info->size == 0) {
+		return;
+	}
+
+	struct xdpw_buffer *buffer = cursor->buffer;
+	if (buffer && (buffer->width != info->width || buffer->height != info->height ||
+			buffer->format != info->format)) {
+		xdpw_shm_buffer_release(buffer);
+		cursor->buffer = NULL;
+	}
+	if (!cursor->buffer) {
+		cursor->buffer = xdpw_shm_buffer_acquire(cast->ctx, info, NULL);
+		if (!cursor->buffer) {
+			logprint(ERROR, "ext: failed to allocate cursor buffer");
+			return;
+		}
+	}
+
+	cursor->frame = ext_image_copy_capture_session_v1_create_frame(cursor->capture_session);
+	ext_image_copy_capture_frame_v1_add_listener(cursor->frame,
+		&ext_cursor_frame_listener, cast);
+	ext_image_copy_capture_frame_v1_attach_buffer(cursor->frame, cursor->buffer->buffer);
+	ext_image_copy_capture_frame_v1_damage_buffer(cursor->frame,
+		0, 0, INT32_MAX, INT32_MAX);
+	ext_image_copy_capture_frame_v1_capture(cursor->frame);
+}
+
+static void ext_cursor_session_handle_buffer_size(void *data,
+		struct ext_image_copy_capture_session_v1 *session,
+		uint32_t width, uint32_t height) {
+	struct xdpw_screencast_instance *cast = data;
+
+	cast->cursor.constraints.width = width;
+	cast->cursor.constraints.height = height;
+}
+
+static void ext_cursor_session_handle_shm_format(void *data,
+		struct ext_image_copy_capture_session_v1 *session, uint32_t format) {
+	struct xdpw_screencast_instance *cast = data;
+
+	// cursors need alpha, which the mandatory argb8888 has
+	if (format == WL_SHM_FORMAT_ARGB8888) {
+		cast->cursor.constraints.format = DRM_FORMAT_ARGB8888;
+	}
+}
+
+static void ext_cursor_session_handle_dmabuf_device(void *data,
+		struct ext_image_copy_capture_session_v1 *session, struct wl_array *device_arr) {
+	/* Nothing to do */
+}
+
+static void ext_cursor_session_handle_dmabuf_format(void *data,
+		struct ext_image_copy_capture_session_v1 *session,
+		uint32_t format, struct wl_array *modifiers) {
+	/* Nothing to do */
+}
+
+static void ext_cursor_session_handle_done(void *data,
+		struct ext_image_copy_capture_session_v1 *session) {
+	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_cursor *cursor = &cast->cursor;
+	struct xdpw_screencopy_frame_info *info = &cursor->constraints;
+
+	logprint(TRACE, "ext: cursor done event handler");
+
+	info->format = DRM_FORMAT_ARGB8888;
+	info->stride = info->width * 4;
+	info->size = info->stride * info->height;
+	if (info->width > XDPW_CURSOR_BITMAP_MAX || info->height > XDPW_CURSOR_BITMAP_MAX) {
+		logprint(WARN, "ext: cursor image %ux%u is too large for metadata",
+			info->width, info->height);
+		info->size = 0;
+	}
+	cursor->frame_info = *info;
+	*info = (struct xdpw_screencopy_frame_info){ 0 };
+
+	// a frame in flight uses the old constraints
+	ext_cursor_frame_free(cursor);
+	ext_cursor_frame_start(cast);
+}
+
+static void ext_cursor_session_handle_stopped(void *data,
+		struct ext_image_copy_capture_session_v1 *session) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(DEBUG, "ext: cursor capture session stopped");
+	ext_cursor_frame_free(&cast->cursor);
+	cast->cursor.frame_info.size = 0;
+}
+
+static const struct ext_image_copy_capture_session_v1_listener ext_cursor_capture_session_listener = {
+	.buffer_size = ext_cursor_session_handle_buffer_size,
+	.shm_format = ext_cursor_session_handle_shm_format,
+	.dmabuf_device = ext_cursor_session_handle_dmabuf_device,
+	.dmabuf_format = ext_cursor_session_handle_dmabuf_format,
+	.done = ext_cursor_session_handle_done,
+	.stopped = ext_cursor_session_handle_stopped,
+};
+
+static void ext_cursor_handle_enter(void *data,
+		struct ext_image_copy_capture_cursor_session_v1 *session) {
+	struct xdpw_screencast_instance *cast = data;
+
+	cast->cursor.visible = true;
+	cast->cursor.serial++;
+	xdpw_pwr_update_cursor(cast);
+}
+
+static void ext_cursor_handle_leave(void *data,
+		struct ext_image_copy_capture_cursor_session_v1 *session) {
+	struct xdpw_screencast_instance *cast = data;
+
+	cast->cursor.visible = false;
+	cast->cursor.serial++;
+	xdpw_pwr_update_cursor(cast);
+}
+
+static void ext_cursor_handle_position(void *data,
+		struct ext_image_copy_capture_cursor_session_v1 *session, int32_t x, int32_t y) {
+	struct xdpw_screencast_instance *cast = data;
+
+	cast->cursor.x = x;
+	cast->cursor.y = y;
+	xdpw_pwr_update_cursor(cast);
+}
+
+static void ext_cursor_handle_hotspot(void *data,
+		struct ext_image_copy_capture_cursor_session_v1 *session, int32_t x, int32_t y) {
+	struct xdpw_screencast_instance *cast = data;
+
+	cast->cursor.hotspot_x = x;
+	cast->cursor.hotspot_y = y;
+	xdpw_pwr_update_cursor(cast);
+}
+
+static const struct ext_image_copy_capture_cursor_session_v1_listener ext_cursor_session_listener = {
+	.enter = ext_cursor_handle_enter,
+	.leave = ext_cursor_handle_leave,
+	.position = ext_cursor_handle_position,
+	.hotspot = ext_cursor_handle_hotspot,
+};
+
+int xdpw_ext_cursor_session_init(struct xdpw_screencast_instance *cast) {
+	struct xdpw_screencast_context *ctx = cast->ctx;
+	struct xdpw_cursor *cursor = &cast->cursor;
+
+	if (!ctx->ext_image_copy_capture_manager || !ctx->pointer) {
+		logprint(ERROR, "ext: compositor can't capture the cursor");
+		return -1;
+	}
+	cursor->source = ext_source_create(ctx, &cast->target);
+	if (!cursor->source) {
+		logprint(ERROR, "ext: cursor source is gone");
+		return -1;
+	}
+
+	cursor->session = ext_image_copy_capture_manager_v1_create_pointer_cursor_session(
+		ctx->ext_image_copy_capture_manager, cursor->source, ctx->pointer);
+	ext_image_copy_capture_cursor_session_v1_add_listener(cursor->session,
+		&ext_cursor_session_listener, cast);
+	cursor->capture_session =
+		ext_image_copy_capture_cursor_session_v1_get_capture_session(cursor->session);
+	ext_image_copy_capture_session_v1_add_listener(cursor->capture_session,
+		&ext_cursor_capture_session_listener, cast);
+
+	logprint(TRACE, "ext: cursor session created");
+	return 0;
+}
+
+void xdpw_ext_cursor_session_finish(struct xdpw_screencast_instance *cast) {
+	struct xdpw_cursor *cursor = &cast->cursor;
+
+	xdpw_timer_disarm(&cursor->timer);
+	ext_cursor_frame_free(cursor);
+	if (cursor->capture_session) {
+		ext_image_copy_capture_session_v1_destroy(cursor->capture_session);
+		cursor->capture_session = NULL;
+	}
+	if (cursor->session) {
+		ext_image_copy_capture_cursor_session_v1_destroy(cursor->session);
+		cursor->session = NULL;
+	}
+	if (cursor->source) {
+		ext_image_capture_source_v1_destroy(cursor->source);
+		cursor->source = NULL;
+	}
+	if (cursor->buffer) {
+		xdpw_shm_buffer_release(cursor->buffer);
+		cursor->buffer = NULL;
+	}
+	free(cursor->bitmap);
+	cursor->bitmap = NULL;
+}
@@ -1,12 +1,14 @@
 #include "fps_limit.h"
 #include "logger.h"
 #include "timespec_util.h"
+#include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 #include <assert.h>
 
 #define FPS_MEASURE_PERIOD_SEC 5.0
+#define FPS_VSYNC_TOLERANCE 0.01
 
 void measure_fps(struct fps_limit_state *state, struct timespec *now);
 
@@ -18,7 +20,53 @@ void fps_limit_measure_start(struct fps_limit_state *state, double max_fps) {
 	clock_gettime(CLOCK_MONOTONIC, &state->frame_last_time);
 }
 
-uint64_t fps_limit_measure_end(struct fps_limit_state *state, double max_fps) {
+void fps_limit_frame_presented(struct fps_limit_state *state, uint64_t tv_sec, uint32_t tv_nsec) {
+	state->frame_presented_time.tv_sec = tv_sec;
+	state->frame_presented_time.tv_nsec = tv_nsec;
+}
+
+static uint32_t vsync_divisor(double max_fps, double refresh) {
+	// the largest integer fraction of the refresh rate not above max_fps,
+	// allowing for refresh rates like 59.94 Hz
+	uint32_t divisor = refresh / max_fps;
+	if (divisor < 1) {
+		divisor = 1;
+	}
+	if (refresh / divisor > max_fps * (1.0 + FPS_VSYNC_TOLERANCE)) {
+		divisor++;
+	}
+	return divisor;
+}
+
+static bool vsync_delay(struct fps_limit_state *state, struct timespec *now,
+		double max_fps, double refresh, uint64_t *delay_ns) {
+	if (refresh <= 0.0 || timespec_is_zero(&state->frame_presented_time)) {
+		return false;
+	}
+
+	// compositors timestamp frames with CLOCK_MONOTONIC, anything else
+	// can't be used to predict vblanks
+	int64_t since_presented_ns = timespec_diff_ns(now, &state->frame_presented_time);
+	if (since_presented_ns < 0 || since_presented_ns > TIMESPEC_NSEC_PER_SEC) {
+		return false;
+	}
+
+	uint32_t divisor = vsync_divisor(max_fps, refresh);
+	int64_t refresh_ns = TIMESPEC_NSEC_PER_SEC / refresh;
+	int64_t target_ns = divisor * refresh_ns;
+
+	// request the capture half a refresh cycle ahead of the target vblank,
+	// late enough not to catch the previous one and early enough for the
+	// compositor to include it in the target frame
+	int64_t wake_ns = target_ns - refresh_ns / 2;
+	int64_t delay = wake_ns - since_presented_ns;
+	logprint(TRACE, "fps_limit: refresh %0.2f Hz, divisor %u, %ld ns since the last frame, "
+		"delay %ld ns", refresh, divisor, since_presented_ns, delay);
+	*delay_ns = delay > 0 ? delay : 0;
+	return true;
+}
+
+uint64_t fps_limit_measure_end(struct fps_limit_state *state, double max_fps, double refresh) {
 	if (max_fps <= 0.0) {
 		return 0;
 	}
@@ -32,6 +80,11 @@ uint64_t fps_limit_measure_end(struct fps_limit_state *state, double max_fps) {
 
 	measure_fps(state, &now);
 
+	uint64_t vsync_delay_ns;
+	if (vsync_delay(state, &now, max_fps, refresh, &vsync_delay_ns)) {
+		return vsync_delay_ns;
+	}
+
 	int64_t target_ns = (1.0 / max_fps) * TIMESPEC_NSEC_PER_SEC;
 	int64_t delay_ns = target_ns - elapsed_ns;
 	if (delay_ns > 0) {
@@ -45,6 +98,16 @@ uint64_t fps_limit_measure_end(struct fps_limit_state *state, double max_fps) {
 	}
 }
 
+bool fps_limit_is_idle(struct timespec *last_change, struct timespec *now,
+		uint32_t idle_frames, double max_fps) {
+	if (idle_frames == 0 || max_fps <= 0.0 || timespec_is_zero(last_change)) {
+		return false;
+	}
+	// wall time, the compositor may hold back captures without damage
+	int64_t idle_ns = (double)idle_frames * TIMESPEC_NSEC_PER_SEC / max_fps;
+	return timespec_diff_ns(now, last_change) >= idle_ns;
+}
+
 void measure_fps(struct fps_limit_state *state, struct timespec *now) {
 	if (timespec_is_zero(&state->fps_last_time)) {
 		state->fps_last_time = *now;
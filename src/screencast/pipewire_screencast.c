@@ -5,16 +5,30 @@
 #include <spa/param/props.h>
 #include <spa/param/format-utils.h>
 #include <spa/param/video/format-utils.h>
+#include <spa/utils/ringbuffer.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <assert.h>
 #include <libdrm/drm_fourcc.h>
 
+#include "convert.h"
+#include "screencast.h"
+#include "shm_allocator.h"
 #include "wlr_screencast.h"
 #include "xdpw.h"
 #include "logger.h"
+#include "timespec_util.h"
 
-static struct spa_pod *build_buffer(struct spa_pod_builder *b, uint32_t blocks, uint32_t size,
+#define CURSOR_META_SIZE(width, height) \
+	(sizeof(struct spa_meta_cursor) + sizeof(struct spa_meta_bitmap) + (width) * (height) * 4)
+
+static struct spa_pod *build_buffer(struct spa_pod_builder *b, uint32_t buffers,
+		uint32_t min_buffers, uint32_t max_buffers, uint32_t blocks, uint32_t size,
 		uint32_t stride, uint32_t datatype) {
 	assert(blocks > 0);
 	assert(datatype > 0);
@@ -22,7 +36,7 @@ static struct spa_pod *build_buffer(struct spa_pod_builder *b, uint32_t blocks,
 
 	spa_pod_builder_push_object(b, &f[0], SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers);
 	spa_pod_builder_add(b, SPA_PARAM_BUFFERS_buffers,
-			SPA_POD_CHOICE_RANGE_Int(XDPW_PWR_BUFFERS, XDPW_PWR_BUFFERS_MIN, 32), 0);
+			SPA_POD_CHOICE_RANGE_Int(buffers, min_buffers, max_buffers), 0);
 	spa_pod_builder_add(b, SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(blocks), 0);
 	if (size > 0) {
 		spa_pod_builder_add(b, SPA_PARAM_BUFFERS_size, SPA_POD_Int(size), 0);
@@ -35,29 +49,69 @@ static struct spa_pod *build_buffer(struct spa_pod_builder *b, uint32_t blocks,
 	return spa_pod_builder_pop(b, &f[0]);
 }
 
+static struct spa_fraction framerate_fraction(double framerate) {
+	uint32_t fps = framerate;
+	if (fps == framerate) {
+		return SPA_FRACTION(fps, 1);
+	}
+	// fractional refresh rates like 59.94Hz
+	return SPA_FRACTION((uint32_t)(framerate * 1000 + 0.5), 1000);
+}
+
+static double pwr_stream_max_framerate(struct xdpw_pwr_stream *pwr_stream) {
+	double max_framerate = pwr_stream->cast->max_framerate;
+	double max_fps = pwr_stream->policy.max_fps;
+	if (max_fps > 0 && (max_framerate <= 0 || max_fps < max_framerate)) {
+		return max_fps;
+	}
+	return max_framerate;
+}
+
 static struct spa_pod *build_format(struct spa_pod_builder *b, enum spa_video_format format,
-		uint32_t width, uint32_t height, uint32_t framerate,
+		uint32_t width, uint32_t height, double framerate,
 		uint64_t *modifiers, int modifier_count) {
 	struct spa_pod_frame f[2];
 	int i, c;
 
-	enum spa_video_format format_without_alpha = xdpw_format_pw_strip_alpha(format);
+	// the compositor's format first, then the same without alpha. Shm frames
+	// can also be converted for consumers that only take the other channel
+	// order.
+	enum spa_video_format formats[4];
+	int format_count = 0;
+	formats[format_count++] = format;
+	if (modifier_count == 0) {
+		enum spa_video_format alternatives[] = {
+			xdpw_format_pw_strip_alpha(format),
+			xdpw_format_pw_swap_rb(format),
+			xdpw_format_pw_strip_alpha(xdpw_format_pw_swap_rb(format)),
+		};
+		for (i = 0; i < 3; i++) {
+			if (alternatives[i] != SPA_VIDEO_FORMAT_UNKNOWN) {
+				formats[format_count++] = alternatives[i];
+			}
+		}
+	}
 
 	spa_pod_builder_push_object(b, &f[0], SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
 	spa_pod_builder_add(b, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video), 0);
 	spa_pod_builder_add(b, SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw), 0);
 	/* format */
-	if (modifier_count > 0 || format_without_alpha == SPA_VIDEO_FORMAT_UNKNOWN) {
+	if (format_count == 1) {
 		// modifiers are defined only in combinations with their format
 		// we should not announce the format without alpha
 		spa_pod_builder_add(b, SPA_FORMAT_VIDEO_format, SPA_POD_Id(format), 0);
 	} else {
-		spa_pod_builder_add(b, SPA_FORMAT_VIDEO_format,
-				SPA_POD_CHOICE_ENUM_Id(3, format, format, format_without_alpha), 0);
+		spa_pod_builder_prop(b, SPA_FORMAT_VIDEO_format, 0);
+		spa_pod_builder_push_choice(b, &f[1], SPA_CHOICE_Enum, 0);
+		spa_pod_builder_id(b, format);
+		for (i = 0; i < format_count; i++) {
+			spa_pod_builder_id(b, formats[i]);
+		}
+		spa_pod_builder_pop(b, &f[1]);
 	}
 	/* modifiers */
-	if (modifier_count == 1 && modifiers[0] == DRM_FORMAT_MOD_INVALID) {
-		// we only support implicit modifiers, use shortpath to skip fixation phase
+	if (modifier_count == 1) {
+		// we only support a single modifier, use shortpath to skip fixation phase
 		spa_pod_builder_prop(b, SPA_FORMAT_VIDEO_modifier, SPA_POD_PROP_FLAG_MANDATORY);
 		spa_pod_builder_long(b, modifiers[0]);
 	} else if (modifier_count > 0) {
@@ -78,87 +132,550 @@ static struct spa_pod *build_format(struct spa_pod_builder *b, enum spa_video_fo
 	// variable framerate
 	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_framerate,
 		SPA_POD_Fraction(&SPA_FRACTION(0, 1)), 0);
+	struct spa_fraction max_framerate = framerate_fraction(framerate);
 	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_maxFramerate,
 		SPA_POD_CHOICE_RANGE_Fraction(
-			&SPA_FRACTION(framerate, 1),
+			&max_framerate,
 			&SPA_FRACTION(1, 1),
-			&SPA_FRACTION(framerate, 1)),
+			&max_framerate),
 		0);
 	return spa_pod_builder_pop(b, &f[0]);
 }
 
-static uint32_t build_formats(struct spa_pod_builder *b, struct xdpw_screencast_instance *cast,
+static uint32_t build_formats(struct spa_pod_builder *b, struct xdpw_pwr_stream *pwr_stream,
 		const struct spa_pod *params[static 2]) {
+	struct xdpw_screencast_instance *cast = pwr_stream->cast;
 	uint32_t param_count;
-	uint32_t modifier_count = 1;
-	uint64_t modifier = DRM_FORMAT_MOD_INVALID;
+	uint32_t modifier_count = 0;
+	uint64_t *modifiers = NULL;
+	double max_framerate = pwr_stream_max_framerate(pwr_stream);
 
-	if (cast->ctx->gbm) {
+	if (cast->gbm && !pwr_stream->avoid_dmabufs) {
+		modifier_count = xdpw_wlr_query_dmabuf_modifiers(cast->ctx, cast->gbm,
+			cast->screencopy_frame_info[DMABUF].format, &modifiers);
+	}
+
+	if (modifier_count > 0) {
 		param_count = 2;
 		params[0] = build_format(b, xdpw_format_pw_from_drm_fourcc(cast->screencopy_frame_info[DMABUF].format),
-				cast->screencopy_frame_info[DMABUF].width, cast->screencopy_frame_info[DMABUF].height, cast->framerate,
-				&modifier, modifier_count);
+				cast->screencopy_frame_info[DMABUF].width, cast->screencopy_frame_info[DMABUF].height, max_framerate,
+				modifiers, modifier_count);
 		params[1] = build_format(b, xdpw_format_pw_from_drm_fourcc(cast->screencopy_frame_info[WL_SHM].format),
-				cast->screencopy_frame_info[WL_SHM].width, cast->screencopy_frame_info[WL_SHM].height, cast->framerate,
+				cast->screencopy_frame_info[WL_SHM].width, cast->screencopy_frame_info[WL_SHM].height, max_framerate,
 				NULL, 0);
 	} else {
 		param_count = 1;
 		params[0] = build_format(b, xdpw_format_pw_from_drm_fourcc(cast->screencopy_frame_info[WL_SHM].format),
-				cast->screencopy_frame_info[WL_SHM].width, cast->screencopy_frame_info[WL_SHM].height, cast->framerate,
+				cast->screencopy_frame_info[WL_SHM].width, cast->screencopy_frame_info[WL_SHM].height, max_framerate,
 				NULL, 0);
 	}
 
+	free(modifiers);
 	return param_count;
 }
 
-static void pwr_handle_stream_on_process(void *data) {
+static bool pwr_buffer_pool_matches(struct xdpw_buffer_pool *pool,
+		enum buffer_type buffer_type, uint64_t modifier, bool swap_rb) {
+	if (pool->buffer_type != buffer_type) {
+		return false;
+	}
+	return buffer_type == WL_SHM ? pool->swap_rb == swap_rb : pool->modifier == modifier;
+}
+
+static struct xdpw_buffer_pool *pwr_buffer_pool_find(struct xdpw_screencast_instance *cast,
+		enum buffer_type buffer_type, uint64_t modifier, bool swap_rb) {
+	struct xdpw_buffer_pool *pool;
+	wl_list_for_each(pool, &cast->buffer_pools, link) {
+		if (pwr_buffer_pool_matches(pool, buffer_type, modifier, swap_rb)) {
+			return pool;
+		}
+	}
+	return NULL;
+}
+
+static void pwr_buffer_pool_damage_all(struct xdpw_buffer_pool *pool) {
+	struct xdpw_screencopy_frame_info *frame_info = &pool->cast->screencopy_frame_info[pool->buffer_type];
+	struct xdpw_frame_damage damage = {
+		.x = 0,
+		.y = 0,
+		.width = frame_info->width,
+		.height = frame_info->height,
+	};
+	xdpw_damage_list_add(&pool->damage, &damage);
+}
+
+static struct xdpw_buffer_pool *pwr_buffer_pool_create(struct xdpw_screencast_instance *cast,
+		enum buffer_type buffer_type, uint64_t modifier, bool swap_rb) {
+	struct xdpw_buffer_pool *pool = calloc(1, sizeof(struct xdpw_buffer_pool));
+	if (!pool) {
+		logprint(ERROR, "pipewire: failed to allocate buffer pool");
+		return NULL;
+	}
+	pool->cast = cast;
+	pool->buffer_type = buffer_type;
+	pool->modifier = modifier;
+	pool->swap_rb = swap_rb;
+	struct config_screencast *screencast_conf = &cast->ctx->state->config->screencast_conf;
+	pool->buffer_count = SPA_MAX(SPA_MIN(XDPW_PWR_BUFFERS, screencast_conf->max_buffers),
+		screencast_conf->min_buffers);
+	wl_list_init(&pool->streams);
+	wl_list_insert(&cast->buffer_pools, &pool->link);
+	pwr_buffer_pool_damage_all(pool);
+	logprint(DEBUG, "pipewire: created buffer pool %p (buffer_type: %u, modifier: %lu, swap_rb: %d)",
+		pool, buffer_type, modifier, swap_rb);
+	return pool;
+}
+
+static void pwr_buffer_pool_destroy(struct xdpw_buffer_pool *pool) {
+	struct xdpw_screencast_instance *cast = pool->cast;
+
+	logprint(DEBUG, "pipewire: destroying buffer pool %p", pool);
+	assert(wl_list_empty(&pool->streams));
+
+	if (cast->current_frame.pool == pool) {
+		cast->current_frame.pool = NULL;
+		cast->current_frame.xdpw_buffer = NULL;
+	}
+	for (uint32_t i = 0; i < XDPW_PWR_BUFFERS_MAX; i++) {
+		if (pool->buffers[i]) {
+			xdpw_buffer_destroy(pool->buffers[i]);
+		}
+	}
+	if (pool->buffer_type == WL_SHM) {
+		xdpw_shm_allocator_drop(&cast->ctx->shm_allocator, pool);
+	}
+	wl_list_remove(&pool->link);
+	free(pool);
+}
+
+static void pwr_buffer_pool_unbind(struct xdpw_buffer_pool *pool, uint32_t index) {
+	assert(pool->bindings[index] > 0);
+	if (--pool->bindings[index] > 0) {
+		return;
+	}
+
+	struct xdpw_screencast_instance *cast = pool->cast;
+	if (cast->current_frame.pool == pool && cast->current_frame.buffer_index == index) {
+		cast->current_frame.pool = NULL;
+		cast->current_frame.xdpw_buffer = NULL;
+	}
+	xdpw_buffer_destroy(pool->buffers[index]);
+	pool->buffers[index] = NULL;
+}
+
+static void pwr_stream_release_buffers(struct xdpw_pwr_stream *pwr_stream) {
+	for (uint32_t i = 0; i < XDPW_PWR_BUFFERS_MAX; i++) {
+		struct pw_buffer *buffer = pwr_stream->buffers[i];
+		if (!buffer) {
+			continue;
+		}
+		for (uint32_t plane = 0; plane < buffer->buffer->n_datas; plane++) {
+			buffer->buffer->datas[plane].fd = -1;
+		}
+		buffer->user_data = NULL;
+		pwr_stream->buffers[i] = NULL;
+		pwr_buffer_pool_unbind(pwr_stream->pool, i);
+	}
+	pwr_stream->free_buffers = 0;
+}
+
+static void pwr_stream_leave_pool(struct xdpw_pwr_stream *pwr_stream) {
+	struct xdpw_buffer_pool *pool = pwr_stream->pool;
+	if (!pool) {
+		return;
+	}
+
+	pwr_stream_release_buffers(pwr_stream);
+	wl_list_remove(&pwr_stream->pool_link);
+	pwr_stream->pool = NULL;
+	// the consumer may still hold the memfds of the idle buffers
+	if (pool->buffer_type == WL_SHM) {
+		xdpw_shm_allocator_drop(&pwr_stream->cast->ctx->shm_allocator, pool);
+	}
+
+	if (wl_list_empty(&pool->streams)) {
+		pwr_buffer_pool_destroy(pool);
+	}
+}
+
+static bool pwr_stream_join_pool(struct xdpw_pwr_stream *pwr_stream,
+		enum buffer_type buffer_type, uint64_t modifier, bool swap_rb) {
+	struct xdpw_screencast_instance *cast = pwr_stream->cast;
+
+	if (pwr_stream->pool &&
+			pwr_buffer_pool_matches(pwr_stream->pool, buffer_type, modifier, swap_rb)) {
+		return true;
+	}
+	pwr_stream_leave_pool(pwr_stream);
+
+	struct xdpw_buffer_pool *pool = pwr_buffer_pool_find(cast, buffer_type, modifier, swap_rb);
+	if (!pool) {
+		pool = pwr_buffer_pool_create(cast, buffer_type, modifier, swap_rb);
+		if (!pool) {
+			return false;
+		}
+	}
+	wl_list_insert(&pool->streams, &pwr_stream->pool_link);
+	pwr_stream->pool = pool;
+	// the new consumer has not seen any content yet
+	pwr_buffer_pool_damage_all(pool);
+	logprint(DEBUG, "pipewire: stream %p uses buffer pool %p with %d streams",
+		pwr_stream, pool, wl_list_length(&pool->streams));
+	return true;
+}
+
+static void pwr_update_framerate(struct xdpw_screencast_instance *cast) {
+	struct xdpw_pwr_stream *pwr_stream;
+	double framerate = 0;
+	bool active = false;
+	cast->idle_frames = 0;
+	cast->idle_fps = 0;
+	wl_list_for_each(pwr_stream, &cast->stream_list, link) {
+		if (!pwr_stream->pwr_stream_state) {
+			continue;
+		}
+		if (pwr_stream->framerate > framerate) {
+			framerate = pwr_stream->framerate;
+		}
+
+		// a single stream without throttling keeps the full rate
+		struct xdpw_stream_policy *policy = &pwr_stream->policy;
+		if (!active || policy->idle_frames == 0) {
+			cast->idle_frames = policy->idle_frames;
+		} else if (cast->idle_frames > 0 && policy->idle_frames > cast->idle_frames) {
+			cast->idle_frames = policy->idle_frames;
+		}
+		if (policy->idle_fps > cast->idle_fps) {
+			cast->idle_fps = policy->idle_fps;
+		}
+		active = true;
+	}
+	cast->framerate = framerate > 0 ? framerate : cast->max_framerate;
+}
+
+static bool pwr_test_allocation(struct xdpw_screencast_instance *cast,
+		const uint64_t *modifiers, uint32_t n_modifiers, uint64_t *modifier) {
+	struct xdpw_screencopy_frame_info *frame_info = &cast->screencopy_frame_info[DMABUF];
+	uint64_t explicit_modifiers[n_modifiers > 0 ? n_modifiers : 1];
+	uint32_t n_explicit = 0;
+	bool implicit = false, linear = false;
+	struct gbm_bo *bo = NULL;
+
+	for (uint32_t i = 0; i < n_modifiers; i++) {
+		switch (modifiers[i]) {
+		case DRM_FORMAT_MOD_INVALID:
+			implicit = true;
+			break;
+		case DRM_FORMAT_MOD_LINEAR:
+			linear = true;
+			// fall through
+		default:
+			explicit_modifiers[n_explicit++] = modifiers[i];
+		}
+	}
+
+	// prefer a modifier which is already in use, so the buffers can be shared
+	struct xdpw_buffer_pool *pool;
+	wl_list_for_each(pool, &cast->buffer_pools, link) {
+		if (pool->buffer_type != DMABUF) {
+			continue;
+		}
+		for (uint32_t i = 0; i < n_modifiers; i++) {
+			if (modifiers[i] == pool->modifier) {
+				*modifier = pool->modifier;
+				return true;
+			}
+		}
+	}
+
+	// let the driver pick the best of the explicit modifiers
+	if (n_explicit > 0) {
+		bo = gbm_bo_create_with_modifiers(cast->gbm, frame_info->width, frame_info->height,
+			frame_info->format, explicit_modifiers, n_explicit);
+		if (bo) {
+			*modifier = gbm_bo_get_modifier(bo);
+			gbm_bo_destroy(bo);
+			return true;
+		}
+		logprint(INFO, "pipewire: unable to allocate a dmabuf with modifiers. Falling back to the old api");
+	}
+
+	if (implicit) {
+		uint32_t flags = GBM_BO_USE_RENDERING;
+		if (cast->ctx->state->config->screencast_conf.force_mod_linear) {
+			flags |= GBM_BO_USE_LINEAR;
+		}
+		bo = gbm_bo_create(cast->gbm, frame_info->width, frame_info->height,
+			frame_info->format, flags);
+		if (bo) {
+			*modifier = DRM_FORMAT_MOD_INVALID;
+			gbm_bo_destroy(bo);
+			return true;
+		}
+	}
+
+	if (linear) {
+		bo = gbm_bo_create(cast->gbm, frame_info->width, frame_info->height,
+			frame_info->format, GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR);
+		if (bo) {
+			*modifier = DRM_FORMAT_MOD_LINEAR;
+			gbm_bo_destroy(bo);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void pwr_fixate_modifier(struct xdpw_pwr_stream *pwr_stream,
+		const struct spa_pod_prop *prop_modifier) {
+	struct xdpw_screencast_instance *cast = pwr_stream->cast;
+	struct pw_stream *stream = pwr_stream->stream;
+	uint8_t params_buffer[XDPW_PWR_PARAMS_BUFFER_SIZE];
+	struct spa_pod_builder b =
+		SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
+	const struct spa_pod *params[3];
+	uint32_t n_params;
+	uint32_t n_values, choice;
+	uint64_t modifier;
+
+	const struct spa_pod *pod_values = spa_pod_get_values(&prop_modifier->value, &n_values, &choice);
+	if (pod_values->type != SPA_TYPE_Long || n_values == 0) {
+		logprint(ERROR, "pipewire: invalid modifier property");
+		cast->err = 1;
+		return;
+	}
+	const uint64_t *modifiers = SPA_POD_BODY_CONST(pod_values);
+	if (choice == SPA_CHOICE_Enum && n_values > 1) {
+		// the first value of an enumeration is the default
+		modifiers++;
+		n_values--;
+	}
+
+	if (!pwr_test_allocation(cast, modifiers, n_values, &modifier)) {
+		logprint(WARN, "pipewire: unable to allocate a dmabuf. Falling back to shm");
+		pwr_stream->avoid_dmabufs = true;
+
+		n_params = build_formats(&b, pwr_stream, params);
+		pw_stream_update_params(stream, params, n_params);
+		return;
+	}
+
+	logprint(DEBUG, "pipewire: fixating modifier %lu", modifier);
+
+	// announce the fixated format first, followed by all other formats
+	// to allow renegotiation later on
+	params[0] = build_format(&b, xdpw_format_pw_from_drm_fourcc(cast->screencopy_frame_info[DMABUF].format),
+		cast->screencopy_frame_info[DMABUF].width, cast->screencopy_frame_info[DMABUF].height,
+		pwr_stream_max_framerate(pwr_stream), &modifier, 1);
+	n_params = build_formats(&b, pwr_stream, &params[1]) + 1;
+
+	pw_stream_update_params(stream, params, n_params);
+}
+
+// the consumers held the buffer from queueing until the last stream of
+// the pool gave it back
+static void pwr_buffer_pool_track_hold(struct xdpw_buffer_pool *pool, uint32_t index,
+		struct timespec *released) {
+	struct xdpw_buffer *buffer = pool->buffers[index];
+	if (!buffer || timespec_is_zero(&buffer->queue_time)) {
+		return;
+	}
+	struct xdpw_pwr_stream *pwr_stream;
+	wl_list_for_each(pwr_stream, &pool->streams, pool_link) {
+		if (pwr_stream->pwr_stream_state && !(pwr_stream->free_buffers & (1u << index))) {
+			return;
+		}
+	}
+	int64_t hold_ns = timespec_diff_ns(released, &buffer->queue_time);
+	if (hold_ns > 0) {
+		pool->hold_ns_max = SPA_MAX(pool->hold_ns_max, (uint64_t)hold_ns);
+	}
+	buffer->queue_time = (struct timespec){ 0 };
+}
+
+static void pwr_stream_mark_free(struct xdpw_pwr_stream *pwr_stream, struct pw_buffer *buffer,
+		struct timespec *released) {
+	for (uint32_t i = 0; i < XDPW_PWR_BUFFERS_MAX; i++) {
+		if (pwr_stream->buffers[i] == buffer) {
+			pwr_stream->free_buffers |= 1u << i;
+			if (pwr_stream->pool) {
+				pwr_buffer_pool_track_hold(pwr_stream->pool, i, released);
+			}
+			return;
+		}
+	}
+	logprint(DEBUG, "pipewire: dequeued buffer without xdpw buffer");
+}
+
+static void pwr_stream_dequeue_buffers(struct xdpw_pwr_stream *pwr_stream) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	struct pw_buffer *buffer;
+	if (pwr_stream->process_fd < 0) {
+		while ((buffer = pw_stream_dequeue_buffer(pwr_stream->stream)) != NULL) {
+			pwr_stream_mark_free(pwr_stream, buffer, &now);
+		}
+		return;
+	}
+
+	// the data thread dequeues, pick up what it handed over
+	uint32_t index;
+	int32_t avail = spa_ringbuffer_get_read_index(&pwr_stream->returned_ring, &index);
+	for (; avail > 0; avail--, index++) {
+		pwr_stream_mark_free(pwr_stream, pwr_stream->returned[index % XDPW_PWR_BUFFERS_MAX], &now);
+	}
+	spa_ringbuffer_read_update(&pwr_stream->returned_ring, index);
+}
+
+static void pwr_stream_process(struct xdpw_pwr_stream *pwr_stream) {
 	logprint(TRACE, "pipewire: stream process");
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_screencast_instance *cast = pwr_stream->cast;
+
+	// take the returned buffers right away, their hold time ends here
+	// and not when the next capture looks for a buffer
+	if (pwr_stream->pwr_stream_state) {
+		pwr_stream_dequeue_buffers(pwr_stream);
+	}
 
 	if (cast->need_buffer) {
 		xdpw_pwr_dequeue_buffer(cast);
-		if (cast->current_frame.pw_buffer) {
+		if (cast->current_frame.xdpw_buffer) {
 			cast->need_buffer = false;
 		}
 	}
 }
 
+static void pwr_handle_stream_on_process(void *data) {
+	struct xdpw_pwr_stream *pwr_stream = data;
+
+	if (pwr_stream->process_fd < 0) {
+		pwr_stream_process(pwr_stream);
+		return;
+	}
+
+	// data thread: hand the returned buffers to the main thread, nothing
+	// in here may block or touch the screencast state
+	uint32_t index;
+	int32_t filled = spa_ringbuffer_get_write_index(&pwr_stream->returned_ring, &index);
+	bool returned = false;
+	struct pw_buffer *buffer;
+	while (filled < XDPW_PWR_BUFFERS_MAX &&
+			(buffer = pw_stream_dequeue_buffer(pwr_stream->stream)) != NULL) {
+		pwr_stream->returned[index % XDPW_PWR_BUFFERS_MAX] = buffer;
+		index++;
+		filled++;
+		returned = true;
+	}
+	if (!returned) {
+		return;
+	}
+	spa_ringbuffer_write_update(&pwr_stream->returned_ring, index);
+
+	uint64_t one = 1;
+	if (write(pwr_stream->process_fd, &one, sizeof(one)) < 0) {
+		// the counter is already non-zero, the main thread will wake up
+	}
+}
+
+static int pwr_handle_stream_process_event(struct xdpw_event_source *source,
+		uint32_t events) {
+	struct xdpw_pwr_stream *pwr_stream = source->data;
+
+	uint64_t count;
+	if (read(pwr_stream->process_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		logprint(ERROR, "pipewire: failed to read stream eventfd: %s", strerror(errno));
+		return -errno;
+	}
+
+	pwr_stream_process(pwr_stream);
+	return 0;
+}
+
 static void pwr_handle_stream_state_changed(void *data,
 		enum pw_stream_state old, enum pw_stream_state state, const char *error) {
-	struct xdpw_screencast_instance *cast = data;
-	cast->node_id = pw_stream_get_node_id(cast->stream);
+	struct xdpw_pwr_stream *pwr_stream = data;
+	struct xdpw_screencast_instance *cast = pwr_stream->cast;
+	pwr_stream->node_id = pw_stream_get_node_id(pwr_stream->stream);
 
 	logprint(INFO, "pipewire: stream state changed to \"%s\"",
 		pw_stream_state_as_string(state));
-	logprint(INFO, "pipewire: node id is %d", (int)cast->node_id);
+	logprint(INFO, "pipewire: node id is %d", (int)pwr_stream->node_id);
+	if (pwr_stream->node_id != SPA_ID_INVALID) {
+		xdpw_screencast_stream_connected(pwr_stream);
+	}
 
 	switch (state) {
 	case PW_STREAM_STATE_STREAMING:
-		cast->pwr_stream_state = true;
+		pwr_stream->pwr_stream_state = true;
+		// (re)connected consumers need the cursor image again
+		pwr_stream->cursor_serial = cast->cursor.serial - 1;
+		pwr_update_framerate(cast);
 		if (cast->frame_state == XDPW_FRAME_STATE_NONE) {
 			xdpw_wlr_frame_start(cast);
 		}
 		break;
-	case PW_STREAM_STATE_PAUSED:
-		if (old == PW_STREAM_STATE_STREAMING) {
-			xdpw_pwr_enqueue_buffer(cast);
-		}
-		// fall through
 	default:
-		cast->pwr_stream_state = false;
+		pwr_stream->pwr_stream_state = false;
+		pwr_update_framerate(cast);
 		break;
 	}
 }
 
-static void pwr_handle_stream_param_changed(void *data, uint32_t id,
-		const struct spa_pod *param) {
-	logprint(TRACE, "pipewire: stream parameters changed");
-	struct xdpw_screencast_instance *cast = data;
-	struct pw_stream *stream = cast->stream;
+static void pwr_stream_update_buffer_params(struct xdpw_pwr_stream *pwr_stream) {
+	struct xdpw_screencast_instance *cast = pwr_stream->cast;
+	struct config_screencast *screencast_conf = &cast->ctx->state->config->screencast_conf;
 	uint8_t params_buffer[1024];
 	struct spa_pod_builder b =
 		SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
-	const struct spa_pod *params[2];
+	const struct spa_pod *params[5];
+	uint32_t n_params = 4;
+
+	uint32_t data_type = pwr_stream->buffer_type == DMABUF ?
+		1<<SPA_DATA_DmaBuf : 1<<SPA_DATA_MemFd;
+
+	params[0] = build_buffer(&b, pwr_stream->pool->buffer_count,
+			screencast_conf->min_buffers, screencast_conf->max_buffers, pwr_stream->blocks,
+			cast->screencopy_frame_info[pwr_stream->buffer_type].size,
+			cast->screencopy_frame_info[pwr_stream->buffer_type].stride, data_type);
+
+	params[1] = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+		SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+
+	params[2] = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+		SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+			sizeof(struct spa_meta_region) * XDPW_DAMAGE_REGIONS_MAX,
+			sizeof(struct spa_meta_region) * 1,
+			sizeof(struct spa_meta_region) * XDPW_DAMAGE_REGIONS_MAX));
+
+	params[3] = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoTransform),
+		SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_videotransform)));
+
+	if (cast->cursor_mode == METADATA) {
+		params[n_params++] = spa_pod_builder_add_object(&b,
+			SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+			SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Cursor),
+			SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+				CURSOR_META_SIZE(64, 64),
+				CURSOR_META_SIZE(1, 1),
+				CURSOR_META_SIZE(XDPW_CURSOR_BITMAP_MAX, XDPW_CURSOR_BITMAP_MAX)));
+	}
+
+	pw_stream_update_params(pwr_stream->stream, params, n_params);
+}
+
+static void pwr_handle_stream_param_changed(void *data, uint32_t id,
+		const struct spa_pod *param) {
+	logprint(TRACE, "pipewire: stream parameters changed");
+	struct xdpw_pwr_stream *pwr_stream = data;
+	struct xdpw_screencast_instance *cast = pwr_stream->cast;
 	uint32_t blocks;
 	uint32_t data_type;
 
@@ -166,42 +683,77 @@ static void pwr_handle_stream_param_changed(void *data, uint32_t id,
 		return;
 	}
 
-	spa_format_video_raw_parse(param, &cast->pwr_format);
-	cast->framerate = (uint32_t)(cast->pwr_format.max_framerate.num / cast->pwr_format.max_framerate.denom);
+	spa_format_video_raw_parse(param, &pwr_stream->pwr_format);
+	pwr_stream->framerate = pwr_stream->pwr_format.max_framerate.denom > 0 ?
+		(double)pwr_stream->pwr_format.max_framerate.num / pwr_stream->pwr_format.max_framerate.denom : 0;
+	pwr_update_framerate(cast);
 
-	if (spa_pod_find_prop(param, NULL, SPA_FORMAT_VIDEO_modifier) != NULL) {
-		if (cast->pwr_format.modifier != DRM_FORMAT_MOD_INVALID) {
-			abort();
-		}
-		cast->buffer_type = DMABUF;
-		blocks = 1;
+	const struct spa_pod_prop *prop_modifier;
+	if ((prop_modifier = spa_pod_find_prop(param, NULL, SPA_FORMAT_VIDEO_modifier)) != NULL) {
+		pwr_stream->buffer_type = DMABUF;
 		data_type = 1<<SPA_DATA_DmaBuf;
+
+		// the consumer left the choice of the modifier to us
+		if ((prop_modifier->flags & SPA_POD_PROP_FLAG_DONT_FIXATE) > 0) {
+			pwr_fixate_modifier(pwr_stream, prop_modifier);
+			return;
+		}
+
+		if (pwr_stream->pwr_format.modifier == DRM_FORMAT_MOD_INVALID) {
+			blocks = 1;
+		} else {
+			int plane_count = gbm_device_get_format_modifier_plane_count(cast->gbm,
+				cast->screencopy_frame_info[DMABUF].format, pwr_stream->pwr_format.modifier);
+			if (plane_count <= 0) {
+				logprint(ERROR, "pipewire: negotiated modifier %lu is not supported", pwr_stream->pwr_format.modifier);
+				cast->err = 1;
+				return;
+			}
+			blocks = plane_count;
+		}
 	} else {
-		cast->buffer_type = WL_SHM;
+		pwr_stream->buffer_type = WL_SHM;
 		blocks = 1;
 		data_type = 1<<SPA_DATA_MemFd;
 	}
 
-	logprint(DEBUG, "pipewire: Format negotiated:");
-	logprint(DEBUG, "pipewire: buffer_type: %u (%u)", cast->buffer_type, data_type);
-	logprint(DEBUG, "pipewire: format: %u", cast->pwr_format.format);
-	logprint(DEBUG, "pipewire: modifier: %lu", cast->pwr_format.modifier);
-	logprint(DEBUG, "pipewire: size: (%u, %u)", cast->pwr_format.size.width, cast->pwr_format.size.height);
-	logprint(DEBUG, "pipewire: max_framerate: (%u / %u)", cast->pwr_format.max_framerate.num, cast->pwr_format.max_framerate.denom);
+	// only shm formats are offered with red and blue swapped
+	enum spa_video_format format =
+		xdpw_format_pw_from_drm_fourcc(cast->screencopy_frame_info[pwr_stream->buffer_type].format);
+	bool swap_rb = pwr_stream->buffer_type == WL_SHM &&
+		pwr_stream->pwr_format.format != format &&
+		pwr_stream->pwr_format.format != xdpw_format_pw_strip_alpha(format);
 
-	params[0] = build_buffer(&b, blocks, cast->screencopy_frame_info[cast->buffer_type].size,
-			cast->screencopy_frame_info[cast->buffer_type].stride, data_type);
+	if (!pwr_stream_join_pool(pwr_stream, pwr_stream->buffer_type, pwr_stream->pwr_format.modifier,
+			swap_rb)) {
+		cast->err = 1;
+		return;
+	}
 
-	params[1] = spa_pod_builder_add_object(&b,
-		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
-		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
-		SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+	logprint(DEBUG, "pipewire: Format negotiated:");
+	logprint(DEBUG, "pipewire: buffer_type: %u (%u)", pwr_stream->buffer_type, data_type);
+	logprint(DEBUG, "pipewire: format: %u (swap_rb: %d)", pwr_stream->pwr_format.format, swap_rb);
+	logprint(DEBUG, "pipewire: modifier: %lu", pwr_stream->pwr_format.modifier);
+	logprint(DEBUG, "pipewire: size: (%u, %u)", pwr_stream->pwr_format.size.width, pwr_stream->pwr_format.size.height);
+	logprint(DEBUG, "pipewire: max_framerate: (%u / %u)", pwr_stream->pwr_format.max_framerate.num, pwr_stream->pwr_format.max_framerate.denom);
+
+	pwr_stream->blocks = blocks;
+	pwr_stream_update_buffer_params(pwr_stream);
+}
 
-	pw_stream_update_params(stream, params, 2);
+static uint32_t pwr_chunk_size(struct xdpw_buffer *xdpw_buffer, uint32_t plane) {
+	// clients have implemented to check chunk->size if the buffer is valid instead
+	// of using the flags. Until they are patched we should use some arbitrary value.
+	if (xdpw_buffer->buffer_type == DMABUF && xdpw_buffer->size[plane] == 0) {
+		return 9; // This was choosen by a fair d20.
+	}
+	return xdpw_buffer->size[plane];
 }
 
 static void pwr_handle_stream_add_buffer(void *data, struct pw_buffer *buffer) {
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_pwr_stream *pwr_stream = data;
+	struct xdpw_screencast_instance *cast = pwr_stream->cast;
+	struct xdpw_buffer_pool *pool = pwr_stream->pool;
 	struct spa_data *d;
 
 	logprint(DEBUG, "pipewire: add buffer event handle");
@@ -210,10 +762,10 @@ static void pwr_handle_stream_add_buffer(void *data, struct pw_buffer *buffer) {
 
 	// Select buffer type from negotiation result
 	if ((d[0].type & (1u << SPA_DATA_MemFd)) > 0) {
-		assert(cast->buffer_type == WL_SHM);
+		assert(pwr_stream->buffer_type == WL_SHM);
 		d[0].type = SPA_DATA_MemFd;
 	} else if ((d[0].type & (1u << SPA_DATA_DmaBuf)) > 0) {
-		assert(cast->buffer_type == DMABUF);
+		assert(pwr_stream->buffer_type == DMABUF);
 		d[0].type = SPA_DATA_DmaBuf;
 	} else {
 		logprint(ERROR, "pipewire: unsupported buffer type");
@@ -223,44 +775,81 @@ static void pwr_handle_stream_add_buffer(void *data, struct pw_buffer *buffer) {
 
 	logprint(TRACE, "pipewire: selected buffertype %u", d[0].type);
 
-	struct xdpw_buffer *xdpw_buffer = xdpw_buffer_create(cast, cast->buffer_type, &cast->screencopy_frame_info[cast->buffer_type]);
-	if (xdpw_buffer == NULL) {
-		logprint(ERROR, "pipewire: failed to create xdpw buffer");
+	assert(pool && pool->buffer_type == pwr_stream->buffer_type);
+
+	uint32_t index;
+	for (index = 0; index < XDPW_PWR_BUFFERS_MAX; index++) {
+		if (!pwr_stream->buffers[index]) {
+			break;
+		}
+	}
+	if (index == XDPW_PWR_BUFFERS_MAX) {
+		logprint(ERROR, "pipewire: too many buffers");
 		cast->err = 1;
 		return;
 	}
-	wl_list_insert(&cast->buffer_list, &xdpw_buffer->link);
-	buffer->user_data = xdpw_buffer;
 
-	d[0].maxsize = xdpw_buffer->size;
-	d[0].mapoffset = 0;
-	d[0].chunk->size = xdpw_buffer->size;
-	d[0].chunk->stride = xdpw_buffer->stride;
-	d[0].chunk->offset = xdpw_buffer->offset;
-	d[0].flags = 0;
-	d[0].fd = xdpw_buffer->fd;
-	d[0].data = NULL;
+	// reuse the buffer of the pool if another stream already created it
+	struct xdpw_buffer *xdpw_buffer = pool->buffers[index];
+	if (!xdpw_buffer) {
+		xdpw_buffer = xdpw_buffer_create(pool, &cast->screencopy_frame_info[pool->buffer_type]);
+		if (xdpw_buffer == NULL) {
+			logprint(ERROR, "pipewire: failed to create xdpw buffer");
+			cast->err = 1;
+			return;
+		}
+		assert(pool->bindings[index] == 0);
+		pool->buffers[index] = xdpw_buffer;
+	}
 
-	// clients have implemented to check chunk->size if the buffer is valid instead
-	// of using the flags. Until they are patched we should use some arbitrary value.
-	if (xdpw_buffer->buffer_type == DMABUF && d[0].chunk->size == 0) {
-		d[0].chunk->size = 9; // This was choosen by a fair d20.
+	if ((uint32_t)xdpw_buffer->plane_count != buffer->buffer->n_datas) {
+		logprint(ERROR, "pipewire: mismatch buffer plane count");
+		if (pool->bindings[index] == 0) {
+			xdpw_buffer_destroy(xdpw_buffer);
+			pool->buffers[index] = NULL;
+		}
+		cast->err = 1;
+		return;
+	}
+	pool->bindings[index]++;
+	pwr_stream->buffers[index] = buffer;
+	buffer->user_data = xdpw_buffer;
+
+	for (uint32_t plane = 0; plane < buffer->buffer->n_datas; plane++) {
+		d[plane].type = d[0].type;
+		d[plane].maxsize = xdpw_buffer->buffer_type == WL_SHM ?
+			xdpw_buffer->alloc_size : xdpw_buffer->size[plane];
+		d[plane].mapoffset = 0;
+		d[plane].chunk->size = pwr_chunk_size(xdpw_buffer, plane);
+		d[plane].chunk->stride = xdpw_buffer->stride[plane];
+		d[plane].chunk->offset = xdpw_buffer->offset[plane];
+		d[plane].flags = 0;
+		d[plane].fd = xdpw_buffer->fd[plane];
+		d[plane].data = NULL;
 	}
 }
 
 static void pwr_handle_stream_remove_buffer(void *data, struct pw_buffer *buffer) {
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_pwr_stream *pwr_stream = data;
 
 	logprint(DEBUG, "pipewire: remove buffer event handle");
 
-	struct xdpw_buffer *xdpw_buffer = buffer->user_data;
-	if (xdpw_buffer) {
-		xdpw_buffer_destroy(xdpw_buffer);
+	// don't leave the buffer behind in the data thread handoff
+	if (pwr_stream->process_fd >= 0) {
+		pwr_stream_dequeue_buffers(pwr_stream);
+	}
+
+	for (uint32_t i = 0; i < XDPW_PWR_BUFFERS_MAX; i++) {
+		if (pwr_stream->buffers[i] == buffer) {
+			pwr_stream->buffers[i] = NULL;
+			pwr_stream->free_buffers &= ~(1u << i);
+			pwr_buffer_pool_unbind(pwr_stream->pool, i);
+			break;
+		}
 	}
-	if (cast->current_frame.pw_buffer == buffer) {
-		cast->current_frame.pw_buffer = NULL;
+	for (uint32_t plane = 0; plane < buffer->buffer->n_datas; plane++) {
+		buffer->buffer->datas[plane].fd = -1;
 	}
-	buffer->buffer->datas[0].fd = -1;
 	buffer->user_data = NULL;
 }
 
@@ -273,147 +862,612 @@ static const struct pw_stream_events pwr_stream_events = {
 	.process = pwr_handle_stream_on_process,
 };
 
+static struct xdpw_buffer_pool *pwr_pool_nth_streaming(struct xdpw_screencast_instance *cast,
+		uint32_t n) {
+	struct xdpw_buffer_pool *pool;
+	wl_list_for_each(pool, &cast->buffer_pools, link) {
+		struct xdpw_pwr_stream *pwr_stream;
+		wl_list_for_each(pwr_stream, &pool->streams, pool_link) {
+			if (pwr_stream->pwr_stream_state) {
+				if (n-- == 0) {
+					return pool;
+				}
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+uint32_t xdpw_pwr_pool_count(struct xdpw_screencast_instance *cast) {
+	uint32_t count = 0;
+	while (pwr_pool_nth_streaming(cast, count)) {
+		count++;
+	}
+	return count;
+}
+
+void xdpw_pwr_add_damage(struct xdpw_screencast_instance *cast,
+		const struct xdpw_damage_list *damage) {
+	struct xdpw_buffer_pool *pool;
+	wl_list_for_each(pool, &cast->buffer_pools, link) {
+		xdpw_damage_list_merge(&pool->damage, damage);
+	}
+}
+
+bool xdpw_pwr_is_streaming(struct xdpw_screencast_instance *cast) {
+	struct xdpw_pwr_stream *pwr_stream;
+	wl_list_for_each(pwr_stream, &cast->stream_list, link) {
+		if (pwr_stream->pwr_stream_state) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void pwr_buffer_pool_resize(struct xdpw_buffer_pool *pool, uint32_t buffer_count) {
+	logprint(DEBUG, "pipewire: resizing buffer pool %p from %u to %u buffers",
+		pool, pool->buffer_count, buffer_count);
+	pool->buffer_count = buffer_count;
+
+	struct xdpw_pwr_stream *pwr_stream;
+	wl_list_for_each(pwr_stream, &pool->streams, pool_link) {
+		pwr_stream_update_buffer_params(pwr_stream);
+	}
+}
+
+static void pwr_buffer_pool_adapt(struct xdpw_buffer_pool *pool) {
+	struct xdpw_screencast_instance *cast = pool->cast;
+	struct config_screencast *screencast_conf = &cast->ctx->state->config->screencast_conf;
+	uint32_t framerate = cast->framerate >= 1 ? cast->framerate : 1;
+
+	// judge the pool size about once per second
+	if (++pool->frames < framerate) {
+		return;
+	}
+
+	uint64_t frame_ns = TIMESPEC_NSEC_PER_SEC / framerate;
+	uint64_t busy_ns = pool->hold_ns_max + pool->round_trip_ns_max;
+	logprint(TRACE, "pipewire: buffer pool %p: %u buffers, %u misses, hold %lu ns, round trip %lu ns",
+		pool, pool->buffer_count, pool->misses, pool->hold_ns_max, pool->round_trip_ns_max);
+
+	if (pool->misses > 0 && pool->buffer_count < (uint32_t)screencast_conf->max_buffers) {
+		pwr_buffer_pool_resize(pool, pool->buffer_count + 1);
+	} else if (pool->misses == 0 && pool->buffer_count > (uint32_t)screencast_conf->min_buffers &&
+			busy_ns < (pool->buffer_count - 2) * frame_ns) {
+		// one buffer would still be spare after shrinking
+		pwr_buffer_pool_resize(pool, pool->buffer_count - 1);
+	}
+
+	pool->frames = 0;
+	pool->misses = 0;
+	pool->hold_ns_max = 0;
+	pool->round_trip_ns_max = 0;
+}
+
 void xdpw_pwr_dequeue_buffer(struct xdpw_screencast_instance *cast) {
 	logprint(TRACE, "pipewire: dequeueing buffer");
 
-	assert(!cast->current_frame.pw_buffer);
-	if ((cast->current_frame.pw_buffer = pw_stream_dequeue_buffer(cast->stream)) == NULL) {
+	assert(!cast->current_frame.xdpw_buffer);
+
+	// buffer pools take turns if the consumers negotiated different buffers
+	uint32_t pool_count = xdpw_pwr_pool_count(cast);
+	if (pool_count == 0) {
+		logprint(TRACE, "pipewire: no streaming buffer pool");
+		return;
+	}
+	struct xdpw_buffer_pool *pool = pwr_pool_nth_streaming(cast, cast->pool_cycle % pool_count);
+
+	// only a buffer which is free on all streams of the pool can be filled
+	uint32_t candidates = UINT32_MAX;
+	struct xdpw_pwr_stream *pwr_stream;
+	wl_list_for_each(pwr_stream, &pool->streams, pool_link) {
+		if (!pwr_stream->pwr_stream_state) {
+			continue;
+		}
+		pwr_stream_dequeue_buffers(pwr_stream);
+		candidates &= pwr_stream->free_buffers;
+	}
+
+	if (candidates == 0) {
 		logprint(WARN, "pipewire: out of buffers");
+		pool->misses++;
+		cast->stats.out_of_buffers++;
 		return;
 	}
 
-	cast->current_frame.xdpw_buffer = cast->current_frame.pw_buffer->user_data;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	uint32_t index = __builtin_ctz(candidates);
+	cast->current_frame.pool = pool;
+	cast->current_frame.buffer_index = index;
+	cast->current_frame.xdpw_buffer = pool->buffers[index];
+	assert(cast->current_frame.xdpw_buffer);
+	cast->current_frame.xdpw_buffer->dequeue_time = now;
 }
 
-void xdpw_pwr_enqueue_buffer(struct xdpw_screencast_instance *cast) {
-	logprint(TRACE, "pipewire: enqueueing buffer");
+static void pwr_stream_export_damage(struct spa_meta *meta,
+		const struct xdpw_damage_list *damage) {
+	uint32_t n_regions = meta->size / sizeof(struct spa_meta_region);
+	struct spa_meta_region *region = spa_meta_first(meta);
+	if (n_regions == 0) {
+		return;
+	}
 
-	if (!cast->current_frame.pw_buffer) {
-		logprint(WARN, "pipewire: no buffer to queue");
-		goto done;
+	if (damage->count > n_regions) {
+		// the consumer can't take all regions, send the bounding box instead
+		struct xdpw_frame_damage bounds;
+		xdpw_damage_list_bounds(damage, &bounds);
+		region->region = SPA_REGION(bounds.x, bounds.y, bounds.width, bounds.height);
+		region++;
+	} else {
+		for (uint32_t i = 0; i < damage->count; i++) {
+			const struct xdpw_frame_damage *r = &damage->regions[i];
+			region->region = SPA_REGION(r->x, r->y, r->width, r->height);
+			region++;
+		}
+	}
+
+	// an empty region terminates the list
+	if (spa_meta_check(region, meta)) {
+		region->region = SPA_REGION(0, 0, 0, 0);
+	}
+}
+
+static void pwr_stream_export_cursor(struct xdpw_pwr_stream *pwr_stream,
+		struct spa_buffer *spa_buf) {
+	struct xdpw_screencast_instance *cast = pwr_stream->cast;
+	struct xdpw_cursor *cursor = &cast->cursor;
+	struct spa_meta *meta = spa_buffer_find_meta(spa_buf, SPA_META_Cursor);
+	if (!meta || meta->size < sizeof(struct spa_meta_cursor)) {
+		return;
+	}
+
+	struct spa_meta_cursor *mc = meta->data;
+	mc->id = 1;
+	mc->flags = 0;
+	mc->position.x = cursor->x;
+	mc->position.y = cursor->y;
+	mc->hotspot.x = cursor->hotspot_x;
+	mc->hotspot.y = cursor->hotspot_y;
+	mc->bitmap_offset = 0;
+
+	// regions are cut out of the output the cursor session reports on
+	const struct xdpw_capture_target *target = &cast->target;
+	if (target->with_region && target->width > 0 && target->height > 0) {
+		double scale_x = (double)cast->screencopy_frame_info[WL_SHM].width / target->width;
+		double scale_y = (double)cast->screencopy_frame_info[WL_SHM].height / target->height;
+		mc->position.x -= target->x * scale_x;
+		mc->position.y -= target->y * scale_y;
+	}
+
+	if (pwr_stream->cursor_serial == cursor->serial) {
+		return;
+	}
+	// a hidden cursor is an empty image
+	const struct xdpw_screencopy_frame_info *info = &cursor->bitmap_info;
+	bool visible = cursor->visible && cursor->bitmap;
+	size_t size = visible ? info->size : 0;
+	if (meta->size < sizeof(*mc) + sizeof(struct spa_meta_bitmap) + size) {
+		logprint(DEBUG, "pipewire: cursor image doesn't fit into the metadata");
+		return;
+	}
+
+	mc->bitmap_offset = sizeof(*mc);
+	struct spa_meta_bitmap *bitmap = SPA_PTROFF(mc, mc->bitmap_offset, struct spa_meta_bitmap);
+	bitmap->format = xdpw_format_pw_from_drm_fourcc(DRM_FORMAT_ARGB8888);
+	bitmap->size.width = visible ? info->width : 0;
+	bitmap->size.height = visible ? info->height : 0;
+	bitmap->stride = visible ? info->stride : 0;
+	bitmap->offset = sizeof(*bitmap);
+	if (visible) {
+		memcpy(SPA_PTROFF(bitmap, bitmap->offset, void), cursor->bitmap, size);
 	}
-	struct pw_buffer *pw_buf = cast->current_frame.pw_buffer;
+	pwr_stream->cursor_serial = cursor->serial;
+}
+
+static bool pwr_buffer_has_transform(struct pw_buffer *buffer) {
+	return spa_buffer_find_meta_data(buffer->buffer, SPA_META_VideoTransform,
+		sizeof(struct spa_meta_videotransform)) != NULL;
+}
+
+static bool pwr_buffer_pool_has_transform(struct xdpw_buffer_pool *pool, uint32_t index) {
+	struct xdpw_pwr_stream *pwr_stream;
+	wl_list_for_each(pwr_stream, &pool->streams, pool_link) {
+		if (!pwr_stream->pwr_stream_state ||
+				!(pwr_stream->free_buffers & (1u << index))) {
+			continue;
+		}
+		if (!pwr_buffer_has_transform(pwr_stream->buffers[index])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// presentation time of the current frame in ns, used as pts
+static int64_t pwr_frame_pts(struct xdpw_screencast_instance *cast) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t now_ns = SPA_TIMESPEC_TO_NSEC(&now);
+	int64_t pts = now_ns;
+
+	// compositors timestamp frames with CLOCK_MONOTONIC, which is also the
+	// clock PipeWire reports graph time in, so no conversion is needed.
+	// Timestamps from the future or older than a second can't be from that
+	// clock though, fall back to the queue time for those.
+	struct xdpw_frame *frame = &cast->current_frame;
+	if (frame->tv_sec || frame->tv_nsec) {
+		int64_t ready_ns = frame->tv_sec * SPA_NSEC_PER_SEC + frame->tv_nsec;
+		if (ready_ns <= now_ns && now_ns - ready_ns < SPA_NSEC_PER_SEC) {
+			pts = ready_ns;
+		}
+	}
+
+	// keep pts strictly increasing across the fallback
+	if (pts <= cast->last_pts) {
+		pts = cast->last_pts + 1;
+	}
+	cast->last_pts = pts;
+	return pts;
+}
+
+static void pwr_stream_enqueue_buffer(struct xdpw_pwr_stream *pwr_stream, uint32_t index,
+		int64_t pts, bool buffer_corrupt, bool y_invert) {
+	struct xdpw_screencast_instance *cast = pwr_stream->cast;
+	struct pw_buffer *pw_buf = pwr_stream->buffers[index];
 	struct spa_buffer *spa_buf = pw_buf->buffer;
 	struct spa_data *d = spa_buf->datas;
 
-	bool buffer_corrupt = cast->frame_state != XDPW_FRAME_STATE_SUCCESS;
-
-	if (cast->current_frame.y_invert) {
-		//TODO: Flip buffer or set stride negative
+	struct spa_meta_videotransform *vt;
+	if ((vt = spa_buffer_find_meta_data(spa_buf, SPA_META_VideoTransform, sizeof(*vt)))) {
+		vt->transform = y_invert ? SPA_META_TRANSFORMATION_Flipped180 : SPA_META_TRANSFORMATION_None;
+	} else if (y_invert) {
 		buffer_corrupt = true;
-		cast->err = 1;
 	}
 
 	struct spa_meta_header *h;
 	if ((h = spa_buffer_find_meta_data(spa_buf, SPA_META_Header, sizeof(*h)))) {
-		h->pts = -1;
+		h->pts = pts;
 		h->flags = buffer_corrupt ? SPA_META_HEADER_FLAG_CORRUPTED : 0;
-		h->seq = cast->seq++;
+		h->seq = pwr_stream->seq++;
 		h->dts_offset = 0;
 	}
 
-	if (buffer_corrupt) {
-		d[0].chunk->flags = SPA_CHUNK_FLAG_CORRUPTED;
-	} else {
-		d[0].chunk->flags = SPA_CHUNK_FLAG_NONE;
+	struct spa_meta *damage;
+	if ((damage = spa_buffer_find_meta(spa_buf, SPA_META_VideoDamage))) {
+		pwr_stream_export_damage(damage, &pwr_stream->pool->damage);
+	}
+	pwr_stream_export_cursor(pwr_stream, spa_buf);
+
+	for (uint32_t plane = 0; plane < spa_buf->n_datas; plane++) {
+		// cursor updates may have emptied the chunk
+		d[plane].chunk->size = pwr_chunk_size(pwr_stream->pool->buffers[index], plane);
+		if (buffer_corrupt) {
+			d[plane].chunk->flags = SPA_CHUNK_FLAG_CORRUPTED;
+		} else {
+			d[plane].chunk->flags = SPA_CHUNK_FLAG_NONE;
+		}
 	}
 
-	logprint(TRACE, "********************");
-	logprint(TRACE, "pipewire: fd %u", d[0].fd);
-	logprint(TRACE, "pipewire: maxsize %d", d[0].maxsize);
-	logprint(TRACE, "pipewire: size %d", d[0].chunk->size);
-	logprint(TRACE, "pipewire: stride %d", d[0].chunk->stride);
-	logprint(TRACE, "pipewire: offset %d", d[0].chunk->offset);
-	logprint(TRACE, "pipewire: chunk flags %d", d[0].chunk->flags);
-	logprint(TRACE, "pipewire: width %d", cast->current_frame.xdpw_buffer->width);
-	logprint(TRACE, "pipewire: height %d", cast->current_frame.xdpw_buffer->height);
-	logprint(TRACE, "pipewire: y_invert %d", cast->current_frame.y_invert);
-	logprint(TRACE, "********************");
+	logprint(TRACE, "pipewire: node id %u: %dx%d, y_invert %d", pwr_stream->node_id,
+		cast->current_frame.xdpw_buffer->width, cast->current_frame.xdpw_buffer->height,
+		cast->current_frame.y_invert);
+	for (uint32_t plane = 0; plane < spa_buf->n_datas; plane++) {
+		logprint(TRACE, "pipewire: plane %d: fd %u, maxsize %d, size %d, stride %d, "
+			"offset %d, chunk flags %d", plane, d[plane].fd, d[plane].maxsize,
+			d[plane].chunk->size, d[plane].chunk->stride, d[plane].chunk->offset,
+			d[plane].chunk->flags);
+	}
 
-	pw_stream_queue_buffer(cast->stream, pw_buf);
+	pw_stream_queue_buffer(pwr_stream->stream, pw_buf);
+	pwr_stream->free_buffers &= ~(1u << index);
+}
+
+void xdpw_pwr_enqueue_buffer(struct xdpw_screencast_instance *cast) {
+	logprint(TRACE, "pipewire: enqueueing buffer");
+
+	struct xdpw_buffer_pool *pool = cast->current_frame.pool;
+	if (!cast->current_frame.xdpw_buffer || !pool) {
+		logprint(WARN, "pipewire: no buffer to queue");
+		goto done;
+	}
+	uint32_t index = cast->current_frame.buffer_index;
+
+	bool buffer_corrupt = cast->frame_state != XDPW_FRAME_STATE_SUCCESS;
+
+	// consumers with the transform meta flip the buffer themselves,
+	// everyone else gets the buffer flipped in place, in the same pass as
+	// the channel swap if the pool needs one
+	bool y_invert = cast->current_frame.y_invert;
+	bool flip_y = y_invert && !pwr_buffer_pool_has_transform(pool, index);
+	if ((flip_y || pool->swap_rb) && !buffer_corrupt) {
+		struct xdpw_buffer *buffer = cast->current_frame.xdpw_buffer;
+		if (buffer->buffer_type == WL_SHM &&
+				xdpw_convert_buffer(buffer, flip_y, pool->swap_rb) == 0) {
+			if (flip_y) {
+				xdpw_convert_flip_damage_y(&pool->damage, buffer->height);
+				y_invert = false;
+			}
+		} else if (pool->swap_rb) {
+			logprint(WARN, "pipewire: unable to swap channels, dropping frame");
+			buffer_corrupt = true;
+		} else {
+			logprint(WARN, "pipewire: unable to flip buffer for consumers without transform meta");
+		}
+	}
+
+	int64_t pts = pwr_frame_pts(cast);
+	struct xdpw_pwr_stream *pwr_stream;
+	wl_list_for_each(pwr_stream, &pool->streams, pool_link) {
+		if (!pwr_stream->pwr_stream_state ||
+				!(pwr_stream->free_buffers & (1u << index))) {
+			continue;
+		}
+		pwr_stream_enqueue_buffer(pwr_stream, index, pts, buffer_corrupt, y_invert);
+	}
+	if (!buffer_corrupt) {
+		pool->damage.count = 0;
+	}
+	cast->pool_cycle++;
+
+	struct xdpw_buffer *xdpw_buffer = cast->current_frame.xdpw_buffer;
+	clock_gettime(CLOCK_MONOTONIC, &xdpw_buffer->queue_time);
+	uint64_t round_trip_ns = timespec_diff_ns(&xdpw_buffer->queue_time, &xdpw_buffer->dequeue_time);
+	pool->round_trip_ns_max = SPA_MAX(pool->round_trip_ns_max, round_trip_ns);
+	pwr_buffer_pool_adapt(pool);
+
+	// the compositor timestamps frames with CLOCK_MONOTONIC
+	if (!buffer_corrupt && (cast->current_frame.tv_sec || cast->current_frame.tv_nsec)) {
+		struct timespec ready_time = {
+			.tv_sec = cast->current_frame.tv_sec,
+			.tv_nsec = cast->current_frame.tv_nsec,
+		};
+		int64_t queue_ns = timespec_diff_ns(&xdpw_buffer->queue_time, &ready_time);
+		if (queue_ns >= 0) {
+			xdpw_histogram_record(&cast->stats.queue_latency, queue_ns / 1000);
+		}
+	}
 
 done:
 	cast->current_frame.xdpw_buffer = NULL;
-	cast->current_frame.pw_buffer = NULL;
+	cast->current_frame.pool = NULL;
+}
+
+// queue the pointer without a new frame, signalled by an empty chunk
+static void pwr_stream_enqueue_cursor(struct xdpw_pwr_stream *pwr_stream, uint32_t index) {
+	struct xdpw_screencast_instance *cast = pwr_stream->cast;
+	struct pw_buffer *pw_buf = pwr_stream->buffers[index];
+	struct spa_buffer *spa_buf = pw_buf->buffer;
+
+	struct spa_meta_header *h;
+	if ((h = spa_buffer_find_meta_data(spa_buf, SPA_META_Header, sizeof(*h)))) {
+		h->pts = pwr_frame_pts(cast);
+		h->flags = 0;
+		h->seq = pwr_stream->seq++;
+		h->dts_offset = 0;
+	}
+
+	struct spa_meta *damage;
+	if ((damage = spa_buffer_find_meta(spa_buf, SPA_META_VideoDamage))) {
+		pwr_stream_export_damage(damage, &(struct xdpw_damage_list){ 0 });
+	}
+	pwr_stream_export_cursor(pwr_stream, spa_buf);
+
+	for (uint32_t plane = 0; plane < spa_buf->n_datas; plane++) {
+		spa_buf->datas[plane].chunk->size = 0;
+		spa_buf->datas[plane].chunk->flags = SPA_CHUNK_FLAG_NONE;
+	}
+
+	pw_stream_queue_buffer(pwr_stream->stream, pw_buf);
+	pwr_stream->free_buffers &= ~(1u << index);
+}
+
+static void pwr_handle_cursor_timer(void *data) {
+	struct xdpw_screencast_instance *cast = data;
+	clock_gettime(CLOCK_MONOTONIC, &cast->cursor.last_update);
+
+	struct xdpw_pwr_stream *pwr_stream;
+	wl_list_for_each(pwr_stream, &cast->stream_list, link) {
+		if (!pwr_stream->pwr_stream_state || !pwr_stream->pool) {
+			continue;
+		}
+		pwr_stream_dequeue_buffers(pwr_stream);
+		uint32_t candidates = pwr_stream->free_buffers;
+		// the buffer being captured into goes out with the next frame
+		if (cast->current_frame.xdpw_buffer && cast->current_frame.pool == pwr_stream->pool) {
+			candidates &= ~(1u << cast->current_frame.buffer_index);
+		}
+		if (candidates == 0) {
+			// the next frame carries the pointer
+			continue;
+		}
+		pwr_stream_enqueue_cursor(pwr_stream, __builtin_ctz(candidates));
+	}
+}
+
+void xdpw_pwr_update_cursor(struct xdpw_screencast_instance *cast) {
+	struct xdpw_cursor *cursor = &cast->cursor;
+	if (!cast->initialized || cursor->timer.armed) {
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double framerate = cast->framerate >= 1 ? cast->framerate : 1;
+	int64_t interval_ns = TIMESPEC_NSEC_PER_SEC / framerate;
+	int64_t elapsed_ns = timespec_diff_ns(&now, &cursor->last_update);
+	uint64_t delay_ns = elapsed_ns < interval_ns ? interval_ns - elapsed_ns : 0;
+	xdpw_timer_arm(cast->ctx->state, &cursor->timer, delay_ns,
+		pwr_handle_cursor_timer, cast);
 }
 
 void xdpw_pwr_swap_buffer(struct xdpw_screencast_instance *cast) {
 	logprint(TRACE, "pipewire: swapping buffers");
 
-	if (!cast->current_frame.pw_buffer) {
+	if (!cast->current_frame.xdpw_buffer) {
 		goto dequeue_buffer;
 	}
 
 	xdpw_pwr_enqueue_buffer(cast);
 
 dequeue_buffer:
-	assert(!cast->current_frame.pw_buffer);
+	assert(!cast->current_frame.xdpw_buffer);
 	cast->need_buffer = false;
 	xdpw_pwr_dequeue_buffer(cast);
-	if (!cast->current_frame.pw_buffer) {
+	if (!cast->current_frame.xdpw_buffer) {
 		cast->need_buffer = true;
 	}
 }
 
 void pwr_update_stream_param(struct xdpw_screencast_instance *cast) {
 	logprint(TRACE, "pipewire: stream update parameters");
-	struct pw_stream *stream = cast->stream;
-	uint8_t params_buffer[1024];
-	struct spa_pod_builder b =
-		SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
-	const struct spa_pod *params[2];
+	cast->stats.renegotiations++;
+
+	// the buffers of all pools are outdated, drop them before renegotiating
+	cast->current_frame.xdpw_buffer = NULL;
+	cast->current_frame.pool = NULL;
 
-	uint32_t n_params = build_formats(&b, cast, params);
+	struct xdpw_pwr_stream *pwr_stream;
+	wl_list_for_each(pwr_stream, &cast->stream_list, link) {
+		uint8_t params_buffer[XDPW_PWR_PARAMS_BUFFER_SIZE];
+		struct spa_pod_builder b =
+			SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
+		const struct spa_pod *params[2];
 
-	pw_stream_update_params(stream, params, n_params);
+		pwr_stream_leave_pool(pwr_stream);
+		uint32_t n_params = build_formats(&b, pwr_stream, params);
+
+		pw_stream_update_params(pwr_stream->stream, params, n_params);
+	}
+}
+
+void pwr_update_stream_framerate(struct xdpw_screencast_instance *cast) {
+	logprint(TRACE, "pipewire: stream update framerate");
+
+	// size, format and modifier stay the same, so the streams keep their pools,
+	// param_changed finds them already joined
+	struct xdpw_pwr_stream *pwr_stream;
+	wl_list_for_each(pwr_stream, &cast->stream_list, link) {
+		uint8_t params_buffer[XDPW_PWR_PARAMS_BUFFER_SIZE];
+		struct spa_pod_builder b =
+			SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
+		const struct spa_pod *params[2];
+
+		uint32_t n_params = build_formats(&b, pwr_stream, params);
+		pw_stream_update_params(pwr_stream->stream, params, n_params);
+	}
+}
+
+static int pwr_stream_init_data_thread(struct xdpw_pwr_stream *pwr_stream) {
+	struct xdpw_state *state = pwr_stream->cast->ctx->state;
+
+	int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fd < 0) {
+		return -1;
+	}
+	spa_ringbuffer_init(&pwr_stream->returned_ring);
+	pwr_stream->process_source = (struct xdpw_event_source){
+		.fd = fd,
+		.events = EPOLLIN,
+		.priority = XDPW_EVENT_PRIORITY_STREAM,
+		.func = pwr_handle_stream_process_event,
+		.data = pwr_stream,
+	};
+	if (xdpw_event_loop_add(&state->event_loop, &pwr_stream->process_source) < 0) {
+		close(fd);
+		return -1;
+	}
+	pwr_stream->process_fd = fd;
+	return 0;
 }
 
-void xdpw_pwr_stream_create(struct xdpw_screencast_instance *cast) {
+struct xdpw_pwr_stream *xdpw_pwr_stream_create(struct xdpw_screencast_instance *cast,
+		const struct xdpw_stream_policy *policy) {
 	struct xdpw_screencast_context *ctx = cast->ctx;
 	struct xdpw_state *state = ctx->state;
 
 	pw_loop_enter(state->pw_loop);
 
-	uint8_t buffer[1024];
+	uint8_t buffer[XDPW_PWR_PARAMS_BUFFER_SIZE];
 	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 	const struct spa_pod *params[2];
 
+	struct xdpw_pwr_stream *pwr_stream = calloc(1, sizeof(struct xdpw_pwr_stream));
+	if (!pwr_stream) {
+		logprint(ERROR, "pipewire: failed to allocate stream");
+		return NULL;
+	}
+	pwr_stream->cast = cast;
+	pwr_stream->policy = *policy;
+	pwr_stream->node_id = SPA_ID_INVALID;
+	wl_list_init(&pwr_stream->pool_link);
+
+	enum pw_stream_flags flags = PW_STREAM_FLAG_DRIVER | PW_STREAM_FLAG_ALLOC_BUFFERS;
+	pwr_stream->process_fd = -1;
+	if (state->config->screencast_conf.pipewire_data_thread) {
+		if (pwr_stream_init_data_thread(pwr_stream) == 0) {
+			flags |= PW_STREAM_FLAG_RT_PROCESS;
+		} else {
+			logprint(WARN, "pipewire: unable to set up the data thread handoff, "
+				"processing on the main thread");
+		}
+	}
+
 	char name[] = "xdpw-stream-XXXXXX";
 	randname(name + strlen(name) - 6);
-	cast->stream = pw_stream_new(ctx->core, name,
+	pwr_stream->stream = pw_stream_new(ctx->core, name,
 		pw_properties_new(
 			PW_KEY_MEDIA_CLASS, "Video/Source",
 			NULL));
 
-	if (!cast->stream) {
+	if (!pwr_stream->stream) {
 		logprint(ERROR, "pipewire: failed to create stream");
 		abort();
 	}
-	cast->pwr_stream_state = false;
+	pwr_stream->pwr_stream_state = false;
+	wl_list_insert(&cast->stream_list, &pwr_stream->link);
 
-	uint32_t param_count = build_formats(&b, cast, params);
+	uint32_t param_count = build_formats(&b, pwr_stream, params);
 
-	pw_stream_add_listener(cast->stream, &cast->stream_listener,
-		&pwr_stream_events, cast);
+	pw_stream_add_listener(pwr_stream->stream, &pwr_stream->stream_listener,
+		&pwr_stream_events, pwr_stream);
 
-	pw_stream_connect(cast->stream,
+	pw_stream_connect(pwr_stream->stream,
 		PW_DIRECTION_OUTPUT,
 		PW_ID_ANY,
-		(PW_STREAM_FLAG_DRIVER |
-			PW_STREAM_FLAG_ALLOC_BUFFERS),
+		flags,
 		params, param_count);
+
+	logprint(INFO, "pipewire: screencast instance %p has %d streams",
+		cast, wl_list_length(&cast->stream_list));
+	return pwr_stream;
 }
 
-void xdpw_pwr_stream_destroy(struct xdpw_screencast_instance *cast) {
-	if (!cast->stream) {
+void xdpw_pwr_stream_destroy(struct xdpw_pwr_stream *pwr_stream) {
+	if (!pwr_stream) {
 		return;
 	}
 
 	logprint(DEBUG, "pipewire: destroying stream");
-	pw_stream_flush(cast->stream, false);
-	pw_stream_disconnect(cast->stream);
-	pw_stream_destroy(cast->stream);
-	cast->stream = NULL;
+	pw_stream_flush(pwr_stream->stream, false);
+	pw_stream_disconnect(pwr_stream->stream);
+	pw_stream_destroy(pwr_stream->stream);
+
+	// the data thread is stopped with the stream. This runs from the
+	// frame callbacks as well, the loop skips the removed source even
+	// when it is ready in the same iteration
+	if (pwr_stream->process_fd >= 0) {
+		xdpw_event_loop_remove(&pwr_stream->process_source);
+		close(pwr_stream->process_fd);
+		pwr_stream->process_fd = -1;
+	}
+
+	pwr_stream_leave_pool(pwr_stream);
+	wl_list_remove(&pwr_stream->link);
+	pwr_update_framerate(pwr_stream->cast);
+	free(pwr_stream);
 }
 
 int xdpw_pwr_context_create(struct xdpw_state *state) {
@@ -0,0 +1,132 @@
+#include "restore_data.h"
+
+#include <string.h>
+
+#include "logger.h"
+
+int xdpw_restore_data_read(sd_bus_message *msg, struct xdpw_restore_data *data) {
+	*data = (struct xdpw_restore_data){ 0 };
+
+	int ret = sd_bus_message_enter_container(msg, 'v', "(suv)");
+	if (ret < 0) {
+		return ret;
+	}
+	ret = sd_bus_message_enter_container(msg, 'r', "suv");
+	if (ret < 0) {
+		return ret;
+	}
+	const char *vendor;
+	uint32_t version;
+	ret = sd_bus_message_read(msg, "su", &vendor, &version);
+	if (ret < 0) {
+		return ret;
+	}
+	if (strcmp(vendor, XDPW_RESTORE_VENDOR) != 0 || version != XDPW_RESTORE_VERSION) {
+		logprint(DEBUG, "dbus: ignoring restore data %s version %u", vendor, version);
+		ret = sd_bus_message_skip(msg, "v");
+		if (ret >= 0) {
+			ret = 0;
+		}
+		goto out;
+	}
+
+	ret = sd_bus_message_enter_container(msg, 'v', "a{sv}");
+	if (ret < 0) {
+		return ret;
+	}
+	ret = sd_bus_message_enter_container(msg, 'a', "{sv}");
+	if (ret < 0) {
+		return ret;
+	}
+	while ((ret = sd_bus_message_enter_container(msg, 'e', "sv")) > 0) {
+		const char *key;
+		ret = sd_bus_message_read(msg, "s", &key);
+		if (ret < 0) {
+			return ret;
+		}
+		if (strcmp(key, "output") == 0) {
+			ret = sd_bus_message_read(msg, "v", "s", &data->output);
+		} else if (strcmp(key, "make") == 0) {
+			ret = sd_bus_message_read(msg, "v", "s", &data->make);
+		} else if (strcmp(key, "model") == 0) {
+			ret = sd_bus_message_read(msg, "v", "s", &data->model);
+		} else if (strcmp(key, "region") == 0) {
+			ret = sd_bus_message_read(msg, "v", "(iiii)",
+				&data->x, &data->y, &data->width, &data->height);
+			data->with_region = true;
+		} else {
+			ret = sd_bus_message_skip(msg, "v");
+		}
+		if (ret < 0) {
+			return ret;
+		}
+		ret = sd_bus_message_exit_container(msg);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	ret = sd_bus_message_exit_container(msg);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = sd_bus_message_exit_container(msg);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = 1;
+
+out:
+	if (ret < 0) {
+		return ret;
+	}
+	int exit_ret = sd_bus_message_exit_container(msg);
+	if (exit_ret < 0) {
+		return exit_ret;
+	}
+	exit_ret = sd_bus_message_exit_container(msg);
+	if (exit_ret < 0) {
+		return exit_ret;
+	}
+	return ret;
+}
+
+int xdpw_restore_data_append(sd_bus_message *reply, const struct xdpw_restore_data *data) {
+	int ret = sd_bus_message_open_container(reply, 'e', "sv");
+	if (ret >= 0) {
+		ret = sd_bus_message_append(reply, "s", "restore_data");
+	}
+	if (ret >= 0) {
+		ret = sd_bus_message_open_container(reply, 'v', "(suv)");
+	}
+	if (ret >= 0) {
+		ret = sd_bus_message_open_container(reply, 'r', "suv");
+	}
+	if (ret >= 0) {
+		ret = sd_bus_message_append(reply, "su", XDPW_RESTORE_VENDOR, XDPW_RESTORE_VERSION);
+	}
+	if (ret >= 0) {
+		ret = sd_bus_message_open_container(reply, 'v', "a{sv}");
+	}
+	if (ret >= 0) {
+		ret = sd_bus_message_open_container(reply, 'a', "{sv}");
+	}
+	if (ret >= 0) {
+		ret = sd_bus_message_append(reply, "{sv}", "output", "s", data->output);
+	}
+	if (ret >= 0 && data->make && data->model) {
+		ret = sd_bus_message_append(reply, "{sv}{sv}",
+			"make", "s", data->make, "model", "s", data->model);
+	}
+	if (ret >= 0 && data->with_region) {
+		ret = sd_bus_message_append(reply, "{sv}", "region", "(iiii)",
+			data->x, data->y, data->width, data->height);
+	}
+	// a{sv}, v, (suv), v and the dict entry
+	for (int i = 0; ret >= 0 && i < 5; i++) {
+		ret = sd_bus_message_close_container(reply);
+	}
+	return ret;
+}
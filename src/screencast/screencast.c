@@ -4,13 +4,19 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <assert.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
 #include <spa/utils/result.h>
 
+#include "encoder.h"
+#include "ext_image_copy.h"
 #include "pipewire_screencast.h"
+#include "pool.h"
+#include "restore_data.h"
+#include "shm_allocator.h"
 #include "wlr_screencast.h"
 #include "xdpw.h"
 #include "logger.h"
@@ -18,6 +24,8 @@
 static const char object_path[] = "/org/freedesktop/portal/desktop";
 static const char interface_name[] = "org.freedesktop.impl.portal.ScreenCast";
 
+static struct xdpw_pool instance_pool = { .size = sizeof(struct xdpw_screencast_instance) };
+
 void exec_with_shell(char *command) {
 	pid_t pid1 = fork();
 	if (pid1 < 0) {
@@ -46,8 +54,130 @@ void exec_with_shell(char *command) {
 	}
 }
 
+static double capture_target_refresh(struct xdpw_screencast_context *ctx,
+		const struct xdpw_capture_target *target) {
+	if (target->output) {
+		return target->output->framerate;
+	}
+	// windows can be shown on any output
+	double refresh = 0;
+	struct xdpw_wlr_output *output;
+	wl_list_for_each(output, &ctx->output_list, link) {
+		if (output->framerate > refresh) {
+			refresh = output->framerate;
+		}
+	}
+	return refresh;
+}
+
+static double fps_cap(double max_fps, double cap) {
+	if (cap > 0 && (max_fps <= 0 || cap < max_fps)) {
+		return cap;
+	}
+	return max_fps;
+}
+
+static bool fps_rule_matches(const struct config_fps_rule *rule,
+		const struct xdpw_wlr_output *output, const char *app_id) {
+	if (rule->type == XDPW_FPS_RULE_APP) {
+		return app_id && strcmp(rule->match, app_id) == 0;
+	}
+	if (!output) {
+		return false;
+	}
+	if (output->name && strcmp(rule->match, output->name) == 0) {
+		return true;
+	}
+	// "make model" keeps matching when the connector changes
+	size_t make_len = output->make ? strlen(output->make) : 0;
+	return make_len > 0 && output->model &&
+		strncmp(rule->match, output->make, make_len) == 0 &&
+		rule->match[make_len] == ' ' &&
+		strcmp(rule->match + make_len + 1, output->model) == 0;
+}
+
+static double fps_rule_max_fps(struct xdpw_state *state,
+		const struct xdpw_wlr_output *output, const char *app_id) {
+	struct config_screencast *conf = &state->config->screencast_conf;
+	double max_fps = 0;
+	for (size_t i = 0; i < conf->fps_rules_len; i++) {
+		if (fps_rule_matches(&conf->fps_rules[i], output, app_id)) {
+			max_fps = fps_cap(max_fps, conf->fps_rules[i].max_fps);
+		}
+	}
+	return max_fps;
+}
+
+void xdpw_screencast_stream_policy(struct xdpw_state *state, const char *app_id,
+		struct xdpw_stream_policy *policy) {
+	struct config_screencast *conf = &state->config->screencast_conf;
+	*policy = (struct xdpw_stream_policy){
+		.max_fps = fps_rule_max_fps(state, NULL, app_id),
+		.idle_frames = conf->idle_frames,
+		.idle_fps = conf->idle_fps,
+	};
+	for (size_t i = 0; i < conf->fps_rules_len; i++) {
+		struct config_fps_rule *rule = &conf->fps_rules[i];
+		if (!fps_rule_matches(rule, NULL, app_id)) {
+			continue;
+		}
+		if (rule->idle_frames >= 0) {
+			policy->idle_frames = rule->idle_frames;
+		}
+		if (rule->idle_fps > 0) {
+			policy->idle_fps = rule->idle_fps;
+		}
+	}
+}
+
+static double capture_target_max_framerate(struct xdpw_screencast_context *ctx,
+		const struct xdpw_capture_target *target) {
+	double max_fps = fps_cap(ctx->state->config->screencast_conf.max_fps,
+		fps_rule_max_fps(ctx->state, target->output, NULL));
+	return fps_cap(capture_target_refresh(ctx, target), max_fps);
+}
+
+void xdpw_screencast_instance_update_framerate(struct xdpw_screencast_instance *cast) {
+	double max_framerate = capture_target_max_framerate(cast->ctx, &cast->target);
+	if (max_framerate == cast->max_framerate) {
+		return;
+	}
+	logprint(INFO, "xdpw: screencast instance %p max framerate %f -> %f",
+		cast, cast->max_framerate, max_framerate);
+	cast->max_framerate = max_framerate;
+	if (cast->framerate > max_framerate || wl_list_empty(&cast->stream_list)) {
+		cast->framerate = max_framerate;
+	}
+	// let the consumers pick a framerate within the new range
+	if (!cast->initialized || wl_list_empty(&cast->stream_list)) {
+		return;
+	}
+	if (cast->frame_state == XDPW_FRAME_STATE_STARTED) {
+		// the compositor may be copying into one of the buffers,
+		// xdpw_wlr_frame_finish updates the formats
+		cast->framerate_update_pending = true;
+		return;
+	}
+	pwr_update_stream_framerate(cast);
+}
+
+static void capture_target_describe(const struct xdpw_capture_target *target,
+		char *buf, size_t size) {
+	if (target->toplevel) {
+		snprintf(buf, size, "window %s", target->toplevel->app_id);
+	} else if (!target->output) {
+		snprintf(buf, size, "closed window");
+	} else if (target->with_region) {
+		snprintf(buf, size, "%s region %d,%d %dx%d", target->output->name,
+			target->x, target->y, target->width, target->height);
+	} else {
+		snprintf(buf, size, "%s", target->output->name);
+	}
+}
+
 void xdpw_screencast_instance_init(struct xdpw_screencast_context *ctx,
-		struct xdpw_screencast_instance *cast, struct xdpw_wlr_output *out, bool with_cursor) {
+		struct xdpw_screencast_instance *cast, const struct xdpw_capture_target *target,
+		enum cursor_modes cursor_mode) {
 
 	// only run exec_before if there's no other instance running that already ran it
 	if (wl_list_empty(&ctx->screencast_instances)) {
@@ -59,19 +189,27 @@ void xdpw_screencast_instance_init(struct xdpw_screencast_context *ctx,
 	}
 
 	cast->ctx = ctx;
-	cast->target_output = out;
-	if (ctx->state->config->screencast_conf.max_fps > 0) {
-		cast->max_framerate = ctx->state->config->screencast_conf.max_fps < (uint32_t)out->framerate ?
-			ctx->state->config->screencast_conf.max_fps : (uint32_t)out->framerate;
-	} else {
-		cast->max_framerate = (uint32_t)out->framerate;
+	cast->target = *target;
+	cast->capture_backend = ctx->capture_backend;
+	cast->gbm = ctx->gbm;
+	if (target->with_region) {
+		// ext-image-copy-capture can't crop, the compositor copies only the region here
+		if (ctx->screencopy_manager) {
+			cast->capture_backend = &xdpw_wlr_screencopy_backend;
+		} else {
+			logprint(WARN, "xdpw: compositor can't capture regions, capturing the whole output");
+			cast->target = (struct xdpw_capture_target){ .output = target->output };
+		}
 	}
+	cast->max_framerate = capture_target_max_framerate(ctx, &cast->target);
 	cast->framerate = cast->max_framerate;
-	cast->with_cursor = with_cursor;
+	cast->cursor_mode = cursor_mode;
+	cast->with_cursor = cursor_mode == EMBEDDED;
 	cast->refcount = 1;
-	cast->node_id = SPA_ID_INVALID;
+	xdpw_stats_start(&cast->stats);
 	cast->need_buffer = false;
-	wl_list_init(&cast->buffer_list);
+	wl_list_init(&cast->stream_list);
+	wl_list_init(&cast->buffer_pools);
 	logprint(INFO, "xdpw: screencast instance %p has %d references", cast, cast->refcount);
 	wl_list_insert(&ctx->screencast_instances, &cast->link);
 	logprint(INFO, "xdpw: %d active screencast instances",
@@ -91,36 +229,77 @@ void xdpw_screencast_instance_destroy(struct xdpw_screencast_instance *cast) {
 		}
 	}
 
+	xdpw_stats_print(&cast->stats);
+
 	wl_list_remove(&cast->link);
-	xdpw_pwr_stream_destroy(cast);
-	assert(wl_list_length(&cast->buffer_list) == 0);
-	free(cast);
+	xdpw_timer_disarm(&cast->frame_timer);
+	xdpw_ext_cursor_session_finish(cast);
+	cast->capture_backend->session_finish(cast);
+	// the encoder consumes one of the streams
+	xdpw_encoder_destroy(cast->encoder);
+	struct xdpw_pwr_stream *pwr_stream, *tmp_s;
+	wl_list_for_each_safe(pwr_stream, tmp_s, &cast->stream_list, link) {
+		xdpw_pwr_stream_destroy(pwr_stream);
+	}
+	assert(wl_list_empty(&cast->buffer_pools));
+	struct xdpw_screencast_context *ctx = cast->ctx;
+	xdpw_pool_free(&instance_pool, cast);
+	xdpw_screencast_schedule_release(ctx);
 }
 
-bool setup_outputs(struct xdpw_screencast_context *ctx, struct xdpw_session *sess, bool with_cursor) {
+static bool screencast_is_idle(struct xdpw_screencast_context *ctx) {
+	return wl_list_empty(&ctx->state->xdpw_sessions) &&
+		wl_list_empty(&ctx->screencast_instances);
+}
 
-	struct xdpw_wlr_output *output, *tmp_o;
-	wl_list_for_each_reverse_safe(output, tmp_o, &ctx->output_list, link) {
-		logprint(INFO, "wlroots: capturable output: %s model: %s: id: %i name: %s",
-			output->make, output->model, output->id, output->name);
+static void screencast_release(void *data) {
+	struct xdpw_screencast_context *ctx = data;
+	if (!ctx->acquired || !screencast_is_idle(ctx)) {
+		return;
 	}
 
-	struct xdpw_wlr_output *out;
-	out = xdpw_wlr_output_chooser(ctx);
-	if (!out) {
-		logprint(ERROR, "wlroots: no output found");
-		return false;
+	logprint(DEBUG, "xdpw: no sessions, releasing pipewire and gbm");
+	xdpw_pwr_context_destroy(ctx->state);
+	xdpw_gbm_devices_finish(ctx);
+	// the cached buffers belong to the last streams
+	xdpw_shm_allocator_finish(&ctx->shm_allocator);
+	ctx->acquired = false;
+}
+
+void xdpw_screencast_schedule_release(struct xdpw_screencast_context *ctx) {
+	if (ctx->acquired && screencast_is_idle(ctx)) {
+		xdpw_timer_arm(ctx->state, &ctx->idle_timer, XDPW_IDLE_RELEASE_TIMEOUT_NS,
+			screencast_release, ctx);
+	}
+}
+
+// pipewire and gbm are set up with the first session, not at startup
+static int screencast_acquire(struct xdpw_screencast_context *ctx) {
+	xdpw_timer_disarm(&ctx->idle_timer);
+	if (ctx->acquired) {
+		return 0;
 	}
 
-	// Disable screencast sharing to avoid sharing between dmabuf and shm capable clients
-	/*
+	int ret = xdpw_pwr_context_create(ctx->state);
+	if (ret < 0) {
+		xdpw_pwr_context_destroy(ctx->state);
+		return ret;
+	}
+	xdpw_wlr_gbm_acquire(ctx);
+	ctx->acquired = true;
+	return 0;
+}
+
+static void setup_outputs(struct xdpw_screencast_context *ctx, struct xdpw_session *sess,
+		const struct xdpw_capture_target *target, enum cursor_modes cursor_mode) {
+	char desc[256];
 	struct xdpw_screencast_instance *cast, *tmp_c;
 	wl_list_for_each_reverse_safe(cast, tmp_c, &ctx->screencast_instances, link) {
-		logprint(INFO, "xdpw: existing screencast instance: %d %s cursor",
-			cast->target_output->id,
-			cast->with_cursor ? "with" : "without");
+		capture_target_describe(&cast->target, desc, sizeof(desc));
+		logprint(INFO, "xdpw: existing screencast instance: %s, cursor mode %x",
+			desc, cast->cursor_mode);
 
-		if (cast->target_output->id == out->id && cast->with_cursor == with_cursor) {
+		if (xdpw_capture_target_equal(&cast->target, target) && cast->cursor_mode == cursor_mode) {
 			if (cast->refcount == 0) {
 				logprint(DEBUG,
 					"xdpw: matching cast instance found, "
@@ -129,38 +308,239 @@ bool setup_outputs(struct xdpw_screencast_context *ctx, struct xdpw_session *ses
 			else {
 				sess->screencast_instance = cast;
 				++cast->refcount;
+				logprint(INFO, "xdpw: screencast instance %p now has %d references",
+					cast, cast->refcount);
+				break;
 			}
-			logprint(INFO, "xdpw: screencast instance %p now has %d references",
-				cast, cast->refcount);
 		}
 	}
-	*/
 
 	if (!sess->screencast_instance) {
-		sess->screencast_instance = calloc(1, sizeof(struct xdpw_screencast_instance));
+		sess->screencast_instance = xdpw_pool_alloc(&instance_pool);
 		xdpw_screencast_instance_init(ctx, sess->screencast_instance,
-			out, with_cursor);
+			target, cursor_mode);
 	}
-	logprint(INFO, "wlroots: output: %s",
-		sess->screencast_instance->target_output->name);
+	capture_target_describe(&sess->screencast_instance->target, desc, sizeof(desc));
+	logprint(INFO, "wlroots: source: %s", desc);
+}
 
-	return true;
+// a SelectSources call waiting for the output chooser
+struct select_sources_call {
+	struct xdpw_state *state;
+	sd_bus_message *msg;
+	char *session_handle;
+	enum cursor_modes cursor_mode;
+	enum persist_modes persist_mode;
+};
 
+// finds the source of restore_data we handed out in an earlier Start reply
+static int read_restore_data(sd_bus_message *msg, struct xdpw_screencast_context *ctx,
+		struct xdpw_capture_target *target) {
+	struct xdpw_restore_data data;
+	int ret = xdpw_restore_data_read(msg, &data);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	*target = (struct xdpw_capture_target){ 0 };
+	target->output = xdpw_wlr_output_find_restore(ctx, data.output, data.make, data.model);
+	if (target->output && data.with_region) {
+		// the output may have shrunk since
+		if (data.width <= 0 || data.height <= 0 || data.x < 0 || data.y < 0 ||
+				data.x + data.width > target->output->logical_width ||
+				data.y + data.height > target->output->logical_height) {
+			target->output = NULL;
+		} else {
+			target->with_region = true;
+			target->x = data.x;
+			target->y = data.y;
+			target->width = data.width;
+			target->height = data.height;
+		}
+	}
+	logprint(INFO, "dbus: restore data for output %s %s %s: %s",
+		data.output ? data.output : "", data.make ? data.make : "",
+		data.model ? data.model : "", target->output ? "found" : "not found");
+	return target->output ? 1 : 0;
+}
+
+static int append_restore_data(sd_bus_message *reply, const struct xdpw_capture_target *target) {
+	struct xdpw_restore_data data = {
+		.output = target->output->name,
+		.make = target->output->make,
+		.model = target->output->model,
+		.with_region = target->with_region,
+		.x = target->x,
+		.y = target->y,
+		.width = target->width,
+		.height = target->height,
+	};
+	return xdpw_restore_data_append(reply, &data);
+}
+
+static void select_sources_reply(sd_bus_message *msg, uint32_t response) {
+	sd_bus_message *reply = NULL;
+	int ret = sd_bus_message_new_method_return(msg, &reply);
+	if (ret >= 0) {
+		ret = sd_bus_message_append(reply, "ua{sv}", response, 0);
+	}
+	if (ret >= 0) {
+		ret = sd_bus_send(NULL, reply, NULL);
+	}
+	if (ret < 0) {
+		logprint(ERROR, "dbus: select sources: failed to send reply: %s", strerror(-ret));
+	}
+	sd_bus_message_unref(reply);
+}
+
+static void select_sources_output_chosen(const struct xdpw_capture_target *target, void *data) {
+	struct select_sources_call *call = data;
+	struct xdpw_state *state = call->state;
+
+	// the session may have been closed while the chooser was open
+	struct xdpw_session *match = xdpw_session_find(state, call->session_handle);
+
+	uint32_t response = PORTAL_RESPONSE_CANCELLED;
+	if (!match) {
+		logprint(DEBUG, "dbus: select sources: session %s is gone", call->session_handle);
+	} else if (!target) {
+		logprint(ERROR, "wlroots: no output found");
+	} else {
+		setup_outputs(&state->screencast, match, target, call->cursor_mode);
+		// windows come and go, only outputs can be restored
+		match->persist_mode = target->toplevel ? PERSIST_NONE : call->persist_mode;
+		response = PORTAL_RESPONSE_SUCCESS;
+	}
+
+	select_sources_reply(call->msg, response);
+	sd_bus_message_unref(call->msg);
+	free(call->session_handle);
+	free(call);
 }
 
 static int start_screencast(struct xdpw_screencast_instance *cast) {
-	xdpw_wlr_register_cb(cast);
+	// the first buffer constraints finish the setup, see xdpw_screencast_instance_ready
+	int ret = cast->capture_backend->session_init(cast);
+	if (ret < 0) {
+		return ret;
+	}
+	// the frames go out without the cursor either way
+	if (cast->cursor_mode == METADATA && xdpw_ext_cursor_session_init(cast) < 0) {
+		logprint(WARN, "xdpw: streaming without cursor metadata");
+	}
 
-	// process at least one frame so that we know
-	// some of the metadata required for the pipewire
-	// remote state connected event
-	wl_display_dispatch(cast->ctx->state->wl_display);
-	wl_display_roundtrip(cast->ctx->state->wl_display);
+	cast->session_started = true;
+	return 0;
+}
 
-	xdpw_pwr_stream_create(cast);
+static void screencast_start_reply(struct xdpw_session *sess, int error) {
+	struct xdpw_screencast_instance *cast = sess->screencast_instance;
+	sd_bus_message *msg = sess->start_msg;
+	sd_bus_message *reply = NULL;
+	sess->start_msg = NULL;
 
+	int ret = error;
+	if (ret < 0) {
+		goto out;
+	}
+	ret = sd_bus_message_new_method_return(msg, &reply);
+	if (ret < 0) {
+		goto out;
+	}
+
+	// position of the source in the layout, windows have none
+	int32_t x = 0, y = 0;
+	uint32_t source_type = cast->target.output ? MONITOR : WINDOW;
+	if (cast->target.output) {
+		x = cast->target.output->x + cast->target.x;
+		y = cast->target.output->y + cast->target.y;
+	}
+
+	logprint(DEBUG, "dbus: start: returning node %d", (int)sess->pwr_stream->node_id);
+	ret = sd_bus_message_append(reply, "u", PORTAL_RESPONSE_SUCCESS);
+	if (ret >= 0) {
+		ret = sd_bus_message_open_container(reply, 'a', "{sv}");
+	}
+	if (ret >= 0) {
+		ret = sd_bus_message_append(reply, "{sv}",
+			"streams", "a(ua{sv})", 1,
+			sess->pwr_stream->node_id, 3,
+			"position", "(ii)", x, y,
+			"size", "(ii)", cast->screencopy_frame_info[WL_SHM].width, cast->screencopy_frame_info[WL_SHM].height,
+			"source_type", "u", source_type);
+	}
+	if (ret >= 0 && sess->persist_mode != PERSIST_NONE && cast->target.output) {
+		ret = sd_bus_message_append(reply, "{sv}", "persist_mode", "u", sess->persist_mode);
+		if (ret >= 0) {
+			ret = append_restore_data(reply, &cast->target);
+		}
+	}
+	if (ret >= 0) {
+		ret = sd_bus_message_close_container(reply);
+	}
+	if (ret >= 0) {
+		ret = sd_bus_send(NULL, reply, NULL);
+	}
+
+out:
+	if (ret < 0) {
+		logprint(ERROR, "dbus: start: failed: %s", strerror(-ret));
+		sd_bus_reply_method_errno(msg, -ret, NULL);
+	}
+	sd_bus_message_unref(reply);
+	sd_bus_message_unref(msg);
+}
+
+static void screencast_start_stream(struct xdpw_session *sess) {
+	// every session gets its own pipewire stream fed by the shared capture
+	if (!sess->pwr_stream) {
+		sess->pwr_stream = xdpw_pwr_stream_create(sess->screencast_instance,
+			&sess->stream_policy);
+		if (!sess->pwr_stream) {
+			screencast_start_reply(sess, -ENOMEM);
+			return;
+		}
+	}
+	// otherwise answered by xdpw_screencast_stream_connected
+	if (sess->pwr_stream->node_id != SPA_ID_INVALID) {
+		screencast_start_reply(sess, 0);
+	}
+}
+
+void xdpw_screencast_instance_ready(struct xdpw_screencast_instance *cast) {
+	logprint(DEBUG, "xdpw: screencast instance %p received its buffer constraints", cast);
 	cast->initialized = true;
-	return 0;
+
+	struct config_screencast *conf = &cast->ctx->state->config->screencast_conf;
+	if (conf->encoder == XDPW_ENCODER_H264) {
+		if (cast->gbm) {
+			// the sessions just don't get an encoded stream if this fails
+			cast->encoder = xdpw_encoder_create(cast);
+		} else {
+			logprint(WARN, "xdpw: the encoder needs dma-bufs, not offering an encoded stream");
+		}
+	}
+
+	struct xdpw_session *sess, *tmp;
+	wl_list_for_each_safe(sess, tmp, &cast->ctx->state->xdpw_sessions, link) {
+		if (sess->screencast_instance == cast && sess->start_msg) {
+			screencast_start_stream(sess);
+		}
+	}
+}
+
+void xdpw_screencast_stream_connected(struct xdpw_pwr_stream *pwr_stream) {
+	struct xdpw_screencast_instance *cast = pwr_stream->cast;
+	if (cast->encoder) {
+		xdpw_encoder_stream_connected(cast->encoder, pwr_stream);
+	}
+
+	struct xdpw_session *sess, *tmp;
+	wl_list_for_each_safe(sess, tmp, &cast->ctx->state->xdpw_sessions, link) {
+		if (sess->pwr_stream == pwr_stream && sess->start_msg) {
+			screencast_start_reply(sess, 0);
+		}
+	}
 }
 
 static int method_screencast_create_session(sd_bus_message *msg, void *data,
@@ -217,6 +597,12 @@ static int method_screencast_create_session(sd_bus_message *msg, void *data,
 		return ret;
 	}
 
+	ret = screencast_acquire(&state->screencast);
+	if (ret < 0) {
+		logprint(ERROR, "xdpw: failed to set up pipewire");
+		return ret;
+	}
+
 	struct xdpw_request *req =
 		xdpw_request_create(sd_bus_message_get_bus(msg), request_handle);
 	if (req == NULL) {
@@ -244,6 +630,8 @@ static int method_screencast_create_session(sd_bus_message *msg, void *data,
 	}
 
 	sd_bus_message_unref(reply);
+	// answered right away, so there is nothing left to close
+	xdpw_request_destroy(req);
 	return 0;
 }
 
@@ -253,13 +641,17 @@ static int method_screencast_select_sources(sd_bus_message *msg, void *data,
 	struct xdpw_screencast_context *ctx = &state->screencast;
 
 	int ret = 0;
-	struct xdpw_session *sess, *tmp_s;
+	struct xdpw_session *sess;
 	sd_bus_message *reply = NULL;
 
 	logprint(INFO, "dbus: select sources method invoked");
 
 	// default to embedded cursor mode if not specified
-	bool cursor_embedded = true;
+	enum cursor_modes cursor_mode = EMBEDDED;
+	uint32_t types = MONITOR;
+	enum persist_modes persist_mode = PERSIST_NONE;
+	struct xdpw_capture_target restore_target = { 0 };
+	bool restored = false;
 
 	char *request_handle, *session_handle, *app_id;
 	ret = sd_bus_message_read(msg, "oos", &request_handle, &session_handle, &app_id);
@@ -290,22 +682,37 @@ static int method_screencast_select_sources(sd_bus_message *msg, void *data,
 		} else if (strcmp(key, "types") == 0) {
 			uint32_t mask;
 			sd_bus_message_read(msg, "v", "u", &mask);
-			if (mask & (1<<WINDOW)) {
-				logprint(INFO, "dbus: non-monitor cast requested, not replying");
-				return -1;
+			types = mask & state->screencast_source_types;
+			if (types == 0) {
+				logprint(WARN, "dbus: unsupported source types requested, offering monitors");
+				types = MONITOR;
 			}
 			logprint(INFO, "dbus: option types:%x", mask);
 		} else if (strcmp(key, "cursor_mode") == 0) {
-			uint32_t cursor_mode;
-			sd_bus_message_read(msg, "v", "u", &cursor_mode);
-			if (cursor_mode & HIDDEN) {
-				cursor_embedded = false;
+			uint32_t mode;
+			sd_bus_message_read(msg, "v", "u", &mode);
+			if (mode & HIDDEN) {
+				cursor_mode = HIDDEN;
+			}
+			if (mode & METADATA) {
+				if (!(state->screencast_cursor_modes & METADATA)) {
+					logprint(ERROR, "dbus: unsupported cursor mode requested, cancelling");
+					goto error;
+				}
+				cursor_mode = METADATA;
 			}
-			if (cursor_mode & METADATA) {
-				logprint(ERROR, "dbus: unsupported cursor mode requested, cancelling");
-				goto error;
+			logprint(INFO, "dbus: option cursor_mode:%x", mode);
+		} else if (strcmp(key, "persist_mode") == 0) {
+			uint32_t mode;
+			sd_bus_message_read(msg, "v", "u", &mode);
+			persist_mode = mode <= PERSIST_PERSISTENT ? mode : PERSIST_NONE;
+			logprint(INFO, "dbus: option persist_mode:%u", mode);
+		} else if (strcmp(key, "restore_data") == 0) {
+			innerRet = read_restore_data(msg, ctx, &restore_target);
+			if (innerRet < 0) {
+				return innerRet;
 			}
-			logprint(INFO, "dbus: option cursor_mode:%x", cursor_mode);
+			restored = innerRet > 0;
 		} else {
 			logprint(WARN, "dbus: unknown option %s", key);
 			sd_bus_message_skip(msg, "v");
@@ -324,39 +731,48 @@ static int method_screencast_select_sources(sd_bus_message *msg, void *data,
 		return ret;
 	}
 
-	bool output_selection_canceled = 1;
-	wl_list_for_each_reverse_safe(sess, tmp_s, &state->xdpw_sessions, link) {
-		if (strcmp(sess->session_handle, session_handle) == 0) {
-				logprint(DEBUG, "dbus: select sources: found matching session %s", sess->session_handle);
-				output_selection_canceled = !setup_outputs(ctx, sess, cursor_embedded);
-		}
+	struct xdpw_session *match = xdpw_session_find(state, session_handle);
+	if (!match) {
+		select_sources_reply(msg, PORTAL_RESPONSE_CANCELLED);
+		return 0;
 	}
 
-	ret = sd_bus_message_new_method_return(msg, &reply);
-	if (ret < 0) {
-		return ret;
+	struct xdpw_wlr_output *output, *tmp_o;
+	wl_list_for_each_reverse_safe(output, tmp_o, &ctx->output_list, link) {
+		logprint(INFO, "wlroots: capturable output: %s model: %s: id: %i name: %s",
+			output->make, output->model, output->id, output->name);
 	}
-	if (output_selection_canceled) {
-		ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_CANCELLED, 0);
-	} else {
-		ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_SUCCESS, 0);
+
+	struct select_sources_call *call = calloc(1, sizeof(*call));
+	if (call == NULL) {
+		return -ENOMEM;
 	}
-	if (ret < 0) {
-		return ret;
+	call->session_handle = strdup(session_handle);
+	if (call->session_handle == NULL) {
+		free(call);
+		return -ENOMEM;
 	}
-	ret = sd_bus_send(NULL, reply, NULL);
-	if (ret < 0) {
-		return ret;
+	call->state = state;
+	call->msg = sd_bus_message_ref(msg);
+	call->cursor_mode = cursor_mode;
+	call->persist_mode = persist_mode;
+
+	// the source was chosen before, don't ask again
+	if (restored && (types & MONITOR)) {
+		logprint(DEBUG, "dbus: select sources: restoring %s", restore_target.output->name);
+		select_sources_output_chosen(&restore_target, call);
+		return 0;
 	}
-	sd_bus_message_unref(reply);
+
+	// the reply is sent once an output is chosen, other streams keep running meanwhile
+	xdpw_wlr_output_chooser(ctx, types, select_sources_output_chosen, call);
 	return 0;
 
 error:
-	wl_list_for_each_reverse_safe(sess, tmp_s, &state->xdpw_sessions, link) {
-		if (strcmp(sess->session_handle, session_handle) == 0) {
-				logprint(DEBUG, "dbus: select sources error: destroying matching session %s", sess->session_handle);
-				xdpw_session_destroy(sess);
-		}
+	sess = xdpw_session_find(state, session_handle);
+	if (sess) {
+		logprint(DEBUG, "dbus: select sources error: destroying matching session %s", sess->session_handle);
+		xdpw_session_destroy(sess);
 	}
 
 	ret = sd_bus_message_new_method_return(msg, &reply);
@@ -421,52 +837,31 @@ static int method_screencast_start(sd_bus_message *msg, void *data,
 	}
 
 	struct xdpw_screencast_instance *cast = NULL;
-	struct xdpw_session *sess, *tmp_s;
-	wl_list_for_each_reverse_safe(sess, tmp_s, &state->xdpw_sessions, link) {
-		if (strcmp(sess->session_handle, session_handle) == 0) {
-				logprint(DEBUG, "dbus: start: found matching session %s", sess->session_handle);
-				cast = sess->screencast_instance;
-		}
+	struct xdpw_session *match = xdpw_session_find(state, session_handle);
+	if (match) {
+		logprint(DEBUG, "dbus: start: found matching session %s", match->session_handle);
+		cast = match->screencast_instance;
 	}
 	if (!cast) {
 		return -1;
 	}
-
-	if (!cast->initialized) {
-		start_screencast(cast);
+	if (match->start_msg) {
+		return -EBUSY;
 	}
 
-	while (cast->node_id == SPA_ID_INVALID) {
-		int ret = pw_loop_iterate(state->pw_loop, 0);
+	if (!cast->initialized && !cast->session_started) {
+		ret = start_screencast(cast);
 		if (ret < 0) {
-			logprint(ERROR, "pipewire_loop_iterate failed: %s", spa_strerror(ret));
 			return ret;
 		}
 	}
 
-	sd_bus_message *reply = NULL;
-	ret = sd_bus_message_new_method_return(msg, &reply);
-	if (ret < 0) {
-		return ret;
-	}
-
-	logprint(DEBUG, "dbus: start: returning node %d", (int)cast->node_id);
-	ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_SUCCESS, 1,
-		"streams", "a(ua{sv})", 1,
-		cast->node_id, 2,
-		"position", "(ii)", 0, 0,
-		"size", "(ii)", cast->screencopy_frame_info[WL_SHM].width, cast->screencopy_frame_info[WL_SHM].height);
-
-	if (ret < 0) {
-		return ret;
-	}
-
-	ret = sd_bus_send(NULL, reply, NULL);
-	if (ret < 0) {
-		return ret;
+	// the reply is sent once the stream has a node id, other sessions keep running meanwhile
+	match->start_msg = sd_bus_message_ref(msg);
+	xdpw_screencast_stream_policy(state, app_id, &match->stream_policy);
+	if (cast->initialized) {
+		screencast_start_stream(match);
 	}
-	sd_bus_message_unref(reply);
-
 	return 0;
 }
 
@@ -497,11 +892,6 @@ int xdpw_screencast_init(struct xdpw_state *state) {
 	state->screencast.state = state;
 
 	int err;
-	err = xdpw_pwr_context_create(state);
-	if (err) {
-		goto fail_pipewire;
-	}
-
 	err = xdpw_wlr_screencopy_init(state);
 	if (err) {
 		goto fail_screencopy;
@@ -513,8 +903,18 @@ int xdpw_screencast_init(struct xdpw_state *state) {
 fail_screencopy:
 	xdpw_wlr_screencopy_finish(&state->screencast);
 
-fail_pipewire:
-	xdpw_pwr_context_destroy(state);
-
 	return err;
 }
+
+// called at exit after the sessions are gone
+void xdpw_screencast_finish(struct xdpw_state *state) {
+	struct xdpw_screencast_context *ctx = &state->screencast;
+	// instances with a capture in flight outlive their last session
+	struct xdpw_screencast_instance *cast, *tmp;
+	wl_list_for_each_safe(cast, tmp, &ctx->screencast_instances, link) {
+		xdpw_screencast_instance_destroy(cast);
+	}
+	xdpw_timer_disarm(&ctx->idle_timer);
+	screencast_release(ctx);
+	xdpw_pool_finish(&instance_pool);
+}
@@ -1,10 +1,10 @@
 #include "xdpw.h"
 #include "screencast_common.h"
+#include "shm_allocator.h"
 #include <assert.h>
 #include <fcntl.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
+#include <sys/param.h>
 #include <unistd.h>
 #include <libdrm/drm_fourcc.h>
 #include <xf86drm.h>
@@ -41,15 +41,26 @@ static char *gbm_find_render_node() {
 	return render_node;
 }
 
-struct gbm_device *xdpw_gbm_device_create(void) {
-	struct gbm_device *gbm;
-	char *render_node = NULL;
-
-	render_node = gbm_find_render_node();
-	if (render_node == NULL) {
-		logprint(ERROR, "xdpw: Could not find render node");
+static char *gbm_render_node_for_device(dev_t device) {
+	drmDevice *dev;
+	if (drmGetDeviceFromDevId(device, 0, &dev) != 0) {
+		logprint(WARN, "xdpw: unable to get drm device from dev_t");
 		return NULL;
 	}
+
+	char *render_node = NULL;
+	if (dev->available_nodes & (1 << DRM_NODE_RENDER)) {
+		render_node = strdup(dev->nodes[DRM_NODE_RENDER]);
+	} else if (dev->available_nodes & (1 << DRM_NODE_PRIMARY)) {
+		// display only devices have no render node
+		render_node = strdup(dev->nodes[DRM_NODE_PRIMARY]);
+	}
+	drmFreeDevice(&dev);
+	return render_node;
+}
+
+static struct gbm_device *gbm_device_open(struct xdpw_screencast_context *ctx,
+		char *render_node) {
 	logprint(INFO, "xdpw: Using render node %s", render_node);
 
 	int fd = open(render_node, O_RDWR | O_CLOEXEC);
@@ -58,150 +69,323 @@ struct gbm_device *xdpw_gbm_device_create(void) {
 		free(render_node);
 		return NULL;
 	}
-
 	free(render_node);
-	gbm = gbm_create_device(fd);
-	return gbm;
-}
 
-static int anonymous_shm_open(void) {
-	char name[] = "/xdpw-shm-XXXXXX";
-	int retries = 100;
+	struct xdpw_gbm_device *device = calloc(1, sizeof(*device));
+	if (device == NULL) {
+		close(fd);
+		return NULL;
+	}
+	device->gbm = gbm_create_device(fd);
+	if (device->gbm == NULL) {
+		logprint(ERROR, "xdpw: Could not create gbm device");
+		close(fd);
+		free(device);
+		return NULL;
+	}
+	wl_list_insert(ctx->gbm_devices.prev, &device->link);
+	return device->gbm;
+}
 
-	do {
-		randname(name + strlen(name) - 6);
+struct gbm_device *xdpw_gbm_device_create(struct xdpw_screencast_context *ctx) {
+	char *render_node = gbm_find_render_node();
+	if (render_node == NULL) {
+		logprint(ERROR, "xdpw: Could not find render node");
+		return NULL;
+	}
+	return gbm_device_open(ctx, render_node);
+}
 
-		--retries;
-		// shm_open guarantees that O_CLOEXEC is set
-		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-		if (fd >= 0) {
-			shm_unlink(name);
-			return fd;
+struct gbm_device *xdpw_gbm_device_get(struct xdpw_screencast_context *ctx, dev_t device) {
+	struct xdpw_gbm_device *dev;
+	wl_list_for_each(dev, &ctx->gbm_devices, link) {
+		if (xdpw_gbm_device_matches(dev->gbm, device)) {
+			return dev->gbm;
 		}
-	} while (retries > 0 && errno == EEXIST);
+	}
 
-	return -1;
+	char *render_node = gbm_render_node_for_device(device);
+	if (render_node == NULL) {
+		logprint(ERROR, "xdpw: Could not find render node of device %lu", (unsigned long)device);
+		return NULL;
+	}
+	return gbm_device_open(ctx, render_node);
 }
 
-static struct wl_buffer *import_wl_shm_buffer(struct xdpw_screencast_instance *cast, int fd,
-		enum wl_shm_format fmt, int width, int height, int stride) {
-	struct xdpw_screencast_context *ctx = cast->ctx;
-	int size = stride * height;
+void xdpw_gbm_devices_finish(struct xdpw_screencast_context *ctx) {
+	struct xdpw_gbm_device *dev, *tmp;
+	wl_list_for_each_safe(dev, tmp, &ctx->gbm_devices, link) {
+		int fd = gbm_device_get_fd(dev->gbm);
+		gbm_device_destroy(dev->gbm);
+		close(fd);
+		wl_list_remove(&dev->link);
+		free(dev);
+	}
+	ctx->gbm = NULL;
+}
 
-	if (fd < 0) {
-		return NULL;
+bool xdpw_gbm_device_matches(struct gbm_device *gbm, dev_t device) {
+	drmDevice *gbm_dev, *dev;
+
+	// dev_t values can't be compared directly, the compositor might
+	// announce the primary node while we are using the render node
+	if (drmGetDevice2(gbm_device_get_fd(gbm), 0, &gbm_dev) != 0) {
+		logprint(WARN, "xdpw: unable to get drm device of gbm device");
+		return false;
+	}
+	if (drmGetDeviceFromDevId(device, 0, &dev) != 0) {
+		logprint(WARN, "xdpw: unable to get drm device from dev_t");
+		drmFreeDevice(&gbm_dev);
+		return false;
+	}
+
+	bool match = drmDevicesEqual(gbm_dev, dev);
+	drmFreeDevice(&dev);
+	drmFreeDevice(&gbm_dev);
+	return match;
+}
+
+static uint64_t buffer_memory(const struct xdpw_buffer *buffer) {
+	uint64_t size = sizeof(*buffer);
+	if (buffer->buffer_type == WL_SHM) {
+		return size + buffer->alloc_size;
 	}
+	// the planes of the supported formats are all as high as the buffer
+	for (int plane = 0; plane < buffer->plane_count; plane++) {
+		size += (uint64_t)buffer->stride[plane] * buffer->height;
+	}
+	return size;
+}
 
-	struct wl_shm_pool *pool = wl_shm_create_pool(ctx->shm, fd, size);
-	struct wl_buffer *buffer =
-		wl_shm_pool_create_buffer(pool, 0, width, height, stride, fmt);
-	wl_shm_pool_destroy(pool);
+uint64_t xdpw_screencast_instance_memory(struct xdpw_screencast_instance *cast) {
+	uint64_t size = sizeof(*cast);
+	struct xdpw_buffer_pool *pool;
+	wl_list_for_each(pool, &cast->buffer_pools, link) {
+		size += sizeof(*pool);
+		for (uint32_t i = 0; i < XDPW_PWR_BUFFERS_MAX; i++) {
+			if (pool->buffers[i]) {
+				size += buffer_memory(pool->buffers[i]);
+			}
+		}
+	}
+	if (cast->cursor.buffer) {
+		size += buffer_memory(cast->cursor.buffer);
+	}
+	return size;
+}
 
-	return buffer;
+bool xdpw_drm_devices_match(dev_t a, dev_t b) {
+	if (a == b) {
+		return true;
+	}
+
+	drmDevice *dev_a, *dev_b;
+	if (drmGetDeviceFromDevId(a, 0, &dev_a) != 0) {
+		logprint(WARN, "xdpw: unable to get drm device from dev_t");
+		return false;
+	}
+	if (drmGetDeviceFromDevId(b, 0, &dev_b) != 0) {
+		logprint(WARN, "xdpw: unable to get drm device from dev_t");
+		drmFreeDevice(&dev_a);
+		return false;
+	}
+
+	bool match = drmDevicesEqual(dev_a, dev_b);
+	drmFreeDevice(&dev_b);
+	drmFreeDevice(&dev_a);
+	return match;
 }
 
-struct xdpw_buffer *xdpw_buffer_create(struct xdpw_screencast_instance *cast,
-		enum buffer_type buffer_type, struct xdpw_screencopy_frame_info *frame_info) {
+struct xdpw_buffer *xdpw_buffer_create(struct xdpw_buffer_pool *pool,
+		struct xdpw_screencopy_frame_info *frame_info) {
+	struct xdpw_screencast_instance *cast = pool->cast;
+	if (pool->buffer_type == WL_SHM) {
+		return xdpw_shm_buffer_acquire(cast->ctx, frame_info, pool);
+	}
+
 	struct xdpw_buffer *buffer = calloc(1, sizeof(struct xdpw_buffer));
+	if (buffer == NULL) {
+		logprint(ERROR, "xdpw: failed to allocate buffer");
+		return NULL;
+	}
+	buffer->ctx = cast->ctx;
 	buffer->width = frame_info->width;
 	buffer->height = frame_info->height;
 	buffer->format = frame_info->format;
-	buffer->buffer_type = buffer_type;
-
-	switch (buffer_type) {
-	case WL_SHM:
-		buffer->size = frame_info->size;
-		buffer->stride = frame_info->stride;
-		buffer->offset = 0;
-		buffer->fd = anonymous_shm_open();
-		if (buffer->fd == -1) {
-			logprint(ERROR, "xdpw: unable to create anonymous filedescriptor");
-			free(buffer);
-			return NULL;
-		}
-
-		if (ftruncate(buffer->fd, buffer->size) < 0) {
-			logprint(ERROR, "xdpw: unable to truncate filedescriptor");
-			close(buffer->fd);
-			free(buffer);
-			return NULL;
-		}
-
-		buffer->buffer = import_wl_shm_buffer(cast, buffer->fd, xdpw_format_wl_shm_from_drm_fourcc(frame_info->format),
-				frame_info->width, frame_info->height, frame_info->stride);
-		if (buffer->buffer == NULL) {
-			logprint(ERROR, "xdpw: unable to create wl_buffer");
-			close(buffer->fd);
-			free(buffer);
-			return NULL;
-		}
-		break;
-	case DMABUF:;
-		uint32_t flags = GBM_BO_USE_RENDERING;
+	buffer->buffer_type = DMABUF;
+
+	uint32_t flags = GBM_BO_USE_RENDERING;
+	uint64_t modifier = pool->modifier;
+	if (modifier != DRM_FORMAT_MOD_INVALID) {
+		buffer->bo = gbm_bo_create_with_modifiers(cast->gbm,
+			frame_info->width, frame_info->height, frame_info->format,
+			&modifier, 1);
+	} else {
 		if (cast->ctx->state->config->screencast_conf.force_mod_linear) {
 			flags |= GBM_BO_USE_LINEAR;
 		}
+		buffer->bo = gbm_bo_create(cast->gbm, frame_info->width, frame_info->height,
+			frame_info->format, flags);
+	}
 
-		buffer->bo = gbm_bo_create(cast->ctx->gbm, frame_info->width, frame_info->height,
-				frame_info->format, flags);
-		if (buffer->bo == NULL) {
-			logprint(ERROR, "xdpw: failed to create gbm_bo");
-			free(buffer);
-			return NULL;
-		}
+	// Fallback for linear buffers via the implicit api
+	if (buffer->bo == NULL && modifier == DRM_FORMAT_MOD_LINEAR) {
+		buffer->bo = gbm_bo_create(cast->gbm, frame_info->width, frame_info->height,
+			frame_info->format, flags | GBM_BO_USE_LINEAR);
+	}
 
-		struct zwp_linux_buffer_params_v1 *params;
-		params = zwp_linux_dmabuf_v1_create_params(cast->ctx->linux_dmabuf);
-		if (!params) {
-			logprint(ERROR, "xdpw: failed to create linux_buffer_params");
-			gbm_bo_destroy(buffer->bo);
-			free(buffer);
-			return NULL;
-		}
+	if (buffer->bo == NULL) {
+		logprint(ERROR, "xdpw: failed to create gbm_bo");
+		free(buffer);
+		return NULL;
+	}
+	buffer->plane_count = gbm_bo_get_plane_count(buffer->bo);
 
-		buffer->size = 0;
-		buffer->stride = gbm_bo_get_stride(buffer->bo);
-		buffer->offset = gbm_bo_get_offset(buffer->bo, 0);
-		uint64_t mod = gbm_bo_get_modifier(buffer->bo);
-		buffer->fd = gbm_bo_get_fd(buffer->bo);
+	struct zwp_linux_buffer_params_v1 *params;
+	params = zwp_linux_dmabuf_v1_create_params(cast->ctx->linux_dmabuf);
+	if (!params) {
+		logprint(ERROR, "xdpw: failed to create linux_buffer_params");
+		gbm_bo_destroy(buffer->bo);
+		free(buffer);
+		return NULL;
+	}
 
-		if (buffer->fd < 0) {
+	uint64_t mod = gbm_bo_get_modifier(buffer->bo);
+	for (int plane = 0; plane < buffer->plane_count; plane++) {
+		buffer->size[plane] = 0;
+		buffer->stride[plane] = gbm_bo_get_stride_for_plane(buffer->bo, plane);
+		buffer->offset[plane] = gbm_bo_get_offset(buffer->bo, plane);
+		buffer->fd[plane] = gbm_bo_get_fd_for_plane(buffer->bo, plane);
+
+		if (buffer->fd[plane] < 0) {
 			logprint(ERROR, "xdpw: failed to get file descriptor");
 			zwp_linux_buffer_params_v1_destroy(params);
 			gbm_bo_destroy(buffer->bo);
+			for (int plane_tmp = 0; plane_tmp < plane; plane_tmp++) {
+				close(buffer->fd[plane_tmp]);
+			}
 			free(buffer);
 			return NULL;
 		}
 
-		zwp_linux_buffer_params_v1_add(params, buffer->fd, 0, buffer->offset, buffer->stride,
-			mod >> 32, mod & 0xffffffff);
-		buffer->buffer = zwp_linux_buffer_params_v1_create_immed(params,
-			buffer->width, buffer->height,
-			buffer->format, /* flags */ 0);
-		zwp_linux_buffer_params_v1_destroy(params);
+		zwp_linux_buffer_params_v1_add(params, buffer->fd[plane], plane,
+			buffer->offset[plane], buffer->stride[plane], mod >> 32, mod & 0xffffffff);
+	}
+
+	buffer->buffer = zwp_linux_buffer_params_v1_create_immed(params,
+		buffer->width, buffer->height,
+		buffer->format, /* flags */ 0);
+	zwp_linux_buffer_params_v1_destroy(params);
 
-		if (!buffer->buffer) {
-			logprint(ERROR, "xdpw: failed to create buffer");
-			gbm_bo_destroy(buffer->bo);
-			close(buffer->fd);
-			free(buffer);
-			return NULL;
+	if (!buffer->buffer) {
+		logprint(ERROR, "xdpw: failed to create buffer");
+		gbm_bo_destroy(buffer->bo);
+		for (int plane = 0; plane < buffer->plane_count; plane++) {
+			close(buffer->fd[plane]);
 		}
+		free(buffer);
+		return NULL;
 	}
 
 	return buffer;
 }
 
 void xdpw_buffer_destroy(struct xdpw_buffer *buffer) {
+	if (buffer->buffer_type == WL_SHM) {
+		xdpw_shm_buffer_release(buffer);
+		return;
+	}
+
 	wl_buffer_destroy(buffer->buffer);
-	if (buffer->buffer_type == DMABUF) {
-		gbm_bo_destroy(buffer->bo);
+	gbm_bo_destroy(buffer->bo);
+	for (int plane = 0; plane < buffer->plane_count; plane++) {
+		close(buffer->fd[plane]);
 	}
-	close(buffer->fd);
-	wl_list_remove(&buffer->link);
 	free(buffer);
 }
 
+bool xdpw_capture_target_equal(const struct xdpw_capture_target *a,
+		const struct xdpw_capture_target *b) {
+	if (a->output != b->output || a->toplevel != b->toplevel ||
+			a->with_region != b->with_region) {
+		return false;
+	}
+	return !a->with_region || (a->x == b->x && a->y == b->y &&
+		a->width == b->width && a->height == b->height);
+}
+
+static bool damage_contains(const struct xdpw_frame_damage *outer,
+		const struct xdpw_frame_damage *inner) {
+	return inner->x >= outer->x && inner->y >= outer->y &&
+		inner->x + inner->width <= outer->x + outer->width &&
+		inner->y + inner->height <= outer->y + outer->height;
+}
+
+static void damage_union(struct xdpw_frame_damage *dst, const struct xdpw_frame_damage *src) {
+	uint32_t x1 = MIN(dst->x, src->x);
+	uint32_t y1 = MIN(dst->y, src->y);
+	uint32_t x2 = MAX(dst->x + dst->width, src->x + src->width);
+	uint32_t y2 = MAX(dst->y + dst->height, src->y + src->height);
+	dst->x = x1;
+	dst->y = y1;
+	dst->width = x2 - x1;
+	dst->height = y2 - y1;
+}
+
+void xdpw_damage_list_bounds(const struct xdpw_damage_list *list,
+		struct xdpw_frame_damage *bounds) {
+	assert(list->count > 0);
+	*bounds = list->regions[0];
+	for (uint32_t i = 1; i < list->count; i++) {
+		damage_union(bounds, &list->regions[i]);
+	}
+}
+
+void xdpw_damage_list_add(struct xdpw_damage_list *list, const struct xdpw_frame_damage *damage) {
+	if (damage->width == 0 || damage->height == 0) {
+		return;
+	}
+
+	uint32_t i = 0;
+	while (i < list->count) {
+		if (damage_contains(&list->regions[i], damage)) {
+			return;
+		}
+		// drop regions covered by the new one
+		if (damage_contains(damage, &list->regions[i])) {
+			list->regions[i] = list->regions[--list->count];
+			continue;
+		}
+		i++;
+	}
+
+	if (list->count < XDPW_DAMAGE_REGIONS_MAX) {
+		list->regions[list->count++] = *damage;
+		return;
+	}
+
+	// out of regions, collapse everything into the bounding box
+	struct xdpw_frame_damage bounds;
+	xdpw_damage_list_bounds(list, &bounds);
+	damage_union(&bounds, damage);
+	list->regions[0] = bounds;
+	list->count = 1;
+}
+
+void xdpw_damage_list_merge(struct xdpw_damage_list *dst, const struct xdpw_damage_list *src) {
+	for (uint32_t i = 0; i < src->count; i++) {
+		xdpw_damage_list_add(dst, &src->regions[i]);
+	}
+}
+
+uint64_t xdpw_damage_list_area(const struct xdpw_damage_list *list) {
+	uint64_t area = 0;
+	for (uint32_t i = 0; i < list->count; i++) {
+		area += (uint64_t)list->regions[i].width * list->regions[i].height;
+	}
+	return area;
+}
+
 enum wl_shm_format xdpw_format_wl_shm_from_drm_fourcc(uint32_t format) {
 	switch (format) {
 	case DRM_FORMAT_ARGB8888:
@@ -326,6 +510,30 @@ enum spa_video_format xdpw_format_pw_strip_alpha(enum spa_video_format format) {
 	}
 }
 
+// the 8 bit rgb format with red and blue exchanged
+enum spa_video_format xdpw_format_pw_swap_rb(enum spa_video_format format) {
+	switch (format) {
+	case SPA_VIDEO_FORMAT_BGRA:
+		return SPA_VIDEO_FORMAT_RGBA;
+	case SPA_VIDEO_FORMAT_RGBA:
+		return SPA_VIDEO_FORMAT_BGRA;
+	case SPA_VIDEO_FORMAT_BGRx:
+		return SPA_VIDEO_FORMAT_RGBx;
+	case SPA_VIDEO_FORMAT_RGBx:
+		return SPA_VIDEO_FORMAT_BGRx;
+	case SPA_VIDEO_FORMAT_ARGB:
+		return SPA_VIDEO_FORMAT_ABGR;
+	case SPA_VIDEO_FORMAT_ABGR:
+		return SPA_VIDEO_FORMAT_ARGB;
+	case SPA_VIDEO_FORMAT_xRGB:
+		return SPA_VIDEO_FORMAT_xBGR;
+	case SPA_VIDEO_FORMAT_xBGR:
+		return SPA_VIDEO_FORMAT_xRGB;
+	default:
+		return SPA_VIDEO_FORMAT_UNKNOWN;
+	}
+}
+
 enum xdpw_chooser_types get_chooser_type(const char *chooser_type) {
 	if (!chooser_type || strcmp(chooser_type, "default") == 0) {
 		return XDPW_CHOOSER_DEFAULT;
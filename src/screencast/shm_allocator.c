@@ -0,0 +1,227 @@
+#define _GNU_SOURCE 1
+#include "shm_allocator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+static int anonymous_shm_open(void) {
+	char name[] = "/xdpw-shm-XXXXXX";
+	int retries = 100;
+
+	do {
+		randname(name + strlen(name) - 6);
+
+		--retries;
+		// shm_open guarantees that O_CLOEXEC is set
+		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+		if (fd >= 0) {
+			shm_unlink(name);
+			return fd;
+		}
+	} while (retries > 0 && errno == EEXIST);
+
+	return -1;
+}
+
+static int shm_memfd_create(unsigned int flags) {
+#ifdef MFD_CLOEXEC
+	int fd = memfd_create("xdpw-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+	if (fd < 0 && errno == EINVAL) {
+		// hugetlb memfds can't be sealed before linux 4.16
+		fd = memfd_create("xdpw-shm", MFD_CLOEXEC | flags);
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+static int shm_buffer_map(struct xdpw_buffer *buffer, int fd, size_t size) {
+	if (ftruncate(fd, size) < 0) {
+		return -1;
+	}
+
+#ifdef F_SEAL_SEAL
+	// consumers must not be able to shrink the buffer under the compositor
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+		logprint(TRACE, "xdpw: unable to seal shm buffer");
+	}
+#endif
+
+	// fault in the whole buffer now instead of on the first copy
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+
+	buffer->fd[0] = fd;
+	buffer->data = data;
+	buffer->alloc_size = size;
+	return 0;
+}
+
+static int shm_buffer_alloc(struct xdpw_shm_allocator *alloc,
+		struct xdpw_buffer *buffer) {
+	size_t size = buffer->size[0];
+	int fd;
+
+#ifdef MFD_HUGETLB
+	if (!alloc->hugetlb_failed) {
+		size_t huge_size = (size + XDPW_SHM_HUGEPAGE_SIZE - 1) &
+			~(size_t)(XDPW_SHM_HUGEPAGE_SIZE - 1);
+		fd = shm_memfd_create(MFD_HUGETLB);
+		if (fd >= 0 && shm_buffer_map(buffer, fd, huge_size) == 0) {
+			return 0;
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+		// no hugepages reserved, don't try again for every buffer
+		logprint(DEBUG, "xdpw: hugetlb shm unavailable, using regular pages");
+		alloc->hugetlb_failed = true;
+	}
+#endif
+
+	fd = shm_memfd_create(0);
+	if (fd < 0) {
+		fd = anonymous_shm_open();
+	}
+	if (fd < 0) {
+		logprint(ERROR, "xdpw: unable to create anonymous filedescriptor");
+		return -1;
+	}
+	if (shm_buffer_map(buffer, fd, size) < 0) {
+		logprint(ERROR, "xdpw: unable to allocate shm buffer");
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+static struct xdpw_buffer *shm_buffer_create(struct xdpw_screencast_context *ctx,
+		struct xdpw_screencopy_frame_info *frame_info, struct xdpw_buffer_pool *pool) {
+	struct xdpw_buffer *buffer = calloc(1, sizeof(struct xdpw_buffer));
+	if (buffer == NULL) {
+		logprint(ERROR, "xdpw: failed to allocate shm buffer");
+		return NULL;
+	}
+	buffer->ctx = ctx;
+	buffer->pool = pool;
+	buffer->buffer_type = WL_SHM;
+	buffer->width = frame_info->width;
+	buffer->height = frame_info->height;
+	buffer->format = frame_info->format;
+	buffer->plane_count = 1;
+	buffer->size[0] = frame_info->size;
+	buffer->stride[0] = frame_info->stride;
+	buffer->offset[0] = 0;
+
+	if (shm_buffer_alloc(&ctx->shm_allocator, buffer) < 0) {
+		free(buffer);
+		return NULL;
+	}
+
+	struct wl_shm_pool *shm_pool = wl_shm_create_pool(ctx->shm, buffer->fd[0], buffer->alloc_size);
+	buffer->buffer = wl_shm_pool_create_buffer(shm_pool, 0, buffer->width, buffer->height,
+		buffer->stride[0], xdpw_format_wl_shm_from_drm_fourcc(buffer->format));
+	wl_shm_pool_destroy(shm_pool);
+	if (buffer->buffer == NULL) {
+		logprint(ERROR, "xdpw: unable to create wl_buffer");
+		munmap(buffer->data, buffer->alloc_size);
+		close(buffer->fd[0]);
+		free(buffer);
+		return NULL;
+	}
+
+	return buffer;
+}
+
+static void shm_buffer_destroy(struct xdpw_buffer *buffer) {
+	wl_buffer_destroy(buffer->buffer);
+	munmap(buffer->data, buffer->alloc_size);
+	close(buffer->fd[0]);
+	free(buffer);
+}
+
+void xdpw_shm_allocator_init(struct xdpw_shm_allocator *alloc) {
+	wl_list_init(&alloc->cache);
+	alloc->cached_size = 0;
+	alloc->hugetlb_failed = false;
+}
+
+void xdpw_shm_allocator_finish(struct xdpw_shm_allocator *alloc) {
+	struct xdpw_buffer *buffer, *tmp;
+	wl_list_for_each_safe(buffer, tmp, &alloc->cache, link) {
+		wl_list_remove(&buffer->link);
+		shm_buffer_destroy(buffer);
+	}
+	alloc->cached_size = 0;
+}
+
+void xdpw_shm_allocator_drop(struct xdpw_shm_allocator *alloc,
+		struct xdpw_buffer_pool *pool) {
+	struct xdpw_buffer *buffer, *tmp;
+	wl_list_for_each_safe(buffer, tmp, &alloc->cache, link) {
+		if (buffer->pool == pool) {
+			wl_list_remove(&buffer->link);
+			alloc->cached_size -= buffer->alloc_size;
+			shm_buffer_destroy(buffer);
+		}
+	}
+}
+
+struct xdpw_buffer *xdpw_shm_buffer_acquire(struct xdpw_screencast_context *ctx,
+		struct xdpw_screencopy_frame_info *frame_info, struct xdpw_buffer_pool *pool) {
+	struct xdpw_shm_allocator *alloc = &ctx->shm_allocator;
+
+	struct xdpw_buffer *buffer;
+	wl_list_for_each(buffer, &alloc->cache, link) {
+		if (buffer->pool == pool &&
+				buffer->width == frame_info->width &&
+				buffer->height == frame_info->height &&
+				buffer->stride[0] == frame_info->stride &&
+				buffer->format == frame_info->format) {
+			wl_list_remove(&buffer->link);
+			alloc->cached_size -= buffer->alloc_size;
+			buffer->dequeue_time = (struct timespec){ 0 };
+			buffer->queue_time = (struct timespec){ 0 };
+			logprint(TRACE, "xdpw: reusing shm buffer %dx%d", buffer->width, buffer->height);
+			return buffer;
+		}
+	}
+
+	return shm_buffer_create(ctx, frame_info, pool);
+}
+
+void xdpw_shm_buffer_release(struct xdpw_buffer *buffer) {
+	struct xdpw_screencast_context *ctx = buffer->ctx;
+	struct xdpw_shm_allocator *alloc = &ctx->shm_allocator;
+
+	// the wl_shm global is gone when shutting down
+	if (!ctx->shm) {
+		shm_buffer_destroy(buffer);
+		return;
+	}
+
+	wl_list_insert(&alloc->cache, &buffer->link);
+	alloc->cached_size += buffer->alloc_size;
+
+	// evict the least recently used buffers
+	while (alloc->cached_size > XDPW_SHM_CACHE_MAX_SIZE) {
+		struct xdpw_buffer *oldest = wl_container_of(alloc->cache.prev, oldest, link);
+		wl_list_remove(&oldest->link);
+		alloc->cached_size -= oldest->alloc_size;
+		shm_buffer_destroy(oldest);
+	}
+}
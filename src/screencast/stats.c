@@ -0,0 +1,132 @@
+#include "stats.h"
+
+#include <sys/resource.h>
+
+#include "logger.h"
+#include "timespec_util.h"
+
+#define SUB_BUCKETS (1 << XDPW_HISTOGRAM_SUB_BITS)
+#define VALUE_MAX (UINT64_C(1) << 32)
+
+static size_t histogram_bucket(uint64_t value) {
+	if (value >= VALUE_MAX) {
+		value = VALUE_MAX - 1;
+	}
+	if (value < SUB_BUCKETS) {
+		return value;
+	}
+	// the leading bit selects the octave, the next bits the linear step within it
+	int exponent = 63 - __builtin_clzll(value);
+	int shift = exponent - XDPW_HISTOGRAM_SUB_BITS;
+	return (exponent - XDPW_HISTOGRAM_SUB_BITS + 1) * SUB_BUCKETS +
+		((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t xdpw_histogram_bucket_max(size_t index) {
+	if (index < SUB_BUCKETS) {
+		return index;
+	}
+	int shift = index / SUB_BUCKETS - 1;
+	uint64_t min = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+	return min + (UINT64_C(1) << shift) - 1;
+}
+
+void xdpw_histogram_record(struct xdpw_histogram *histogram, uint64_t value) {
+	histogram->buckets[histogram_bucket(value)]++;
+	histogram->count++;
+	if (value > histogram->max) {
+		histogram->max = value;
+	}
+}
+
+uint64_t xdpw_histogram_percentile(const struct xdpw_histogram *histogram, double percentile) {
+	if (histogram->count == 0) {
+		return 0;
+	}
+
+	double exact_rank = histogram->count * percentile / 100.0;
+	uint64_t rank = exact_rank;
+	if (rank < exact_rank || rank == 0) {
+		rank++;
+	}
+	uint64_t seen = 0;
+	for (size_t i = 0; i < XDPW_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= rank) {
+			uint64_t value = xdpw_histogram_bucket_max(i);
+			return value < histogram->max ? value : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+void xdpw_stats_record_since(struct xdpw_histogram *histogram, struct timespec *since) {
+	if (timespec_is_zero(since)) {
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t elapsed_ns = timespec_diff_ns(&now, since);
+	if (elapsed_ns >= 0) {
+		xdpw_histogram_record(histogram, elapsed_ns / 1000);
+	}
+	*since = (struct timespec){ 0 };
+}
+
+static uint64_t stats_cpu_time(struct rusage *usage) {
+	return (uint64_t)(usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000 +
+		usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+}
+
+void xdpw_stats_start(struct xdpw_screencast_stats *stats) {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		stats->start_cpu_time = stats_cpu_time(&usage);
+	}
+}
+
+void xdpw_stats_frame(struct xdpw_screencast_stats *stats) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	stats->frames++;
+	if (timespec_is_zero(&stats->first_frame_time)) {
+		stats->first_frame_time = now;
+	} else {
+		xdpw_histogram_record(&stats->frame_interval,
+			timespec_diff_ns(&now, &stats->last_frame_time) / 1000);
+	}
+	stats->last_frame_time = now;
+}
+
+static void stats_print_histogram(const char *name, const struct xdpw_histogram *histogram) {
+	logprint(INFO, "stats: %s: %lu samples, p50 %lu us, p99 %lu us, max %lu us", name,
+		histogram->count, xdpw_histogram_percentile(histogram, 50),
+		xdpw_histogram_percentile(histogram, 99), histogram->max);
+}
+
+void xdpw_stats_print(struct xdpw_screencast_stats *stats) {
+	logprint(INFO, "stats: %lu frames, %lu dropped, %lu failed, %lu renegotiations, "
+		"%lu out of buffers, %lu idle", stats->frames, stats->dropped_frames, stats->failed_frames,
+		stats->renegotiations, stats->out_of_buffers, stats->idle_frames);
+	stats_print_histogram("capture latency", &stats->capture_latency);
+	stats_print_histogram("queue latency", &stats->queue_latency);
+	stats_print_histogram("timer wait", &stats->timer_wait);
+	stats_print_histogram("frame interval", &stats->frame_interval);
+
+	int64_t elapsed_ns = timespec_diff_ns(&stats->last_frame_time, &stats->first_frame_time);
+	if (stats->frames > 1 && elapsed_ns > 0) {
+		logprint(INFO, "stats: %.2f fps over %.1f s", (stats->frames - 1) * 1e9 / elapsed_ns,
+			elapsed_ns / 1e9);
+	}
+
+	// cpu time and rss are counted for the whole process
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		uint64_t cpu_time = stats_cpu_time(&usage) - stats->start_cpu_time;
+		logprint(INFO, "stats: process cpu time %lu ms, %.1f%% of the stream, max rss %ld KiB",
+			cpu_time / 1000, elapsed_ns > 0 ? cpu_time * 1e5 / elapsed_ns : 0.0,
+			usage.ru_maxrss);
+	}
+}
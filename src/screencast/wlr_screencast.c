@@ -1,11 +1,15 @@
 #include "wlr_screencast.h"
 
+#include "ext-foreign-toplevel-list-v1-client-protocol.h"
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -14,24 +18,73 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <assert.h>
+#include <libdrm/drm_fourcc.h>
 #include <wayland-client-protocol.h>
 
+#include "child.h"
 #include "screencast.h"
+#include "ext_image_copy.h"
+#include "shm_allocator.h"
 #include "pipewire_screencast.h"
 #include "xdpw.h"
 #include "logger.h"
 #include "fps_limit.h"
+#include "hash.h"
+#include "timespec_util.h"
 
-void wlr_frame_free(struct xdpw_screencast_instance *cast) {
+static void wlr_frame_free(struct xdpw_screencast_instance *cast) {
+	if (!cast->wlr_frame) {
+		return;
+	}
 	zwlr_screencopy_frame_v1_destroy(cast->wlr_frame);
 	cast->wlr_frame = NULL;
 	logprint(TRACE, "wlroots: frame destroyed");
 }
 
+static void wlr_frame_pending_free(struct xdpw_screencast_instance *cast) {
+	if (!cast->wlr_frame_pending) {
+		return;
+	}
+	zwlr_screencopy_frame_v1_destroy(cast->wlr_frame_pending);
+	cast->wlr_frame_pending = NULL;
+	cast->wlr_frame_pending_done = false;
+	logprint(TRACE, "wlroots: pending frame destroyed");
+}
+
+static struct zwlr_screencopy_frame_v1 *wlr_capture_output(
+		struct xdpw_screencast_instance *cast);
+
+static bool wlr_frame_info_compatible(struct xdpw_screencast_instance *cast) {
+	struct xdpw_pwr_stream *pwr_stream;
+	wl_list_for_each(pwr_stream, &cast->stream_list, link) {
+		if (!pwr_stream->pwr_stream_state) {
+			continue;
+		}
+		struct xdpw_screencopy_frame_info *frame_info =
+			&cast->screencopy_frame_info[pwr_stream->buffer_type];
+		enum spa_video_format format = xdpw_format_pw_from_drm_fourcc(frame_info->format);
+		if (pwr_stream->pool && pwr_stream->pool->swap_rb) {
+			format = xdpw_format_pw_swap_rb(format);
+		}
+		if ((pwr_stream->pwr_format.format != format &&
+				pwr_stream->pwr_format.format != xdpw_format_pw_strip_alpha(format)) ||
+				pwr_stream->pwr_format.size.width != frame_info->width ||
+				pwr_stream->pwr_format.size.height != frame_info->height) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool wlr_frame_is_idle(struct xdpw_screencast_instance *cast, struct timespec *now) {
+	return cast->idle_fps < cast->framerate &&
+		fps_limit_is_idle(&cast->last_change, now, cast->idle_frames, cast->framerate);
+}
+
 void xdpw_wlr_frame_finish(struct xdpw_screencast_instance *cast) {
 	logprint(TRACE, "wlroots: finish screencopy");
 
-	wlr_frame_free(cast);
+	cast->capture_backend->frame_free(cast);
 
 	if (cast->quit || cast->err) {
 		// TODO: revisit the exit condition (remove quit?)
@@ -41,20 +94,73 @@ void xdpw_wlr_frame_finish(struct xdpw_screencast_instance *cast) {
 		return;
 	}
 
-	if (!cast->pwr_stream_state) {
+	if (!xdpw_pwr_is_streaming(cast)) {
 		cast->frame_state = XDPW_FRAME_STATE_NONE;
 		return;
 	}
 
+	// the buffer is no longer written to, a renegotiation also
+	// offers the new framerate
 	if (cast->frame_state == XDPW_FRAME_STATE_RENEG) {
 		pwr_update_stream_param(cast);
+		cast->framerate_update_pending = false;
+	} else if (cast->framerate_update_pending) {
+		pwr_update_stream_framerate(cast);
+		cast->framerate_update_pending = false;
+	}
+
+	if (cast->frame_state == XDPW_FRAME_STATE_FAILED) {
+		cast->stats.failed_frames++;
 	}
 
 	if (cast->frame_state == XDPW_FRAME_STATE_SUCCESS) {
-		xdpw_pwr_swap_buffer(cast);
-		uint64_t delay_ns = fps_limit_measure_end(&cast->fps_limit, cast->framerate);
+		xdpw_stats_frame(&cast->stats);
+		xdpw_stats_record_since(&cast->stats.capture_latency, &cast->stats.request_time);
+
+		struct xdpw_buffer_pool *pool = cast->current_frame.pool;
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		// compositors hold back captures until there is damage, so frames
+		// without any are rare, small damage like a blinking cursor is
+		// what keeps a static screen busy
+		int idle_damage = cast->ctx->state->config->screencast_conf.idle_damage;
+		if (timespec_is_zero(&cast->last_change) || (pool &&
+				xdpw_damage_list_area(&pool->damage) > (uint64_t)idle_damage)) {
+			cast->last_change = now;
+		}
+
+		if (pool && pool->damage.count == 0) {
+			// consumers already have this content, keep the buffer for the next capture
+			logprint(TRACE, "wlroots: frame without damage, skipping");
+		} else {
+			xdpw_pwr_swap_buffer(cast);
+			// capture the next buffer pool right away until the cycle is complete
+			uint32_t pool_count = xdpw_pwr_pool_count(cast);
+			if (pool_count > 1 && cast->pool_cycle % pool_count != 0) {
+				xdpw_wlr_frame_start(cast);
+				return;
+			}
+		}
+		fps_limit_frame_presented(&cast->fps_limit,
+			cast->current_frame.tv_sec, cast->current_frame.tv_nsec);
+		// windows aren't tied to the refresh cycle of a single output
+		float refresh = cast->target.output ? cast->target.output->framerate : 0;
+		double framerate = cast->framerate;
+		bool idle = wlr_frame_is_idle(cast, &now);
+		if (idle != cast->throttled) {
+			logprint(DEBUG, "wlroots: %s, capturing at %f fps",
+				idle ? "screen is static" : "screen changed",
+				idle ? cast->idle_fps : cast->framerate);
+			cast->throttled = idle;
+		}
+		if (idle) {
+			framerate = cast->idle_fps;
+			cast->stats.idle_frames++;
+		}
+		uint64_t delay_ns = fps_limit_measure_end(&cast->fps_limit, framerate, refresh);
 		if (delay_ns > 0) {
-			xdpw_add_timer(cast->ctx->state, delay_ns,
+			clock_gettime(CLOCK_MONOTONIC, &cast->stats.timer_armed_time);
+			xdpw_timer_arm(cast->ctx->state, &cast->frame_timer, delay_ns,
 				(xdpw_event_loop_timer_func_t) xdpw_wlr_frame_start, cast);
 			return;
 		}
@@ -69,13 +175,61 @@ void xdpw_wlr_frame_start(struct xdpw_screencast_instance *cast) {
 		return;
 	}
 
-	if (cast->initialized && !cast->pwr_stream_state) {
+	if (cast->initialized && !xdpw_pwr_is_streaming(cast)) {
 		cast->frame_state = XDPW_FRAME_STATE_NONE;
 		return;
 	}
 
+	xdpw_stats_record_since(&cast->stats.timer_wait, &cast->stats.timer_armed_time);
+
 	cast->frame_state = XDPW_FRAME_STATE_STARTED;
-	xdpw_wlr_register_cb(cast);
+	cast->current_frame.damage.count = 0;
+	cast->current_frame.tv_sec = 0;
+	cast->current_frame.tv_nsec = 0;
+	clock_gettime(CLOCK_MONOTONIC, &cast->stats.request_time);
+	cast->capture_backend->frame_start(cast);
+}
+
+bool xdpw_wlr_frame_prepare_buffer(struct xdpw_screencast_instance *cast) {
+	// Check if announced screencopy information is compatible with pipewire meta
+	if (!wlr_frame_info_compatible(cast)) {
+		logprint(DEBUG, "wlroots: pipewire and wlroots metadata are incompatible. Renegotiate stream");
+		cast->frame_state = XDPW_FRAME_STATE_RENEG;
+		cast->stats.dropped_frames++;
+		return false;
+	}
+
+	if (!cast->current_frame.xdpw_buffer) {
+		xdpw_pwr_dequeue_buffer(cast);
+	}
+
+	cast->need_buffer = false;
+	if (!cast->current_frame.xdpw_buffer) {
+		logprint(WARN, "wlroots: no current buffer");
+		cast->stats.dropped_frames++;
+		return false;
+	}
+
+	assert(cast->current_frame.xdpw_buffer);
+
+	// Check if dequeued buffer is compatible with announced buffer
+	struct xdpw_buffer *buffer = cast->current_frame.xdpw_buffer;
+	struct xdpw_screencopy_frame_info *frame_info = &cast->screencopy_frame_info[buffer->buffer_type];
+	if (( buffer->buffer_type == WL_SHM &&
+				(buffer->size[0] != frame_info->size ||
+				buffer->stride[0] != frame_info->stride)) ||
+			buffer->width != frame_info->width ||
+			buffer->height != frame_info->height) {
+		logprint(DEBUG, "wlroots: pipewire buffer has wrong dimensions");
+		cast->frame_state = XDPW_FRAME_STATE_FAILED;
+		return false;
+	}
+
+	uint32_t pool_count = xdpw_pwr_pool_count(cast);
+	if (pool_count <= 1 || cast->pool_cycle % pool_count == 0) {
+		fps_limit_measure_start(&cast->fps_limit, cast->framerate);
+	}
+	return true;
 }
 
 static void wlr_frame_buffer_done(void *data,
@@ -86,7 +240,6 @@ static void wlr_frame_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame,
 	struct xdpw_screencast_instance *cast = data;
 
 	logprint(TRACE, "wlroots: buffer event handler");
-	cast->wlr_frame = frame;
 
 	cast->screencopy_frame_info[WL_SHM].width = width;
 	cast->screencopy_frame_info[WL_SHM].height = height;
@@ -117,43 +270,19 @@ static void wlr_frame_buffer_done(void *data,
 
 	logprint(TRACE, "wlroots: buffer_done event handler");
 
-	if (!cast->initialized) {
-		xdpw_wlr_frame_finish(cast);
+	if (frame == cast->wlr_frame_pending) {
+		// the copy is requested once the previous frame is done
+		cast->wlr_frame_pending_done = true;
 		return;
 	}
 
-	// Check if announced screencopy information is compatible with pipewire meta
-	if ((cast->pwr_format.format != xdpw_format_pw_from_drm_fourcc(cast->screencopy_frame_info[cast->buffer_type].format) &&
-			cast->pwr_format.format != xdpw_format_pw_strip_alpha(xdpw_format_pw_from_drm_fourcc(cast->screencopy_frame_info[cast->buffer_type].format))) ||
-			cast->pwr_format.size.width != cast->screencopy_frame_info[cast->buffer_type].width ||
-			cast->pwr_format.size.height != cast->screencopy_frame_info[cast->buffer_type].height) {
-		logprint(DEBUG, "wlroots: pipewire and wlroots metadata are incompatible. Renegotiate stream");
-		cast->frame_state = XDPW_FRAME_STATE_RENEG;
-		xdpw_wlr_frame_finish(cast);
-		return;
-	}
-
-	if (!cast->current_frame.xdpw_buffer) {
-		xdpw_pwr_dequeue_buffer(cast);
-	}
-
-	cast->need_buffer = false;
-	if (!cast->current_frame.xdpw_buffer) {
-		logprint(WARN, "wlroots: no current buffer");
+	if (!cast->initialized) {
+		xdpw_screencast_instance_ready(cast);
 		xdpw_wlr_frame_finish(cast);
 		return;
 	}
 
-	assert(cast->current_frame.xdpw_buffer);
-
-	// Check if dequeued buffer is compatible with announced buffer
-	if (( cast->buffer_type == WL_SHM &&
-				(cast->current_frame.xdpw_buffer->size != cast->screencopy_frame_info[cast->buffer_type].size ||
-				cast->current_frame.xdpw_buffer->stride != cast->screencopy_frame_info[cast->buffer_type].stride)) ||
-			cast->current_frame.xdpw_buffer->width != cast->screencopy_frame_info[cast->buffer_type].width ||
-			cast->current_frame.xdpw_buffer->height != cast->screencopy_frame_info[cast->buffer_type].height) {
-		logprint(DEBUG, "wlroots: pipewire buffer has wrong dimensions");
-		cast->frame_state = XDPW_FRAME_STATE_FAILED;
+	if (!xdpw_wlr_frame_prepare_buffer(cast)) {
 		xdpw_wlr_frame_finish(cast);
 		return;
 	}
@@ -161,7 +290,12 @@ static void wlr_frame_buffer_done(void *data,
 	zwlr_screencopy_frame_v1_copy_with_damage(frame, cast->current_frame.xdpw_buffer->buffer);
 	logprint(TRACE, "wlroots: frame copied");
 
-	fps_limit_measure_start(&cast->fps_limit, cast->framerate);
+	// get the buffer constraints of the next frame out of the way
+	// while this one is copied
+	if (!cast->wlr_frame_pending) {
+		cast->wlr_frame_pending = wlr_capture_output(cast);
+		cast->wlr_frame_pending_done = false;
+	}
 }
 
 static void wlr_frame_flags(void *data, struct zwlr_screencopy_frame_v1 *frame,
@@ -178,10 +312,13 @@ static void wlr_frame_damage(void *data, struct zwlr_screencopy_frame_v1 *frame,
 
 	logprint(TRACE, "wlroots: damage event handler");
 
-	cast->current_frame.damage.x = x;
-	cast->current_frame.damage.y = y;
-	cast->current_frame.damage.width = width;
-	cast->current_frame.damage.height = height;
+	struct xdpw_frame_damage damage = {
+		.x = x,
+		.y = y,
+		.width = width,
+		.height = height,
+	};
+	xdpw_damage_list_add(&cast->current_frame.damage, &damage);
 }
 
 static void wlr_frame_ready(void *data, struct zwlr_screencopy_frame_v1 *frame,
@@ -192,6 +329,9 @@ static void wlr_frame_ready(void *data, struct zwlr_screencopy_frame_v1 *frame,
 
 	cast->current_frame.tv_sec = ((((uint64_t)tv_sec_hi) << 32) | tv_sec_lo);
 	cast->current_frame.tv_nsec = tv_nsec;
+	logprint(TRACE, "wlroots: frame has %u damage regions", cast->current_frame.damage.count);
+
+	xdpw_pwr_add_damage(cast, &cast->current_frame.damage);
 
 	cast->frame_state = XDPW_FRAME_STATE_SUCCESS;
 
@@ -204,6 +344,11 @@ static void wlr_frame_failed(void *data,
 
 	logprint(TRACE, "wlroots: failed event handler");
 
+	if (frame == cast->wlr_frame_pending) {
+		wlr_frame_pending_free(cast);
+		return;
+	}
+
 	cast->frame_state = XDPW_FRAME_STATE_FAILED;
 
 	xdpw_wlr_frame_finish(cast);
@@ -219,33 +364,128 @@ static const struct zwlr_screencopy_frame_v1_listener wlr_frame_listener = {
 	.damage = wlr_frame_damage,
 };
 
-void xdpw_wlr_register_cb(struct xdpw_screencast_instance *cast) {
-	cast->frame_callback = zwlr_screencopy_manager_v1_capture_output(
-		cast->ctx->screencopy_manager, cast->with_cursor, cast->target_output->output);
+static struct zwlr_screencopy_frame_v1 *wlr_capture_output(
+		struct xdpw_screencast_instance *cast) {
+	struct xdpw_capture_target *target = &cast->target;
+	struct zwlr_screencopy_frame_v1 *frame;
+	if (target->with_region) {
+		// the compositor announces buffers at the size of the region
+		frame = zwlr_screencopy_manager_v1_capture_output_region(cast->ctx->screencopy_manager,
+			cast->with_cursor, target->output->output,
+			target->x, target->y, target->width, target->height);
+	} else {
+		frame = zwlr_screencopy_manager_v1_capture_output(cast->ctx->screencopy_manager,
+			cast->with_cursor, target->output->output);
+	}
 
-	zwlr_screencopy_frame_v1_add_listener(cast->frame_callback,
-		&wlr_frame_listener, cast);
+	zwlr_screencopy_frame_v1_add_listener(frame, &wlr_frame_listener, cast);
 	logprint(TRACE, "wlroots: callbacks registered");
+	return frame;
+}
+
+static void wlr_register_cb(struct xdpw_screencast_instance *cast) {
+	assert(!cast->wlr_frame);
+
+	if (!cast->wlr_frame_pending) {
+		cast->wlr_frame = cast->frame_callback = wlr_capture_output(cast);
+		return;
+	}
+
+	// continue with the frame requested during the last copy
+	cast->wlr_frame = cast->frame_callback = cast->wlr_frame_pending;
+	cast->wlr_frame_pending = NULL;
+	if (cast->wlr_frame_pending_done) {
+		cast->wlr_frame_pending_done = false;
+		wlr_frame_buffer_done(cast, cast->wlr_frame);
+	}
+}
+
+static int wlr_session_init(struct xdpw_screencast_instance *cast) {
+	// capture a first frame to learn the buffer constraints
+	wlr_register_cb(cast);
+	return 0;
 }
 
+static void wlr_session_finish(struct xdpw_screencast_instance *cast) {
+	wlr_frame_pending_free(cast);
+	wlr_frame_free(cast);
+}
+
+const struct xdpw_capture_backend xdpw_wlr_screencopy_backend = {
+	.name = "wlr-screencopy",
+	.session_init = wlr_session_init,
+	.session_finish = wlr_session_finish,
+	.frame_start = wlr_register_cb,
+	.frame_free = wlr_frame_free,
+};
+
 static void wlr_output_handle_geometry(void *data, struct wl_output *wl_output,
 		int32_t x, int32_t y, int32_t phys_width, int32_t phys_height,
 		int32_t subpixel, const char *make, const char *model, int32_t transform) {
 	struct xdpw_wlr_output *output = data;
+	free(output->make);
+	free(output->model);
 	output->make = strdup(make);
 	output->model = strdup(model);
+	output->transform = transform;
+}
+
+static struct wl_list *wlr_output_name_bucket(struct xdpw_screencast_context *ctx,
+		const char *name) {
+	return &ctx->outputs_by_name[xdpw_hash_str(name) % XDPW_OUTPUT_BUCKETS];
+}
+
+// makes the state received since the last done event visible
+static void wlr_output_commit(struct xdpw_wlr_output *output) {
+	struct xdpw_screencast_context *ctx = output->ctx;
+
+	// the name comes with the xdg_output, which may be created later
+	if (!output->name) {
+		return;
+	}
+	if (wl_list_empty(&output->name_link)) {
+		wl_list_insert(wlr_output_name_bucket(ctx, output->name), &output->name_link);
+	}
+	if (!output->ready) {
+		output->framerate = output->pending_framerate;
+		output->ready = true;
+		logprint(DEBUG, "wlroots: output %s is ready", output->name);
+		return;
+	}
+
+	if (output->framerate == output->pending_framerate) {
+		return;
+	}
+	output->framerate = output->pending_framerate;
+	logprint(DEBUG, "wlroots: output %s refresh rate changed to %f",
+		output->name, output->framerate);
+	// windows follow the fastest output
+	struct xdpw_screencast_instance *cast;
+	wl_list_for_each(cast, &ctx->screencast_instances, link) {
+		if (cast->target.output == output || !cast->target.output) {
+			xdpw_screencast_instance_update_framerate(cast);
+		}
+	}
 }
 
 static void wlr_output_handle_mode(void *data, struct wl_output *wl_output,
 		uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
-	if (flags & WL_OUTPUT_MODE_CURRENT) {
-		struct xdpw_wlr_output *output = data;
-		output->framerate = (float)refresh/1000;
+	if (!(flags & WL_OUTPUT_MODE_CURRENT)) {
+		return;
+	}
+	struct xdpw_wlr_output *output = data;
+	output->pending_framerate = (float)refresh/1000;
+	// version 1 has no done event
+	if (wl_output_get_version(wl_output) < WL_OUTPUT_DONE_SINCE_VERSION) {
+		wlr_output_commit(output);
 	}
 }
 
 static void wlr_output_handle_done(void *data, struct wl_output *wl_output) {
-	/* Nothing to do */
+	struct xdpw_wlr_output *output = data;
+
+	// xdg_output v3 sends its events before this done event
+	wlr_output_commit(output);
 }
 
 static void wlr_output_handle_scale(void *data, struct wl_output *wl_output,
@@ -264,16 +504,39 @@ static void wlr_xdg_output_name(void *data, struct zxdg_output_v1 *xdg_output,
 		const char *name) {
 	struct xdpw_wlr_output *output = data;
 
+	// reindexed on the next commit
+	wl_list_remove(&output->name_link);
+	wl_list_init(&output->name_link);
+	free(output->name);
 	output->name = strdup(name);
+	if (wl_output_get_version(output->output) < WL_OUTPUT_DONE_SINCE_VERSION) {
+		wlr_output_commit(output);
+	}
 };
 
+static void wlr_xdg_output_logical_position(void *data,
+		struct zxdg_output_v1 *xdg_output, int32_t x, int32_t y) {
+	struct xdpw_wlr_output *output = data;
+
+	output->x = x;
+	output->y = y;
+}
+
+static void wlr_xdg_output_logical_size(void *data,
+		struct zxdg_output_v1 *xdg_output, int32_t width, int32_t height) {
+	struct xdpw_wlr_output *output = data;
+
+	output->logical_width = width;
+	output->logical_height = height;
+}
+
 static void noop() {
 	// This space intentionally left blank
 }
 
 static const struct zxdg_output_v1_listener wlr_xdg_output_listener = {
-	.logical_position = noop,
-	.logical_size = noop,
+	.logical_position = wlr_xdg_output_logical_position,
+	.logical_size = wlr_xdg_output_logical_size,
 	.done = NULL, /* Deprecated */
 	.description = noop,
 	.name = wlr_xdg_output_name,
@@ -304,235 +567,725 @@ static void wlr_init_xdg_outputs(struct xdpw_screencast_context *ctx) {
 	}
 }
 
-static pid_t spawn_chooser(char *cmd, int chooser_in[2], int chooser_out[2]) {
-	logprint(TRACE,
-			"exec chooser called: cmd %s, pipe chooser_in (%d,%d), pipe chooser_out (%d,%d)",
-			cmd, chooser_in[0], chooser_in[1], chooser_out[0], chooser_out[1]);
-	pid_t pid = fork();
+static char *wlr_toplevel_strdup(const char *str) {
+	// the dmenu choosers read one entry per line
+	char *dup = strdup(str);
+	for (char *p = dup; p && *p; p++) {
+		if (*p == '\n') {
+			*p = ' ';
+		}
+	}
+	return dup;
+}
+
+static void wlr_toplevel_destroy(struct xdpw_toplevel *toplevel) {
+	ext_foreign_toplevel_handle_v1_destroy(toplevel->handle);
+	wl_list_remove(&toplevel->link);
+	free(toplevel->title);
+	free(toplevel->app_id);
+	free(toplevel);
+}
+
+static void wlr_toplevel_handle_closed(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle) {
+	struct xdpw_toplevel *toplevel = data;
+
+	logprint(DEBUG, "wlroots: toplevel %s closed", toplevel->app_id);
+	// the capture session of the window is stopped by the compositor
+	struct xdpw_screencast_instance *cast;
+	wl_list_for_each(cast, &toplevel->ctx->screencast_instances, link) {
+		if (cast->target.toplevel == toplevel) {
+			cast->target.toplevel = NULL;
+		}
+	}
+	wlr_toplevel_destroy(toplevel);
+}
+
+static void wlr_toplevel_handle_title(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle, const char *title) {
+	struct xdpw_toplevel *toplevel = data;
+
+	free(toplevel->title);
+	toplevel->title = wlr_toplevel_strdup(title);
+}
+
+static void wlr_toplevel_handle_app_id(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle, const char *app_id) {
+	struct xdpw_toplevel *toplevel = data;
 
-	if (pid < 0) {
-		perror("fork");
-		return pid;
-	} else if (pid == 0) {
-		close(chooser_in[1]);
-		close(chooser_out[0]);
+	free(toplevel->app_id);
+	toplevel->app_id = wlr_toplevel_strdup(app_id);
+}
 
-		dup2(chooser_in[0], STDIN_FILENO);
-		dup2(chooser_out[1], STDOUT_FILENO);
-		close(chooser_in[0]);
-		close(chooser_out[1]);
+static const struct ext_foreign_toplevel_handle_v1_listener wlr_toplevel_listener = {
+	.closed = wlr_toplevel_handle_closed,
+	.done = noop,
+	.title = wlr_toplevel_handle_title,
+	.app_id = wlr_toplevel_handle_app_id,
+	.identifier = noop,
+};
 
-		execl("/bin/sh", "/bin/sh", "-c", cmd, NULL);
+static void wlr_toplevel_list_handle_toplevel(void *data,
+		struct ext_foreign_toplevel_list_v1 *list,
+		struct ext_foreign_toplevel_handle_v1 *handle) {
+	struct xdpw_screencast_context *ctx = data;
 
-		perror("execl");
-		_exit(127);
+	struct xdpw_toplevel *toplevel = calloc(1, sizeof(*toplevel));
+	if (toplevel == NULL) {
+		logprint(ERROR, "wlroots: failed to allocate toplevel");
+		ext_foreign_toplevel_handle_v1_destroy(handle);
+		return;
 	}
+	toplevel->ctx = ctx;
+	toplevel->handle = handle;
+	ext_foreign_toplevel_handle_v1_add_listener(handle, &wlr_toplevel_listener, toplevel);
+	wl_list_insert(ctx->toplevel_list.prev, &toplevel->link);
+}
 
-	close(chooser_in[0]);
-	close(chooser_out[1]);
+static void wlr_toplevel_list_handle_finished(void *data,
+		struct ext_foreign_toplevel_list_v1 *list) {
+	struct xdpw_screencast_context *ctx = data;
 
-	return pid;
+	logprint(DEBUG, "wlroots: toplevel list finished");
+	ext_foreign_toplevel_list_v1_destroy(ctx->foreign_toplevel_list);
+	ctx->foreign_toplevel_list = NULL;
 }
 
-static bool wait_chooser(pid_t pid) {
-	int status;
-	if (waitpid(pid ,&status, 0) != -1 && WIFEXITED(status)) {
-		return WEXITSTATUS(status) != 127;
+static const struct ext_foreign_toplevel_list_v1_listener wlr_toplevel_list_listener = {
+	.toplevel = wlr_toplevel_list_handle_toplevel,
+	.finished = wlr_toplevel_list_handle_finished,
+};
+
+// the line a window is listed with in the dmenu choosers
+static void wlr_toplevel_label(struct xdpw_toplevel *toplevel, char *label, size_t size) {
+	snprintf(label, size, "Window: %s - %s",
+		toplevel->app_id ? toplevel->app_id : "",
+		toplevel->title ? toplevel->title : "");
+}
+
+static struct xdpw_toplevel *wlr_toplevel_find_by_label(struct xdpw_screencast_context *ctx,
+		const char *label) {
+	char buf[XDPW_CHILD_OUTPUT_MAX];
+	struct xdpw_toplevel *toplevel;
+	wl_list_for_each(toplevel, &ctx->toplevel_list, link) {
+		wlr_toplevel_label(toplevel, buf, sizeof(buf));
+		if (strcmp(buf, label) == 0) {
+			return toplevel;
+		}
 	}
-	return false;
+	return NULL;
 }
 
-static bool wlr_output_chooser(struct xdpw_output_chooser *chooser,
-		struct wl_list *output_list, struct xdpw_wlr_output **output) {
-	logprint(DEBUG, "wlroots: output chooser called");
-	struct xdpw_wlr_output *out;
-	size_t name_size = 0;
-	char *name = NULL;
-	*output = NULL;
+struct wlr_chooser_run {
+	struct xdpw_screencast_context *ctx;
+	struct xdpw_output_chooser chooser;
+	// bitmask of enum source_types
+	uint32_t types;
+	// the default choosers are tried in turn until one exists
+	bool is_default;
+	size_t default_index;
+
+	xdpw_wlr_output_chooser_func_t func;
+	void *data;
+};
+
+static const struct xdpw_output_chooser default_chooser[] = {
+	{XDPW_CHOOSER_SIMPLE, "slurp -f '%o %x,%y %wx%h' -o"},
+	{XDPW_CHOOSER_DMENU, "wofi -d -n --prompt='Select the source to share:'"},
+	{XDPW_CHOOSER_DMENU, "bemenu --prompt='Select the source to share:'"},
+};
 
-	int chooser_in[2]; //p -> c
-	int chooser_out[2]; //c -> p
+static bool wlr_chooser_run_spawn(struct wlr_chooser_run *run);
 
-	if (pipe(chooser_in) == -1) {
-		perror("pipe chooser_in");
-		logprint(ERROR, "Failed to open pipe chooser_in");
-		goto error_chooser_in;
+// whether the program a command starts is in PATH, checked without forking a shell
+static bool wlr_chooser_cmd_exists(const char *cmd) {
+	char prog[PATH_MAX];
+	size_t len = strcspn(cmd, " \t");
+	if (len == 0 || len >= sizeof(prog)) {
+		return false;
 	}
-	if (pipe(chooser_out) == -1) {
-		perror("pipe chooser_out");
-		logprint(ERROR, "Failed to open pipe chooser_out");
-		goto error_chooser_out;
+	memcpy(prog, cmd, len);
+	prog[len] = '\0';
+	if (strchr(prog, '/')) {
+		return access(prog, X_OK) == 0;
 	}
 
-	pid_t pid = spawn_chooser(chooser->cmd, chooser_in, chooser_out);
-	if (pid < 0) {
-		logprint(ERROR, "Failed to fork chooser");
-		goto error_fork;
+	const char *path = getenv("PATH");
+	if (!path) {
+		path = "/usr/local/bin:/usr/bin:/bin";
 	}
+	while (*path) {
+		size_t dir_len = strcspn(path, ":");
+		char file[PATH_MAX];
+		int n = dir_len == 0 ? snprintf(file, sizeof(file), "./%s", prog) :
+			snprintf(file, sizeof(file), "%.*s/%s", (int)dir_len, path, prog);
+		if (n > 0 && (size_t)n < sizeof(file) && access(file, X_OK) == 0) {
+			return true;
+		}
+		path += dir_len;
+		if (*path == ':') {
+			path++;
+		}
+	}
+	return false;
+}
 
-	switch (chooser->type) {
-	case XDPW_CHOOSER_DMENU:;
-		FILE *f = fdopen(chooser_in[1], "w");
-		if (f == NULL) {
-			perror("fdopen pipe chooser_in");
-			logprint(ERROR, "Failed to create stream writing to pipe chooser_in");
-			goto error_fork;
+// looked up once, a chooser that is installed later is found after a restart
+static void wlr_chooser_probe_defaults(struct xdpw_screencast_context *ctx) {
+	if (ctx->default_choosers_probed) {
+		return;
+	}
+	for (size_t i = 0; i < sizeof(default_chooser) / sizeof(default_chooser[0]); i++) {
+		if (!wlr_chooser_cmd_exists(default_chooser[i].cmd)) {
+			logprint(DEBUG, "wlroots: output chooser %s not found", default_chooser[i].cmd);
+			ctx->default_choosers_missing |= 1u << i;
 		}
-		wl_list_for_each(out, output_list, link) {
-			fprintf(f, "%s\n", out->name);
+	}
+	ctx->default_choosers_probed = true;
+}
+
+static void wlr_chooser_run_done(struct wlr_chooser_run *run,
+		struct xdpw_capture_target *target) {
+	if (target != NULL && target->toplevel != NULL) {
+		logprint(DEBUG, "wlroots: output chooser selects window %s", target->toplevel->app_id);
+	} else if (target != NULL) {
+		logprint(DEBUG, "wlroots: output chooser selects %s", target->output->name);
+	}
+	run->func(target, run->data);
+	free(run);
+}
+
+static void wlr_chooser_run_output(struct wlr_chooser_run *run,
+		struct xdpw_wlr_output *output) {
+	if (output == NULL || !(run->types & MONITOR)) {
+		wlr_chooser_run_done(run, NULL);
+		return;
+	}
+	struct xdpw_capture_target target = { .output = output };
+	wlr_chooser_run_done(run, &target);
+}
+
+static void wlr_chooser_run_next(struct wlr_chooser_run *run) {
+	while (run->is_default && run->default_index < sizeof(default_chooser) / sizeof(default_chooser[0])) {
+		if (run->ctx->default_choosers_missing & (1u << run->default_index)) {
+			run->default_index++;
+			continue;
 		}
-		fclose(f);
-		break;
-	default:
-		close(chooser_in[1]);
+		run->chooser = default_chooser[run->default_index++];
+		// slurp can't list windows
+		if ((run->types & WINDOW) && run->chooser.type == XDPW_CHOOSER_SIMPLE) {
+			continue;
+		}
+		if (wlr_chooser_run_spawn(run)) {
+			return;
+		}
+		logprint(DEBUG, "wlroots: output chooser %s not found. Trying next one.",
+				run->chooser.cmd);
 	}
 
-	if (!wait_chooser(pid)) {
-		close(chooser_out[0]);
+	if (run->is_default) {
+		wlr_chooser_run_output(run, xdpw_wlr_output_first(run->ctx));
+	} else {
+		logprint(ERROR, "wlroots: output chooser %s failed", run->chooser.cmd);
+		wlr_chooser_run_done(run, NULL);
+	}
+}
+
+bool xdpw_wlr_parse_selection(const char *line, struct xdpw_chooser_selection *sel) {
+	*sel = (struct xdpw_chooser_selection){ 0 };
+	int n = sscanf(line, "%255s %d,%d %dx%d", sel->name,
+		&sel->x, &sel->y, &sel->width, &sel->height);
+	if (n != 1 && n != 5) {
 		return false;
 	}
+	sel->with_region = n == 5;
+	return true;
+}
 
-	FILE *f = fdopen(chooser_out[0], "r");
-	if (f == NULL) {
-		perror("fdopen pipe chooser_out");
-		logprint(ERROR, "Failed to create stream reading from pipe chooser_out");
-		close(chooser_out[0]);
-		goto end;
+bool xdpw_wlr_target_clip_region(struct xdpw_capture_target *target,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	struct xdpw_wlr_output *out = target->output;
+	int32_t x1 = MAX(x, out->x);
+	int32_t y1 = MAX(y, out->y);
+	int32_t x2 = MIN(x + width, out->x + out->logical_width);
+	int32_t y2 = MIN(y + height, out->y + out->logical_height);
+	if (x2 <= x1 || y2 <= y1) {
+		return false;
+	}
+	if (x1 == out->x && y1 == out->y &&
+			x2 - x1 == out->logical_width && y2 - y1 == out->logical_height) {
+		// the whole output was selected
+		target->with_region = false;
+		return true;
 	}
+	target->with_region = true;
+	target->x = x1 - out->x;
+	target->y = y1 - out->y;
+	target->width = x2 - x1;
+	target->height = y2 - y1;
+	return true;
+}
 
-	ssize_t nread = getline(&name, &name_size, f);
-	fclose(f);
-	if (nread < 0) {
-		perror("getline failed");
-		goto end;
+static bool wlr_chooser_parse_output(struct xdpw_screencast_context *ctx,
+		const char *line, struct xdpw_capture_target *target) {
+	struct xdpw_chooser_selection sel;
+	if (!xdpw_wlr_parse_selection(line, &sel)) {
+		return false;
 	}
 
-	//Strip newline
-	char *p = strchr(name, '\n');
-	if (p != NULL) {
-		*p = '\0';
+	target->output = xdpw_wlr_output_find_by_name(ctx, sel.name);
+	if (target->output == NULL) {
+		return false;
 	}
+	if (sel.with_region && !xdpw_wlr_target_clip_region(target,
+			sel.x, sel.y, sel.width, sel.height)) {
+		logprint(ERROR, "wlroots: region %d,%d %dx%d is outside of output %s",
+			sel.x, sel.y, sel.width, sel.height, sel.name);
+		return false;
+	}
+	return true;
+}
 
-	logprint(TRACE, "wlroots: output chooser %s selects output %s", chooser->cmd, name);
-	wl_list_for_each(out, output_list, link) {
-		if (strcmp(out->name, name) == 0) {
-			*output = out;
-			break;
+static void wlr_chooser_exited(int status, const char *output, void *data) {
+	struct wlr_chooser_run *run = data;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+		logprint(DEBUG, "wlroots: output chooser %s exited abnormally", run->chooser.cmd);
+		if (run->is_default && WIFEXITED(status)) {
+			// the shell didn't find it, don't fork for it again
+			run->ctx->default_choosers_missing |= 1u << (run->default_index - 1);
 		}
+		wlr_chooser_run_next(run);
+		return;
 	}
-	free(name);
 
-end:
-	return true;
+	//Strip newline
+	char line[XDPW_CHILD_OUTPUT_MAX];
+	snprintf(line, sizeof(line), "%s", output);
+	char *p = strchr(line, '\n');
+	if (p != NULL) {
+		*p = '\0';
+	}
 
-error_fork:
-	close(chooser_out[0]);
-	close(chooser_out[1]);
-error_chooser_out:
-	close(chooser_in[0]);
-	close(chooser_in[1]);
-error_chooser_in:
-	*output = NULL;
-	return false;
+	logprint(TRACE, "wlroots: output chooser %s selects %s", run->chooser.cmd, line);
+	struct xdpw_capture_target target = { 0 };
+	if (run->types & WINDOW) {
+		target.toplevel = wlr_toplevel_find_by_label(run->ctx, line);
+	}
+	if (target.toplevel == NULL &&
+			(!(run->types & MONITOR) || !wlr_chooser_parse_output(run->ctx, line, &target))) {
+		logprint(DEBUG, "wlroots: output chooser canceled");
+		wlr_chooser_run_done(run, NULL);
+		return;
+	}
+	wlr_chooser_run_done(run, &target);
 }
 
-static struct xdpw_wlr_output *wlr_output_chooser_default(struct wl_list *output_list) {
-	logprint(DEBUG, "wlroots: output chooser called");
-	struct xdpw_output_chooser default_chooser[] = {
-		{XDPW_CHOOSER_SIMPLE, "slurp -f %o -or"},
-		{XDPW_CHOOSER_DMENU, "wofi -d -n --prompt='Select the monitor to share:'"},
-		{XDPW_CHOOSER_DMENU, "bemenu --prompt='Select the monitor to share:'"},
-	};
-
-	size_t N = sizeof(default_chooser)/sizeof(default_chooser[0]);
-	struct xdpw_wlr_output *output = NULL;
-	bool ret;
-	for (size_t i = 0; i<N; i++) {
-		ret = wlr_output_chooser(&default_chooser[i], output_list, &output);
-		if (!ret) {
-			logprint(DEBUG, "wlroots: output chooser %s not found. Trying next one.",
-					default_chooser[i].cmd);
-			continue;
+static bool wlr_chooser_run_spawn(struct wlr_chooser_run *run) {
+	char *input = NULL;
+	if (run->chooser.type == XDPW_CHOOSER_DMENU) {
+		size_t size = 0;
+		FILE *f = open_memstream(&input, &size);
+		if (f == NULL) {
+			logprint(ERROR, "wlroots: failed to build the output list");
+			return false;
 		}
-		if (output != NULL) {
-			logprint(DEBUG, "wlroots: output chooser selects %s", output->name);
-		} else {
-			logprint(DEBUG, "wlroots: output chooser canceled");
+		if (run->types & MONITOR) {
+			struct xdpw_wlr_output *out;
+			wl_list_for_each(out, &run->ctx->output_list, link) {
+				if (out->ready) {
+					fprintf(f, "%s\n", out->name);
+				}
+			}
 		}
-		return output;
+		if (run->types & WINDOW) {
+			char label[XDPW_CHILD_OUTPUT_MAX];
+			struct xdpw_toplevel *toplevel;
+			wl_list_for_each(toplevel, &run->ctx->toplevel_list, link) {
+				wlr_toplevel_label(toplevel, label, sizeof(label));
+				fprintf(f, "%s\n", label);
+			}
+		}
+		fclose(f);
 	}
-	return xdpw_wlr_output_first(output_list);
+
+	int ret = xdpw_child_spawn(run->ctx->state, run->chooser.cmd, input,
+		wlr_chooser_exited, run);
+	free(input);
+	return ret == 0;
 }
 
-struct xdpw_wlr_output *xdpw_wlr_output_chooser(struct xdpw_screencast_context *ctx) {
-	switch (ctx->state->config->screencast_conf.chooser_type) {
-	case XDPW_CHOOSER_DEFAULT:
-		return wlr_output_chooser_default(&ctx->output_list);
+void xdpw_wlr_output_chooser(struct xdpw_screencast_context *ctx, uint32_t types,
+		xdpw_wlr_output_chooser_func_t func, void *data) {
+	struct config_screencast *conf = &ctx->state->config->screencast_conf;
+	logprint(DEBUG, "wlroots: output chooser called");
+
+	switch (conf->chooser_type) {
 	case XDPW_CHOOSER_NONE:
-		if (ctx->state->config->screencast_conf.output_name) {
-			return xdpw_wlr_output_find_by_name(&ctx->output_list, ctx->state->config->screencast_conf.output_name);
-		} else {
-			return xdpw_wlr_output_first(&ctx->output_list);
-		}
+		break;
 	case XDPW_CHOOSER_DMENU:
-	case XDPW_CHOOSER_SIMPLE:;
-		struct xdpw_wlr_output *output = NULL;
-		if (!ctx->state->config->screencast_conf.chooser_cmd) {
+	case XDPW_CHOOSER_SIMPLE:
+		if (!conf->chooser_cmd) {
 			logprint(ERROR, "wlroots: no output chooser given");
-			goto end;
-		}
-		struct xdpw_output_chooser chooser = {
-			ctx->state->config->screencast_conf.chooser_type,
-			ctx->state->config->screencast_conf.chooser_cmd
-		};
-		logprint(DEBUG, "wlroots: output chooser %s (%d)", chooser.cmd, chooser.type);
-		bool ret = wlr_output_chooser(&chooser, &ctx->output_list, &output);
-		if (!ret) {
-			logprint(ERROR, "wlroots: output chooser %s failed", chooser.cmd);
-			goto end;
-		}
-		if (output) {
-			logprint(DEBUG, "wlroots: output chooser selects %s", output->name);
+			func(NULL, data);
+			return;
+		}
+		break;
+	case XDPW_CHOOSER_DEFAULT:
+		break;
+	}
+
+	struct wlr_chooser_run *run = calloc(1, sizeof(*run));
+	if (run == NULL) {
+		logprint(ERROR, "wlroots: failed to allocate output chooser");
+		func(NULL, data);
+		return;
+	}
+	run->ctx = ctx;
+	run->types = types;
+	run->func = func;
+	run->data = data;
+
+	if (conf->chooser_type == XDPW_CHOOSER_NONE) {
+		if (conf->output_name) {
+			wlr_chooser_run_output(run,
+				xdpw_wlr_output_find_by_name(ctx, conf->output_name));
 		} else {
-			logprint(DEBUG, "wlroots: output chooser canceled");
+			wlr_chooser_run_output(run, xdpw_wlr_output_first(ctx));
 		}
-		return output;
+		return;
+	}
+
+	if (conf->chooser_type == XDPW_CHOOSER_DEFAULT) {
+		wlr_chooser_probe_defaults(ctx);
+		run->is_default = true;
+		wlr_chooser_run_next(run);
+		return;
+	}
+
+	run->chooser = (struct xdpw_output_chooser){ conf->chooser_type, conf->chooser_cmd };
+	logprint(DEBUG, "wlroots: output chooser %s (%d)", run->chooser.cmd, run->chooser.type);
+	if (!wlr_chooser_run_spawn(run)) {
+		logprint(ERROR, "wlroots: output chooser %s failed", run->chooser.cmd);
+		wlr_chooser_run_done(run, NULL);
 	}
-end:
-	return NULL;
 }
 
-struct xdpw_wlr_output *xdpw_wlr_output_first(struct wl_list *output_list) {
-	struct xdpw_wlr_output *output, *tmp;
-	wl_list_for_each_safe(output, tmp, output_list, link) {
-		return output;
+struct xdpw_wlr_output *xdpw_wlr_output_first(struct xdpw_screencast_context *ctx) {
+	struct xdpw_wlr_output *output;
+	wl_list_for_each(output, &ctx->output_list, link) {
+		if (output->ready) {
+			return output;
+		}
 	}
 	return NULL;
 }
 
-struct xdpw_wlr_output *xdpw_wlr_output_find_by_name(struct wl_list *output_list,
+struct xdpw_wlr_output *xdpw_wlr_output_find_by_name(struct xdpw_screencast_context *ctx,
 		const char *name) {
-	struct xdpw_wlr_output *output, *tmp;
-	wl_list_for_each_safe(output, tmp, output_list, link) {
-		if (strcmp(output->name, name) == 0) {
+	struct xdpw_wlr_output *output;
+	wl_list_for_each(output, wlr_output_name_bucket(ctx, name), name_link) {
+		if (output->ready && strcmp(output->name, name) == 0) {
 			return output;
 		}
 	}
 	return NULL;
 }
 
+static bool wlr_output_is_monitor(struct xdpw_wlr_output *output,
+		const char *make, const char *model) {
+	return output->make && output->model &&
+		strcmp(output->make, make) == 0 && strcmp(output->model, model) == 0;
+}
+
+struct xdpw_wlr_output *xdpw_wlr_output_find_restore(struct xdpw_screencast_context *ctx,
+		const char *name, const char *make, const char *model) {
+	struct xdpw_wlr_output *output = name ? xdpw_wlr_output_find_by_name(ctx, name) : NULL;
+	if (!make || !model) {
+		return output;
+	}
+	if (output && wlr_output_is_monitor(output, make, model)) {
+		return output;
+	}
+
+	// connectors can change when a monitor is replugged, look for the monitor elsewhere
+	struct xdpw_wlr_output *match = NULL;
+	wl_list_for_each(output, &ctx->output_list, link) {
+		if (output->ready && wlr_output_is_monitor(output, make, model)) {
+			if (match) {
+				// two identical monitors, let the user choose
+				return NULL;
+			}
+			match = output;
+		}
+	}
+	return match;
+}
+
 struct xdpw_wlr_output *xdpw_wlr_output_find(struct xdpw_screencast_context *ctx,
 		struct wl_output *out, uint32_t id) {
-	struct xdpw_wlr_output *output, *tmp;
-	wl_list_for_each_safe(output, tmp, &ctx->output_list, link) {
-		if ((output->output == out) || (output->id == id)) {
+	if (out) {
+		return wl_output_get_user_data(out);
+	}
+	struct xdpw_wlr_output *output;
+	wl_list_for_each(output, &ctx->outputs_by_id[id % XDPW_OUTPUT_BUCKETS], id_link) {
+		if (output->id == id) {
 			return output;
 		}
 	}
 	return NULL;
 }
 
+static bool wlr_gbm_supports_format_modifier(struct gbm_device *gbm,
+		uint32_t fourcc, uint64_t modifier) {
+	if (!gbm) {
+		return false;
+	}
+	if (modifier == DRM_FORMAT_MOD_INVALID) {
+		return gbm_device_is_format_supported(gbm, fourcc, GBM_BO_USE_RENDERING);
+	}
+	return gbm_device_get_format_modifier_plane_count(gbm, fourcc, modifier) > 0;
+}
+
+uint32_t xdpw_wlr_query_dmabuf_modifiers(struct xdpw_screencast_context *ctx,
+		struct gbm_device *gbm, uint32_t drm_format, uint64_t **modifiers) {
+	*modifiers = NULL;
+	if (drm_format == DRM_FORMAT_INVALID) {
+		return 0;
+	}
+
+	// nothing usable was announced, fall back to implicit modifiers
+	if (ctx->format_modifier_pairs.size == 0) {
+		*modifiers = calloc(1, sizeof(uint64_t));
+		(*modifiers)[0] = DRM_FORMAT_MOD_INVALID;
+		return 1;
+	}
+
+	// the pairs were checked against the main device only
+	bool other_device = gbm != ctx->gbm;
+	uint32_t modifier_count = 0;
+	struct xdpw_format_modifier_pair *fm_pair;
+	wl_array_for_each(fm_pair, &ctx->format_modifier_pairs) {
+		if (fm_pair->fourcc == drm_format) {
+			modifier_count++;
+		}
+	}
+	if (modifier_count == 0) {
+		logprint(INFO, "wlroots: no modifiers available for format %u", drm_format);
+		return 0;
+	}
+
+	*modifiers = calloc(modifier_count, sizeof(uint64_t));
+	uint32_t i = 0;
+	wl_array_for_each(fm_pair, &ctx->format_modifier_pairs) {
+		if (fm_pair->fourcc != drm_format) {
+			continue;
+		}
+		if (other_device && !wlr_gbm_supports_format_modifier(gbm, fm_pair->fourcc, fm_pair->modifier)) {
+			continue;
+		}
+		(*modifiers)[i++] = fm_pair->modifier;
+	}
+	modifier_count = i;
+	logprint(DEBUG, "wlroots: %u modifiers available for format %u", modifier_count, drm_format);
+	return modifier_count;
+}
+
+static void wlr_add_format_modifier_pair(struct xdpw_screencast_context *ctx,
+		uint32_t fourcc, uint64_t modifier) {
+	struct xdpw_format_modifier_pair *fm_pair;
+	wl_array_for_each(fm_pair, &ctx->format_modifier_pairs) {
+		if (fm_pair->fourcc == fourcc && fm_pair->modifier == modifier) {
+			return;
+		}
+	}
+
+	// without a gbm device the pairs are filtered once one is opened
+	if (ctx->gbm && !wlr_gbm_supports_format_modifier(ctx->gbm, fourcc, modifier)) {
+		logprint(TRACE, "wlroots: format %u with modifier %lu not supported by gbm", fourcc, modifier);
+		return;
+	}
+
+	fm_pair = wl_array_add(&ctx->format_modifier_pairs, sizeof(struct xdpw_format_modifier_pair));
+	if (!fm_pair) {
+		logprint(ERROR, "wlroots: unable to store format modifier pair");
+		return;
+	}
+	fm_pair->fourcc = fourcc;
+	fm_pair->modifier = modifier;
+}
+
+static void linux_dmabuf_handle_format(void *data,
+		struct zwp_linux_dmabuf_v1 *linux_dmabuf, uint32_t format) {
+	/* Deprecated, superseded by the modifier event */
+}
+
+static void linux_dmabuf_handle_modifier(void *data,
+		struct zwp_linux_dmabuf_v1 *linux_dmabuf,
+		uint32_t format, uint32_t modifier_hi, uint32_t modifier_lo) {
+	struct xdpw_screencast_context *ctx = data;
+
+	logprint(TRACE, "linux-dmabuf: modifier event handler");
+
+	uint64_t modifier = (((uint64_t)modifier_hi) << 32) | modifier_lo;
+	wlr_add_format_modifier_pair(ctx, format, modifier);
+}
+
+static const struct zwp_linux_dmabuf_v1_listener linux_dmabuf_listener = {
+	.format = linux_dmabuf_handle_format,
+	.modifier = linux_dmabuf_handle_modifier,
+};
+
+static void linux_dmabuf_feedback_handle_done(void *data,
+		struct zwp_linux_dmabuf_feedback_v1 *feedback) {
+	struct xdpw_screencast_context *ctx = data;
+
+	logprint(DEBUG, "linux-dmabuf: feedback done, %zu usable format modifier pairs",
+		ctx->format_modifier_pairs.size / sizeof(struct xdpw_format_modifier_pair));
+	ctx->feedback_data.done = true;
+}
+
+static void linux_dmabuf_feedback_handle_format_table(void *data,
+		struct zwp_linux_dmabuf_feedback_v1 *feedback, int fd, uint32_t size) {
+	struct xdpw_screencast_context *ctx = data;
+
+	logprint(TRACE, "linux-dmabuf: format_table event handler");
+
+	if (ctx->feedback_data.format_table_data) {
+		munmap(ctx->feedback_data.format_table_data, ctx->feedback_data.format_table_size);
+		ctx->feedback_data.format_table_data = NULL;
+		ctx->feedback_data.format_table_size = 0;
+	}
+
+	void *table = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (table == MAP_FAILED) {
+		logprint(ERROR, "linux-dmabuf: failed to map format table");
+		return;
+	}
+	ctx->feedback_data.format_table_data = table;
+	ctx->feedback_data.format_table_size = size;
+}
+
+static void linux_dmabuf_feedback_handle_main_device(void *data,
+		struct zwp_linux_dmabuf_feedback_v1 *feedback, struct wl_array *device_arr) {
+	struct xdpw_screencast_context *ctx = data;
+
+	logprint(TRACE, "linux-dmabuf: main_device event handler");
+
+	// a new feedback batch replaces everything announced before
+	if (ctx->feedback_data.done) {
+		ctx->format_modifier_pairs.size = 0;
+		ctx->feedback_data.done = false;
+	}
+
+	dev_t device;
+	assert(device_arr->size == sizeof(device));
+	memcpy(&device, device_arr->data, sizeof(device));
+
+	// allocate on the gpu the compositor renders with, not the first one found
+	ctx->feedback_data.main_device = device;
+	ctx->feedback_data.has_main_device = true;
+	if (!ctx->acquired) {
+		return;
+	}
+	struct gbm_device *gbm = xdpw_gbm_device_get(ctx, device);
+	if (gbm) {
+		ctx->gbm = gbm;
+	}
+}
+
+static void linux_dmabuf_feedback_handle_tranche_target_device(void *data,
+		struct zwp_linux_dmabuf_feedback_v1 *feedback, struct wl_array *device_arr) {
+	struct xdpw_screencast_context *ctx = data;
+
+	logprint(TRACE, "linux-dmabuf: tranche_target_device event handler");
+
+	dev_t device;
+	assert(device_arr->size == sizeof(device));
+	memcpy(&device, device_arr->data, sizeof(device));
+
+	ctx->feedback_data.device_used = ctx->feedback_data.has_main_device &&
+		xdpw_drm_devices_match(ctx->feedback_data.main_device, device);
+}
+
+static void linux_dmabuf_feedback_handle_tranche_formats(void *data,
+		struct zwp_linux_dmabuf_feedback_v1 *feedback, struct wl_array *indices) {
+	struct xdpw_screencast_context *ctx = data;
+
+	logprint(TRACE, "linux-dmabuf: tranche_formats event handler");
+
+	if (!ctx->feedback_data.device_used || !ctx->feedback_data.format_table_data) {
+		return;
+	}
+
+	struct fm_entry {
+		uint32_t format;
+		uint32_t padding;
+		uint64_t modifier;
+	};
+	// An entry in the table has to be 16 bytes long
+	static_assert(sizeof(struct fm_entry) == 16, "format table entry has the wrong size");
+
+	uint32_t n_entries = ctx->feedback_data.format_table_size / sizeof(struct fm_entry);
+	struct fm_entry *fm_entry = ctx->feedback_data.format_table_data;
+	uint16_t *idx;
+	wl_array_for_each(idx, indices) {
+		if (*idx >= n_entries) {
+			continue;
+		}
+		wlr_add_format_modifier_pair(ctx, fm_entry[*idx].format, fm_entry[*idx].modifier);
+	}
+}
+
+static void linux_dmabuf_feedback_handle_tranche_flags(void *data,
+		struct zwp_linux_dmabuf_feedback_v1 *feedback, uint32_t flags) {
+	/* Nothing to do */
+}
+
+static void linux_dmabuf_feedback_handle_tranche_done(void *data,
+		struct zwp_linux_dmabuf_feedback_v1 *feedback) {
+	struct xdpw_screencast_context *ctx = data;
+
+	logprint(TRACE, "linux-dmabuf: tranche_done event handler");
+	ctx->feedback_data.device_used = false;
+}
+
+static const struct zwp_linux_dmabuf_feedback_v1_listener linux_dmabuf_feedback_listener = {
+	.done = linux_dmabuf_feedback_handle_done,
+	.format_table = linux_dmabuf_feedback_handle_format_table,
+	.main_device = linux_dmabuf_feedback_handle_main_device,
+	.tranche_done = linux_dmabuf_feedback_handle_tranche_done,
+	.tranche_target_device = linux_dmabuf_feedback_handle_tranche_target_device,
+	.tranche_formats = linux_dmabuf_feedback_handle_tranche_formats,
+	.tranche_flags = linux_dmabuf_feedback_handle_tranche_flags,
+};
+
+static void wlr_seat_handle_capabilities(void *data, struct wl_seat *seat,
+		uint32_t capabilities) {
+	struct xdpw_screencast_context *ctx = data;
+
+	// the pointer only names the cursor to capture, it never gets focus
+	if ((capabilities & WL_SEAT_CAPABILITY_POINTER) && !ctx->pointer) {
+		ctx->pointer = wl_seat_get_pointer(seat);
+	} else if (!(capabilities & WL_SEAT_CAPABILITY_POINTER) && ctx->pointer) {
+		wl_pointer_destroy(ctx->pointer);
+		ctx->pointer = NULL;
+	}
+}
+
+static void wlr_seat_handle_name(void *data, struct wl_seat *seat, const char *name) {
+	/* Nothing to do */
+}
+
+static const struct wl_seat_listener wlr_seat_listener = {
+	.capabilities = wlr_seat_handle_capabilities,
+	.name = wlr_seat_handle_name,
+};
+
 static void wlr_remove_output(struct xdpw_wlr_output *out) {
+	wl_list_remove(&out->id_link);
+	wl_list_remove(&out->name_link);
 	free(out->name);
 	free(out->make);
 	free(out->model);
@@ -550,12 +1303,16 @@ static void wlr_registry_handle_add(void *data, struct wl_registry *reg,
 	if (!strcmp(interface, wl_output_interface.name)) {
 		struct xdpw_wlr_output *output = calloc(1, sizeof(*output));
 
+		output->ctx = ctx;
 		output->id = id;
-		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, WL_OUTPUT_VERSION);
-		output->output = wl_registry_bind(reg, id, &wl_output_interface, WL_OUTPUT_VERSION);
+		uint32_t version = ver < WL_OUTPUT_VERSION ? ver : WL_OUTPUT_VERSION;
+		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, version);
+		output->output = wl_registry_bind(reg, id, &wl_output_interface, version);
 
 		wl_output_add_listener(output->output, &wlr_output_listener, output);
 		wl_list_insert(&ctx->output_list, &output->link);
+		wl_list_insert(&ctx->outputs_by_id[id % XDPW_OUTPUT_BUCKETS], &output->id_link);
+		wl_list_init(&output->name_link);
 		if (ctx->xdg_output_manager) {
 			wlr_init_xdg_output(ctx, output);
 		}
@@ -573,6 +1330,39 @@ static void wlr_registry_handle_add(void *data, struct wl_registry *reg,
 			reg, id, &zwlr_screencopy_manager_v1_interface, version);
 	}
 
+	if (!strcmp(interface, ext_image_copy_capture_manager_v1_interface.name)) {
+		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, EXT_IMAGE_COPY_CAPTURE_MANAGER_VERSION);
+		ctx->ext_image_copy_capture_manager = wl_registry_bind(
+			reg, id, &ext_image_copy_capture_manager_v1_interface, EXT_IMAGE_COPY_CAPTURE_MANAGER_VERSION);
+	}
+
+	if (!strcmp(interface, ext_output_image_capture_source_manager_v1_interface.name)) {
+		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, EXT_OUTPUT_IMAGE_CAPTURE_SOURCE_MANAGER_VERSION);
+		ctx->ext_output_image_capture_source_manager = wl_registry_bind(
+			reg, id, &ext_output_image_capture_source_manager_v1_interface, EXT_OUTPUT_IMAGE_CAPTURE_SOURCE_MANAGER_VERSION);
+	}
+
+	if (!strcmp(interface, ext_foreign_toplevel_image_capture_source_manager_v1_interface.name)) {
+		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, EXT_TOPLEVEL_IMAGE_CAPTURE_SOURCE_MANAGER_VERSION);
+		ctx->ext_toplevel_image_capture_source_manager = wl_registry_bind(
+			reg, id, &ext_foreign_toplevel_image_capture_source_manager_v1_interface, EXT_TOPLEVEL_IMAGE_CAPTURE_SOURCE_MANAGER_VERSION);
+	}
+
+	if (!strcmp(interface, ext_foreign_toplevel_list_v1_interface.name)) {
+		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, EXT_FOREIGN_TOPLEVEL_LIST_VERSION);
+		ctx->foreign_toplevel_list = wl_registry_bind(
+			reg, id, &ext_foreign_toplevel_list_v1_interface, EXT_FOREIGN_TOPLEVEL_LIST_VERSION);
+		ext_foreign_toplevel_list_v1_add_listener(ctx->foreign_toplevel_list,
+			&wlr_toplevel_list_listener, ctx);
+	}
+
+	// cursors are captured for the first seat
+	if (strcmp(interface, wl_seat_interface.name) == 0 && !ctx->seat) {
+		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, WL_SEAT_VERSION);
+		ctx->seat = wl_registry_bind(reg, id, &wl_seat_interface, WL_SEAT_VERSION);
+		wl_seat_add_listener(ctx->seat, &wlr_seat_listener, ctx);
+	}
+
 	if (strcmp(interface, wl_shm_interface.name) == 0) {
 		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, WL_SHM_VERSION);
 		ctx->shm = wl_registry_bind(reg, id, &wl_shm_interface, WL_SHM_VERSION);
@@ -584,8 +1374,23 @@ static void wlr_registry_handle_add(void *data, struct wl_registry *reg,
 			wl_registry_bind(reg, id, &zxdg_output_manager_v1_interface, XDG_OUTPUT_MANAGER_VERSION);
 	}
 	if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0) {
-		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, LINUX_DMABUF_VERSION);
-		ctx->linux_dmabuf = wl_registry_bind(reg, id, &zwp_linux_dmabuf_v1_interface, LINUX_DMABUF_VERSION);
+		uint32_t version = ver;
+		if (LINUX_DMABUF_VERSION < ver) {
+			version = LINUX_DMABUF_VERSION;
+		} else if (ver < LINUX_DMABUF_VERSION_MIN) {
+			logprint(DEBUG, "wlroots: |-- interface %s (Version %u) too old, skipping", interface, ver);
+			return;
+		}
+		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, version);
+		ctx->linux_dmabuf = wl_registry_bind(reg, id, &zwp_linux_dmabuf_v1_interface, version);
+
+		if (version >= 4) {
+			ctx->linux_dmabuf_feedback = zwp_linux_dmabuf_v1_get_default_feedback(ctx->linux_dmabuf);
+			zwp_linux_dmabuf_feedback_v1_add_listener(ctx->linux_dmabuf_feedback,
+				&linux_dmabuf_feedback_listener, ctx);
+		} else {
+			zwp_linux_dmabuf_v1_add_listener(ctx->linux_dmabuf, &linux_dmabuf_listener, ctx);
+		}
 	}
 }
 
@@ -606,12 +1411,28 @@ static const struct wl_registry_listener wlr_registry_listener = {
 int xdpw_wlr_screencopy_init(struct xdpw_state *state) {
 	struct xdpw_screencast_context *ctx = &state->screencast;
 
-	// initialize a list of outputs
+	// initialize a list of outputs and its indices
 	wl_list_init(&ctx->output_list);
+	for (size_t i = 0; i < XDPW_OUTPUT_BUCKETS; i++) {
+		wl_list_init(&ctx->outputs_by_id[i]);
+		wl_list_init(&ctx->outputs_by_name[i]);
+	}
+
+	// initialize a list of windows
+	wl_list_init(&ctx->toplevel_list);
 
 	// initialize a list of active screencast instances
 	wl_list_init(&ctx->screencast_instances);
 
+	// idle shm buffers shared by all instances
+	xdpw_shm_allocator_init(&ctx->shm_allocator);
+
+	// initialize the list of usable dmabuf format modifier pairs
+	wl_array_init(&ctx->format_modifier_pairs);
+
+	// gbm devices are opened once the compositor announces its main device
+	wl_list_init(&ctx->gbm_devices);
+
 	// retrieve registry
 	ctx->registry = wl_display_get_registry(state->wl_display);
 	wl_registry_add_listener(ctx->registry, &wlr_registry_listener, ctx);
@@ -639,20 +1460,57 @@ int xdpw_wlr_screencopy_init(struct xdpw_state *state) {
 		return -1;
 	}
 
-	// make sure our wlroots supports screencopy protocol
-	if (!ctx->screencopy_manager) {
-		logprint(ERROR, "Compositor doesn't support %s!",
+	// prefer the persistent capture sessions of ext-image-copy-capture
+	if (ctx->ext_image_copy_capture_manager && ctx->ext_output_image_capture_source_manager) {
+		ctx->capture_backend = &xdpw_ext_image_copy_backend;
+	} else if (ctx->screencopy_manager) {
+		ctx->capture_backend = &xdpw_wlr_screencopy_backend;
+	} else {
+		logprint(ERROR, "Compositor supports neither %s nor %s!",
+			ext_image_copy_capture_manager_v1_interface.name,
 			zwlr_screencopy_manager_v1_interface.name);
 		return -1;
 	}
+	logprint(INFO, "wlroots: using capture backend %s", ctx->capture_backend->name);
+
+	// windows are captured through ext-image-copy-capture only
+	if (ctx->ext_image_copy_capture_manager && ctx->ext_toplevel_image_capture_source_manager &&
+			ctx->foreign_toplevel_list) {
+		state->screencast_source_types |= WINDOW;
+	}
+
+	// cursor metadata comes from ext-image-copy-capture cursor sessions
+	if (ctx->ext_image_copy_capture_manager && ctx->pointer) {
+		state->screencast_cursor_modes |= METADATA;
+	}
 
-	// make sure we have a gbm device
-	ctx->gbm = xdpw_gbm_device_create();
+	return 0;
+}
+
+void xdpw_wlr_gbm_acquire(struct xdpw_screencast_context *ctx) {
+	if (!ctx->gbm && ctx->feedback_data.has_main_device) {
+		ctx->gbm = xdpw_gbm_device_get(ctx, ctx->feedback_data.main_device);
+	}
+	// without dmabuf feedback the modifiers are filtered against the first render node
+	if (!ctx->gbm) {
+		ctx->gbm = xdpw_gbm_device_create(ctx);
+	}
 	if (!ctx->gbm) {
 		logprint(ERROR, "System doesn't support gbm!");
+		return;
 	}
 
-	return 0;
+	// drop the pairs announced while no device was open
+	struct xdpw_format_modifier_pair *pairs = ctx->format_modifier_pairs.data;
+	size_t count = ctx->format_modifier_pairs.size / sizeof(*pairs);
+	size_t kept = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (wlr_gbm_supports_format_modifier(ctx->gbm, pairs[i].fourcc, pairs[i].modifier)) {
+			pairs[kept++] = pairs[i];
+		}
+	}
+	ctx->format_modifier_pairs.size = kept * sizeof(*pairs);
+	logprint(DEBUG, "wlroots: %zu usable format modifier pairs", kept);
 }
 
 void xdpw_wlr_screencopy_finish(struct xdpw_screencast_context *ctx) {
@@ -663,25 +1521,56 @@ void xdpw_wlr_screencopy_finish(struct xdpw_screencast_context *ctx) {
 		wl_output_destroy(output->output);
 	}
 
+	struct xdpw_toplevel *toplevel, *tmp_t;
+	wl_list_for_each_safe(toplevel, tmp_t, &ctx->toplevel_list, link) {
+		wlr_toplevel_destroy(toplevel);
+	}
+
 	struct xdpw_screencast_instance *cast, *tmp_c;
 	wl_list_for_each_safe(cast, tmp_c, &ctx->screencast_instances, link) {
+		cast->target.toplevel = NULL;
 		cast->quit = true;
 	}
 
 	if (ctx->screencopy_manager) {
 		zwlr_screencopy_manager_v1_destroy(ctx->screencopy_manager);
 	}
+	if (ctx->ext_image_copy_capture_manager) {
+		ext_image_copy_capture_manager_v1_destroy(ctx->ext_image_copy_capture_manager);
+	}
+	if (ctx->ext_output_image_capture_source_manager) {
+		ext_output_image_capture_source_manager_v1_destroy(ctx->ext_output_image_capture_source_manager);
+	}
+	if (ctx->ext_toplevel_image_capture_source_manager) {
+		ext_foreign_toplevel_image_capture_source_manager_v1_destroy(ctx->ext_toplevel_image_capture_source_manager);
+	}
+	if (ctx->foreign_toplevel_list) {
+		ext_foreign_toplevel_list_v1_destroy(ctx->foreign_toplevel_list);
+	}
+	if (ctx->pointer) {
+		wl_pointer_destroy(ctx->pointer);
+		ctx->pointer = NULL;
+	}
+	if (ctx->seat) {
+		wl_seat_destroy(ctx->seat);
+		ctx->seat = NULL;
+	}
+	xdpw_shm_allocator_finish(&ctx->shm_allocator);
 	if (ctx->shm) {
 		wl_shm_destroy(ctx->shm);
+		ctx->shm = NULL;
 	}
 	if (ctx->xdg_output_manager) {
 		zxdg_output_manager_v1_destroy(ctx->xdg_output_manager);
 	}
-	if (ctx->gbm) {
-		int fd = gbm_device_get_fd(ctx->gbm);
-		gbm_device_destroy(ctx->gbm);
-		close(fd);
+	xdpw_gbm_devices_finish(ctx);
+	if (ctx->linux_dmabuf_feedback) {
+		zwp_linux_dmabuf_feedback_v1_destroy(ctx->linux_dmabuf_feedback);
+	}
+	if (ctx->feedback_data.format_table_data) {
+		munmap(ctx->feedback_data.format_table_data, ctx->feedback_data.format_table_size);
 	}
+	wl_array_release(&ctx->format_modifier_pairs);
 	if (ctx->linux_dmabuf) {
 		zwp_linux_dmabuf_v1_destroy(ctx->linux_dmabuf);
 	}
@@ -0,0 +1,119 @@
+#include "screenshot.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "logger.h"
+
+#define PNG_CHUNK_SIZE (256 * 1024)
+
+static void png_put_u32(uint8_t *p, uint32_t value) {
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static int png_write_chunk(FILE *f, const char type[4], const uint8_t *data, uint32_t len) {
+	uint8_t header[8];
+	png_put_u32(header, len);
+	memcpy(header + 4, type, 4);
+
+	uLong crc = crc32(0, header + 4, 4);
+	if (len > 0) {
+		// a NULL buffer would reset the crc
+		crc = crc32(crc, data, len);
+	}
+	uint8_t footer[4];
+	png_put_u32(footer, crc);
+
+	if (fwrite(header, sizeof(header), 1, f) != 1 ||
+			(len > 0 && fwrite(data, len, 1, f) != 1) ||
+			fwrite(footer, sizeof(footer), 1, f) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+static int png_deflate(z_stream *z, FILE *f, uint8_t *out, const uint8_t *data,
+		size_t len, int flush) {
+	z->next_in = (Bytef *)data;
+	z->avail_in = len;
+	do {
+		int ret = deflate(z, flush);
+		if (ret == Z_STREAM_ERROR) {
+			return -1;
+		}
+		bool end = ret == Z_STREAM_END;
+		// IDAT chunks are cut wherever the output buffer fills up
+		if (z->avail_out == 0 || (end && z->avail_out < PNG_CHUNK_SIZE)) {
+			if (png_write_chunk(f, "IDAT", out, PNG_CHUNK_SIZE - z->avail_out) < 0) {
+				return -1;
+			}
+			z->next_out = out;
+			z->avail_out = PNG_CHUNK_SIZE;
+		}
+		if (end) {
+			return 0;
+		}
+	} while (z->avail_in > 0 || flush == Z_FINISH);
+	return 0;
+}
+
+int xdpw_png_write(FILE *f, const uint8_t *rgb, uint32_t width, uint32_t height,
+		int level) {
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	if (fwrite(signature, sizeof(signature), 1, f) != 1) {
+		return -1;
+	}
+
+	uint8_t ihdr[13];
+	png_put_u32(ihdr, width);
+	png_put_u32(ihdr + 4, height);
+	ihdr[8] = 8; // bit depth
+	ihdr[9] = 2; // truecolor
+	ihdr[10] = 0; // deflate
+	ihdr[11] = 0; // adaptive filtering
+	ihdr[12] = 0; // no interlace
+	if (png_write_chunk(f, "IHDR", ihdr, sizeof(ihdr)) < 0) {
+		return -1;
+	}
+
+	z_stream z = { 0 };
+	if (deflateInit(&z, level) != Z_OK) {
+		logprint(ERROR, "png: failed to initialize deflate");
+		return -1;
+	}
+	uint8_t *out = malloc(PNG_CHUNK_SIZE);
+	if (out == NULL) {
+		deflateEnd(&z);
+		return -1;
+	}
+	z.next_out = out;
+	z.avail_out = PNG_CHUNK_SIZE;
+
+	// every row starts with its filter type, rows are stored unfiltered
+	static const uint8_t filter = 0;
+	size_t row_size = (size_t)width * 3;
+	int ret = 0;
+	for (uint32_t y = 0; y < height && ret == 0; y++) {
+		ret = png_deflate(&z, f, out, &filter, 1, Z_NO_FLUSH);
+		if (ret == 0) {
+			ret = png_deflate(&z, f, out, rgb + y * row_size, row_size, Z_NO_FLUSH);
+		}
+	}
+	if (ret == 0) {
+		ret = png_deflate(&z, f, out, NULL, 0, Z_FINISH);
+	}
+
+	deflateEnd(&z);
+	free(out);
+	if (ret < 0) {
+		logprint(ERROR, "png: failed to write image data");
+		return -1;
+	}
+
+	return png_write_chunk(f, "IEND", NULL, 0);
+}
@@ -2,13 +2,17 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include "child.h"
 #include "xdpw.h"
 #include "screenshot.h"
 
 static const char object_path[] = "/org/freedesktop/portal/desktop";
 static const char interface_name[] = "org.freedesktop.impl.portal.Screenshot";
+// TODO: choose a better path
+static const char screenshot_path[] = "/tmp/out.png";
 
 static bool exec_screenshooter(const char *path) {
 	pid_t pid = fork();
@@ -58,8 +62,46 @@ static bool exec_screenshooter_interactive(const char *path) {
 	return stat == 0;
 }
 
+static int screenshot_reply(sd_bus_message *msg, uint32_t response, const char *path) {
+	const char uri_prefix[] = "file://";
+	char uri[strlen(path) + strlen(uri_prefix) + 1];
+	snprintf(uri, sizeof(uri), "%s%s", uri_prefix, path);
+
+	sd_bus_message *reply = NULL;
+	int ret = sd_bus_message_new_method_return(msg, &reply);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (response == PORTAL_RESPONSE_SUCCESS) {
+		ret = sd_bus_message_append(reply, "ua{sv}", response, 1, "uri", "s", uri);
+	} else {
+		ret = sd_bus_message_append(reply, "ua{sv}", response, 0);
+	}
+	if (ret < 0) {
+		sd_bus_message_unref(reply);
+		return ret;
+	}
+
+	ret = sd_bus_send(NULL, reply, NULL);
+	sd_bus_message_unref(reply);
+	return ret < 0 ? ret : 0;
+}
+
+static void screenshot_captured(bool success, void *data) {
+	sd_bus_message *msg = data;
+
+	int ret = screenshot_reply(msg, success ? PORTAL_RESPONSE_SUCCESS : PORTAL_RESPONSE_ENDED,
+		screenshot_path);
+	if (ret < 0) {
+		logprint(ERROR, "dbus: screenshot: failed to send reply: %s", strerror(-ret));
+	}
+	sd_bus_message_unref(msg);
+}
+
 static int method_screenshot(sd_bus_message *msg, void *data,
 		sd_bus_error *ret_error) {
+	struct xdpw_state *state = data;
 	int ret = 0;
 
 	bool interactive = false;
@@ -116,8 +158,21 @@ static int method_screenshot(sd_bus_message *msg, void *data,
 		return -ENOMEM;
 	}
 
-	// TODO: choose a better path
-	const char path[] = "/tmp/out.png";
+	const char *path = screenshot_path;
+
+	// region selection is left to slurp, full screenshots are taken in-process
+	// and answered once the encoder thread has written the file
+	if (!interactive) {
+		sd_bus_message_ref(msg);
+		if (xdpw_screenshot_capture(&state->screencast, path,
+				state->config->screenshot_conf.png_compression,
+				screenshot_captured, msg) == 0) {
+			return 0;
+		}
+		sd_bus_message_unref(msg);
+		logprint(DEBUG, "screenshot: in-process capture unavailable, running grim");
+	}
+
 	if (interactive && !exec_screenshooter_interactive(path)) {
 		return -1;
 	}
@@ -125,28 +180,7 @@ static int method_screenshot(sd_bus_message *msg, void *data,
 		return -1;
 	}
 
-	const char uri_prefix[] = "file://";
-	char uri[strlen(path) + strlen(uri_prefix) + 1];
-	snprintf(uri, sizeof(uri), "%s%s", uri_prefix, path);
-
-	sd_bus_message *reply = NULL;
-	ret = sd_bus_message_new_method_return(msg, &reply);
-	if (ret < 0) {
-		return ret;
-	}
-
-	ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_SUCCESS, 1, "uri", "s", uri);
-	if (ret < 0) {
-		return ret;
-	}
-
-	ret = sd_bus_send(NULL, reply, NULL);
-	if (ret < 0) {
-		return ret;
-	}
-
-	sd_bus_message_unref(reply);
-	return 0;
+	return screenshot_reply(msg, PORTAL_RESPONSE_SUCCESS, path);
 }
 
 static bool spawn_chooser(int chooser_out[2]) {
@@ -236,9 +270,71 @@ error_img:
 	return false;
 }
 
+static int pick_color_reply(sd_bus_message *msg, uint32_t response,
+		double red, double green, double blue) {
+	sd_bus_message *reply = NULL;
+	int ret = sd_bus_message_new_method_return(msg, &reply);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (response == PORTAL_RESPONSE_SUCCESS) {
+		ret = sd_bus_message_append(reply, "ua{sv}", response, 1, "color", "(ddd)", red, green, blue);
+	} else {
+		ret = sd_bus_message_append(reply, "ua{sv}", response, 0);
+	}
+	if (ret < 0) {
+		sd_bus_message_unref(reply);
+		return ret;
+	}
+
+	ret = sd_bus_send(NULL, reply, NULL);
+	sd_bus_message_unref(reply);
+	return ret < 0 ? ret : 0;
+}
+
+// a PickColor call waiting for slurp or the capture
+struct pick_color_call {
+	struct xdpw_state *state;
+	sd_bus_message *msg;
+};
+
+static void pick_color_call_finish(struct pick_color_call *call, uint32_t response,
+		double red, double green, double blue) {
+	int ret = pick_color_reply(call->msg, response, red, green, blue);
+	if (ret < 0) {
+		logprint(ERROR, "dbus: pick color: failed to send reply: %s", strerror(-ret));
+	}
+	sd_bus_message_unref(call->msg);
+	free(call);
+}
+
+static void pick_color_picked(bool success, double red, double green, double blue,
+		void *data) {
+	pick_color_call_finish(data, success ? PORTAL_RESPONSE_SUCCESS : PORTAL_RESPONSE_ENDED,
+		red, green, blue);
+}
+
+static void pick_color_point_chosen(int status, const char *output, void *data) {
+	struct pick_color_call *call = data;
+
+	int x, y;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+			sscanf(output, "%d %d", &x, &y) != 2) {
+		logprint(DEBUG, "screenshot: color pick canceled");
+		pick_color_call_finish(call, PORTAL_RESPONSE_CANCELLED, 0, 0, 0);
+		return;
+	}
+
+	if (xdpw_screenshot_pick_color(&call->state->screencast, x, y,
+			pick_color_picked, call) < 0) {
+		pick_color_call_finish(call, PORTAL_RESPONSE_ENDED, 0, 0, 0);
+	}
+}
+
 static int method_pick_color(sd_bus_message *msg, void *data,
 		sd_bus_error *ret_error) {
-
+	struct xdpw_state *state = data;
 	int ret = 0;
 
 	char *handle, *app_id, *parent_window;
@@ -253,6 +349,23 @@ static int method_pick_color(sd_bus_message *msg, void *data,
 		return -ENOMEM;
 	}
 
+	// slurp only picks the point, the pixel is read through screencopy
+	if (state->screencast.screencopy_manager) {
+		struct pick_color_call *call = calloc(1, sizeof(*call));
+		if (call == NULL) {
+			return -ENOMEM;
+		}
+		call->state = state;
+		call->msg = sd_bus_message_ref(msg);
+		if (xdpw_child_spawn(state, "slurp -p -f '%x %y'", NULL,
+				pick_color_point_chosen, call) == 0) {
+			return 0;
+		}
+		sd_bus_message_unref(call->msg);
+		free(call);
+		logprint(DEBUG, "screenshot: unable to run slurp, running grim");
+	}
+
 	struct xdpw_ppm_pixel pixel = {0};
 	if (!exec_color_picker(&pixel)) {
 		return -1;
@@ -262,24 +375,7 @@ static int method_pick_color(sd_bus_message *msg, void *data,
 	double green = pixel.green / (pixel.max_color_value * 1.0);
 	double blue = pixel.blue / (pixel.max_color_value * 1.0);
 
-	sd_bus_message *reply = NULL;
-	ret = sd_bus_message_new_method_return(msg, &reply);
-	if (ret < 0) {
-		return ret;
-	}
-
-	ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_SUCCESS, 1, "color", "(ddd)", red, green, blue);
-	if (ret < 0) {
-		return ret;
-	}
-
-	ret = sd_bus_send(NULL, reply, NULL);
-	if (ret < 0) {
-		return ret;
-	}
-
-	sd_bus_message_unref(reply);
-	return 0;
+	return pick_color_reply(msg, PORTAL_RESPONSE_SUCCESS, red, green, blue);
 }
 
 static const sd_bus_vtable screenshot_vtable[] = {
@@ -293,5 +389,5 @@ int xdpw_screenshot_init(struct xdpw_state *state) {
 	// TODO: cleanup
 	sd_bus_slot *slot = NULL;
 	return sd_bus_add_object_vtable(state->bus, &slot, object_path, interface_name,
-		screenshot_vtable, NULL);
+		screenshot_vtable, state);
 }
@@ -0,0 +1,546 @@
+#include "screenshot.h"
+
+#include "wlr-screencopy-unstable-v1-client-protocol.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <libdrm/drm_fourcc.h>
+#include <wayland-client-protocol.h>
+
+#include "shm_allocator.h"
+#include "xdpw.h"
+#include "logger.h"
+
+struct screenshot_output {
+	struct xdpw_screenshot *shot;
+	struct zwlr_screencopy_frame_v1 *frame;
+	struct xdpw_screencopy_frame_info frame_info;
+	struct xdpw_buffer *buffer;
+	bool y_invert;
+
+	// copied at capture time, the output may go away before encoding
+	int32_t transform;
+	int32_t x, y;
+	int32_t logical_width, logical_height;
+};
+
+struct xdpw_screenshot {
+	struct xdpw_screencast_context *ctx;
+	char *path;
+	int png_compression;
+
+	struct screenshot_output *outputs;
+	size_t outputs_len;
+	size_t pending;
+	bool failed;
+
+	// the worker signals the eventfd once the file is written
+	pthread_t thread;
+	int done_fd;
+	struct xdpw_event_source done_source;
+	bool success;
+
+	xdpw_screenshot_done_func_t func;
+	// set for color picks, which read a single pixel instead of writing a file
+	xdpw_pick_color_done_func_t pick_func;
+	void *data;
+};
+
+struct screenshot_channels {
+	uint8_t r, g, b;
+	// 10 bit channels are truncated to 8 bits
+	uint8_t bits;
+};
+
+static bool screenshot_format_channels(uint32_t format, struct screenshot_channels *ch) {
+	switch (format) {
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ARGB8888:
+		*ch = (struct screenshot_channels){ 16, 8, 0, 8 };
+		return true;
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_ABGR8888:
+		*ch = (struct screenshot_channels){ 0, 8, 16, 8 };
+		return true;
+	case DRM_FORMAT_RGBX8888:
+	case DRM_FORMAT_RGBA8888:
+		*ch = (struct screenshot_channels){ 24, 16, 8, 8 };
+		return true;
+	case DRM_FORMAT_BGRX8888:
+	case DRM_FORMAT_BGRA8888:
+		*ch = (struct screenshot_channels){ 8, 16, 24, 8 };
+		return true;
+	case DRM_FORMAT_XRGB2101010:
+	case DRM_FORMAT_ARGB2101010:
+		*ch = (struct screenshot_channels){ 20, 10, 0, 10 };
+		return true;
+	case DRM_FORMAT_XBGR2101010:
+	case DRM_FORMAT_ABGR2101010:
+		*ch = (struct screenshot_channels){ 0, 10, 20, 10 };
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool transform_swaps_axes(int32_t transform) {
+	return transform & WL_OUTPUT_TRANSFORM_90;
+}
+
+static void screenshot_output_logical_size(struct screenshot_output *out,
+		int32_t *width, int32_t *height) {
+	if (out->logical_width > 0 && out->logical_height > 0) {
+		*width = out->logical_width;
+		*height = out->logical_height;
+	} else if (transform_swaps_axes(out->transform)) {
+		*width = out->frame_info.height;
+		*height = out->frame_info.width;
+	} else {
+		*width = out->frame_info.width;
+		*height = out->frame_info.height;
+	}
+}
+
+// maps the center of pixel i of n onto a buffer axis of the given size
+static uint32_t sample_index(uint32_t i, uint32_t n, uint32_t size, bool invert) {
+	uint32_t index = ((2 * (uint64_t)i + 1) * size) / (2 * (uint64_t)n);
+	return invert ? size - 1 - index : index;
+}
+
+static void screenshot_output_draw(struct screenshot_output *out, uint8_t *rgb,
+		uint32_t canvas_width, uint32_t x0, uint32_t y0, uint32_t width, uint32_t height) {
+	struct screenshot_channels ch;
+	screenshot_format_channels(out->frame_info.format, &ch);
+	const uint8_t *src = out->buffer->data;
+	uint32_t stride = out->frame_info.stride;
+	uint32_t buf_width = out->frame_info.width;
+	uint32_t buf_height = out->frame_info.height;
+	uint32_t shift = ch.bits - 8;
+
+	// the inverse output transform takes layout coordinates back into the
+	// buffer, for odd rotations the buffer x axis follows the layout y axis
+	bool swap = transform_swaps_axes(out->transform);
+	bool invert_x, invert_y;
+	switch (out->transform) {
+	case WL_OUTPUT_TRANSFORM_90:
+		invert_x = false, invert_y = true;
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		invert_x = true, invert_y = true;
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		invert_x = true, invert_y = false;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		invert_x = true, invert_y = false;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		invert_x = false, invert_y = false;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		invert_x = false, invert_y = true;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		invert_x = true, invert_y = true;
+		break;
+	default:
+		invert_x = false, invert_y = false;
+		break;
+	}
+	if (out->y_invert) {
+		invert_y = !invert_y;
+	}
+
+	for (uint32_t j = 0; j < height; j++) {
+		uint8_t *dst = rgb + ((size_t)(y0 + j) * canvas_width + x0) * 3;
+		for (uint32_t i = 0; i < width; i++) {
+			uint32_t bx, by;
+			if (swap) {
+				bx = sample_index(j, height, buf_width, invert_x);
+				by = sample_index(i, width, buf_height, invert_y);
+			} else {
+				bx = sample_index(i, width, buf_width, invert_x);
+				by = sample_index(j, height, buf_height, invert_y);
+			}
+			uint32_t pixel;
+			memcpy(&pixel, src + (size_t)by * stride + (size_t)bx * 4, sizeof(pixel));
+			dst[0] = ((pixel >> ch.r) & ((1u << ch.bits) - 1)) >> shift;
+			dst[1] = ((pixel >> ch.g) & ((1u << ch.bits) - 1)) >> shift;
+			dst[2] = ((pixel >> ch.b) & ((1u << ch.bits) - 1)) >> shift;
+			dst += 3;
+		}
+	}
+}
+
+static bool screenshot_write(struct xdpw_screenshot *shot, const uint8_t *rgb,
+		uint32_t width, uint32_t height) {
+	size_t len = strlen(shot->path);
+	char tmp_path[len + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", shot->path);
+	int fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		logprint(ERROR, "screenshot: failed to create %s: %s", tmp_path, strerror(errno));
+		return false;
+	}
+	FILE *f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+		unlink(tmp_path);
+		return false;
+	}
+
+	bool ok = xdpw_png_write(f, rgb, width, height, shot->png_compression) == 0;
+	ok = (fclose(f) == 0) && ok;
+	// readers never see a partially written file
+	if (ok && rename(tmp_path, shot->path) < 0) {
+		logprint(ERROR, "screenshot: failed to rename %s: %s", tmp_path, strerror(errno));
+		ok = false;
+	}
+	if (!ok) {
+		unlink(tmp_path);
+	}
+	return ok;
+}
+
+static uint32_t round_up(double value) {
+	uint32_t rounded = value;
+	return rounded < value ? rounded + 1 : rounded;
+}
+
+static uint32_t round_nearest(double value) {
+	return value + 0.5;
+}
+
+static void *screenshot_worker(void *data) {
+	struct xdpw_screenshot *shot = data;
+
+	// the image covers the bounding box of the layout at the highest output scale
+	int32_t min_x = INT32_MAX, min_y = INT32_MAX, max_x = INT32_MIN, max_y = INT32_MIN;
+	double scale = 1.0;
+	for (size_t i = 0; i < shot->outputs_len; i++) {
+		struct screenshot_output *out = &shot->outputs[i];
+		int32_t width, height;
+		screenshot_output_logical_size(out, &width, &height);
+		min_x = out->x < min_x ? out->x : min_x;
+		min_y = out->y < min_y ? out->y : min_y;
+		max_x = out->x + width > max_x ? out->x + width : max_x;
+		max_y = out->y + height > max_y ? out->y + height : max_y;
+
+		uint32_t buf_width = transform_swaps_axes(out->transform) ?
+			out->frame_info.height : out->frame_info.width;
+		double out_scale = (double)buf_width / width;
+		scale = out_scale > scale ? out_scale : scale;
+	}
+
+	uint32_t canvas_width = round_up((max_x - min_x) * scale);
+	uint32_t canvas_height = round_up((max_y - min_y) * scale);
+	uint8_t *rgb = calloc((size_t)canvas_width * canvas_height, 3);
+	if (rgb == NULL) {
+		logprint(ERROR, "screenshot: failed to allocate a %ux%u image",
+			canvas_width, canvas_height);
+		goto out;
+	}
+
+	for (size_t i = 0; i < shot->outputs_len; i++) {
+		struct screenshot_output *out = &shot->outputs[i];
+		int32_t width, height;
+		screenshot_output_logical_size(out, &width, &height);
+		uint32_t x0 = round_nearest((out->x - min_x) * scale);
+		uint32_t y0 = round_nearest((out->y - min_y) * scale);
+		uint32_t x1 = round_nearest((out->x + width - min_x) * scale);
+		uint32_t y1 = round_nearest((out->y + height - min_y) * scale);
+		x1 = x1 > canvas_width ? canvas_width : x1;
+		y1 = y1 > canvas_height ? canvas_height : y1;
+		screenshot_output_draw(out, rgb, canvas_width, x0, y0, x1 - x0, y1 - y0);
+	}
+
+	shot->success = screenshot_write(shot, rgb, canvas_width, canvas_height);
+	free(rgb);
+
+out:;
+	uint64_t one = 1;
+	if (write(shot->done_fd, &one, sizeof(one)) < 0) {
+		logprint(ERROR, "screenshot: failed to signal completion: %s", strerror(errno));
+	}
+	return NULL;
+}
+
+static void screenshot_destroy(struct xdpw_screenshot *shot) {
+	for (size_t i = 0; i < shot->outputs_len; i++) {
+		struct screenshot_output *out = &shot->outputs[i];
+		if (out->frame) {
+			zwlr_screencopy_frame_v1_destroy(out->frame);
+		}
+		if (out->buffer) {
+			xdpw_shm_buffer_release(out->buffer);
+		}
+	}
+	xdpw_event_loop_remove(&shot->done_source);
+	if (shot->done_fd >= 0) {
+		close(shot->done_fd);
+	}
+	free(shot->outputs);
+	free(shot->path);
+	free(shot);
+}
+
+static void screenshot_finish(struct xdpw_screenshot *shot, bool success) {
+	if (shot->pick_func) {
+		shot->pick_func(false, 0, 0, 0, shot->data);
+		screenshot_destroy(shot);
+		return;
+	}
+	logprint(DEBUG, "screenshot: %s %s", success ? "wrote" : "failed to write", shot->path);
+	shot->func(success, shot->data);
+	screenshot_destroy(shot);
+}
+
+static void screenshot_pick_finish(struct xdpw_screenshot *shot) {
+	struct screenshot_output *out = &shot->outputs[0];
+	struct screenshot_channels ch;
+	screenshot_format_channels(out->frame_info.format, &ch);
+
+	// the region may come back larger than 1x1 on scaled outputs, any of its
+	// pixels will do
+	const uint8_t *row = out->buffer->data;
+	if (out->y_invert) {
+		row += (size_t)(out->frame_info.height - 1) * out->frame_info.stride;
+	}
+	uint32_t pixel;
+	memcpy(&pixel, row, sizeof(pixel));
+
+	double max = (1u << ch.bits) - 1;
+	double red = ((pixel >> ch.r) & ((1u << ch.bits) - 1)) / max;
+	double green = ((pixel >> ch.g) & ((1u << ch.bits) - 1)) / max;
+	double blue = ((pixel >> ch.b) & ((1u << ch.bits) - 1)) / max;
+	logprint(DEBUG, "screenshot: picked color %f %f %f", red, green, blue);
+
+	shot->pick_func(true, red, green, blue, shot->data);
+	screenshot_destroy(shot);
+}
+
+static int screenshot_handle_done(struct xdpw_event_source *source, uint32_t events) {
+	struct xdpw_screenshot *shot = source->data;
+
+	pthread_join(shot->thread, NULL);
+	screenshot_finish(shot, shot->success);
+	return 0;
+}
+
+static void screenshot_output_done(struct screenshot_output *out, bool failed) {
+	struct xdpw_screenshot *shot = out->shot;
+
+	zwlr_screencopy_frame_v1_destroy(out->frame);
+	out->frame = NULL;
+	shot->failed |= failed;
+	if (--shot->pending > 0) {
+		return;
+	}
+
+	if (shot->failed) {
+		screenshot_finish(shot, false);
+		return;
+	}
+
+	if (shot->pick_func) {
+		screenshot_pick_finish(shot);
+		return;
+	}
+
+	if (pthread_create(&shot->thread, NULL, screenshot_worker, shot) != 0) {
+		logprint(ERROR, "screenshot: failed to start the encoder thread");
+		screenshot_finish(shot, false);
+	}
+}
+
+static void screenshot_frame_buffer_done(void *data,
+		struct zwlr_screencopy_frame_v1 *frame) {
+	struct screenshot_output *out = data;
+	struct xdpw_screencast_context *ctx = out->shot->ctx;
+
+	struct screenshot_channels ch;
+	if (!screenshot_format_channels(out->frame_info.format, &ch)) {
+		logprint(ERROR, "screenshot: unsupported shm format %.4s",
+			(char *)&out->frame_info.format);
+		screenshot_output_done(out, true);
+		return;
+	}
+
+	out->buffer = xdpw_shm_buffer_acquire(ctx, &out->frame_info, NULL);
+	if (out->buffer == NULL) {
+		screenshot_output_done(out, true);
+		return;
+	}
+	zwlr_screencopy_frame_v1_copy(frame, out->buffer->buffer);
+}
+
+static void screenshot_frame_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame,
+		uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+	struct screenshot_output *out = data;
+
+	out->frame_info.width = width;
+	out->frame_info.height = height;
+	out->frame_info.stride = stride;
+	out->frame_info.size = stride * height;
+	out->frame_info.format = xdpw_format_drm_fourcc_from_wl_shm(format);
+
+	if (zwlr_screencopy_frame_v1_get_version(frame) < 3) {
+		screenshot_frame_buffer_done(out, frame);
+	}
+}
+
+static void screenshot_frame_flags(void *data, struct zwlr_screencopy_frame_v1 *frame,
+		uint32_t flags) {
+	struct screenshot_output *out = data;
+
+	out->y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+}
+
+static void screenshot_frame_ready(void *data, struct zwlr_screencopy_frame_v1 *frame,
+		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+	screenshot_output_done(data, false);
+}
+
+static void screenshot_frame_failed(void *data,
+		struct zwlr_screencopy_frame_v1 *frame) {
+	logprint(ERROR, "screenshot: compositor failed to copy an output");
+	screenshot_output_done(data, true);
+}
+
+static void screenshot_frame_damage(void *data, struct zwlr_screencopy_frame_v1 *frame,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+	// only sent for copy_with_damage
+}
+
+static void screenshot_frame_linux_dmabuf(void *data,
+		struct zwlr_screencopy_frame_v1 *frame,
+		uint32_t format, uint32_t width, uint32_t height) {
+	// the encoder reads the pixels on the cpu, shm is all we need
+}
+
+static const struct zwlr_screencopy_frame_v1_listener screenshot_frame_listener = {
+	.buffer = screenshot_frame_buffer,
+	.buffer_done = screenshot_frame_buffer_done,
+	.flags = screenshot_frame_flags,
+	.ready = screenshot_frame_ready,
+	.failed = screenshot_frame_failed,
+	.damage = screenshot_frame_damage,
+	.linux_dmabuf = screenshot_frame_linux_dmabuf,
+};
+
+static struct xdpw_screenshot *screenshot_create(struct xdpw_screencast_context *ctx,
+		size_t outputs_len) {
+	struct xdpw_screenshot *shot = calloc(1, sizeof(*shot));
+	if (shot == NULL) {
+		return NULL;
+	}
+	shot->ctx = ctx;
+	shot->done_fd = -1;
+	shot->outputs_len = outputs_len;
+	shot->outputs = calloc(shot->outputs_len, sizeof(*shot->outputs));
+	if (shot->outputs == NULL) {
+		free(shot);
+		return NULL;
+	}
+	for (size_t i = 0; i < outputs_len; i++) {
+		shot->outputs[i].shot = shot;
+	}
+	shot->pending = outputs_len;
+	return shot;
+}
+
+static void screenshot_output_capture(struct screenshot_output *out,
+		struct zwlr_screencopy_frame_v1 *frame, struct xdpw_wlr_output *output) {
+	out->transform = output->transform;
+	out->x = output->x;
+	out->y = output->y;
+	out->logical_width = output->logical_width;
+	out->logical_height = output->logical_height;
+	out->frame = frame;
+	zwlr_screencopy_frame_v1_add_listener(out->frame, &screenshot_frame_listener, out);
+}
+
+int xdpw_screenshot_capture(struct xdpw_screencast_context *ctx, const char *path,
+		int png_compression, xdpw_screenshot_done_func_t func, void *data) {
+	if (!ctx->screencopy_manager || !ctx->shm || wl_list_empty(&ctx->output_list)) {
+		return -1;
+	}
+
+	struct xdpw_screenshot *shot = screenshot_create(ctx, wl_list_length(&ctx->output_list));
+	if (shot == NULL) {
+		return -1;
+	}
+	shot->png_compression = png_compression;
+	shot->func = func;
+	shot->data = data;
+	shot->path = strdup(path);
+	shot->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (shot->path == NULL || shot->done_fd < 0) {
+		logprint(ERROR, "screenshot: failed to set up capture");
+		screenshot_destroy(shot);
+		return -1;
+	}
+
+	shot->done_source = (struct xdpw_event_source){
+		.fd = shot->done_fd,
+		.events = EPOLLIN,
+		.priority = XDPW_EVENT_PRIORITY_CONTROL,
+		.func = screenshot_handle_done,
+		.data = shot,
+	};
+	if (xdpw_event_loop_add(&ctx->state->event_loop, &shot->done_source) < 0) {
+		screenshot_destroy(shot);
+		return -1;
+	}
+
+	size_t i = 0;
+	struct xdpw_wlr_output *output;
+	wl_list_for_each(output, &ctx->output_list, link) {
+		screenshot_output_capture(&shot->outputs[i++],
+			zwlr_screencopy_manager_v1_capture_output(ctx->screencopy_manager, 0,
+				output->output),
+			output);
+	}
+
+	logprint(DEBUG, "screenshot: capturing %zu outputs into %s", shot->outputs_len, path);
+	return 0;
+}
+
+int xdpw_screenshot_pick_color(struct xdpw_screencast_context *ctx, int32_t x, int32_t y,
+		xdpw_pick_color_done_func_t func, void *data) {
+	if (!ctx->screencopy_manager || !ctx->shm) {
+		return -1;
+	}
+
+	struct xdpw_wlr_output *output, *match = NULL;
+	wl_list_for_each(output, &ctx->output_list, link) {
+		if (x >= output->x && x < output->x + output->logical_width &&
+				y >= output->y && y < output->y + output->logical_height) {
+			match = output;
+			break;
+		}
+	}
+	if (match == NULL) {
+		logprint(ERROR, "screenshot: no output at %d,%d", x, y);
+		return -1;
+	}
+
+	struct xdpw_screenshot *shot = screenshot_create(ctx, 1);
+	if (shot == NULL) {
+		return -1;
+	}
+	shot->pick_func = func;
+	shot->data = data;
+
+	screenshot_output_capture(&shot->outputs[0],
+		zwlr_screencopy_manager_v1_capture_output_region(ctx->screencopy_manager, 0,
+			match->output, x - match->x, y - match->y, 1, 1),
+		match);
+
+	logprint(DEBUG, "screenshot: picking color at %d,%d on %s", x, y, match->name);
+	return 0;
+}
@@ -0,0 +1,87 @@
+#undef NDEBUG
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libdrm/drm_fourcc.h>
+
+#include "convert.h"
+
+#define MAX_WIDTH 67
+#define MAX_HEIGHT 9
+
+// straightforward versions of what the kernels do
+static void reference(uint8_t *dst, const uint8_t *src, uint32_t stride, uint32_t height,
+		bool flip_y, uint32_t swap_mask) {
+	for (uint32_t y = 0; y < height; y++) {
+		const uint8_t *row = src + (size_t)(flip_y ? height - 1 - y : y) * stride;
+		memcpy(dst + (size_t)y * stride, row, stride);
+		if (swap_mask == 0) {
+			continue;
+		}
+		// the lower of the swapped channels sits at byte 0 or 1
+		uint32_t low = swap_mask == 0xff ? 0 : 1;
+		for (uint32_t x = 0; x + 4 <= stride; x += 4) {
+			uint8_t *pixel = dst + (size_t)y * stride + x;
+			uint8_t tmp = pixel[low];
+			pixel[low] = pixel[low + 2];
+			pixel[low + 2] = tmp;
+		}
+	}
+}
+
+static void check(const struct xdpw_convert_kernel *kernel, uint32_t stride,
+		uint32_t height, bool flip_y, uint32_t swap_mask) {
+	static uint8_t src[MAX_WIDTH * 4 * MAX_HEIGHT];
+	static uint8_t expected[sizeof(src)], data[sizeof(src)];
+	size_t size = (size_t)stride * height;
+	for (size_t i = 0; i < size; i++) {
+		src[i] = rand();
+	}
+	reference(expected, src, stride, height, flip_y, swap_mask);
+	memcpy(data, src, size);
+	kernel->convert(data, stride, height, flip_y, swap_mask);
+	assert(memcmp(data, expected, size) == 0);
+}
+
+// every width hits the vector loops and the pixel tails, heights include
+// the odd middle row and a single row
+static void test_kernels(void) {
+	const struct xdpw_convert_kernel *kernels;
+	size_t count = xdpw_convert_get_kernels(&kernels);
+	assert(count > 0);
+
+	uint32_t masks[] = {
+		xdpw_convert_swap_rb_mask(DRM_FORMAT_XRGB8888),
+		xdpw_convert_swap_rb_mask(DRM_FORMAT_BGRX8888),
+	};
+	for (size_t k = 0; k < count; k++) {
+		for (uint32_t width = 1; width <= MAX_WIDTH; width++) {
+			for (uint32_t height = 1; height <= MAX_HEIGHT; height++) {
+				uint32_t stride = width * 4;
+				check(&kernels[k], stride, height, true, 0);
+				for (size_t m = 0; m < 2; m++) {
+					check(&kernels[k], stride, height, false, masks[m]);
+					check(&kernels[k], stride, height, true, masks[m]);
+				}
+			}
+		}
+		// flips don't care about pixels
+		check(&kernels[k], 4 * MAX_WIDTH - 3, MAX_HEIGHT, true, 0);
+	}
+}
+
+static void test_swap_rb_mask(void) {
+	assert(xdpw_convert_swap_rb_mask(DRM_FORMAT_ARGB8888) == 0x000000ff);
+	assert(xdpw_convert_swap_rb_mask(DRM_FORMAT_XBGR8888) == 0x000000ff);
+	assert(xdpw_convert_swap_rb_mask(DRM_FORMAT_RGBA8888) == 0x0000ff00);
+	assert(xdpw_convert_swap_rb_mask(DRM_FORMAT_BGRX8888) == 0x0000ff00);
+	// ten bit channels don't line up with bytes
+	assert(xdpw_convert_swap_rb_mask(DRM_FORMAT_XRGB2101010) == 0);
+	assert(xdpw_convert_swap_rb_mask(DRM_FORMAT_NV12) == 0);
+}
+
+int main(void) {
+	test_kernels();
+	test_swap_rb_mask();
+	return 0;
+}
@@ -0,0 +1,104 @@
+#undef NDEBUG
+#include <assert.h>
+
+#include "convert.h"
+#include "screencast_common.h"
+
+static struct xdpw_frame_damage rect(uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+	return (struct xdpw_frame_damage){ x, y, width, height };
+}
+
+static bool rect_equal(struct xdpw_frame_damage a, struct xdpw_frame_damage b) {
+	return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+}
+
+static void test_add_contained(void) {
+	struct xdpw_damage_list list = { 0 };
+	xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ 0, 0, 100, 100 });
+	xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ 10, 10, 20, 20 });
+	assert(list.count == 1);
+	assert(rect_equal(list.regions[0], rect(0, 0, 100, 100)));
+
+	// empty regions are dropped
+	xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ 200, 200, 0, 10 });
+	assert(list.count == 1);
+}
+
+static void test_add_covering(void) {
+	struct xdpw_damage_list list = { 0 };
+	xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ 10, 10, 5, 5 });
+	xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ 50, 50, 5, 5 });
+	xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ 500, 500, 5, 5 });
+	assert(list.count == 3);
+
+	// replaces the first two, keeps the third
+	xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ 0, 0, 100, 100 });
+	assert(list.count == 2);
+	bool big = false, far = false;
+	for (uint32_t i = 0; i < list.count; i++) {
+		big |= rect_equal(list.regions[i], rect(0, 0, 100, 100));
+		far |= rect_equal(list.regions[i], rect(500, 500, 5, 5));
+	}
+	assert(big && far);
+}
+
+static void test_add_overflow(void) {
+	struct xdpw_damage_list list = { 0 };
+	for (uint32_t i = 0; i < XDPW_DAMAGE_REGIONS_MAX; i++) {
+		xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ i * 10, 0, 5, 5 });
+	}
+	assert(list.count == XDPW_DAMAGE_REGIONS_MAX);
+
+	// one more collapses everything into the bounding box
+	xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ 0, 100, 5, 5 });
+	assert(list.count == 1);
+	assert(rect_equal(list.regions[0],
+		rect(0, 0, (XDPW_DAMAGE_REGIONS_MAX - 1) * 10 + 5, 105)));
+}
+
+static void test_merge_bounds(void) {
+	struct xdpw_damage_list a = { 0 }, b = { 0 };
+	xdpw_damage_list_add(&a, &(struct xdpw_frame_damage){ 0, 0, 10, 10 });
+	xdpw_damage_list_add(&b, &(struct xdpw_frame_damage){ 2, 2, 4, 4 });
+	xdpw_damage_list_add(&b, &(struct xdpw_frame_damage){ 20, 30, 10, 10 });
+	xdpw_damage_list_merge(&a, &b);
+	assert(a.count == 2);
+
+	struct xdpw_frame_damage bounds;
+	xdpw_damage_list_bounds(&a, &bounds);
+	assert(rect_equal(bounds, rect(0, 0, 30, 40)));
+}
+
+static void test_area(void) {
+	struct xdpw_damage_list list = { 0 };
+	assert(xdpw_damage_list_area(&list) == 0);
+	// a text cursor
+	xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ 100, 100, 2, 20 });
+	assert(xdpw_damage_list_area(&list) == 40);
+	xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ 0, 0, 3840, 2160 });
+	assert(xdpw_damage_list_area(&list) == 3840 * 2160);
+}
+
+static void test_flip_y(void) {
+	struct xdpw_damage_list list = { 0 };
+	xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ 0, 0, 10, 10 });
+	xdpw_damage_list_add(&list, &(struct xdpw_frame_damage){ 5, 70, 10, 30 });
+	xdpw_convert_flip_damage_y(&list, 100);
+	assert(rect_equal(list.regions[0], rect(0, 90, 10, 10)));
+	assert(rect_equal(list.regions[1], rect(5, 0, 10, 30)));
+
+	// flipping twice is the identity
+	xdpw_convert_flip_damage_y(&list, 100);
+	assert(rect_equal(list.regions[0], rect(0, 0, 10, 10)));
+	assert(rect_equal(list.regions[1], rect(5, 70, 10, 30)));
+}
+
+int main(void) {
+	test_add_contained();
+	test_add_covering();
+	test_add_overflow();
+	test_merge_bounds();
+	test_area();
+	test_flip_y();
+	return 0;
+}
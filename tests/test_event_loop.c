@@ -0,0 +1,94 @@
+#undef NDEBUG
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+
+struct test_source {
+	struct xdpw_event_source source;
+	int dispatched;
+	// removed and freed from within func
+	struct test_source *victim;
+};
+
+static int handle_event(struct xdpw_event_source *source, uint32_t events) {
+	struct test_source *t = source->data;
+	uint64_t val;
+	assert(read(source->fd, &val, sizeof(val)) == sizeof(val));
+	t->dispatched++;
+	struct test_source *victim = t->victim;
+	t->victim = NULL;
+	if (victim) {
+		xdpw_event_loop_remove(&victim->source);
+		close(victim->source.fd);
+		free(victim);
+	}
+	return 0;
+}
+
+static struct test_source *add_source(struct xdpw_event_loop *loop,
+		enum xdpw_event_priority priority) {
+	struct test_source *t = calloc(1, sizeof(*t));
+	assert(t);
+	t->source = (struct xdpw_event_source){
+		.fd = eventfd(1, EFD_CLOEXEC | EFD_NONBLOCK),
+		.events = EPOLLIN,
+		.priority = priority,
+		.func = handle_event,
+		.data = t,
+	};
+	assert(t->source.fd >= 0);
+	assert(xdpw_event_loop_add(loop, &t->source) == 0);
+	return t;
+}
+
+static void destroy_source(struct test_source *t) {
+	xdpw_event_loop_remove(&t->source);
+	close(t->source.fd);
+	free(t);
+}
+
+static void test_remove_next(void) {
+	struct xdpw_event_loop loop;
+	assert(xdpw_event_loop_init(&loop) == 0);
+
+	// all three are ready, the first frees the one dispatched after it
+	struct test_source *a = add_source(&loop, XDPW_EVENT_PRIORITY_FRAME);
+	struct test_source *b = add_source(&loop, XDPW_EVENT_PRIORITY_FRAME);
+	struct test_source *c = add_source(&loop, XDPW_EVENT_PRIORITY_STREAM);
+	a->victim = b;
+
+	assert(xdpw_event_loop_dispatch(&loop, 0) == 0);
+	assert(a->dispatched == 1);
+	assert(c->dispatched == 1);
+	assert(wl_list_length(&loop.sources) == 2);
+
+	destroy_source(a);
+	destroy_source(c);
+	xdpw_event_loop_finish(&loop);
+}
+
+static void test_remove_self(void) {
+	struct xdpw_event_loop loop;
+	assert(xdpw_event_loop_init(&loop) == 0);
+
+	struct test_source *a = add_source(&loop, XDPW_EVENT_PRIORITY_FRAME);
+	struct test_source *b = add_source(&loop, XDPW_EVENT_PRIORITY_CONTROL);
+	a->victim = a;
+
+	assert(xdpw_event_loop_dispatch(&loop, 0) == 0);
+	assert(b->dispatched == 1);
+	assert(wl_list_length(&loop.sources) == 1);
+
+	destroy_source(b);
+	xdpw_event_loop_finish(&loop);
+}
+
+int main(void) {
+	test_remove_next();
+	test_remove_self();
+	return 0;
+}
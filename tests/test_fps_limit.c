@@ -0,0 +1,44 @@
+#undef NDEBUG
+#include <assert.h>
+
+#include "fps_limit.h"
+#include "timespec_util.h"
+
+static struct timespec after(struct timespec t, int64_t ns) {
+	timespec_add(&t, ns);
+	return t;
+}
+
+static void test_idle(void) {
+	struct timespec change = { .tv_sec = 100 };
+
+	// 30 frames at 60 fps are half a second
+	struct timespec now = after(change, 499 * 1000000);
+	assert(!fps_limit_is_idle(&change, &now, 30, 60));
+	now = after(change, 500 * 1000000);
+	assert(fps_limit_is_idle(&change, &now, 30, 60));
+
+	// wall time counts, not the number of captured frames, and a lower
+	// rate stretches the period
+	now = after(change, 600 * 1000000);
+	assert(!fps_limit_is_idle(&change, &now, 30, 30));
+	now = after(change, TIMESPEC_NSEC_PER_SEC);
+	assert(fps_limit_is_idle(&change, &now, 30, 30));
+}
+
+static void test_disabled(void) {
+	struct timespec change = { .tv_sec = 100 };
+	struct timespec now = after(change, 10 * TIMESPEC_NSEC_PER_SEC);
+	assert(!fps_limit_is_idle(&change, &now, 0, 60));
+	assert(!fps_limit_is_idle(&change, &now, 30, 0));
+
+	// nothing was captured yet
+	struct timespec none = { 0 };
+	assert(!fps_limit_is_idle(&none, &now, 30, 60));
+}
+
+int main(void) {
+	test_idle();
+	test_disabled();
+	return 0;
+}
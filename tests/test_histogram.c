@@ -0,0 +1,69 @@
+#undef NDEBUG
+#include <assert.h>
+
+#include "stats.h"
+
+static void test_bucket_max(void) {
+	// exact below the first octave
+	for (size_t i = 0; i < 8; i++) {
+		assert(xdpw_histogram_bucket_max(i) == i);
+	}
+	// 8 steps per octave: 8-8, 9-9, ... then 16-17, 18-19, ...
+	assert(xdpw_histogram_bucket_max(8) == 8);
+	assert(xdpw_histogram_bucket_max(15) == 15);
+	assert(xdpw_histogram_bucket_max(16) == 17);
+	assert(xdpw_histogram_bucket_max(23) == 31);
+	assert(xdpw_histogram_bucket_max(24) == 35);
+	// the last bucket ends right below 2^32
+	assert(xdpw_histogram_bucket_max(XDPW_HISTOGRAM_BUCKETS - 1) == UINT32_MAX);
+
+	for (size_t i = 1; i < XDPW_HISTOGRAM_BUCKETS; i++) {
+		assert(xdpw_histogram_bucket_max(i) > xdpw_histogram_bucket_max(i - 1));
+	}
+}
+
+// every value lands in the bucket whose range contains it
+static void test_record(void) {
+	uint64_t values[] = { 0, 1, 7, 8, 9, 16, 17, 100, 1000, 16667, 33333,
+		1000000, UINT32_MAX };
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		struct xdpw_histogram histogram = { 0 };
+		xdpw_histogram_record(&histogram, values[i]);
+		size_t bucket = 0;
+		while (histogram.buckets[bucket] == 0) {
+			bucket++;
+		}
+		assert(values[i] <= xdpw_histogram_bucket_max(bucket));
+		assert(bucket == 0 || values[i] > xdpw_histogram_bucket_max(bucket - 1));
+		assert(histogram.count == 1);
+		assert(histogram.max == values[i]);
+	}
+
+	// out of range values are clamped into the last bucket
+	struct xdpw_histogram histogram = { 0 };
+	xdpw_histogram_record(&histogram, UINT64_C(1) << 40);
+	assert(histogram.buckets[XDPW_HISTOGRAM_BUCKETS - 1] == 1);
+}
+
+static void test_percentile(void) {
+	struct xdpw_histogram histogram = { 0 };
+	assert(xdpw_histogram_percentile(&histogram, 50) == 0);
+
+	for (uint64_t i = 1; i <= 100; i++) {
+		xdpw_histogram_record(&histogram, i * 100);
+	}
+	// buckets are at most 1/8th of an octave wide
+	uint64_t p50 = xdpw_histogram_percentile(&histogram, 50);
+	assert(p50 >= 5000 && p50 <= 5000 + 5000 / 8);
+	uint64_t p99 = xdpw_histogram_percentile(&histogram, 99);
+	assert(p99 >= 9900 && p99 <= 10000);
+	// never beyond the largest value
+	assert(xdpw_histogram_percentile(&histogram, 100) == 10000);
+}
+
+int main(void) {
+	test_bucket_max();
+	test_record();
+	test_percentile();
+	return 0;
+}
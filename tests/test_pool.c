@@ -0,0 +1,64 @@
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+
+#include "pool.h"
+
+struct object {
+	int value;
+	char data[60];
+};
+
+static void test_reuse(void) {
+	struct xdpw_pool pool = { .size = sizeof(struct object) };
+
+	struct object *a = xdpw_pool_alloc(&pool);
+	assert(a && a->value == 0);
+	a->value = 42;
+	memset(a->data, 0xff, sizeof(a->data));
+	xdpw_pool_free(&pool, a);
+	assert(pool.free_len == 1);
+
+	// the freed object comes back zeroed
+	struct object *b = xdpw_pool_alloc(&pool);
+	assert(b == a);
+	assert(b->value == 0);
+	for (size_t i = 0; i < sizeof(b->data); i++) {
+		assert(b->data[i] == 0);
+	}
+	assert(pool.free_len == 0);
+
+	xdpw_pool_free(&pool, b);
+	xdpw_pool_free(&pool, NULL);
+	assert(pool.free_len == 1);
+	xdpw_pool_finish(&pool);
+	assert(pool.free_len == 0);
+}
+
+static void test_limit(void) {
+	struct xdpw_pool pool = { .size = sizeof(struct object) };
+	struct object *objs[XDPW_POOL_MAX + 4];
+	for (size_t i = 0; i < XDPW_POOL_MAX + 4; i++) {
+		objs[i] = xdpw_pool_alloc(&pool);
+		assert(objs[i]);
+	}
+	// objects beyond the limit are freed right away
+	for (size_t i = 0; i < XDPW_POOL_MAX + 4; i++) {
+		xdpw_pool_free(&pool, objs[i]);
+	}
+	assert(pool.free_len == XDPW_POOL_MAX);
+
+	xdpw_pool_finish(&pool);
+	assert(pool.free_len == 0);
+	// still usable after finish
+	struct object *obj = xdpw_pool_alloc(&pool);
+	assert(obj);
+	xdpw_pool_free(&pool, obj);
+	xdpw_pool_finish(&pool);
+}
+
+int main(void) {
+	test_reuse();
+	test_limit();
+	return 0;
+}
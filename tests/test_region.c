@@ -0,0 +1,66 @@
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+
+#include "wlr_screencast.h"
+
+static void test_parse(void) {
+	struct xdpw_chooser_selection sel;
+	assert(xdpw_wlr_parse_selection("DP-1", &sel));
+	assert(strcmp(sel.name, "DP-1") == 0);
+	assert(!sel.with_region);
+
+	assert(xdpw_wlr_parse_selection("HDMI-A-1 10,-20 300x200", &sel));
+	assert(strcmp(sel.name, "HDMI-A-1") == 0);
+	assert(sel.with_region);
+	assert(sel.x == 10 && sel.y == -20);
+	assert(sel.width == 300 && sel.height == 200);
+
+	// partial regions are rejected
+	assert(!xdpw_wlr_parse_selection("DP-1 10,20", &sel));
+	assert(!xdpw_wlr_parse_selection("DP-1 10,20 300", &sel));
+	assert(!xdpw_wlr_parse_selection("", &sel));
+
+	// the name is cut at the buffer size
+	char line[2 * XDPW_CHILD_OUTPUT_MAX];
+	memset(line, 'a', sizeof(line) - 1);
+	line[sizeof(line) - 1] = '\0';
+	assert(xdpw_wlr_parse_selection(line, &sel));
+	assert(strlen(sel.name) == XDPW_CHILD_OUTPUT_MAX - 1);
+}
+
+static void test_clip(void) {
+	struct xdpw_wlr_output output = {
+		.x = 1920,
+		.y = 0,
+		.logical_width = 1280,
+		.logical_height = 720,
+	};
+	struct xdpw_capture_target target = { .output = &output };
+
+	// made output local
+	assert(xdpw_wlr_target_clip_region(&target, 2000, 100, 200, 100));
+	assert(target.with_region);
+	assert(target.x == 80 && target.y == 100);
+	assert(target.width == 200 && target.height == 100);
+
+	// clipped to the output
+	assert(xdpw_wlr_target_clip_region(&target, 1800, -50, 300, 100));
+	assert(target.with_region);
+	assert(target.x == 0 && target.y == 0);
+	assert(target.width == 180 && target.height == 50);
+
+	// covering the whole output is no region at all
+	assert(xdpw_wlr_target_clip_region(&target, 0, -100, 4000, 2000));
+	assert(!target.with_region);
+
+	// entirely on another output
+	assert(!xdpw_wlr_target_clip_region(&target, 0, 0, 1920, 1080));
+	assert(!xdpw_wlr_target_clip_region(&target, 3200, 0, 100, 100));
+}
+
+int main(void) {
+	test_parse();
+	test_clip();
+	return 0;
+}
@@ -0,0 +1,103 @@
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "restore_data.h"
+
+// meson treats this exit code as a skipped test
+#define EXIT_SKIP 77
+
+// writes the a{sv} of a Start reply and reads it back like SelectSources,
+// out points into the returned message
+static sd_bus_message *round_trip(sd_bus *bus, const struct xdpw_restore_data *in,
+		struct xdpw_restore_data *out) {
+	sd_bus_message *msg = NULL;
+	assert(sd_bus_message_new_method_call(bus, &msg, "org.example.Test",
+		"/org/example/Test", "org.example.Test", "Test") >= 0);
+	assert(sd_bus_message_open_container(msg, 'a', "{sv}") >= 0);
+	assert(xdpw_restore_data_append(msg, in) >= 0);
+	assert(sd_bus_message_close_container(msg) >= 0);
+	assert(sd_bus_message_seal(msg, 1, 0) >= 0);
+	assert(sd_bus_message_rewind(msg, true) >= 0);
+
+	const char *key;
+	assert(sd_bus_message_enter_container(msg, 'a', "{sv}") > 0);
+	assert(sd_bus_message_enter_container(msg, 'e', "sv") > 0);
+	assert(sd_bus_message_read(msg, "s", &key) > 0);
+	assert(strcmp(key, "restore_data") == 0);
+	assert(xdpw_restore_data_read(msg, out) == 1);
+	// the reader consumed the whole variant
+	assert(sd_bus_message_exit_container(msg) >= 0);
+	assert(sd_bus_message_exit_container(msg) >= 0);
+	assert(sd_bus_message_at_end(msg, true) > 0);
+	return msg;
+}
+
+static void test_output(sd_bus *bus) {
+	struct xdpw_restore_data in = {
+		.output = "DP-1",
+		.make = "Foo Corp",
+		.model = "Monitor 3000",
+	}, out;
+	sd_bus_message *msg = round_trip(bus, &in, &out);
+	assert(strcmp(out.output, "DP-1") == 0);
+	assert(strcmp(out.make, "Foo Corp") == 0);
+	assert(strcmp(out.model, "Monitor 3000") == 0);
+	assert(!out.with_region);
+	sd_bus_message_unref(msg);
+}
+
+static void test_region(sd_bus *bus) {
+	struct xdpw_restore_data in = {
+		.output = "HDMI-A-1",
+		.with_region = true,
+		.x = 10, .y = 20,
+		.width = 300, .height = 200,
+	}, out;
+	sd_bus_message *msg = round_trip(bus, &in, &out);
+	assert(strcmp(out.output, "HDMI-A-1") == 0);
+	// make and model are only written together
+	assert(out.make == NULL && out.model == NULL);
+	assert(out.with_region);
+	assert(out.x == 10 && out.y == 20);
+	assert(out.width == 300 && out.height == 200);
+	sd_bus_message_unref(msg);
+}
+
+// restore_data of another portal is skipped, not an error
+static void test_foreign(sd_bus *bus) {
+	sd_bus_message *msg = NULL;
+	assert(sd_bus_message_new_method_call(bus, &msg, "org.example.Test",
+		"/org/example/Test", "org.example.Test", "Test") >= 0);
+	assert(sd_bus_message_append(msg, "v", "(suv)", "gnome", 1, "s", "whatever") >= 0);
+	assert(sd_bus_message_append(msg, "v", "(suv)", XDPW_RESTORE_VENDOR,
+		XDPW_RESTORE_VERSION + 1, "a{sv}", 0) >= 0);
+	assert(sd_bus_message_append(msg, "u", 42) >= 0);
+	assert(sd_bus_message_seal(msg, 1, 0) >= 0);
+	assert(sd_bus_message_rewind(msg, true) >= 0);
+
+	struct xdpw_restore_data out;
+	assert(xdpw_restore_data_read(msg, &out) == 0);
+	assert(xdpw_restore_data_read(msg, &out) == 0);
+	uint32_t after;
+	assert(sd_bus_message_read(msg, "u", &after) > 0);
+	assert(after == 42);
+	sd_bus_message_unref(msg);
+}
+
+int main(void) {
+	// messages can only be built on a connected bus
+	sd_bus *bus = NULL;
+	if (sd_bus_open_user(&bus) < 0) {
+		fprintf(stderr, "no session bus, skipping\n");
+		return EXIT_SKIP;
+	}
+
+	test_output(bus);
+	test_region(bus);
+	test_foreign(bus);
+
+	sd_bus_flush_close_unref(bus);
+	return 0;
+}
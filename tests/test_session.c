@@ -0,0 +1,47 @@
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "xdpw.h"
+
+#define SESSIONS (4 * XDPW_SESSION_BUCKETS)
+
+// only the handle index is used, no bus is needed
+static void test_find(void) {
+	struct xdpw_state state = { 0 };
+	for (size_t i = 0; i < XDPW_SESSION_BUCKETS; i++) {
+		wl_list_init(&state.session_buckets[i]);
+	}
+
+	// more sessions than buckets, so some have to share
+	static struct xdpw_session sessions[SESSIONS];
+	static char handles[SESSIONS][64];
+	for (size_t i = 0; i < SESSIONS; i++) {
+		snprintf(handles[i], sizeof(handles[i]),
+			"/org/freedesktop/portal/desktop/session/1_%zu/app%zu", i, i);
+		sessions[i].session_handle = handles[i];
+		wl_list_insert(xdpw_session_bucket(&state, handles[i]), &sessions[i].handle_link);
+	}
+
+	size_t used = 0;
+	for (size_t i = 0; i < XDPW_SESSION_BUCKETS; i++) {
+		used += !wl_list_empty(&state.session_buckets[i]);
+	}
+	assert(used > XDPW_SESSION_BUCKETS / 2);
+
+	for (size_t i = 0; i < SESSIONS; i++) {
+		assert(xdpw_session_find(&state, handles[i]) == &sessions[i]);
+	}
+	assert(xdpw_session_find(&state, "/org/freedesktop/portal/desktop/session/1_0") == NULL);
+
+	// removed sessions are no longer found, the others still are
+	wl_list_remove(&sessions[0].handle_link);
+	assert(xdpw_session_find(&state, handles[0]) == NULL);
+	assert(xdpw_session_find(&state, handles[1]) == &sessions[1]);
+}
+
+int main(void) {
+	test_find();
+	return 0;
+}
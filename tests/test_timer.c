@@ -0,0 +1,105 @@
+#undef NDEBUG
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "timespec_util.h"
+#include "xdpw.h"
+
+#define TIMERS 64
+
+struct fired {
+	struct xdpw_timer *order[TIMERS];
+	size_t len;
+};
+
+struct test_timer {
+	struct xdpw_timer timer;
+	struct fired *fired;
+};
+
+static void check_heap(struct xdpw_state *state) {
+	for (size_t i = 0; i < state->timers_len; i++) {
+		assert(state->timers[i]->armed);
+		assert(state->timers[i]->heap_index == i);
+		if (i > 0) {
+			struct xdpw_timer *parent = state->timers[(i - 1) / 2];
+			assert(!timespec_less(&state->timers[i]->at, &parent->at));
+		}
+	}
+}
+
+static void handle_timer(void *data) {
+	struct test_timer *t = data;
+	assert(!t->timer.armed);
+	t->fired->order[t->fired->len++] = &t->timer;
+}
+
+static void sleep_ms(long ms) {
+	struct timespec ts = { .tv_nsec = ms * 1000000 };
+	nanosleep(&ts, NULL);
+}
+
+static void test_order(void) {
+	// no timerfd, only the heap is exercised
+	struct xdpw_state state = { .timer_poll_fd = -1 };
+	struct fired fired = { 0 };
+	static struct test_timer timers[TIMERS];
+
+	srand(1);
+	for (size_t i = 0; i < TIMERS; i++) {
+		timers[i].fired = &fired;
+		xdpw_timer_arm(&state, &timers[i].timer, (rand() % 1000) * 1000,
+			handle_timer, &timers[i]);
+		check_heap(&state);
+	}
+	assert(state.timers_len == TIMERS);
+
+	// disarm every fourth and move every fourth other one
+	for (size_t i = 0; i < TIMERS; i += 4) {
+		xdpw_timer_disarm(&timers[i].timer);
+		assert(!timers[i].timer.armed);
+		xdpw_timer_arm(&state, &timers[i + 1].timer, (rand() % 1000) * 1000,
+			handle_timer, &timers[i + 1]);
+		check_heap(&state);
+	}
+	assert(state.timers_len == TIMERS - TIMERS / 4);
+	// disarming twice does nothing
+	xdpw_timer_disarm(&timers[0].timer);
+	assert(state.timers_len == TIMERS - TIMERS / 4);
+
+	sleep_ms(5);
+	xdpw_timers_dispatch(&state);
+	assert(state.timers_len == 0);
+	assert(fired.len == TIMERS - TIMERS / 4);
+	for (size_t i = 1; i < fired.len; i++) {
+		assert(!timespec_less(&fired.order[i]->at, &fired.order[i - 1]->at));
+	}
+
+	xdpw_timers_finish(&state);
+}
+
+static void test_pending(void) {
+	struct xdpw_state state = { .timer_poll_fd = -1 };
+	struct fired fired = { 0 };
+	struct test_timer soon = { .fired = &fired }, later = { .fired = &fired };
+
+	xdpw_timer_arm(&state, &later.timer, 10 * 1000000000ull, handle_timer, &later);
+	xdpw_timer_arm(&state, &soon.timer, 0, handle_timer, &soon);
+	assert(state.timers[0] == &soon.timer);
+
+	// only expired timers run
+	xdpw_timers_dispatch(&state);
+	assert(fired.len == 1 && fired.order[0] == &soon.timer);
+	assert(later.timer.armed && state.timers_len == 1);
+
+	xdpw_timers_finish(&state);
+	assert(!later.timer.armed);
+	assert(state.timers == NULL && state.timers_len == 0);
+}
+
+int main(void) {
+	test_order();
+	test_pending();
+	return 0;
+}